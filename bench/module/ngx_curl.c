@@ -0,0 +1 @@
+../../ngx_curl.c
\ No newline at end of file
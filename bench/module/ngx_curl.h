@@ -0,0 +1 @@
+../../ngx_curl.h
\ No newline at end of file
@@ -0,0 +1,554 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_curl.h"
+
+#include <stdbool.h>
+#include <sys/resource.h>
+#include <time.h>
+
+// This module drives load through `ngx_curl_add_handles` and reports how
+// ngx_curl held up. See `bench/README.md`.
+//
+// A "request" is `curl_bench_fanout` transfers of `curl_bench_url`, added
+// together, and it completes when the last of them does. Without
+// `curl_bench_rate`, the load is a closed loop: `curl_bench_concurrency`
+// requests are kept in flight, each started as soon as the previous one
+// completes. With it, the load is an open loop: requests are scheduled at
+// that rate, and each one's latency is measured from when it was scheduled,
+// so that a stall isn't hidden by the requests it delayed. A scheduled
+// request that finds `curl_bench_concurrency` requests already in flight is
+// counted as missed.
+//
+// Nothing is measured during `curl_bench_warmup`. After `curl_bench_duration`
+// more, the results are logged, appended as a line of JSON to
+// `curl_bench_report` (if set), and nginx exits.
+
+typedef struct {
+  ngx_str_t url;
+  ngx_uint_t concurrency;
+  ngx_uint_t rate;
+  ngx_uint_t fanout;
+  ngx_msec_t warmup;
+  ngx_msec_t duration;
+  ngx_flag_t http2;
+  ngx_flag_t edge_triggered;
+  ngx_flag_t insecure;
+  ngx_str_t report;
+} ngx_curl_bench_conf_t;
+
+static void *ngx_curl_bench_create_conf(ngx_cycle_t *cycle);
+static char *ngx_curl_bench_init_conf(ngx_cycle_t *cycle, void *conf);
+
+static ngx_int_t ngx_curl_bench_init_process(ngx_cycle_t *cycle);
+static void ngx_curl_bench_exit_process(ngx_cycle_t *cycle);
+
+static ngx_command_t ngx_curl_bench_commands[] = {
+
+    {ngx_string("curl_bench_url"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_str_slot,
+     0, offsetof(ngx_curl_bench_conf_t, url), NULL},
+
+    {ngx_string("curl_bench_concurrency"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_num_slot,
+     0, offsetof(ngx_curl_bench_conf_t, concurrency), NULL},
+
+    {ngx_string("curl_bench_rate"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_num_slot,
+     0, offsetof(ngx_curl_bench_conf_t, rate), NULL},
+
+    {ngx_string("curl_bench_fanout"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_num_slot,
+     0, offsetof(ngx_curl_bench_conf_t, fanout), NULL},
+
+    {ngx_string("curl_bench_warmup"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_msec_slot,
+     0, offsetof(ngx_curl_bench_conf_t, warmup), NULL},
+
+    {ngx_string("curl_bench_duration"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_msec_slot,
+     0, offsetof(ngx_curl_bench_conf_t, duration), NULL},
+
+    {ngx_string("curl_bench_http2"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_FLAG, ngx_conf_set_flag_slot, 0,
+     offsetof(ngx_curl_bench_conf_t, http2), NULL},
+
+    {ngx_string("curl_bench_edge_triggered"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_FLAG, ngx_conf_set_flag_slot, 0,
+     offsetof(ngx_curl_bench_conf_t, edge_triggered), NULL},
+
+    {ngx_string("curl_bench_insecure"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_FLAG, ngx_conf_set_flag_slot, 0,
+     offsetof(ngx_curl_bench_conf_t, insecure), NULL},
+
+    {ngx_string("curl_bench_report"),
+     NGX_MAIN_CONF | NGX_DIRECT_CONF | NGX_CONF_TAKE1, ngx_conf_set_str_slot,
+     0, offsetof(ngx_curl_bench_conf_t, report), NULL},
+
+    ngx_null_command};
+
+static ngx_core_module_t ngx_curl_bench_module_ctx = {
+    ngx_string("curl_bench"), ngx_curl_bench_create_conf,
+    ngx_curl_bench_init_conf};
+
+ngx_module_t ngx_curl_bench_module = {
+    NGX_MODULE_V1,
+    &ngx_curl_bench_module_ctx,   /* module context */
+    ngx_curl_bench_commands,      /* module directives */
+    NGX_CORE_MODULE,              /* module type */
+    NULL,                         /* init master */
+    NULL,                         /* init module */
+    &ngx_curl_bench_init_process, /* init process */
+    NULL,                         /* init thread */
+    NULL,                         /* exit thread */
+    &ngx_curl_bench_exit_process, /* exit process */
+    NULL,                         /* exit master */
+    NGX_MODULE_V1_PADDING};
+
+static void *ngx_curl_bench_create_conf(ngx_cycle_t *cycle) {
+  ngx_curl_bench_conf_t *bcf;
+
+  bcf = ngx_pcalloc(cycle->pool, sizeof(ngx_curl_bench_conf_t));
+  if (bcf == NULL) {
+    return NULL;
+  }
+
+  bcf->concurrency = NGX_CONF_UNSET_UINT;
+  bcf->rate = NGX_CONF_UNSET_UINT;
+  bcf->fanout = NGX_CONF_UNSET_UINT;
+  bcf->warmup = NGX_CONF_UNSET_MSEC;
+  bcf->duration = NGX_CONF_UNSET_MSEC;
+  bcf->http2 = NGX_CONF_UNSET;
+  bcf->edge_triggered = NGX_CONF_UNSET;
+  bcf->insecure = NGX_CONF_UNSET;
+
+  return bcf;
+}
+
+static char *ngx_curl_bench_init_conf(ngx_cycle_t *cycle, void *conf) {
+  ngx_curl_bench_conf_t *bcf = conf;
+
+  ngx_conf_init_uint_value(bcf->concurrency, 64);
+  ngx_conf_init_uint_value(bcf->rate, 0);
+  ngx_conf_init_uint_value(bcf->fanout, 1);
+  ngx_conf_init_msec_value(bcf->warmup, 2000);
+  ngx_conf_init_msec_value(bcf->duration, 10000);
+  ngx_conf_init_value(bcf->http2, 0);
+  ngx_conf_init_value(bcf->edge_triggered, 0);
+  ngx_conf_init_value(bcf->insecure, 0);
+
+  if (bcf->concurrency == 0 || bcf->fanout == 0) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                  "curl_bench_concurrency and curl_bench_fanout must be "
+                  "positive");
+    return NGX_CONF_ERROR;
+  }
+
+  if (bcf->report.len &&
+      ngx_conf_full_name(cycle, &bcf->report, 0) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+// Latencies are counted in a log-linear histogram: each power of two of
+// microseconds is divided into `NGX_CURL_BENCH_SUB_BUCKETS` buckets, so that
+// percentiles are accurate to within a sixteenth.
+#define NGX_CURL_BENCH_SUB_BITS 4
+#define NGX_CURL_BENCH_SUB_BUCKETS (1 << NGX_CURL_BENCH_SUB_BITS)
+#define NGX_CURL_BENCH_MAX_BITS 36
+#define NGX_CURL_BENCH_BUCKETS                                                 \
+  ((NGX_CURL_BENCH_MAX_BITS - NGX_CURL_BENCH_SUB_BITS + 1) *                   \
+   NGX_CURL_BENCH_SUB_BUCKETS)
+
+typedef struct ngx_curl_bench_request_s ngx_curl_bench_request_t;
+
+struct ngx_curl_bench_request_s {
+  // `next` links the request into the free list while it isn't in flight.
+  ngx_curl_bench_request_t *next;
+  // When the request started (or was scheduled to), in microseconds.
+  uint64_t started;
+  // The number of its transfers that haven't completed.
+  ngx_uint_t pending;
+  bool failed;
+  CURL **handles;
+};
+
+typedef struct {
+  const ngx_curl_bench_conf_t *conf;
+  ngx_curl_t *curl;
+  ngx_connection_t dummy_connection;
+  // `tick` schedules requests in the open loop. `phase` ends the warmup, and
+  // then the measurement.
+  ngx_event_t tick;
+  ngx_event_t phase;
+  ngx_curl_bench_request_t *free_requests;
+  long http_version;
+  // When the load began, and how many requests the open loop has scheduled.
+  uint64_t began;
+  uint64_t scheduled;
+  bool measuring;
+  bool stopping;
+  // The following are reset when the measurement begins.
+  uint64_t measure_began;
+  struct rusage usage_began;
+  ngx_curl_stats_t stats_began;
+  uint64_t completed;
+  uint64_t failed;
+  uint64_t missed;
+  uint64_t transfers;
+  uint64_t bytes;
+  uint64_t latency_max;
+  uint64_t latencies[NGX_CURL_BENCH_BUCKETS];
+} ngx_curl_bench_t;
+
+static ngx_curl_bench_t bench;
+
+static uint64_t now_usec(void) {
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static size_t latency_bucket(uint64_t value) {
+  if (value < NGX_CURL_BENCH_SUB_BUCKETS) {
+    return value;
+  }
+
+  const unsigned magnitude = 63 - __builtin_clzll(value);
+  if (magnitude >= NGX_CURL_BENCH_MAX_BITS) {
+    return NGX_CURL_BENCH_BUCKETS - 1;
+  }
+  const unsigned shift = magnitude - NGX_CURL_BENCH_SUB_BITS;
+  return (shift + 1) * NGX_CURL_BENCH_SUB_BUCKETS + (value >> shift) -
+         NGX_CURL_BENCH_SUB_BUCKETS;
+}
+
+static uint64_t latency_percentile(double percentile) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < NGX_CURL_BENCH_BUCKETS; ++i) {
+    count += bench.latencies[i];
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(percentile / 100 * count + 0.5);
+  rank = ngx_max(rank, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NGX_CURL_BENCH_BUCKETS; ++i) {
+    seen += bench.latencies[i];
+    if (seen < rank) {
+      continue;
+    }
+    if (i < NGX_CURL_BENCH_SUB_BUCKETS) {
+      return i;
+    }
+    // Report the largest value in the bucket, but not more than the maximum.
+    const unsigned shift = i / NGX_CURL_BENCH_SUB_BUCKETS - 1;
+    const uint64_t limit = ((uint64_t)(NGX_CURL_BENCH_SUB_BUCKETS +
+                                       i % NGX_CURL_BENCH_SUB_BUCKETS)
+                            << shift) +
+                           ((uint64_t)1 << shift) - 1;
+    return ngx_min(limit, bench.latency_max);
+  }
+  return bench.latency_max;
+}
+
+static uint64_t cpu_usec(const struct rusage *usage) {
+  return (uint64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) *
+             1000000 +
+         usage->ru_utime.tv_usec + usage->ru_stime.tv_usec;
+}
+
+// Returns the resident set size in KiB, or zero if it isn't known.
+static uint64_t current_rss_kib(void) {
+  ngx_fd_t fd = ngx_open_file("/proc/self/statm", NGX_FILE_RDONLY,
+                              NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    return 0;
+  }
+
+  u_char buffer[128];
+  const ssize_t n = ngx_read_fd(fd, buffer, sizeof buffer - 1);
+  (void)ngx_close_file(fd);
+  if (n <= 0) {
+    return 0;
+  }
+
+  // The second field is the number of resident pages.
+  u_char *p = ngx_strlchr(buffer, buffer + n, ' ');
+  if (p == NULL) {
+    return 0;
+  }
+  u_char *end = ngx_strlchr(++p, buffer + n, ' ');
+  const ngx_int_t pages = ngx_atoi(p, (end ? end : buffer + n) - p);
+  return pages == NGX_ERROR ? 0 : (uint64_t)pages * ngx_pagesize / 1024;
+}
+
+static void start_request(uint64_t started);
+
+static size_t on_body(char *data, size_t size, size_t count, void *user_data) {
+  (void)data;
+  (void)user_data;
+  bench.bytes += size * count;
+  return size * count;
+}
+
+static void finish_transfer(CURL *handle, bool failed) {
+  ngx_curl_bench_request_t *request = NULL;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&request);
+
+  long status = 0;
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+  ngx_curl_release_handle(bench.curl, handle);
+
+  request->failed |= failed || status >= 500;
+  ++bench.transfers;
+  if (--request->pending) {
+    return;
+  }
+
+  if (bench.measuring) {
+    const uint64_t latency = now_usec() - request->started;
+    ++bench.latencies[latency_bucket(latency)];
+    bench.latency_max = ngx_max(bench.latency_max, latency);
+    ++bench.completed;
+    if (request->failed) {
+      ++bench.failed;
+    }
+  }
+
+  request->next = bench.free_requests;
+  bench.free_requests = request;
+
+  if (bench.conf->rate == 0 && !bench.stopping) {
+    start_request(now_usec());
+  }
+}
+
+static void on_error(CURL *handle, CURLcode error) {
+  (void)error;
+  finish_transfer(handle, true);
+}
+
+static void on_done(CURL *handle) { finish_transfer(handle, false); }
+
+static void start_request(uint64_t started) {
+  ngx_curl_bench_request_t *request = bench.free_requests;
+  if (request == NULL) {
+    if (bench.measuring) {
+      ++bench.missed;
+    }
+    return;
+  }
+
+  const ngx_curl_bench_conf_t *conf = bench.conf;
+  ngx_uint_t i;
+  for (i = 0; i < conf->fanout; ++i) {
+    CURL *handle = ngx_curl_acquire_handle(bench.curl);
+    if (handle == NULL) {
+      break;
+    }
+    request->handles[i] = handle;
+    curl_easy_setopt(handle, CURLOPT_URL, (char *)conf->url.data);
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, bench.http_version);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &on_body);
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, request);
+    if (conf->insecure) {
+      curl_easy_setopt(handle, CURLOPT_SSL_VERIFYPEER, 0L);
+      curl_easy_setopt(handle, CURLOPT_SSL_VERIFYHOST, 0L);
+    }
+  }
+
+  if (i < conf->fanout ||
+      ngx_curl_add_handles(bench.curl, request->handles, conf->fanout,
+                           &on_error, &on_done) != 0) {
+    while (i) {
+      ngx_curl_release_handle(bench.curl, request->handles[--i]);
+    }
+    if (bench.measuring) {
+      ++bench.completed;
+      ++bench.failed;
+    }
+    return;
+  }
+
+  bench.free_requests = request->next;
+  request->started = started;
+  request->pending = conf->fanout;
+  request->failed = false;
+}
+
+// Starts the requests that the open loop has scheduled by now.
+static void on_tick(ngx_event_t *event) {
+  if (bench.stopping) {
+    return;
+  }
+
+  const uint64_t rate = bench.conf->rate;
+  const uint64_t now = now_usec();
+  const uint64_t due = (now - bench.began) * rate / 1000000;
+  for (; bench.scheduled < due; ++bench.scheduled) {
+    start_request(bench.began + bench.scheduled * 1000000 / rate);
+  }
+
+  ngx_add_timer(event, 1);
+}
+
+static void write_report(void) {
+  const ngx_curl_bench_conf_t *conf = bench.conf;
+
+  struct rusage usage;
+  (void)getrusage(RUSAGE_SELF, &usage);
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(bench.curl, &stats);
+
+  const uint64_t elapsed = ngx_max(now_usec() - bench.measure_began, 1);
+  const uint64_t cpu = cpu_usec(&usage) - cpu_usec(&bench.usage_began);
+  const uint64_t completed = ngx_max(bench.completed, 1);
+
+  u_char line[1024];
+  u_char *last = ngx_slprintf(
+      line, line + sizeof line - 1,
+      "{\"url\":\"%V\",\"http2\":%s,\"edge_triggered\":%s,"
+      "\"concurrency\":%ui,\"rate\":%ui,\"fanout\":%ui,"
+      "\"duration_ms\":%uL,\"requests\":%uL,\"failed\":%uL,\"missed\":%uL,"
+      "\"requests_per_sec\":%.1f,\"transfers_per_sec\":%.1f,"
+      "\"mib_per_sec\":%.2f,"
+      "\"latency_us\":{\"p50\":%uL,\"p90\":%uL,\"p99\":%uL,\"p999\":%uL,"
+      "\"max\":%uL},"
+      "\"cpu_us_per_request\":%.1f,\"max_rss_kib\":%l,\"rss_kib\":%uL,"
+      "\"connections_opened\":%uz,\"connections_reused\":%uz,"
+      "\"event_registrations\":%uz}",
+      &conf->url, conf->http2 ? "true" : "false",
+      conf->edge_triggered ? "true" : "false", conf->concurrency, conf->rate,
+      conf->fanout, elapsed / 1000, bench.completed, bench.failed,
+      bench.missed, (double)bench.completed * 1000000 / elapsed,
+      (double)bench.transfers * 1000000 / elapsed,
+      (double)bench.bytes * 1000000 / elapsed / (1024 * 1024),
+      latency_percentile(50), latency_percentile(90), latency_percentile(99),
+      latency_percentile(99.9), bench.latency_max, (double)cpu / completed,
+      usage.ru_maxrss, current_rss_kib(),
+      stats.connections_opened - bench.stats_began.connections_opened,
+      stats.connections_reused - bench.stats_began.connections_reused,
+      stats.event_registrations - bench.stats_began.event_registrations);
+
+  ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0, "curl bench: %*s",
+                last - line, line);
+
+  if (conf->report.len == 0) {
+    return;
+  }
+
+  *last++ = '\n';
+  ngx_fd_t fd = ngx_open_file(conf->report.data, NGX_FILE_APPEND,
+                              NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+  if (fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  ngx_open_file_n " \"%V\" failed", &conf->report);
+    return;
+  }
+  if (ngx_write_fd(fd, line, last - line) != last - line) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  ngx_write_fd_n " \"%V\" failed", &conf->report);
+  }
+  (void)ngx_close_file(fd);
+}
+
+static void on_phase(ngx_event_t *event) {
+  if (!bench.measuring) {
+    // The warmup is over.
+    bench.measuring = true;
+    bench.measure_began = now_usec();
+    (void)getrusage(RUSAGE_SELF, &bench.usage_began);
+    ngx_curl_stats(bench.curl, &bench.stats_began);
+    bench.transfers = 0;
+    bench.bytes = 0;
+    ngx_add_timer(event, bench.conf->duration);
+    return;
+  }
+
+  bench.stopping = true;
+  write_report();
+  ngx_quit = 1;
+}
+
+static ngx_int_t ngx_curl_bench_init_process(ngx_cycle_t *cycle) {
+  const ngx_curl_bench_conf_t *conf = (const ngx_curl_bench_conf_t *)
+      ngx_get_conf(cycle->conf_ctx, ngx_curl_bench_module);
+  if (conf->url.len == 0) {
+    return NGX_OK;
+  }
+
+  bench.conf = conf;
+  ngx_curl_options_t options = {0};
+  options.edge_triggered = conf->edge_triggered;
+  options.multiplex = conf->http2;
+  options.handle_pool_size = conf->concurrency * conf->fanout;
+  bench.curl = ngx_create_curl_with_options(&options);
+  if (bench.curl == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (!conf->http2) {
+    bench.http_version = CURL_HTTP_VERSION_1_1;
+  } else if (conf->url.len > 8 &&
+             ngx_strncasecmp(conf->url.data, (u_char *)"https://", 8) == 0) {
+    bench.http_version = CURL_HTTP_VERSION_2TLS;
+  } else {
+    bench.http_version = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+  }
+
+  for (ngx_uint_t i = 0; i < conf->concurrency; ++i) {
+    ngx_curl_bench_request_t *request =
+        ngx_pcalloc(cycle->pool, sizeof(ngx_curl_bench_request_t));
+    if (request == NULL) {
+      return NGX_ERROR;
+    }
+    request->handles = ngx_pcalloc(cycle->pool, conf->fanout * sizeof(CURL *));
+    if (request->handles == NULL) {
+      return NGX_ERROR;
+    }
+    request->next = bench.free_requests;
+    bench.free_requests = request;
+  }
+
+  bench.dummy_connection.fd = -1;
+  bench.tick.data = &bench.dummy_connection;
+  bench.tick.handler = &on_tick;
+  bench.tick.cancelable = true;
+  bench.tick.log = cycle->log;
+  bench.phase.data = &bench.dummy_connection;
+  bench.phase.handler = &on_phase;
+  bench.phase.cancelable = true;
+  bench.phase.log = cycle->log;
+
+  bench.began = now_usec();
+  if (conf->warmup) {
+    ngx_add_timer(&bench.phase, conf->warmup);
+  } else {
+    on_phase(&bench.phase);
+  }
+
+  if (conf->rate) {
+    ngx_add_timer(&bench.tick, 1);
+  } else {
+    for (ngx_uint_t i = 0; i < conf->concurrency; ++i) {
+      start_request(bench.began);
+    }
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_curl_bench_exit_process(ngx_cycle_t *cycle) {
+  (void)cycle;
+  if (bench.curl) {
+    // Requests still in flight are abandoned.
+    ngx_destroy_curl(bench.curl);
+    bench.curl = NULL;
+  }
+}
@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""A local stand-in upstream for the ngx_curl benchmarks.
+
+It answers every request with a fixed-size body, optionally after an injected
+delay, and optionally fails a fraction of requests with "503 Service
+Unavailable". It speaks HTTP/1.1 with keep-alive, and HTTP/2 if the `h2`
+package is installed: over TLS when the client negotiates "h2" with ALPN, and
+in cleartext when the client sends the HTTP/2 connection preface ("prior
+knowledge").
+"""
+
+import argparse
+import asyncio
+import random
+import ssl
+import sys
+
+try:
+    import h2.config
+    import h2.connection
+    import h2.events
+except ImportError:
+    h2 = None
+
+PREFACE = b"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+
+class Upstream:
+    def __init__(self, args):
+        self.args = args
+        self.body = b"x" * args.body_size
+
+    async def delay(self):
+        latency = self.args.latency_ms
+        if self.args.jitter_ms:
+            latency += random.uniform(0, self.args.jitter_ms)
+        if latency > 0:
+            await asyncio.sleep(latency / 1000)
+
+    def status(self):
+        if self.args.error_rate and random.random() < self.args.error_rate:
+            return 503
+        return 200
+
+    async def serve(self, reader, writer):
+        try:
+            ssl_object = writer.get_extra_info("ssl_object")
+            if ssl_object is not None:
+                if ssl_object.selected_alpn_protocol() == "h2":
+                    await self.serve_http2(reader, writer, b"")
+                else:
+                    await self.serve_http1(reader, writer, b"")
+                return
+
+            # In cleartext, HTTP/2 with prior knowledge begins with the
+            # preface. Read until it's clear whether it does.
+            start = b""
+            while len(start) < len(PREFACE) and PREFACE.startswith(start):
+                chunk = await reader.read(len(PREFACE) - len(start))
+                if not chunk:
+                    return
+                start += chunk
+            if start == PREFACE:
+                await self.serve_http2(reader, writer, start)
+            else:
+                await self.serve_http1(reader, writer, start)
+        except (asyncio.IncompleteReadError, ConnectionError):
+            pass
+        finally:
+            writer.close()
+
+    async def serve_http1(self, reader, writer, buffered):
+        while True:
+            head = buffered
+            buffered = b""
+            while b"\r\n\r\n" not in head:
+                chunk = await reader.read(65536)
+                if not chunk:
+                    return
+                head += chunk
+            head, buffered = head.split(b"\r\n\r\n", 1)
+            lines = head.split(b"\r\n")
+            headers = {}
+            for line in lines[1:]:
+                name, _, value = line.partition(b":")
+                headers[name.strip().lower()] = value.strip()
+
+            length = int(headers.get(b"content-length", b"0"))
+            while len(buffered) < length:
+                buffered += await reader.readexactly(length - len(buffered))
+            buffered = buffered[length:]
+
+            await self.delay()
+            status = self.status()
+            reason = b"OK" if status == 200 else b"Service Unavailable"
+            body = self.body if status == 200 else b""
+            close = headers.get(b"connection", b"").lower() == b"close"
+            writer.write(
+                b"HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%s\r\n"
+                % (status, reason, len(body),
+                   b"Connection: close\r\n" if close else b"")
+                + body)
+            await writer.drain()
+            if close:
+                return
+
+    async def serve_http2(self, reader, writer, received):
+        if h2 is None:
+            sys.stderr.write("upstream: HTTP/2 requires the h2 package\n")
+            return
+
+        connection = h2.connection.H2Connection(
+            config=h2.config.H2Configuration(client_side=False))
+        connection.initiate_connection()
+        writer.write(connection.data_to_send())
+
+        def respond(stream_id, status):
+            body = self.body if status == 200 else b""
+            connection.send_headers(stream_id, [
+                (":status", str(status)),
+                ("content-length", str(len(body))),
+            ], end_stream=not body)
+            if body:
+                self.send_body(connection, stream_id, 0, pending)
+
+        async def answer(stream_id):
+            await self.delay()
+            respond(stream_id, self.status())
+            writer.write(connection.data_to_send())
+
+        pending = {}
+        tasks = set()
+        data = received
+        while True:
+            if data:
+                for event in connection.receive_data(data):
+                    if isinstance(event, h2.events.RequestReceived):
+                        task = asyncio.ensure_future(answer(event.stream_id))
+                        tasks.add(task)
+                        task.add_done_callback(tasks.discard)
+                    elif isinstance(event, h2.events.DataReceived):
+                        connection.acknowledge_received_data(
+                            event.flow_controlled_length, event.stream_id)
+                    elif isinstance(event, h2.events.WindowUpdated):
+                        for stream_id, offset in list(pending.items()):
+                            self.send_body(connection, stream_id, offset,
+                                           pending)
+                    elif isinstance(event, h2.events.ConnectionTerminated):
+                        writer.write(connection.data_to_send())
+                        return
+                writer.write(connection.data_to_send())
+                await writer.drain()
+            data = await reader.read(65536)
+            if not data:
+                return
+
+    def send_body(self, connection, stream_id, offset, pending):
+        """Sends as much of the body as flow control allows. If that isn't
+        all of it, records in `pending` where to resume."""
+        body = self.body
+        while offset < len(body):
+            size = min(connection.local_flow_control_window(stream_id),
+                       connection.max_outbound_frame_size,
+                       len(body) - offset)
+            if size <= 0:
+                pending[stream_id] = offset
+                return
+            connection.send_data(stream_id, body[offset:offset + size],
+                                 end_stream=offset + size == len(body))
+            offset += size
+        pending.pop(stream_id, None)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8443)
+    parser.add_argument("--cert", help="PEM certificate; enables TLS")
+    parser.add_argument("--key", help="PEM private key for --cert")
+    parser.add_argument("--body-size", type=int, default=1024,
+                        help="bytes in each response body")
+    parser.add_argument("--latency-ms", type=float, default=0,
+                        help="delay before each response")
+    parser.add_argument("--jitter-ms", type=float, default=0,
+                        help="uniformly distributed extra delay")
+    parser.add_argument("--error-rate", type=float, default=0,
+                        help="fraction of requests answered with 503")
+    args = parser.parse_args()
+
+    context = None
+    if args.cert:
+        context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+        context.load_cert_chain(args.cert, args.key)
+        context.set_alpn_protocols(
+            ["h2", "http/1.1"] if h2 else ["http/1.1"])
+
+    upstream = Upstream(args)
+    loop = asyncio.new_event_loop()
+    server = loop.run_until_complete(
+        asyncio.start_server(upstream.serve, args.host, args.port,
+                             ssl=context, backlog=4096))
+    sys.stderr.write("upstream: listening on %s:%d%s%s\n" % (
+        args.host, args.port, " with TLS" if context else "",
+        "" if h2 else " (HTTP/2 unavailable: no h2 package)"))
+    try:
+        loop.run_forever()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.close()
+
+
+if __name__ == "__main__":
+    main()
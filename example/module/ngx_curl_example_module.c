@@ -82,16 +82,28 @@ static ngx_curl_t *curl;
 ngx_connection_t dummy_connection;
 ngx_event_t timer;
 
+// Each request has its own pool, which holds the response body.
+static void finish_request(CURL *handle) {
+  ngx_pool_t *pool = NULL;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&pool);
+  ngx_destroy_pool(pool);
+  ngx_curl_release_handle(curl, handle);
+}
+
 static void on_error(CURL *handle, CURLcode error) {
   ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                "Error occurred making request.");
-  curl_easy_cleanup(handle);
+                "Error occurred making request: %s", ngx_curl_strerror(error));
+  finish_request(handle);
 }
 
-static void on_done(CURL *handle) {
+static void on_done(CURL *handle, ngx_chain_t *body) {
+  for (ngx_chain_t *link = body; link; link = link->next) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "received body data: %*s",
+                  (size_t)(link->buf->last - link->buf->pos), link->buf->pos);
+  }
   ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
                 "========== Request completed successfully. ===========");
-  curl_easy_cleanup(handle);
+  finish_request(handle);
 }
 
 static size_t on_read_header(char *data, size_t, size_t length,
@@ -113,29 +125,21 @@ static size_t on_read_header(char *data, size_t, size_t length,
   return length;
 }
 
-static size_t on_read_body(char *data, size_t, size_t length, void *user_data) {
-  const ngx_curl_allocator_t *allocator = user_data;
-  char *buffer = allocator->allocate(length + 1);
-  memcpy(buffer, data, length);
-  buffer[length] = '\0';
-  ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "received body data: %s",
-                buffer);
-  allocator->free(buffer);
-  return length;
-}
-
 static ngx_msec_t period = 5 * 1000;
 
 static void make_request(ngx_event_t *) {
-  CURL *handle = curl_easy_init();
+  CURL *handle = ngx_curl_acquire_handle(curl);
+  ngx_pool_t *pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
 
   curl_easy_setopt(handle, CURLOPT_URL, "https://api.ipify.org?format=json");
   curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &on_read_header);
   curl_easy_setopt(handle, CURLOPT_HEADERDATA, ngx_curl_allocator(curl));
-  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &on_read_body);
-  curl_easy_setopt(handle, CURLOPT_WRITEDATA, ngx_curl_allocator(curl));
+  curl_easy_setopt(handle, CURLOPT_PRIVATE, pool);
 
-  ngx_curl_add_handle(curl, handle, &on_error, &on_done);
+  if (ngx_curl_add_handle_to_chain(curl, handle, pool, 64 * 1024, &on_error,
+                                   &on_done) != 0) {
+    finish_request(handle);
+  }
 
   ngx_add_timer(&timer, period);
 }
@@ -0,0 +1 @@
+../../ngx_curl_http.c
\ No newline at end of file
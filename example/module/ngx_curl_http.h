@@ -0,0 +1 @@
+../../ngx_curl_http.h
\ No newline at end of file
@@ -5,37 +5,1017 @@
 
 #include "ngx_curl.h"
 
+#if (NGX_OPENSSL)
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if (NGX_HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#endif
+
 static const ngx_curl_allocator_t malloc_allocator = {&malloc, &calloc,
                                                       &realloc, &free, &strdup};
 
+// `worker_share` is a libcurl share handle used by every `ngx_curl_t` in this
+// process that was created with the `share_worker_caches` option. Nginx
+// workers are single-threaded processes, so no locking callbacks are needed.
+// `worker_share_users` is the number of such `ngx_curl_t` objects.
+static CURLSH *worker_share;
+static size_t worker_share_users;
+
+// An `ngx_curl_shm_cache_t` is the `data` of a shared memory zone holding
+// entries keyed by string. The zone is shared by all nginx workers, and
+// survives reloads.
+typedef struct ngx_curl_shm_cache_shared_s {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  // Least recently stored (or used) entries are at the tail.
+  ngx_queue_t lru;
+} ngx_curl_shm_cache_shared_t;
+
+typedef struct ngx_curl_shm_cache_s {
+  ngx_curl_shm_cache_shared_t *shared;
+  ngx_slab_pool_t *shpool;
+} ngx_curl_shm_cache_t;
+
+// An `ngx_curl_metrics_zone_t` is the `data` of a shared memory zone added by
+// `ngx_curl_add_metrics_zone`. The counters themselves are in the zone.
+typedef struct ngx_curl_metrics_zone_s {
+  ngx_curl_metrics_t *metrics;
+} ngx_curl_metrics_zone_t;
+
+// Adds `delta` to the named counter of the `ngx_curl_t`'s metrics zone, if it
+// has one. This is a single atomic instruction, so that the counters can be
+// shared by every worker without a lock.
+#define add_metric(curl, name, delta)                                         \
+  do {                                                                         \
+    if ((curl)->metrics) {                                                     \
+      (void)ngx_atomic_fetch_add(&(curl)->metrics->name,                       \
+                                 (ngx_atomic_int_t)(delta));                   \
+    }                                                                          \
+  } while (0)
+
+// The SSL session cache stores TLS client sessions, so that a session
+// negotiated by one nginx worker can be resumed by any other. Sessions are
+// keyed by server name (SNI), port, and a digest of the TLS settings that
+// bear on trust and identity (see `ssl_session_key`).
+typedef struct ngx_curl_ssl_session_node_s {
+  // `node.str` refers to the key, which is stored in `data`.
+  ngx_str_node_t node;
+  ngx_queue_t queue;
+  time_t expires;
+  size_t session_length;
+  // The key, followed by the DER encoded session.
+  u_char data[1];
+} ngx_curl_ssl_session_node_t;
+
+// Sessions whose encoding is larger than this are not cached.
+#define NGX_CURL_MAX_SSL_SESSION_SIZE 4096
+
+// The response cache stores responses fetched by `ngx_curl_fetch`, keyed by
+// `ngx_curl_fetch_options_t::key`.
+typedef struct ngx_curl_cached_response_s {
+  // `node.str` refers to the key, which is stored in `data`.
+  ngx_str_node_t node;
+  ngx_queue_t queue;
+  // The response may be used without revalidation until then.
+  time_t fresh_until;
+  // The value of the response's `Last-Modified` header, or zero.
+  time_t last_modified;
+  long status;
+  size_t etag_length;
+  size_t headers_length;
+  size_t body_length;
+  // The key, then the value of the `ETag` header, then the header block, then
+  // the body.
+  u_char data[1];
+} ngx_curl_cached_response_t;
+
+// ETags longer than this are not used for revalidation.
+#define NGX_CURL_MAX_ETAG_SIZE 256
+
+// What a response's headers say about how it may be cached.
+typedef struct ngx_curl_cache_policy_s {
+  // If true, the response must not be stored.
+  bool no_store;
+  // If true, the response may be stored even if the request had
+  // `Authorization` (`public`, `s-maxage`, or `must-revalidate`).
+  bool shared;
+  // The response may be used without revalidation until then.
+  time_t fresh_until;
+  // The value of the `ETag` header, referring into the header block.
+  ngx_str_t etag;
+  // The value of the `Last-Modified` header, or zero.
+  time_t last_modified;
+} ngx_curl_cache_policy_t;
+
+// An `ngx_curl_chain_sink_t` collects a response body into buffers allocated
+// from `pool`, for `ngx_curl_add_handle_to_chain`. It is itself allocated
+// from `pool`.
+typedef struct ngx_curl_chain_sink_s {
+  ngx_pool_t *pool;
+  CURL *handle;
+  // The maximum body size, or zero for no limit.
+  size_t max_size;
+  // The total size of the body received so far.
+  size_t size;
+  // `last` is where the next link goes, and `buffer` is the last buffer.
+  ngx_chain_t *chain;
+  ngx_chain_t **last;
+  ngx_buf_t *buffer;
+  void (*on_error)(CURL *, CURLcode);
+  void (*on_done)(CURL *, ngx_chain_t *);
+} ngx_curl_chain_sink_t;
+
+// If the body's length isn't known in advance, it's collected into buffers
+// of at least this size, which is libcurl's `CURL_MAX_WRITE_SIZE`.
+#define NGX_CURL_CHAIN_BUFFER_SIZE 16384
+
+// If it is, the first buffer is allocated for the whole body, but no larger
+// than this unless the sink's `max_size` allows it, since `Content-Length`
+// comes from the server. A longer body continues into more buffers.
+#define NGX_CURL_CHAIN_MAX_PREALLOCATION (64 * NGX_CURL_CHAIN_BUFFER_SIZE)
+
+// An `ngx_curl_upload_t` feeds a request body to libcurl's read callback from
+// an `ngx_chain_t`, for `ngx_curl_upload_chain`. It's obtained from the
+// allocator rather than from the body's pool, because a file read by a
+// thread pool might still be in progress when the pool is destroyed.
+typedef struct ngx_curl_upload_s {
+  const ngx_curl_allocator_t *allocator;
+  CURL *handle;
+  ngx_chain_t *body;
+  // The next byte to send is at `offset` within the buffer of `link`.
+  ngx_chain_t *link;
+  off_t offset;
+  // `failed` is true if a file couldn't be read.
+  bool failed;
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool;
+  ngx_thread_task_t task;
+  // `reading` is true while `task` is reading into `staging`. Afterward,
+  // `staging[staged_offset]` through `staging[staged_length]` are the next
+  // bytes to send.
+  bool reading;
+  // `orphaned` is true if the body's pool was destroyed while reading, so
+  // that the task's completion frees the upload.
+  bool orphaned;
+  // `paused` is true while the transfer waits for `task`, which then resumes
+  // it. The upload is in `curl->paused_uploads` meanwhile, so that removing
+  // the handle from the multi-handle can clear it: see `detach_uploads`.
+  bool paused;
+  ngx_curl_t *curl;
+  ngx_queue_t paused_link;
+  ngx_fd_t fd;
+  off_t read_position;
+  size_t read_length;
+  ssize_t read_result;
+  ngx_err_t read_error;
+  u_char *staging;
+  size_t staging_size;
+  size_t staged_offset;
+  size_t staged_length;
+#endif
+} ngx_curl_upload_t;
+
+#define NGX_CURL_DEFAULT_UPLOAD_READ_SIZE (64 * 1024)
+
+// An `ngx_curl_submission_t` is a handle passed to `ngx_curl_submit` by some
+// thread, on its way to the event loop. It's obtained from the allocator by
+// the submitting thread, and freed once `on_complete` has been called.
+typedef struct ngx_curl_submission_s ngx_curl_submission_t;
+
+struct ngx_curl_submission_s {
+  // `next` links the submission into `ngx_curl_t::submissions`.
+  ngx_curl_submission_t *next;
+  const ngx_curl_allocator_t *allocator;
+  CURL *handle;
+  void (*on_complete)(CURL *, CURLcode, void *data);
+  void *data;
+  CURLcode result;
+#if (NGX_THREADS)
+  // If `thread_pool` is not NULL, then `on_complete` is called by `task`.
+  ngx_thread_pool_t *thread_pool;
+  ngx_thread_task_t task;
+#endif
+};
+
+// An `ngx_curl_group_member_t` is a handle added to an `ngx_curl_group_t`. A
+// pointer to it is the `data` of the handle's completion.
+typedef struct ngx_curl_group_member_s {
+  ngx_curl_group_t *group;
+  CURL *handle;
+  CURLcode result;
+  bool finished;
+} ngx_curl_group_member_t;
+
+struct ngx_curl_group_s {
+  ngx_curl_t *curl;
+  // The number of successful members that resolves the group, or zero to
+  // wait for every member.
+  size_t quorum;
+  void (*on_group_done)(ngx_curl_group_t *, void *data);
+  void *data;
+  // `members` doesn't move once the group has started.
+  ngx_curl_group_member_t *members;
+  size_t member_count;
+  size_t member_capacity;
+  size_t finished_count;
+  size_t success_count;
+  bool started;
+  // `resolving` is true while `on_group_done` is being called.
+  bool resolving;
+  // `resolve` is posted to resolve a group that has no members.
+  ngx_event_t resolve;
+};
+
+typedef enum ngx_curl_cache_lookup_e {
+  NGX_CURL_CACHE_MISS,
+  NGX_CURL_CACHE_FRESH,
+  NGX_CURL_CACHE_STALE
+} ngx_curl_cache_lookup_t;
+
+typedef struct ngx_curl_handle_context_s ngx_curl_handle_context_t;
+
+// The callbacks associated with a handle. Handles added by users of this
+// library have `on_error` and either `on_done` or `on_response`. Handles added
+// by this library for its own purposes instead have `on_complete`, which
+// receives `data`.
+typedef struct ngx_curl_callbacks_s {
+  void (*on_error)(CURL *, CURLcode);
+  void (*on_done)(CURL *);
+  void (*on_response)(CURL *, const ngx_curl_response_t *);
+  void (*on_complete)(CURL *, CURLcode, void *data);
+  // If not NULL, `on_retry` is called before the handle is retried, so that
+  // whatever collects its response can discard the previous attempt's.
+  void (*on_retry)(CURL *, void *data);
+  void *data;
+} ngx_curl_callbacks_t;
+
+// A growable byte buffer, allocated by `ngx_curl_t::allocator`.
+typedef struct ngx_curl_buffer_s {
+  char *data;
+  size_t length;
+  size_t capacity;
+} ngx_curl_buffer_t;
+
+// The number of recent transfer times kept for each origin.
+#define NGX_CURL_ORIGIN_SAMPLE_COUNT 64
+
+typedef enum ngx_curl_breaker_state_e {
+  // Handles for the origin proceed.
+  NGX_CURL_BREAKER_CLOSED,
+  // Handles for the origin fail with `NGX_CURLE_CIRCUIT_OPEN` until
+  // `ngx_curl_origin_t::open_until`.
+  NGX_CURL_BREAKER_OPEN,
+  // One handle at a time probes the origin, and the rest fail. The probe's
+  // outcome closes the breaker or opens it again.
+  NGX_CURL_BREAKER_HALF_OPEN
+} ngx_curl_breaker_state_t;
+
+// Phase histograms are log-linear, like HdrHistogram's: each power of two
+// of microseconds is divided into `NGX_CURL_HISTOGRAM_SUB_BUCKETS` equal
+// buckets, so that a recorded duration is off by at most an eighth. Durations
+// of `2^NGX_CURL_HISTOGRAM_MAX_BITS` microseconds (about 9.5 hours) or more
+// are counted in the last bucket.
+#define NGX_CURL_HISTOGRAM_SUB_BITS 3
+#define NGX_CURL_HISTOGRAM_SUB_BUCKETS (1 << NGX_CURL_HISTOGRAM_SUB_BITS)
+#define NGX_CURL_HISTOGRAM_MAX_BITS 35
+#define NGX_CURL_HISTOGRAM_BUCKETS                                             \
+  ((NGX_CURL_HISTOGRAM_MAX_BITS - NGX_CURL_HISTOGRAM_SUB_BITS + 1) *           \
+   NGX_CURL_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct ngx_curl_histogram_s {
+  // The number of durations recorded, and the longest, in microseconds.
+  uint64_t count;
+  uint64_t max;
+  uint32_t buckets[NGX_CURL_HISTOGRAM_BUCKETS];
+} ngx_curl_histogram_t;
+
+// An `ngx_curl_origin_t` records how transfers to one origin
+// ("scheme://host:port") have fared: how long they took, so that fetches to
+// it can be hedged after its 95th percentile latency, and how often they
+// failed, for its circuit breaker.
+typedef struct ngx_curl_origin_s {
+  // `node.str` refers to the origin, which is stored after the struct.
+  ngx_str_node_t node;
+  // `link` is in `ngx_curl_t::all_origins`.
+  ngx_queue_t link;
+  // The most recent successful transfer times, in milliseconds. The next
+  // sample goes at `sample_count % NGX_CURL_ORIGIN_SAMPLE_COUNT`.
+  ngx_msec_t samples[NGX_CURL_ORIGIN_SAMPLE_COUNT];
+  size_t sample_count;
+  // The 95th percentile of `samples`, or zero if there aren't enough yet.
+  ngx_msec_t p95;
+  // The following are used only if `ngx_curl_t::breaker_enabled`.
+  // `outcomes` holds the last `outcome_count` outcomes that bear on the
+  // origin's health, the most recent in bit 0. A set bit is a failure, and
+  // `failure_count` is the number of set bits.
+  ngx_curl_breaker_state_t breaker;
+  uint32_t outcomes;
+  unsigned outcome_count;
+  unsigned failure_count;
+  ngx_msec_t open_until;
+  // `probing` is true while a handle probes the half-open breaker.
+  bool probing;
+  // If `ngx_curl_t::phase_timing` is true, then `phases` points to a
+  // histogram for each `ngx_curl_phase_t`, allocated with the first
+  // successful transfer to the origin.
+  ngx_curl_histogram_t *phases;
+} ngx_curl_origin_t;
+
+// Circuit breaker parameters, unless otherwise specified in the options.
+// Outcomes are counted over a window of at most 32.
+#define NGX_CURL_DEFAULT_BREAKER_ERROR_PERCENT 50
+#define NGX_CURL_DEFAULT_BREAKER_MIN_REQUESTS 10
+#define NGX_CURL_DEFAULT_BREAKER_OPEN_TIME (5 * 1000)
+#define NGX_CURL_BREAKER_WINDOW 32
+
+// An origin's percentiles are not used until this many transfers to it have
+// completed, and are recomputed after every this many more.
+#define NGX_CURL_ORIGIN_MIN_SAMPLES 16
+
+// At most this many origins are tracked. Transfers to others aren't.
+#define NGX_CURL_MAX_ORIGINS 1024
+
+// Origins longer than this aren't tracked.
+#define NGX_CURL_MAX_ORIGIN_SIZE 256
+
+// An `ngx_curl_budget_t` limits extra requests, such as hedges and retries,
+// to a percentage of the requests that could make them. It counts tokens,
+// each a hundredth of an extra request. Every request that could make an
+// extra request earns `percent` tokens, every extra request spends 100, and
+// at most `NGX_CURL_MAX_BUDGET_TOKENS` are saved up for bursts.
+typedef struct ngx_curl_budget_s {
+  size_t percent;
+  size_t tokens;
+} ngx_curl_budget_t;
+
+#define NGX_CURL_MAX_BUDGET_TOKENS (10 * 100)
+
+#define NGX_CURL_DEFAULT_HEDGE_BUDGET_PERCENT 5
+
+#define NGX_CURL_DEFAULT_RETRY_BUDGET_PERCENT 10
+
+// Retry backoff, unless otherwise specified in the policy.
+#define NGX_CURL_DEFAULT_RETRY_BACKOFF 100
+#define NGX_CURL_DEFAULT_MAX_RETRY_BACKOFF (10 * 1000)
+
+// A copy of a flight's transfer started by hedging, with its own response.
+typedef struct ngx_curl_hedge_s {
+  CURL *transfer;
+  ngx_curl_buffer_t headers;
+  ngx_curl_buffer_t body;
+} ngx_curl_hedge_t;
+
+// An `ngx_curl_flight_t` is a transfer performed on behalf of one or more
+// callers of `ngx_curl_fetch`. The transfer uses a duplicate of the first
+// caller's handle, and its response is buffered and then delivered to every
+// caller waiting on it.
+typedef struct ngx_curl_flight_s ngx_curl_flight_t;
+
+struct ngx_curl_flight_s {
+  // While `transfer` is in progress, if the flight has a key, then `node` is
+  // in `ngx_curl_t::flights` and `in_flights` is true.
+  ngx_str_node_t node;
+  bool in_flights;
+  // The fetch key, if any, which is stored after the flight.
+  ngx_str_t key;
+  ngx_curl_t *curl;
+  // `link` is in `ngx_curl_t::all_flights`.
+  ngx_queue_t link;
+  // `transfer` is NULL if the response was found fresh in the response cache.
+  // `deliver` is then posted to deliver it.
+  CURL *transfer;
+  ngx_event_t deliver;
+  // Request headers built for `transfer` by this library, or NULL.
+  struct curl_slist *request_headers;
+  // `authorized` is true if the caller's request headers include
+  // `Authorization`. See `store_cached_response`.
+  bool authorized;
+  // `waiters` is a queue of `ngx_curl_handle_context_t`, linked by `queue`.
+  ngx_queue_t waiters;
+  long status;
+  ngx_curl_buffer_t headers;
+  ngx_curl_buffer_t body;
+  // If `stale` is true, then `transfer` is revalidating a stale response
+  // from the response cache, and the following describe that response.
+  bool stale;
+  long stale_status;
+  time_t stale_last_modified;
+  ngx_curl_buffer_t stale_etag;
+  ngx_curl_buffer_t stale_headers;
+  ngx_curl_buffer_t stale_body;
+  // `completing` is true while responses are being delivered to `waiters`.
+  bool completing;
+  // `hedge_timer` starts `hedge` if `transfer` is still running when it
+  // fires. If `hedge_url` is not NULL, the hedge requests it instead.
+  // Whichever copy succeeds first is delivered, and the other is removed.
+  // `transfer_failed` is true if `transfer` failed while `hedge` was still
+  // running, in which case the hedge's result is delivered.
+  ngx_event_t hedge_timer;
+  char *hedge_url;
+  ngx_curl_hedge_t hedge;
+  bool transfer_failed;
+};
+
+typedef enum ngx_curl_handle_state_e {
+  // The handle is added to `ngx_curl_t::multi`.
+  NGX_CURL_HANDLE_RUNNING,
+  // The handle is waiting for nginx's resolver, and is not added to
+  // `ngx_curl_t::multi`.
+  NGX_CURL_HANDLE_RESOLVING,
+  // The handle is waiting in `ngx_curl_t::queue` to be admitted.
+  NGX_CURL_HANDLE_QUEUED,
+  // The handle was passed to `ngx_curl_fetch`, and is waiting for a flight.
+  // It is never added to `ngx_curl_t::multi`.
+  NGX_CURL_HANDLE_WAITING,
+  // The handle failed, and is waiting for `retry_timer` to try again. It is
+  // not added to `ngx_curl_t::multi`, and is not admitted.
+  NGX_CURL_HANDLE_BACKING_OFF,
+  // The handle's origin has an open circuit breaker, and `reject` is posted
+  // to fail it. It is never added to `ngx_curl_t::multi`.
+  NGX_CURL_HANDLE_REJECTED
+} ngx_curl_handle_state_t;
+
+struct ngx_curl_handle_context_s {
+  ngx_curl_t *curl;
+  CURL *handle;
+  ngx_curl_callbacks_t callbacks;
+  ngx_curl_handle_state_t state;
+  // `admitted` is true if the handle counts against
+  // `ngx_curl_t::max_running_handles`, i.e. if it has left the queue.
+  bool admitted;
+  // `reserving` is true if the handle holds one of
+  // `ngx_curl_t::reserved_connections`: it's admitted, but libcurl hasn't
+  // yet registered a socket for it.
+  bool reserving;
+  // `queue` links the context into `ngx_curl_t::queues[priority]` while the
+  // handle is `NGX_CURL_HANDLE_QUEUED`, and `queue_timer` limits how long it
+  // waits there, since `queued_at`. While the handle is
+  // `NGX_CURL_HANDLE_WAITING`, `queue` instead links the context into
+  // `flight->waiters`.
+  ngx_queue_t queue;
+  unsigned priority;
+  ngx_msec_t queued_at;
+  // How long the handle waited in the queue before its current attempt was
+  // admitted, in milliseconds.
+  ngx_msec_t queue_wait;
+  ngx_event_t queue_timer;
+  ngx_curl_flight_t *flight;
+  // `next` links the context into its bucket in `ngx_curl_t::contexts` while
+  // the handle is registered, and into `ngx_curl_t::free_contexts` otherwise.
+  ngx_curl_handle_context_t *next;
+  // The following are used only when `ngx_curl_t::resolver` is set.
+  // See `on_resolver_start`.
+  ngx_resolver_ctx_t *resolver_ctx;
+  // `host` is the name being resolved by `resolver_ctx`.
+  char *host;
+  long port;
+  // `resolve` is the `CURLOPT_RESOLVE` list built from nginx's answer, or
+  // `resolve_result` describes why there isn't one.
+  struct curl_slist *resolve;
+  CURLcode resolve_result;
+  // `awaiting_resolver` is true if libcurl's resolution was aborted in favor
+  // of nginx's, so the transfer's upcoming failure is to be ignored.
+  bool awaiting_resolver;
+  // `resolved_by_nginx` is true once nginx's answer has been handed to
+  // libcurl. Any further resolutions are left to libcurl.
+  bool resolved_by_nginx;
+  // The following are used only if a retry policy was attached by
+  // `ngx_curl_retry`. `attempt` is 1 during the first attempt. If
+  // `has_deadline` is true, every attempt must finish by `deadline`, in terms
+  // of `ngx_current_msec`.
+  const ngx_curl_retry_policy_t *retry;
+  unsigned attempt;
+  bool has_deadline;
+  ngx_msec_t deadline;
+  ngx_event_t retry_timer;
+  ngx_event_t reject;
+  // If not NULL, the handle is probing this origin's half-open breaker.
+  ngx_curl_origin_t *probe_origin;
+};
+
+// Contexts are allocated in slabs of this many, and are never freed
+// individually. Instead, unused contexts are kept in a free list for reuse.
+#define NGX_CURL_CONTEXT_SLAB_SIZE 64
+
+typedef struct ngx_curl_context_slab_s ngx_curl_context_slab_t;
+
+struct ngx_curl_context_slab_s {
+  ngx_curl_context_slab_t *next;
+  ngx_curl_handle_context_t contexts[NGX_CURL_CONTEXT_SLAB_SIZE];
+};
+
+// The number of idle `CURL*` handles kept for reuse by
+// `ngx_curl_release_handle`, unless otherwise specified in the options.
+#define NGX_CURL_DEFAULT_HANDLE_POOL_SIZE 64
+
+// The number of buckets in a new `ngx_curl_t`'s context table. The table
+// doubles in size whenever it holds more contexts than it has buckets.
+#define NGX_CURL_INITIAL_BUCKET_COUNT 64
+
+// The weight of each priority class, unless otherwise specified in the
+// options. See `dequeue_context`.
+static const unsigned default_priority_weights[NGX_CURL_PRIORITY_CLASSES] = {
+    64, 16, 4, 1};
+
+// A class's stride is this divided by its weight.
+#define NGX_CURL_STRIDE_SCALE (1 << 20)
+
+// How long to wait for nginx's resolver, unless otherwise specified in the
+// options. This matches nginx's default `resolver_timeout`.
+#define NGX_CURL_DEFAULT_RESOLVER_TIMEOUT (30 * 1000)
+
 struct ngx_curl_s {
   const ngx_curl_allocator_t *allocator;
   CURLM *multi;
   ngx_connection_t dummy_connection;
   ngx_event_t timeout;
+  // `kick` is posted when handles are added, so that all handles added during
+  // one iteration of nginx's event loop are started by a single call to
+  // `curl_multi_socket_action`.
+  ngx_event_t kick;
+  // If `edge_triggered` is true, then each libcurl socket is registered with
+  // nginx's event loop once, for both directions, using edge-triggered
+  // notifications. Changes in the direction that libcurl is interested in
+  // are then tracked by swapping event handlers, without involving the event
+  // module.
+  bool edge_triggered;
+  // `contexts` is a hash table mapping each registered `CURL*` to its
+  // `ngx_curl_handle_context_t`. We keep the mapping ourselves, rather than in
+  // the handle's `CURLOPT_PRIVATE` data, so that the private pointer remains
+  // the caller's for the lifetime of the request.
+  ngx_curl_handle_context_t **contexts;
+  size_t bucket_count; // always a power of two
+  size_t context_count;
+  ngx_curl_handle_context_t *free_contexts;
+  ngx_curl_context_slab_t *slabs;
+  // `idle_handles` is a stack of reset `CURL*` handles, with room for
+  // `handle_pool_size` of them.
+  CURL **idle_handles;
+  size_t idle_handle_count;
+  size_t handle_pool_size;
+  // `share` is either `worker_share` or null.
+  CURLSH *share;
+  // `ssl_session_cache` is the `data` of the shared memory zone created by
+  // `ngx_curl_add_ssl_session_cache`, or null.
+  ngx_curl_shm_cache_t *ssl_session_cache;
+  // `response_cache` is the `data` of the shared memory zone created by
+  // `ngx_curl_add_response_cache`, or null.
+  ngx_curl_shm_cache_t *response_cache;
+  // `metrics` is in the shared memory zone created by
+  // `ngx_curl_add_metrics_zone`, or null. It mirrors some of `stats`, for
+  // all workers together.
+  ngx_curl_metrics_t *metrics;
+  // If `resolver` is not null, then host names are resolved using nginx's
+  // resolver instead of libcurl's.
+  ngx_resolver_t *resolver;
+  ngx_msec_t resolver_timeout;
+  // Handles beyond `max_running_handles` (if nonzero), or added while nginx
+  // has no free connections to spare, wait in `queues` for at most
+  // `queue_timeout` milliseconds (if nonzero). `running_count` is the number
+  // of admitted handles. `reserved_connections` is the number of them that
+  // haven't registered a socket yet, each of which will need an nginx
+  // connection, and `connection_headroom` is the number of connections to
+  // leave free besides. See `can_admit`.
+  size_t max_running_handles;
+  ngx_msec_t queue_timeout;
+  size_t running_count;
+  size_t reserved_connections;
+  size_t connection_headroom;
+  // There's a queue for each priority class, and `queued_count` is the
+  // number of handles in all of them. See `dequeue_context` for how the
+  // next handle to admit is chosen.
+  ngx_queue_t queues[NGX_CURL_PRIORITY_CLASSES];
+  size_t queued_count;
+  uint64_t queue_pass[NGX_CURL_PRIORITY_CLASSES];
+  uint64_t queue_stride[NGX_CURL_PRIORITY_CLASSES];
+  uint64_t queue_time;
+  // If `multiplex` is true, then handles wait for a connection that can
+  // multiplex them (e.g. HTTP/2) rather than opening another.
+  bool multiplex;
+  // `flights` contains each `ngx_curl_flight_t` that has a key, so that
+  // later fetches with the same key can join it.
+  ngx_rbtree_t flights;
+  ngx_rbtree_node_t flights_sentinel;
+  ngx_queue_t all_flights;
+  // `origins` contains an `ngx_curl_origin_t` for each origin that a
+  // transfer has completed to, up to `NGX_CURL_MAX_ORIGINS`, if anything
+  // needs them: see `tracks_origins`.
+  ngx_rbtree_t origins;
+  ngx_rbtree_node_t origins_sentinel;
+  ngx_queue_t all_origins;
+  size_t origin_count;
+  // Set by the first fetch that hedges after its origin's p95, from which
+  // point transfer times are sampled.
+  bool hedging_after_p95;
+  ngx_curl_budget_t hedge_budget;
+  ngx_curl_budget_t retry_budget;
+  // If `breaker_enabled` is true, then each origin has a circuit breaker.
+  // See `update_breaker`.
+  bool breaker_enabled;
+  size_t breaker_error_percent;
+  size_t breaker_min_requests;
+  ngx_msec_t breaker_open_time;
+  // If `phase_timing` is true, then each origin has a histogram of each
+  // phase of its transfers. If `slow_transfer_time` is nonzero, then that
+  // percentage of transfers that take at least that long (in milliseconds,
+  // from being added to their callback returning) are logged.
+  bool phase_timing;
+  ngx_msec_t slow_transfer_time;
+  size_t slow_transfer_log_percent;
+  // `submissions` is a lock-free stack of `ngx_curl_submission_t`, pushed by
+  // any thread in `ngx_curl_submit`, and emptied all at once by the event
+  // loop. The thread that makes the stack nonempty wakes the event loop by
+  // writing to `submission_fd`, whose reading end is `submission_connection`.
+  // These are used only if the `accept_submissions` option was set.
+  ngx_atomic_t submissions;
+  ngx_connection_t *submission_connection;
+  ngx_fd_t submission_fd;
+#if (NGX_THREADS)
+  // `paused_uploads` contains each `ngx_curl_upload_t` whose transfer is
+  // paused while a thread pool reads its body.
+  ngx_queue_t paused_uploads;
+#endif
+  ngx_curl_stats_t stats;
 };
 
-typedef struct ngx_curl_handle_context_s {
-  void (*on_error)(CURL *, CURLcode);
-  void (*on_done)(CURL *);
-  // `user_data` is whatever was installed as the handle's "private" data
-  // before we replaced it with this object.
-  void *user_data;
-} ngx_curl_handle_context_t;
-
+static ngx_curl_handle_context_t *acquire_context(ngx_curl_t *curl);
+static void release_context(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context);
+static void insert_context(ngx_curl_t *curl,
+                           ngx_curl_handle_context_t *context);
+static ngx_curl_handle_context_t **find_context(ngx_curl_t *curl,
+                                                CURL *handle);
+static ngx_curl_handle_context_t *remove_context(ngx_curl_t *curl,
+                                                 CURL *handle);
+static void clean_up_context(ngx_curl_t *curl,
+                             ngx_curl_handle_context_t *context);
+static void complete_context(ngx_curl_t *curl,
+                             ngx_curl_handle_context_t *context,
+                             CURLcode result);
 static void process_messages(ngx_curl_t *curl);
 static void on_connection_event(ngx_event_t *event);
+static void on_unwanted_event(ngx_event_t *event);
 static void on_timeout(ngx_event_t *event);
+static void on_kick(ngx_event_t *event);
+static void schedule_kick(ngx_curl_t *curl);
+static bool can_admit(const ngx_curl_t *curl);
+static int start_transfer(ngx_curl_t *curl,
+                          ngx_curl_handle_context_t *context);
+static void admit_queued(ngx_curl_t *curl);
+static void enqueue_context(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context);
+static void unlink_queued_context(ngx_curl_t *curl,
+                                  ngx_curl_handle_context_t *context);
+static ngx_curl_handle_context_t *dequeue_context(ngx_curl_t *curl);
+static void on_queue_timeout(ngx_event_t *event);
+static void release_admission(ngx_curl_t *curl,
+                              ngx_curl_handle_context_t *context);
+static void release_reservation(ngx_curl_t *curl,
+                                ngx_curl_handle_context_t *context);
+static int admit_or_enqueue(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context);
+static void earn_budget(ngx_curl_budget_t *budget);
+static bool can_spend_budget(const ngx_curl_budget_t *budget);
+static void spend_budget(ngx_curl_budget_t *budget);
+static bool should_retry(ngx_curl_t *curl, ngx_curl_handle_context_t *context,
+                         CURLcode result, ngx_msec_t *backoff);
+static void on_retry_timer(ngx_event_t *event);
+static CURLcode attach_retry_policy(ngx_curl_t *curl,
+                                    ngx_curl_handle_context_t *context,
+                                    const ngx_curl_retry_policy_t *policy);
+static void set_context_priority(ngx_curl_t *curl,
+                                 ngx_curl_handle_context_t *context,
+                                 unsigned priority);
+static CURLcode limit_attempt_time(ngx_curl_handle_context_t *context);
 static int on_register_timer(CURLM *multi, long timeout_milliseconds,
                              void *user_data);
 static int on_register_event(CURL *handle, curl_socket_t s, int what,
                              void *user_data, void *socket_context);
+static int watch_event(ngx_curl_t *curl, ngx_event_t *event, bool wanted);
+static ngx_int_t unwatch_connection(ngx_curl_t *curl,
+                                    ngx_connection_t *connection);
+static int add_handle(ngx_curl_t *curl, CURL *handle,
+                      const ngx_curl_callbacks_t *callbacks);
+static int remove_handle(ngx_curl_t *curl, CURL *handle);
+static bool append_to_buffer(const ngx_curl_allocator_t *allocator,
+                             ngx_curl_buffer_t *buffer, const char *data,
+                             size_t length);
+static size_t on_flight_header(char *data, size_t size, size_t count,
+                               void *user_data);
+static size_t on_flight_body(char *data, size_t size, size_t count,
+                             void *user_data);
+static ngx_curl_flight_t *create_flight(ngx_curl_t *curl,
+                                        const ngx_str_t *key);
+static int start_flight(ngx_curl_t *curl, ngx_curl_flight_t *flight,
+                        CURL *handle, const ngx_curl_fetch_options_t *options);
+static void on_flight_complete(CURL *transfer, CURLcode result, void *data);
+static void finish_flight(ngx_curl_flight_t *flight, CURLcode result);
+static void on_flight_retry(CURL *transfer, void *data);
+static void stop_flight(ngx_curl_flight_t *flight);
+static void arm_hedge(ngx_curl_t *curl, ngx_curl_flight_t *flight,
+                      const ngx_curl_fetch_options_t *options);
+static void on_hedge_timer(ngx_event_t *event);
+static int start_hedge(ngx_curl_t *curl, ngx_curl_flight_t *flight);
+static size_t on_hedge_header(char *data, size_t size, size_t count,
+                              void *user_data);
+static size_t on_hedge_body(char *data, size_t size, size_t count,
+                            void *user_data);
+static void on_hedge_complete(CURL *transfer, CURLcode result, void *data);
+static void discard_hedge(ngx_curl_flight_t *flight);
+static bool tracks_origins(const ngx_curl_t *curl);
+static size_t origin_key(CURL *handle, u_char *buffer);
+static ngx_curl_origin_t *find_origin(ngx_curl_t *curl, CURL *handle,
+                                      bool create);
+static ngx_curl_origin_t *record_result(ngx_curl_t *curl,
+                                        ngx_curl_handle_context_t *context,
+                                        CURLcode result);
+static bool measure_phases(ngx_curl_handle_context_t *context,
+                           curl_off_t *phases);
+static curl_off_t monotonic_usec(void);
+static void record_phases(ngx_curl_t *curl, ngx_curl_origin_t *origin,
+                          const curl_off_t *phases, CURLcode result,
+                          long status);
+static void record_transfer_time(ngx_curl_origin_t *origin, CURL *handle);
+static bool breaker_admits(ngx_curl_t *curl,
+                           ngx_curl_handle_context_t *context);
+static void update_breaker(ngx_curl_t *curl, ngx_curl_origin_t *origin,
+                           bool failed, bool probe);
+static void open_breaker(ngx_curl_t *curl, ngx_curl_origin_t *origin);
+static void on_reject(ngx_event_t *event);
+static void on_flight_deliver(ngx_event_t *event);
+static void deliver_flight(ngx_curl_flight_t *flight, CURLcode result);
+static void destroy_flight(ngx_curl_flight_t *flight);
+static void parse_cache_policy(u_char *headers, size_t length, time_t now,
+                               ngx_curl_cache_policy_t *policy);
+static ngx_curl_cache_lookup_t
+lookup_cached_response(ngx_curl_t *curl, ngx_curl_flight_t *flight);
+static void store_cached_response(ngx_curl_t *curl, ngx_curl_flight_t *flight);
+static void refresh_cached_response(ngx_curl_t *curl,
+                                    ngx_curl_flight_t *flight);
+static size_t on_sink_body(char *data, size_t size, size_t count,
+                           void *user_data);
+static void on_sink_complete(CURL *handle, CURLcode result, void *data);
+static void on_sink_retry(CURL *handle, void *data);
+static size_t on_upload_read(char *data, size_t size, size_t count,
+                             void *user_data);
+static int on_upload_seek(void *user_data, curl_off_t offset, int origin);
+#if (NGX_THREADS)
+static void on_upload_thread_read(void *data, ngx_log_t *log);
+static void pause_upload(ngx_curl_upload_t *upload);
+static void on_upload_thread_done(ngx_event_t *event);
+#endif
+static void on_upload_cleanup(void *data);
+static void detach_uploads(ngx_curl_t *curl, CURL *handle);
+static int submit(ngx_curl_t *curl, CURL *handle,
+                  void (*on_complete)(CURL *, CURLcode, void *data),
+                  void *data, ngx_curl_submission_t **submission_out);
+static void push_submission(ngx_curl_t *curl,
+                            ngx_curl_submission_t *submission);
+static ngx_curl_submission_t *take_submissions(ngx_curl_t *curl);
+static int open_submission_channel(ngx_curl_t *curl);
+static void close_submission_channel(ngx_curl_t *curl);
+static void wake_event_loop(ngx_curl_t *curl);
+static void on_submission_event(ngx_event_t *event);
+static void on_submission_complete(CURL *handle, CURLcode result, void *data);
+static void finish_submission(ngx_curl_submission_t *submission);
+#if (NGX_THREADS)
+static void on_submission_thread_complete(void *data, ngx_log_t *log);
+static void on_submission_thread_done(ngx_event_t *event);
+#endif
+static void on_group_member_complete(CURL *handle, CURLcode result,
+                                     void *data);
+static void cancel_group_members(ngx_curl_group_t *group);
+static void on_group_resolve(ngx_event_t *event);
+static void resolve_group(ngx_curl_group_t *group);
+static void destroy_group(ngx_curl_group_t *group);
+static int on_resolver_start(void *resolver_state, void *reserved,
+                             void *user_data);
+static void on_resolved(ngx_resolver_ctx_t *ctx);
+static void resume_resolved(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context);
+static CURLSH *acquire_worker_share(void);
+static void release_worker_share(void);
+
+static ngx_curl_handle_context_t *acquire_context(ngx_curl_t *curl) {
+  assert(curl);
+  assert(curl->allocator);
+
+  if (curl->free_contexts == NULL) {
+    ngx_curl_context_slab_t *slab =
+        curl->allocator->allocate(sizeof(ngx_curl_context_slab_t));
+    if (slab == NULL) {
+      return NULL;
+    }
+    ++curl->stats.context_pool_misses;
+
+    slab->next = curl->slabs;
+    curl->slabs = slab;
+    for (size_t i = 0; i < NGX_CURL_CONTEXT_SLAB_SIZE; ++i) {
+      slab->contexts[i].next = curl->free_contexts;
+      curl->free_contexts = &slab->contexts[i];
+    }
+  } else {
+    ++curl->stats.context_pool_hits;
+  }
+
+  ngx_curl_handle_context_t *context = curl->free_contexts;
+  curl->free_contexts = context->next;
+  memset(context, 0, sizeof *context);
+  return context;
+}
+
+static void release_context(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  context->handle = NULL;
+  context->next = curl->free_contexts;
+  curl->free_contexts = context;
+}
+
+static size_t hash_handle(const ngx_curl_t *curl, const CURL *handle) {
+  // `CURL*` handles are large heap allocations, so the low bits of their
+  // addresses carry little information. Mix the high bits in.
+  uintptr_t key = (uintptr_t)handle;
+  key ^= key >> 17;
+  key *= 0x9e3779b1u;
+  key ^= key >> 13;
+  return key & (curl->bucket_count - 1);
+}
+
+static void insert_context(ngx_curl_t *curl,
+                           ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(curl->contexts);
+  assert(context);
+  assert(context->handle);
+
+  if (curl->context_count >= curl->bucket_count) {
+    // Grow the table. If we can't, then carry on with longer chains.
+    const size_t old_bucket_count = curl->bucket_count;
+    ngx_curl_handle_context_t **old_contexts = curl->contexts;
+    ngx_curl_handle_context_t **contexts = curl->allocator->callocate(
+        old_bucket_count * 2, sizeof(ngx_curl_handle_context_t *));
+    if (contexts != NULL) {
+      curl->contexts = contexts;
+      curl->bucket_count = old_bucket_count * 2;
+      for (size_t i = 0; i < old_bucket_count; ++i) {
+        ngx_curl_handle_context_t *entry = old_contexts[i];
+        while (entry) {
+          ngx_curl_handle_context_t *next = entry->next;
+          const size_t bucket = hash_handle(curl, entry->handle);
+          entry->next = contexts[bucket];
+          contexts[bucket] = entry;
+          entry = next;
+        }
+      }
+      curl->allocator->free(old_contexts);
+    }
+  }
+
+  const size_t bucket = hash_handle(curl, context->handle);
+  context->next = curl->contexts[bucket];
+  curl->contexts[bucket] = context;
+  ++curl->context_count;
+  add_metric(curl, handles_added, 1);
+}
+
+static ngx_curl_handle_context_t **find_context(ngx_curl_t *curl,
+                                                CURL *handle) {
+  assert(curl);
+  assert(curl->contexts);
+  assert(handle);
+
+  // Return the link that refers to the context, so that the caller can
+  // unlink it.
+  ngx_curl_handle_context_t **link =
+      &curl->contexts[hash_handle(curl, handle)];
+  for (; *link; link = &(*link)->next) {
+    if ((*link)->handle == handle) {
+      return link;
+    }
+  }
+
+  return NULL;
+}
+
+static ngx_curl_handle_context_t *remove_context(ngx_curl_t *curl,
+                                                 CURL *handle) {
+  ngx_curl_handle_context_t **link = find_context(curl, handle);
+  if (link == NULL) {
+    return NULL;
+  }
+
+  ngx_curl_handle_context_t *context = *link;
+  *link = context->next;
+  --curl->context_count;
+  return context;
+}
+
+static void clean_up_context(ngx_curl_t *curl,
+                             ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  if (context->state == NGX_CURL_HANDLE_QUEUED) {
+    unlink_queued_context(curl, context);
+    if (context->queue_timer.timer_set) {
+      ngx_del_timer(&context->queue_timer);
+    }
+  }
+
+  if (context->retry_timer.timer_set) {
+    ngx_del_timer(&context->retry_timer);
+  }
+
+  if (context->reject.posted) {
+    ngx_delete_posted_event(&context->reject);
+  }
+
+  if (context->probe_origin) {
+    // The probe was removed before it could tell. Let another handle probe.
+    context->probe_origin->probing = false;
+    context->probe_origin = NULL;
+  }
+
+  if (context->state == NGX_CURL_HANDLE_WAITING) {
+    ngx_curl_flight_t *flight = context->flight;
+    ngx_queue_remove(&context->queue);
+    context->flight = NULL;
+    // Nobody else wants the response, so stop fetching it.
+    if (ngx_queue_empty(&flight->waiters) && !flight->completing) {
+      stop_flight(flight);
+      destroy_flight(flight);
+    }
+    return;
+  }
+
+  release_admission(curl, context);
+
+  if (curl->resolver == NULL) {
+    return;
+  }
+
+  if (context->resolver_ctx) {
+    ngx_resolve_name_done(context->resolver_ctx);
+    context->resolver_ctx = NULL;
+  }
+
+  // Don't leave libcurl referring to things that are about to be freed.
+  (void)curl_easy_setopt(context->handle, CURLOPT_RESOLVER_START_FUNCTION,
+                         NULL);
+  (void)curl_easy_setopt(context->handle, CURLOPT_RESOLVER_START_DATA, NULL);
+  if (context->resolve) {
+    (void)curl_easy_setopt(context->handle, CURLOPT_RESOLVE, NULL);
+    curl_slist_free_all(context->resolve);
+    context->resolve = NULL;
+  }
+
+  curl->allocator->free(context->host);
+  context->host = NULL;
+}
+
+static void complete_context(ngx_curl_t *curl,
+                             ngx_curl_handle_context_t *context,
+                             CURLcode result) {
+  assert(curl);
+  assert(context);
+
+  CURL *handle = context->handle;
+  (void)remove_context(curl, handle);
+  clean_up_context(curl, context);
+
+  // Return the context to the pool before invoking the user-supplied
+  // callback, so that the callback may add the handle again.
+  const ngx_curl_callbacks_t callbacks = context->callbacks;
+  release_context(curl, context);
+
+  if ((unsigned)result < NGX_CURL_RESULT_COUNT) {
+    add_metric(curl, results[result], 1);
+  }
+
+  // Finally, it's time to invoke a user-supplied callback.
+  if (callbacks.on_complete) {
+    callbacks.on_complete(handle, result, callbacks.data);
+  } else if (result == CURLE_OK) {
+    callbacks.on_done(handle);
+  } else {
+    callbacks.on_error(handle, result);
+  }
+}
 
 static void process_messages(ngx_curl_t *curl) {
   assert(curl);
@@ -57,37 +1037,75 @@ static void process_messages(ngx_curl_t *curl) {
                     "Unable to remove CURL handle from multi-handle: %s",
                     curl_multi_strerror(mrc));
     }
+    detach_uploads(curl, handle);
 
-    ngx_curl_handle_context_t *context;
-    CURLcode rc = curl_easy_getinfo(handle, CURLINFO_PRIVATE, &context);
-    if (rc != CURLE_OK) {
+    ngx_curl_handle_context_t **link = find_context(curl, handle);
+    if (link == NULL) {
       ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                    "Unable to get private data pointer from CURL handle: %s",
-                    curl_easy_strerror(rc));
-      // This is a leak.  What can we do?
+                    "libcurl completed a CURL handle that is not registered "
+                    "with ngx_curl");
       continue;
     }
 
-    // Restore the original user data associated with the handle when it was
-    // added.
-    rc = curl_easy_setopt(handle, CURLOPT_PRIVATE, context->user_data);
-    if (rc != CURLE_OK) {
-      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                    "Unable to set private pointer of CURL handle: %s",
-                    curl_easy_strerror(rc));
-      // This is a leak.  What can we do?
+    ngx_curl_handle_context_t *context = *link;
+    if (context->awaiting_resolver) {
+      // The transfer failed only because `on_resolver_start` stopped it.
+      // Start it again once nginx's resolver has answered.
+      context->awaiting_resolver = false;
+      context->state = NGX_CURL_HANDLE_RESOLVING;
+      if (context->resolver_ctx == NULL) {
+        resume_resolved(curl, context);
+      }
       continue;
     }
 
-    // Finally, it's time to invoke a user-supplied callback.
-    rc = message->data.result;
-    if (rc == CURLE_OK) {
-      context->on_done(handle);
-    } else {
-      context->on_error(handle, rc);
+    long num_connects;
+    if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &num_connects) ==
+        CURLE_OK) {
+      if (num_connects) {
+        curl->stats.connections_opened += num_connects;
+        add_metric(curl, connections_opened, num_connects);
+      } else {
+        ++curl->stats.connections_reused;
+        add_metric(curl, connections_reused, 1);
+      }
+    }
+
+    const CURLcode result = message->data.result;
+    ngx_curl_origin_t *origin = record_result(curl, context, result);
+
+    // Phases are measured now, while the handle is still ours, and recorded
+    // once the callback, which is one of them, has returned.
+    curl_off_t phases[NGX_CURL_PHASE_COUNT];
+    long status = 0;
+    const bool timed = (curl->phase_timing || curl->slow_transfer_time) &&
+                       measure_phases(context, phases);
+    if (timed) {
+      (void)curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+    }
+
+    ngx_msec_t backoff;
+    if (context->retry && should_retry(curl, context, result, &backoff)) {
+      // Give up the handle's place while it waits.
+      release_admission(curl, context);
+      context->state = NGX_CURL_HANDLE_BACKING_OFF;
+      ngx_add_timer(&context->retry_timer, backoff);
+      ++curl->stats.retries;
+      if (timed) {
+        record_phases(curl, origin, phases, result, status);
+      }
+      continue;
+    }
+
+    if (!timed) {
+      complete_context(curl, context, result);
+      continue;
     }
 
-    curl->allocator->free(context);
+    const curl_off_t callback_start = monotonic_usec();
+    complete_context(curl, context, result);
+    phases[NGX_CURL_PHASE_CALLBACK] = monotonic_usec() - callback_start;
+    record_phases(curl, origin, phases, result, status);
   } while (message);
 }
 
@@ -108,15 +1126,32 @@ static void on_connection_event(ngx_event_t *event) {
   // > on a socket are unknown, pass 0 instead, and libcurl will test the
   // > descriptor internally.
   int ev_bitmask = 0;
-  if (connection->read->ready) {
+  if (connection->read->ready &&
+      connection->read->handler == &on_connection_event) {
     ev_bitmask |= CURL_CSELECT_IN;
   }
-  if (connection->write->ready) {
+  if (connection->write->ready &&
+      connection->write->handler == &on_connection_event) {
     ev_bitmask |= CURL_CSELECT_OUT;
   }
   if (connection->read->error || connection->write->error) {
     ev_bitmask |= CURL_CSELECT_ERR;
   }
+  add_metric(curl, socket_events, 1);
+
+  if (curl->edge_triggered) {
+    // The readiness we're about to report is consumed by libcurl. If it stops
+    // short of `EAGAIN`, libcurl arranges to be called again via its timer,
+    // so there's no need to remember it. On the other hand, readiness in a
+    // direction that libcurl isn't interested in is left set, so that
+    // `watch_event` can replay it later.
+    if (ev_bitmask & CURL_CSELECT_IN) {
+      connection->read->ready = 0;
+    }
+    if (ev_bitmask & CURL_CSELECT_OUT) {
+      connection->write->ready = 0;
+    }
+  }
 
   int num_running_handles;
   CURLMcode mrc = curl_multi_socket_action(curl->multi, connection->fd,
@@ -131,6 +1166,13 @@ static void on_connection_event(ngx_event_t *event) {
   process_messages(curl);
 }
 
+static void on_unwanted_event(ngx_event_t *event) {
+  // In edge-triggered mode, this is the handler for the direction of a socket
+  // that libcurl is not currently interested in. The event's `ready` flag
+  // records that the notification happened.
+  (void)event;
+}
+
 static void on_timeout(ngx_event_t *event) {
   assert(event);
   assert(event->data);
@@ -139,6 +1181,7 @@ static void on_timeout(ngx_event_t *event) {
   ngx_curl_t *curl = (ngx_curl_t *)(dummy_connection_address -
                                     offsetof(ngx_curl_t, dummy_connection));
   assert(curl->multi);
+  add_metric(curl, timeouts, 1);
 
   int num_running_handles;
   CURLMcode mrc = curl_multi_socket_action(curl->multi, CURL_SOCKET_TIMEOUT, 0,
@@ -152,72 +1195,596 @@ static void on_timeout(ngx_event_t *event) {
   process_messages(curl);
 }
 
-static int on_register_timer(CURLM *multi, long timeout_milliseconds,
-                             void *user_data) {
-  assert(multi);
-  assert(user_data);
-  ngx_curl_t *curl = user_data;
-  assert(curl->multi == multi);
+static void on_kick(ngx_event_t *event) {
+  assert(event);
+  assert(event->data);
+  // reminder: ngx_connection_t *dummy_connection = event->data;
+  char *dummy_connection_address = event->data;
+  ngx_curl_t *curl = (ngx_curl_t *)(dummy_connection_address -
+                                    offsetof(ngx_curl_t, dummy_connection));
+  assert(curl->multi);
+
+  admit_queued(curl);
 
   // From the libcurl docs:
   //
-  // > Your callback function timer_callback should install a non-repeating
-  // > timer with an expire time of timeout_ms milliseconds. When that timer
-  // > fires, call either curl_multi_socket_action or curl_multi_perform,
-  // > depending on which interface you use.
-  // >
-  // > A timeout_ms value of -1 passed to this callback means you should delete
-  // > the timer. All other values are valid expire times in number of
-  // > milliseconds.
+  // > When you have added your initial set of handles, you call
+  // > curl_multi_socket_action with CURL_SOCKET_TIMEOUT set in the sockfd
+  // > argument, and you will get callbacks call that sets you up and you then
+  // > continue to call curl_multi_socket_action accordingly when you get
+  // > activity on the sockets you have been asked to wait on, or if the timeout
+  // > timer expires.
+  int num_running_handles;
+  CURLMcode mrc = curl_multi_socket_action(curl->multi, CURL_SOCKET_TIMEOUT, 0,
+                                           &num_running_handles);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(
+        NGX_LOG_ERR, ngx_cycle->log, 0,
+        "Unable to notify libcurl of CURL handles that were added: %s",
+        curl_multi_strerror(mrc));
+  }
 
-  if (curl->timeout.timer_set) {
-    ngx_del_timer(&curl->timeout);
+  process_messages(curl);
+}
+
+static void schedule_kick(ngx_curl_t *curl) {
+  assert(curl);
+
+  if (curl->kick.posted) {
+    return;
   }
 
-  if (timeout_milliseconds == -1) {
-    return 0;
+  assert(curl->kick.data == &curl->dummy_connection);
+  curl->kick.log = ngx_cycle->log;
+  curl->kick.handler = &on_kick;
+  ngx_post_event(&curl->kick, &ngx_posted_events);
+}
+
+static bool can_admit(const ngx_curl_t *curl) {
+  assert(curl);
+
+  if (curl->max_running_handles &&
+      curl->running_count >= curl->max_running_handles) {
+    return false;
   }
 
-  assert(curl->timeout.data == &curl->dummy_connection);
-  curl->timeout.log = ngx_cycle->log;
-  curl->timeout.handler = &on_timeout;
-  curl->timeout.cancelable =
-      true; // otherwise a pending timeout will prevent shutdown
+  // A transfer that can't get an nginx connection for its socket breaks the
+  // whole multi-handle (see `on_register_event`), so wait for one to free up.
+  // Admitted transfers don't take their connection until libcurl registers
+  // their socket, so each one that hasn't yet has a connection reserved.
+  // Some transfers open more than one socket (e.g. happy eyeballs, or a
+  // proxy), which is what the headroom is for.
+  return ngx_cycle->free_connection_n >
+         curl->reserved_connections + curl->connection_headroom;
+}
 
-  ngx_add_timer(&curl->timeout, timeout_milliseconds);
+static int start_transfer(ngx_curl_t *curl,
+                          ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  CURLMcode mrc = curl_multi_add_handle(curl->multi, context->handle);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(
+        NGX_LOG_ERR, ngx_cycle->log, 0,
+        "Unable to register CURL handle with libcurl multi-handle: %s",
+        curl_multi_strerror(mrc));
+    return -2;
+  }
+
+  context->state = NGX_CURL_HANDLE_RUNNING;
+  context->admitted = true;
+  context->reserving = true;
+  ++curl->running_count;
+  ++curl->reserved_connections;
+  add_metric(curl, transfers_running, 1);
   return 0;
 }
 
-static int on_register_event(CURL *handle, curl_socket_t s, int what,
-                             void *user_data, void *socket_context) {
-  assert(handle);
-  assert(user_data);
-  ngx_curl_t *curl = user_data;
+static void enqueue_context(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+  assert(context->priority < NGX_CURL_PRIORITY_CLASSES);
 
-  ngx_connection_t *connection;
-  if (socket_context == NULL) {
-    // This socket (`s`) is new to us. Get an nginx connection for it and
-    // associate that connection with the socket.
-    connection = ngx_get_connection(s, ngx_cycle->log);
-    if (connection == NULL) {
-      // Returning -1 from this function screws up the whole multi-handle, but
-      // what else can we do? Nginx has probably hit its connection limit.
-      return -1;
-    }
+  // A class that was idle doesn't get credit for the time it was idle.
+  const unsigned priority = context->priority;
+  if (ngx_queue_empty(&curl->queues[priority]) &&
+      curl->queue_pass[priority] < curl->queue_time) {
+    curl->queue_pass[priority] = curl->queue_time;
+  }
 
-    // `on_connection_event` will dig this value out via `event->data->data`.
-    connection->data = curl;
+  ngx_queue_insert_tail(&curl->queues[priority], &context->queue);
+  ++curl->queued_count;
+  ++curl->stats.classes[priority].queue_depth;
+  add_metric(curl, handles_queued, 1);
+}
 
-    // Associate the connection with the socket. That will be `socket_context`
-    // the next time libcurl calls us about this socket (`s`).
-    CURLMcode mrc = curl_multi_assign(curl->multi, s, connection);
-    if (mrc != CURLM_OK) {
-      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                    "Error occurred while associating a context object with "
+static void unlink_queued_context(ngx_curl_t *curl,
+                                  ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+  assert(curl->queued_count);
+
+  ngx_queue_remove(&context->queue);
+  --curl->queued_count;
+  --curl->stats.classes[context->priority].queue_depth;
+  add_metric(curl, handles_queued, -1);
+}
+
+// Removes and returns the next queued handle to admit, or returns NULL if
+// none are queued. This is stride scheduling: each class advances its pass
+// by its stride, which is inversely proportional to its weight, whenever one
+// of its handles is admitted, and the nonempty class with the smallest pass
+// goes next (the more urgent class, in a tie). While several classes have
+// handles waiting, each is admitted in proportion to its weight. Weights
+// that differ by large factors approximate strict priority, except that no
+// class starves.
+static ngx_curl_handle_context_t *dequeue_context(ngx_curl_t *curl) {
+  assert(curl);
+
+  if (curl->queued_count == 0) {
+    return NULL;
+  }
+
+  unsigned next = NGX_CURL_PRIORITY_CLASSES;
+  for (unsigned i = 0; i < NGX_CURL_PRIORITY_CLASSES; ++i) {
+    if (!ngx_queue_empty(&curl->queues[i]) &&
+        (next == NGX_CURL_PRIORITY_CLASSES ||
+         curl->queue_pass[i] < curl->queue_pass[next])) {
+      next = i;
+    }
+  }
+  assert(next < NGX_CURL_PRIORITY_CLASSES);
+
+  curl->queue_time = curl->queue_pass[next];
+  curl->queue_pass[next] += curl->queue_stride[next];
+
+  ngx_curl_handle_context_t *context = ngx_queue_data(
+      ngx_queue_head(&curl->queues[next]), ngx_curl_handle_context_t, queue);
+  unlink_queued_context(curl, context);
+
+  ngx_curl_class_stats_t *stats = &curl->stats.classes[next];
+  const ngx_msec_t waited = ngx_current_msec - context->queued_at;
+  context->queue_wait = waited;
+  ++stats->admitted_from_queue;
+  stats->total_queue_wait += waited;
+  stats->max_queue_wait = ngx_max(stats->max_queue_wait, waited);
+  return context;
+}
+
+static void admit_queued(ngx_curl_t *curl) {
+  assert(curl);
+
+  while (curl->queued_count && can_admit(curl)) {
+    ngx_curl_handle_context_t *context = dequeue_context(curl);
+    if (context->queue_timer.timer_set) {
+      ngx_del_timer(&context->queue_timer);
+    }
+
+    if (start_transfer(curl, context) != 0) {
+      // `start_transfer` didn't change the state, but the context is no
+      // longer in the queue.
+      context->state = NGX_CURL_HANDLE_RUNNING;
+      complete_context(curl, context, CURLE_FAILED_INIT);
+    }
+  }
+}
+
+// Starts the handle's transfer, or puts the handle in the queue if it can't
+// be admitted yet.
+static int admit_or_enqueue(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  if (curl->breaker_enabled && !breaker_admits(curl, context)) {
+    // Fail without touching the network, but from the event loop.
+    context->state = NGX_CURL_HANDLE_REJECTED;
+    context->reject.data = &curl->dummy_connection;
+    context->reject.handler = &on_reject;
+    context->reject.log = ngx_cycle->log;
+    ngx_post_event(&context->reject, &ngx_posted_events);
+    ++curl->stats.circuit_rejections;
+    return 0;
+  }
+
+  // If any handles are already waiting, this one waits too, and the
+  // scheduler decides when it's admitted.
+  if (curl->queued_count || !can_admit(curl)) {
+    context->state = NGX_CURL_HANDLE_QUEUED;
+    context->queued_at = ngx_current_msec;
+    enqueue_context(curl, context);
+    if (curl->queue_timeout) {
+      context->queue_timer.data = &curl->dummy_connection;
+      context->queue_timer.handler = &on_queue_timeout;
+      context->queue_timer.log = ngx_cycle->log;
+      context->queue_timer.cancelable = true;
+      ngx_add_timer(&context->queue_timer, curl->queue_timeout);
+    }
+    ++curl->stats.handles_queued;
+    return 0;
+  }
+
+  return start_transfer(curl, context);
+}
+
+static void release_admission(ngx_curl_t *curl,
+                              ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  release_reservation(curl, context);
+  if (context->admitted) {
+    // Make room for the next queued handle, if any.
+    context->admitted = false;
+    --curl->running_count;
+    add_metric(curl, transfers_running, -1);
+    if (curl->queued_count) {
+      schedule_kick(curl);
+    }
+  }
+}
+
+static void release_reservation(ngx_curl_t *curl,
+                                ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  if (context->reserving) {
+    context->reserving = false;
+    assert(curl->reserved_connections);
+    --curl->reserved_connections;
+  }
+}
+
+static void on_queue_timeout(ngx_event_t *event) {
+  assert(event);
+  ngx_curl_handle_context_t *context =
+      (ngx_curl_handle_context_t *)((char *)event -
+                                    offsetof(ngx_curl_handle_context_t,
+                                             queue_timer));
+  ngx_curl_t *curl = context->curl;
+  assert(curl);
+  assert(context->state == NGX_CURL_HANDLE_QUEUED);
+
+  ++curl->stats.queue_timeouts;
+  complete_context(curl, context, NGX_CURLE_QUEUE_TIMEOUT);
+}
+
+static void earn_budget(ngx_curl_budget_t *budget) {
+  budget->tokens += budget->percent;
+  if (budget->tokens > NGX_CURL_MAX_BUDGET_TOKENS) {
+    budget->tokens = NGX_CURL_MAX_BUDGET_TOKENS;
+  }
+}
+
+static bool can_spend_budget(const ngx_curl_budget_t *budget) {
+  return budget->tokens >= 100;
+}
+
+static void spend_budget(ngx_curl_budget_t *budget) {
+  assert(can_spend_budget(budget));
+  budget->tokens -= 100;
+}
+
+static bool is_retryable(const ngx_curl_retry_policy_t *policy, CURL *handle,
+                         CURLcode result) {
+  if (result == CURLE_OK) {
+    if (policy->retryable_statuses == NULL) {
+      return false;
+    }
+    long status = 0;
+    (void)curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+    for (const long *retryable = policy->retryable_statuses; *retryable;
+         ++retryable) {
+      if (*retryable == status) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Failures that don't depend on the request: the connection couldn't be
+  // made, or broke, or the origin was too slow.
+  static const CURLcode default_codes[] = {
+      CURLE_COULDNT_CONNECT, CURLE_OPERATION_TIMEDOUT, CURLE_GOT_NOTHING,
+      CURLE_SEND_ERROR,      CURLE_RECV_ERROR,         CURLE_HTTP2,
+      CURLE_HTTP2_STREAM,    CURLE_OK};
+  const CURLcode *retryable =
+      policy->retryable_codes ? policy->retryable_codes : default_codes;
+  for (; *retryable != CURLE_OK; ++retryable) {
+    if (*retryable == result) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns whether the handle, whose attempt just finished with `result`,
+// should be tried again, and if so, how many milliseconds to wait first.
+static bool should_retry(ngx_curl_t *curl, ngx_curl_handle_context_t *context,
+                         CURLcode result, ngx_msec_t *backoff) {
+  assert(curl);
+  assert(context);
+  assert(context->retry);
+  const ngx_curl_retry_policy_t *policy = context->retry;
+
+  if (context->attempt >= policy->max_attempts ||
+      !is_retryable(policy, context->handle, result)) {
+    return false;
+  }
+
+  // Exponential backoff with "full jitter": a random delay up to a limit
+  // that doubles with each attempt.
+  const ngx_msec_t base =
+      policy->backoff ? policy->backoff : NGX_CURL_DEFAULT_RETRY_BACKOFF;
+  const ngx_msec_t max_backoff = policy->max_backoff
+                                     ? policy->max_backoff
+                                     : NGX_CURL_DEFAULT_MAX_RETRY_BACKOFF;
+  ngx_msec_t limit = base;
+  for (unsigned i = 1; i < context->attempt && limit < max_backoff; ++i) {
+    limit *= 2;
+  }
+  limit = ngx_min(limit, max_backoff);
+  *backoff = ngx_random() % (limit + 1);
+
+  // Don't bother if there won't be time for the next attempt.
+  if (context->has_deadline &&
+      (ngx_msec_int_t)(context->deadline - ngx_current_msec - *backoff) <= 0) {
+    return false;
+  }
+
+  if (!can_spend_budget(&curl->retry_budget)) {
+    ++curl->stats.retries_denied;
+    return false;
+  }
+  spend_budget(&curl->retry_budget);
+  return true;
+}
+
+// Caps the handle's `CURLOPT_TIMEOUT_MS` for its next attempt, according to
+// its retry policy.
+static CURLcode limit_attempt_time(ngx_curl_handle_context_t *context) {
+  assert(context);
+  assert(context->retry);
+
+  ngx_msec_t limit = context->retry->attempt_timeout;
+  if (context->has_deadline) {
+    ngx_msec_int_t remaining = context->deadline - ngx_current_msec;
+    if (remaining <= 0) {
+      remaining = 1; // zero would mean "no timeout"
+    }
+    if (limit == 0 || (ngx_msec_t)remaining < limit) {
+      limit = remaining;
+    }
+  }
+
+  if (limit == 0) {
+    return CURLE_OK;
+  }
+  return curl_easy_setopt(context->handle, CURLOPT_TIMEOUT_MS, (long)limit);
+}
+
+static CURLcode attach_retry_policy(ngx_curl_t *curl,
+                                    ngx_curl_handle_context_t *context,
+                                    const ngx_curl_retry_policy_t *policy) {
+  assert(curl);
+  assert(context);
+  assert(policy);
+
+  context->retry = policy;
+  context->attempt = 1;
+  if (policy->deadline) {
+    context->has_deadline = true;
+    context->deadline = ngx_current_msec + policy->deadline;
+  }
+  context->retry_timer.data = &curl->dummy_connection;
+  context->retry_timer.handler = &on_retry_timer;
+  context->retry_timer.log = ngx_cycle->log;
+  context->retry_timer.cancelable = true;
+
+  earn_budget(&curl->retry_budget);
+  return limit_attempt_time(context);
+}
+
+static void on_retry_timer(ngx_event_t *event) {
+  assert(event);
+  ngx_curl_handle_context_t *context =
+      (ngx_curl_handle_context_t *)((char *)event -
+                                    offsetof(ngx_curl_handle_context_t,
+                                             retry_timer));
+  ngx_curl_t *curl = context->curl;
+  assert(curl);
+  assert(context->state == NGX_CURL_HANDLE_BACKING_OFF);
+
+  ++context->attempt;
+  if (context->callbacks.on_retry) {
+    context->callbacks.on_retry(context->handle, context->callbacks.data);
+  }
+  if (context->retry->on_retry) {
+    context->retry->on_retry(context->handle);
+  }
+
+  const CURLcode rc = limit_attempt_time(context);
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to limit the time of CURL handle's next attempt: %s",
+                  curl_easy_strerror(rc));
+    complete_context(curl, context, rc);
+    return;
+  }
+
+  if (admit_or_enqueue(curl, context) != 0) {
+    complete_context(curl, context, CURLE_FAILED_INIT);
+    return;
+  }
+  schedule_kick(curl);
+}
+
+static void set_context_priority(ngx_curl_t *curl,
+                                 ngx_curl_handle_context_t *context,
+                                 unsigned priority) {
+  assert(curl);
+  assert(context);
+  assert(priority < NGX_CURL_PRIORITY_CLASSES);
+
+  if (context->state != NGX_CURL_HANDLE_QUEUED) {
+    // It applies if the handle queues again, e.g. to be retried.
+    context->priority = priority;
+    return;
+  }
+
+  // Move the handle to the back of its new class's queue. It keeps its
+  // `queued_at`, so its wait is measured from when it was added.
+  unlink_queued_context(curl, context);
+  context->priority = priority;
+  enqueue_context(curl, context);
+}
+
+int ngx_curl_set_priority(ngx_curl_t *curl, CURL *handle, unsigned priority) {
+  assert(curl);
+  assert(handle);
+
+  if (priority >= NGX_CURL_PRIORITY_CLASSES) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Invalid ngx_curl priority class: %ui", priority);
+    return -2;
+  }
+
+  ngx_curl_handle_context_t **link = find_context(curl, handle);
+  if (link == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to set priority of CURL handle that is not "
+                  "registered with ngx_curl");
+    return -1;
+  }
+
+  set_context_priority(curl, *link, priority);
+  return 0;
+}
+
+int ngx_curl_retry(ngx_curl_t *curl, CURL *handle,
+                   const ngx_curl_retry_policy_t *policy) {
+  assert(curl);
+  assert(handle);
+  assert(policy);
+
+  ngx_curl_handle_context_t **link = find_context(curl, handle);
+  if (link == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to attach retry policy to CURL handle that is not "
+                  "registered with ngx_curl");
+    return -1;
+  }
+  if ((*link)->state == NGX_CURL_HANDLE_WAITING) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to attach retry policy to a fetch; use "
+                  "ngx_curl_fetch_options_t::retry instead");
+    return -2;
+  }
+
+  const CURLcode rc = attach_retry_policy(curl, *link, policy);
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to set CURLOPT_TIMEOUT_MS on CURL handle: %s",
+                  curl_easy_strerror(rc));
+    return -5;
+  }
+  return 0;
+}
+
+static int on_register_timer(CURLM *multi, long timeout_milliseconds,
+                             void *user_data) {
+  assert(multi);
+  assert(user_data);
+  ngx_curl_t *curl = user_data;
+  assert(curl->multi == multi);
+
+  // From the libcurl docs:
+  //
+  // > Your callback function timer_callback should install a non-repeating
+  // > timer with an expire time of timeout_ms milliseconds. When that timer
+  // > fires, call either curl_multi_socket_action or curl_multi_perform,
+  // > depending on which interface you use.
+  // >
+  // > A timeout_ms value of -1 passed to this callback means you should delete
+  // > the timer. All other values are valid expire times in number of
+  // > milliseconds.
+
+  if (curl->timeout.timer_set) {
+    ngx_del_timer(&curl->timeout);
+  }
+
+  if (timeout_milliseconds == -1) {
+    return 0;
+  }
+
+  assert(curl->timeout.data == &curl->dummy_connection);
+  curl->timeout.log = ngx_cycle->log;
+  curl->timeout.handler = &on_timeout;
+  curl->timeout.cancelable =
+      true; // otherwise a pending timeout will prevent shutdown
+
+  ngx_add_timer(&curl->timeout, timeout_milliseconds);
+  return 0;
+}
+
+static int on_register_event(CURL *handle, curl_socket_t s, int what,
+                             void *user_data, void *socket_context) {
+  assert(handle);
+  assert(user_data);
+  ngx_curl_t *curl = user_data;
+
+  if (curl->reserved_connections && what != CURL_POLL_REMOVE) {
+    // The handle's reservation is used up, either by taking a connection
+    // below, or by reusing one that it already has.
+    ngx_curl_handle_context_t **link = find_context(curl, handle);
+    if (link) {
+      release_reservation(curl, *link);
+    }
+  }
+
+  ngx_connection_t *connection;
+  if (socket_context == NULL) {
+    // This socket (`s`) is new to us. Get an nginx connection for it and
+    // associate that connection with the socket.
+    connection = ngx_get_connection(s, ngx_cycle->log);
+    if (connection == NULL) {
+      // Returning -1 from this function screws up the whole multi-handle, but
+      // what else can we do? Nginx has probably hit its connection limit.
+      return -1;
+    }
+
+    // `on_connection_event` will dig this value out via `event->data->data`.
+    connection->data = curl;
+
+    if (curl->edge_triggered) {
+      // Neither direction is wanted yet. The `switch` below will choose.
+      connection->read->handler = &on_unwanted_event;
+      connection->write->handler = &on_unwanted_event;
+      connection->read->log = ngx_cycle->log;
+      connection->write->log = ngx_cycle->log;
+      ++curl->stats.event_registrations;
+      if (ngx_add_conn(connection) != NGX_OK) {
+        ngx_free_connection(connection);
+        return -1;
+      }
+    }
+
+    // Associate the connection with the socket. That will be `socket_context`
+    // the next time libcurl calls us about this socket (`s`).
+    CURLMcode mrc = curl_multi_assign(curl->multi, s, connection);
+    if (mrc != CURLM_OK) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Error occurred while associating a context object with "
                     "file descriptor %d in libcurl: %s",
                     s, curl_multi_strerror(mrc));
       return -1;
     }
+
+    ++curl->stats.sockets_open;
+    add_metric(curl, sockets_open, 1);
   } else {
     connection = socket_context;
   }
@@ -246,272 +1813,3865 @@ static int on_register_event(CURL *handle, curl_socket_t s, int what,
 
   switch (what) {
   case CURL_POLL_IN:
-    connection->read->handler = &on_connection_event;
-    if (!connection->read->active) {
-      if (ngx_add_event(connection->read, NGX_READ_EVENT, 0) != NGX_OK) {
-        return -1;
-      }
-    }
-    if (connection->write->active) {
-      if (ngx_del_event(connection->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
-        return -1;
-      }
+    if (watch_event(curl, connection->read, true) ||
+        watch_event(curl, connection->write, false)) {
+      return -1;
     }
     break;
   case CURL_POLL_OUT:
-    connection->write->handler = &on_connection_event;
-    if (!connection->write->active) {
-      if (ngx_add_event(connection->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
-        return -1;
+    if (watch_event(curl, connection->write, true) ||
+        watch_event(curl, connection->read, false)) {
+      return -1;
+    }
+    break;
+  case CURL_POLL_INOUT:
+    if (watch_event(curl, connection->read, true) ||
+        watch_event(curl, connection->write, true)) {
+      return -1;
+    }
+    break;
+  case CURL_POLL_REMOVE: {
+    // Remove the connection from nginx's event loop. This fails when a
+    // transfer is removed while it's still connecting, because then libcurl
+    // closes the socket before telling us, bypassing even
+    // `CURLOPT_CLOSESOCKETFUNCTION`. Closing the socket already removed it,
+    // though, and libcurl tells us within the same call, so nothing on this
+    // thread can have registered the descriptor again. The connection is
+    // freed regardless.
+    (void)unwatch_connection(curl, connection);
+    ngx_free_connection(connection);
+    --curl->stats.sockets_open;
+    add_metric(curl, sockets_open, -1);
+
+    // The user data associated with the socket appears to be cleared by
+    // libcurl anyway, but let's be explicit with cleanup here.
+    (void)curl_multi_assign(curl->multi, s, NULL);
+  } break;
+  default:
+    ngx_log_error(
+        NGX_LOG_ERR, ngx_cycle->log, 0,
+        "libcurl requested notification for an unknown event type: %d", what);
+    return -1;
+  }
+
+  return 0; // success
+}
+
+static int watch_event(ngx_curl_t *curl, ngx_event_t *event, bool wanted) {
+  assert(curl);
+  assert(event);
+
+  if (curl->edge_triggered) {
+    // The socket is already registered for both directions. All that changes
+    // is whether notifications are delivered to libcurl.
+    if (!wanted) {
+      event->handler = &on_unwanted_event;
+    } else if (event->handler != &on_connection_event) {
+      event->handler = &on_connection_event;
+      // If the socket became ready in this direction while libcurl wasn't
+      // interested, then there won't be another edge to tell us about it.
+      if (event->ready) {
+        ngx_post_event(event, &ngx_posted_events);
       }
     }
-    if (connection->read->active) {
-      if (ngx_del_event(connection->read, NGX_READ_EVENT, 0) != NGX_OK) {
+    return 0;
+  }
+
+  const ngx_int_t direction = event->write ? NGX_WRITE_EVENT : NGX_READ_EVENT;
+  if (wanted) {
+    event->handler = &on_connection_event;
+    if (!event->active) {
+      ++curl->stats.event_registrations;
+      if (ngx_add_event(event, direction, 0) != NGX_OK) {
         return -1;
       }
     }
-    break;
-  case CURL_POLL_INOUT:
-    connection->read->handler = &on_connection_event;
-    if (!connection->read->active) {
-      if (ngx_add_event(connection->read, NGX_READ_EVENT, 0) != NGX_OK) {
-        return -1;
-      }
+  } else if (event->active) {
+    ++curl->stats.event_registrations;
+    if (ngx_del_event(event, direction, 0) != NGX_OK) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static ngx_int_t unwatch_connection(ngx_curl_t *curl,
+                                    ngx_connection_t *connection) {
+  assert(curl);
+  assert(connection);
+
+  // `ngx_free_connection` leaves posted events alone, but the connection is
+  // about to be reused.
+  if (connection->read->posted) {
+    ngx_delete_posted_event(connection->read);
+  }
+  if (connection->write->posted) {
+    ngx_delete_posted_event(connection->write);
+  }
+
+  if (ngx_del_conn) {
+    // Pass zero for the flags so that nginx actually removes the socket from
+    // the event loop.
+    ++curl->stats.event_registrations;
+    return ngx_del_conn(connection, 0);
+  }
+
+  // Event modules without `del_conn` (e.g. kqueue, poll, and select) have
+  // each direction registered separately.
+  if (connection->read->active) {
+    ++curl->stats.event_registrations;
+    if (ngx_del_event(connection->read, NGX_READ_EVENT, 0) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  if (connection->write->active) {
+    ++curl->stats.event_registrations;
+    if (ngx_del_event(connection->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+// libcurl can't be made to wait for an external resolver, so instead the
+// first resolution attempted by each transfer is aborted, and the host is
+// resolved by nginx. When the transfer then fails, it is added again with
+// nginx's answer installed via `CURLOPT_RESOLVE`. The answer lands in
+// libcurl's DNS cache, so later transfers to the same host don't get here
+// until the cache entry expires.
+static int on_resolver_start(void *resolver_state, void *reserved,
+                             void *user_data) {
+  (void)resolver_state;
+  (void)reserved;
+  ngx_curl_handle_context_t *context = user_data;
+  assert(context);
+  ngx_curl_t *curl = context->curl;
+  assert(curl);
+  assert(curl->resolver);
+
+  // If nginx already answered for this transfer, then libcurl is resolving
+  // something else (e.g. a proxy, or a redirect's host). Let it.
+  if (context->resolved_by_nginx || context->resolver_ctx) {
+    return 0;
+  }
+
+  char *url = NULL;
+  if (curl_easy_getinfo(context->handle, CURLINFO_EFFECTIVE_URL, &url) !=
+          CURLE_OK ||
+      url == NULL) {
+    return 0;
+  }
+
+  CURLU *parsed = curl_url();
+  if (parsed == NULL) {
+    return 0;
+  }
+
+  char *host = NULL;
+  char *port = NULL;
+  if (curl_url_set(parsed, CURLUPART_URL, url, 0) != CURLUE_OK ||
+      curl_url_get(parsed, CURLUPART_HOST, &host, 0) != CURLUE_OK ||
+      curl_url_get(parsed, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) !=
+          CURLUE_OK) {
+    curl_free(host);
+    curl_url_cleanup(parsed);
+    return 0;
+  }
+  curl_url_cleanup(parsed);
+
+  const size_t host_length = strlen(host);
+  const bool is_address =
+      host[0] == '[' ||
+      ngx_inet_addr((u_char *)host, host_length) != INADDR_NONE;
+  if (!is_address) {
+    context->host = curl->allocator->duplicate(host);
+    context->port = atol(port);
+  }
+  curl_free(host);
+  curl_free(port);
+  if (context->host == NULL) {
+    return 0;
+  }
+
+  ngx_resolver_ctx_t *ctx = ngx_resolve_start(curl->resolver, NULL);
+  if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+    curl->allocator->free(context->host);
+    context->host = NULL;
+    return 0;
+  }
+
+  ctx->name.data = (u_char *)context->host;
+  ctx->name.len = host_length;
+  ctx->handler = &on_resolved;
+  ctx->data = context;
+  ctx->timeout = curl->resolver_timeout;
+
+  context->resolver_ctx = ctx;
+  context->awaiting_resolver = true;
+  if (ngx_resolve_name(ctx) != NGX_OK) {
+    // `ngx_resolve_name` freed `ctx`. Fall back to libcurl's resolver.
+    context->resolver_ctx = NULL;
+    context->awaiting_resolver = false;
+    curl->allocator->free(context->host);
+    context->host = NULL;
+    return 0;
+  }
+
+  // Note that if nginx had the answer cached, `on_resolved` has already been
+  // called. Either way, abort libcurl's resolution.
+  ++curl->stats.nginx_resolutions;
+  return 1;
+}
+
+static void on_resolved(ngx_resolver_ctx_t *ctx) {
+  assert(ctx);
+  ngx_curl_handle_context_t *context = ctx->data;
+  assert(context);
+  ngx_curl_t *curl = context->curl;
+  assert(curl);
+
+  context->resolver_ctx = NULL;
+  context->resolve_result = CURLE_COULDNT_RESOLVE_HOST;
+
+  if (ctx->state) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "ngx_curl: \"%V\" could not be resolved (%i: %s)",
+                  &ctx->name, ctx->state, ngx_resolver_strerror(ctx->state));
+  } else {
+    // Build "+HOST:PORT:ADDRESS[,ADDRESS]...". The leading "+" makes the
+    // entry expire from libcurl's DNS cache like any other, after which
+    // nginx's resolver (and its TTL-respecting cache) is consulted again.
+    const size_t size = 1 + ctx->name.len + 1 + NGX_INT_T_LEN + 1 +
+                        ctx->naddrs * (NGX_SOCKADDR_STRLEN + 3);
+    u_char *entry = curl->allocator->allocate(size);
+    if (entry != NULL) {
+      u_char *p = ngx_sprintf(entry, "+%V:%l:", &ctx->name, context->port);
+      for (ngx_uint_t i = 0; i < ctx->naddrs; ++i) {
+        const ngx_resolver_addr_t *addr = &ctx->addrs[i];
+        if (i) {
+          *p++ = ',';
+        }
+        const bool is_ipv6 = addr->sockaddr->sa_family == AF_INET6;
+        if (is_ipv6) {
+          *p++ = '[';
+        }
+        p += ngx_sock_ntop(addr->sockaddr, addr->socklen, p,
+                           NGX_SOCKADDR_STRLEN, 0);
+        if (is_ipv6) {
+          *p++ = ']';
+        }
+      }
+      *p = '\0';
+
+      context->resolve = curl_slist_append(NULL, (const char *)entry);
+      curl->allocator->free(entry);
+      if (context->resolve) {
+        context->resolve_result = CURLE_OK;
+      }
+    }
+  }
+
+  ngx_resolve_name_done(ctx);
+
+  // If libcurl hasn't yet reported the aborted transfer, then
+  // `process_messages` will resume it.
+  if (context->state == NGX_CURL_HANDLE_RESOLVING) {
+    resume_resolved(curl, context);
+  }
+}
+
+static void resume_resolved(ngx_curl_t *curl,
+                            ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+  assert(context->state == NGX_CURL_HANDLE_RESOLVING);
+  assert(context->resolver_ctx == NULL);
+
+  context->resolved_by_nginx = true;
+  if (context->resolve_result != CURLE_OK) {
+    complete_context(curl, context, context->resolve_result);
+    return;
+  }
+
+  CURLcode rc =
+      curl_easy_setopt(context->handle, CURLOPT_RESOLVE, context->resolve);
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to install nginx's DNS answer on CURL handle: %s",
+                  curl_easy_strerror(rc));
+    complete_context(curl, context, rc);
+    return;
+  }
+
+  // The handle is still admitted, so it needn't queue again.
+  CURLMcode mrc = curl_multi_add_handle(curl->multi, context->handle);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(
+        NGX_LOG_ERR, ngx_cycle->log, 0,
+        "Unable to register CURL handle with libcurl multi-handle: %s",
+        curl_multi_strerror(mrc));
+    complete_context(curl, context, CURLE_FAILED_INIT);
+    return;
+  }
+
+  context->state = NGX_CURL_HANDLE_RUNNING;
+  schedule_kick(curl);
+}
+
+static CURLSH *acquire_worker_share(void) {
+  if (worker_share == NULL) {
+    worker_share = curl_share_init();
+    if (worker_share == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to initialize libcurl share handle");
+      return NULL;
+    }
+
+    static const struct {
+      curl_lock_data data;
+      const char *name;
+    } shared[] = {{CURL_LOCK_DATA_DNS, "DNS cache"},
+                  {CURL_LOCK_DATA_CONNECT, "connection cache"},
+                  {CURL_LOCK_DATA_SSL_SESSION, "SSL session cache"},
+                  {CURL_LOCK_DATA_PSL, "public suffix list"}};
+    for (size_t i = 0; i < sizeof shared / sizeof shared[0]; ++i) {
+      // Not every libcurl supports sharing everything (e.g. the public
+      // suffix list requires libpsl). Share whatever we can.
+      const CURLSHcode src =
+          curl_share_setopt(worker_share, CURLSHOPT_SHARE, shared[i].data);
+      if (src != CURLSHE_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "ngx_curl: unable to share libcurl's %s: %s",
+                      shared[i].name, curl_share_strerror(src));
+      }
+    }
+  }
+
+  ++worker_share_users;
+  return worker_share;
+}
+
+static void release_worker_share(void) {
+  assert(worker_share);
+  assert(worker_share_users);
+
+  if (--worker_share_users) {
+    return;
+  }
+
+  const CURLSHcode src = curl_share_cleanup(worker_share);
+  if (src != CURLSHE_OK) {
+    // Most likely some `CURL*` handle still refers to the share. Keep it for
+    // the next `ngx_curl_t`, rather than leave that handle dangling.
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to clean up libcurl share handle: %s",
+                  curl_share_strerror(src));
+    return;
+  }
+
+  worker_share = NULL;
+}
+
+static ngx_int_t init_shm_cache(ngx_shm_zone_t *zone, void *data) {
+  ngx_curl_shm_cache_t *cache = zone->data;
+  ngx_curl_shm_cache_t *old_cache = data;
+
+  if (old_cache) {
+    // nginx is reloading. Keep the entries from the previous cycle.
+    cache->shared = old_cache->shared;
+    cache->shpool = old_cache->shpool;
+    return NGX_OK;
+  }
+
+  cache->shpool = (ngx_slab_pool_t *)zone->shm.addr;
+  if (zone->shm.exists) {
+    cache->shared = cache->shpool->data;
+    return NGX_OK;
+  }
+
+  cache->shared =
+      ngx_slab_alloc(cache->shpool, sizeof(ngx_curl_shm_cache_shared_t));
+  if (cache->shared == NULL) {
+    return NGX_ERROR;
+  }
+  cache->shpool->data = cache->shared;
+
+  ngx_rbtree_init(&cache->shared->rbtree, &cache->shared->sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&cache->shared->lru);
+  return NGX_OK;
+}
+
+#if (NGX_OPENSSL)
+
+// The following functions are called with the zone's mutex held.
+
+static void expire_ssl_session(ngx_curl_shm_cache_t *cache,
+                               ngx_curl_ssl_session_node_t *session) {
+  ngx_queue_remove(&session->queue);
+  ngx_rbtree_delete(&cache->shared->rbtree, &session->node.node);
+  ngx_slab_free_locked(cache->shpool, session);
+}
+
+static ngx_curl_ssl_session_node_t *
+find_ssl_session(ngx_curl_shm_cache_t *cache, ngx_str_t *name) {
+  ngx_str_node_t *node = ngx_str_rbtree_lookup(
+      &cache->shared->rbtree, name, ngx_crc32_short(name->data, name->len));
+  if (node == NULL) {
+    return NULL;
+  }
+
+  ngx_curl_ssl_session_node_t *session =
+      (ngx_curl_ssl_session_node_t *)((u_char *)node -
+                                      offsetof(ngx_curl_ssl_session_node_t,
+                                               node));
+  if (session->expires <= ngx_time()) {
+    expire_ssl_session(cache, session);
+    return NULL;
+  }
+
+  return session;
+}
+
+// Each `SSL_CTX` that libcurl creates for a handle of a `ngx_curl_t` with a
+// shared SSL session cache gets one of these, in ex_data. libcurl creates an
+// `SSL_CTX` for each connection.
+typedef struct ngx_curl_ssl_ctx_data_s {
+  ngx_curl_shm_cache_t *cache;
+  // libcurl installs its own "new session" callback (for its in-process
+  // session cache) before calling ours. We call it from ours.
+  int (*libcurl_new_session_callback)(SSL *, SSL_SESSION *);
+  // The port of the URL that the connection was made for.
+  long port;
+  // `trust_digest` is a digest of the certificates and CRLs in the
+  // `SSL_CTX`'s trust store, computed once, the first time a session key is
+  // needed (see `digest_trust_store`). `trust_digested` is true once it has
+  // been tried, and `trusts` is true if it succeeded.
+  bool trust_digested;
+  bool trusts;
+  u_char trust_digest[SHA256_DIGEST_LENGTH];
+} ngx_curl_ssl_ctx_data_t;
+
+static int ssl_ctx_data_index = -1;
+
+// The longest session key: a server name, ":", a port, "/", and a SHA-256
+// digest in hex.
+#define NGX_CURL_MAX_SSL_SESSION_KEY                                          \
+  (255 + 1 + NGX_INT_T_LEN + 1 + 2 * SHA256_DIGEST_LENGTH)
+
+static void free_ssl_ctx_data(void *parent, void *pointer, CRYPTO_EX_DATA *ad,
+                              int index, long argl, void *argp) {
+  (void)parent;
+  (void)ad;
+  (void)index;
+  (void)argl;
+  (void)argp;
+  OPENSSL_free(pointer);
+}
+
+// Writes to `md` a digest of the certificates and CRLs in `store`. Returns
+// false if its trust can't be described, because the store has no
+// certificates; e.g. a `CURLOPT_CAPATH` directory is only consulted during
+// verification.
+static bool digest_trust_store(X509_STORE *store,
+                               u_char md[SHA256_DIGEST_LENGTH]) {
+  EVP_MD_CTX *digest = EVP_MD_CTX_new();
+  if (digest == NULL || !EVP_DigestInit_ex(digest, EVP_sha256(), NULL) ||
+      !X509_STORE_lock(store)) {
+    EVP_MD_CTX_free(digest);
+    return false;
+  }
+
+  // Fingerprints are SHA-1, which OpenSSL caches in each parsed certificate.
+  u_char fingerprint[EVP_MAX_MD_SIZE];
+  unsigned fingerprint_length;
+  size_t trusted = 0;
+  bool ok = true;
+  STACK_OF(X509_OBJECT) *objects = X509_STORE_get0_objects(store);
+  for (int i = 0; ok && i < sk_X509_OBJECT_num(objects); ++i) {
+    X509_OBJECT *object = sk_X509_OBJECT_value(objects, i);
+    switch (X509_OBJECT_get_type(object)) {
+    case X509_LU_X509:
+      ++trusted;
+      ok = X509_digest(X509_OBJECT_get0_X509(object), EVP_sha1(),
+                       fingerprint, &fingerprint_length);
+      break;
+    case X509_LU_CRL:
+      ok = X509_CRL_digest(X509_OBJECT_get0_X509_CRL(object), EVP_sha1(),
+                           fingerprint, &fingerprint_length);
+      break;
+    default:
+      continue;
+    }
+    ok = ok && EVP_DigestUpdate(digest, fingerprint, fingerprint_length);
+  }
+  X509_STORE_unlock(store);
+
+  ok = ok && trusted > 0 && EVP_DigestFinal_ex(digest, md, NULL);
+  EVP_MD_CTX_free(digest);
+  return ok;
+}
+
+// Adds to `digest` what the connection of `ssl` trusts and who it claims to
+// be: the digest of its trust store (see `digest_trust_store`), its client
+// certificate, and its verification settings, protocol versions, options,
+// and ciphers. Returns false if its trust can't be described.
+static bool digest_ssl_settings(const SSL *ssl,
+                                ngx_curl_ssl_ctx_data_t *data,
+                                EVP_MD_CTX *digest) {
+  // The trust store is what's expensive to digest: every certificate and
+  // CRL, under the store's lock. It belongs to the `SSL_CTX`, so it's
+  // digested once for both the lookup before the handshake and the store
+  // after it.
+  if (!data->trust_digested) {
+    data->trust_digested = true;
+    data->trusts = digest_trust_store(
+        SSL_CTX_get_cert_store(SSL_get_SSL_CTX(ssl)), data->trust_digest);
+  }
+  if (!data->trusts || !EVP_DigestUpdate(digest, data->trust_digest,
+                                         sizeof data->trust_digest)) {
+    return false;
+  }
+
+  const uint64_t settings[] = {
+      (uint64_t)SSL_get_verify_mode(ssl),
+      (uint64_t)SSL_get_verify_depth(ssl),
+      (uint64_t)X509_VERIFY_PARAM_get_flags(SSL_get0_param((SSL *)ssl)),
+      (uint64_t)SSL_get_options(ssl),
+      (uint64_t)SSL_get_min_proto_version((SSL *)ssl),
+      (uint64_t)SSL_get_max_proto_version((SSL *)ssl)};
+  if (!EVP_DigestUpdate(digest, settings, sizeof settings)) {
+    return false;
+  }
+
+  STACK_OF(SSL_CIPHER) *ciphers = SSL_get_ciphers(ssl);
+  for (int i = 0; i < sk_SSL_CIPHER_num(ciphers); ++i) {
+    const uint32_t id = SSL_CIPHER_get_id(sk_SSL_CIPHER_value(ciphers, i));
+    if (!EVP_DigestUpdate(digest, &id, sizeof id)) {
+      return false;
+    }
+  }
+
+  u_char fingerprint[EVP_MAX_MD_SIZE];
+  unsigned fingerprint_length;
+  X509 *certificate = SSL_get_certificate(ssl);
+  const u_char has_certificate = certificate != NULL;
+  return EVP_DigestUpdate(digest, &has_certificate, 1) &&
+         (certificate == NULL ||
+          (X509_digest(certificate, EVP_sha1(), fingerprint,
+                       &fingerprint_length) &&
+           EVP_DigestUpdate(digest, fingerprint, fingerprint_length)));
+}
+
+// Writes the cache key of the sessions of `ssl` to `key`, and returns its
+// length, or returns zero if they must not be shared. Sessions are shared
+// only when the peer is verified, because resuming a session skips
+// certificate verification, and are keyed by server name (SNI), port, and a
+// digest of the settings that bear on trust and identity, so that a session
+// is only resumed by a connection that would have accepted its peer, and
+// that would have presented the same client certificate.
+static size_t ssl_session_key(const SSL *ssl, ngx_curl_ssl_ctx_data_t *data,
+                              u_char key[NGX_CURL_MAX_SSL_SESSION_KEY]) {
+  const char *server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+  if (!(SSL_get_verify_mode(ssl) & SSL_VERIFY_PEER) || server_name == NULL ||
+      ngx_strlen(server_name) > 255) {
+    return 0;
+  }
+
+  EVP_MD_CTX *digest = EVP_MD_CTX_new();
+  u_char md[SHA256_DIGEST_LENGTH];
+  const bool digested = digest && EVP_DigestInit_ex(digest, EVP_sha256(),
+                                                    NULL) &&
+                        digest_ssl_settings(ssl, data, digest) &&
+                        EVP_DigestFinal_ex(digest, md, NULL);
+  EVP_MD_CTX_free(digest);
+  if (!digested) {
+    return 0;
+  }
+
+  u_char *p = ngx_sprintf(key, "%s:%l/", server_name, data->port);
+  p = ngx_hex_dump(p, md, sizeof md);
+  return p - key;
+}
+
+static int on_new_ssl_session(SSL *ssl, SSL_SESSION *ssl_session) {
+  ngx_curl_ssl_ctx_data_t *data =
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ssl_ctx_data_index);
+  if (data == NULL) {
+    return 0;
+  }
+
+  int rc = 0;
+  if (data->libcurl_new_session_callback) {
+    rc = data->libcurl_new_session_callback(ssl, ssl_session);
+  }
+
+  if (SSL_get_verify_result(ssl) != X509_V_OK) {
+    return rc;
+  }
+
+  u_char key[NGX_CURL_MAX_SSL_SESSION_KEY];
+  ngx_str_t name;
+  name.data = key;
+  name.len = ssl_session_key(ssl, data, key);
+  if (name.len == 0) {
+    return rc;
+  }
+
+  const int length = i2d_SSL_SESSION(ssl_session, NULL);
+  if (length <= 0 || length > NGX_CURL_MAX_SSL_SESSION_SIZE) {
+    return rc;
+  }
+
+  u_char der[NGX_CURL_MAX_SSL_SESSION_SIZE];
+  u_char *p = der;
+  (void)i2d_SSL_SESSION(ssl_session, &p);
+
+  ngx_curl_shm_cache_t *cache = data->cache;
+  const size_t size =
+      offsetof(ngx_curl_ssl_session_node_t, data) + name.len + length;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  ngx_curl_ssl_session_node_t *session = find_ssl_session(cache, &name);
+  if (session) {
+    expire_ssl_session(cache, session);
+  }
+
+  session = ngx_slab_alloc_locked(cache->shpool, size);
+  if (session == NULL) {
+    // Make room by evicting the least recently stored sessions.
+    for (int i = 0; i < 8 && !ngx_queue_empty(&cache->shared->lru); ++i) {
+      ngx_queue_t *last = ngx_queue_last(&cache->shared->lru);
+      expire_ssl_session(cache, ngx_queue_data(last,
+                                               ngx_curl_ssl_session_node_t,
+                                               queue));
+    }
+    session = ngx_slab_alloc_locked(cache->shpool, size);
+  }
+
+  if (session) {
+    session->node.str.data = session->data;
+    session->node.str.len = name.len;
+    session->node.node.key = ngx_crc32_short(name.data, name.len);
+    session->expires = SSL_SESSION_get_time(ssl_session) +
+                       SSL_SESSION_get_timeout(ssl_session);
+    session->session_length = length;
+    ngx_memcpy(ngx_cpymem(session->data, name.data, name.len), der, length);
+    ngx_rbtree_insert(&cache->shared->rbtree, &session->node.node);
+    ngx_queue_insert_head(&cache->shared->lru, &session->queue);
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+  return rc;
+}
+
+// OpenSSL has no client-side hook for supplying a session to resume, other
+// than `SSL_set_session` before the handshake. libcurl calls `SSL_connect`
+// right after setting up the `SSL`, and `SSL_connect` reports
+// `SSL_CB_HANDSHAKE_START` before it builds the client hello. That is the
+// last point at which a session can be set, so it's set only while
+// `SSL_in_before` confirms that nothing has been sent.
+static void on_ssl_info(const SSL *ssl, int where, int ret) {
+  (void)ret;
+  if (!(where & SSL_CB_HANDSHAKE_START) || SSL_is_server((SSL *)ssl) ||
+      !SSL_in_before(ssl) || SSL_get_session(ssl) != NULL) {
+    return;
+  }
+
+  ngx_curl_ssl_ctx_data_t *data =
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ssl_ctx_data_index);
+  if (data == NULL) {
+    return;
+  }
+
+  u_char key[NGX_CURL_MAX_SSL_SESSION_KEY];
+  ngx_str_t name;
+  name.data = key;
+  name.len = ssl_session_key(ssl, data, key);
+  if (name.len == 0) {
+    return;
+  }
+
+  u_char der[NGX_CURL_MAX_SSL_SESSION_SIZE];
+  size_t length = 0;
+
+  ngx_curl_shm_cache_t *cache = data->cache;
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  ngx_curl_ssl_session_node_t *session = find_ssl_session(cache, &name);
+  if (session) {
+    length = session->session_length;
+    ngx_memcpy(der, session->data + name.len, length);
+  }
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  if (length == 0) {
+    return;
+  }
+
+  const u_char *p = der;
+  SSL_SESSION *ssl_session = d2i_SSL_SESSION(NULL, &p, length);
+  if (ssl_session == NULL) {
+    return;
+  }
+  // The info callback's `SSL` is `const` only by its signature.
+  (void)SSL_set_session((SSL *)ssl, ssl_session);
+  SSL_SESSION_free(ssl_session);
+}
+
+// Returns the port of the URL that `handle` is transferring, or -1.
+static long handle_port(CURL *handle) {
+  char *url = NULL;
+  if (curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK ||
+      url == NULL) {
+    return -1;
+  }
+
+  CURLU *parsed = curl_url();
+  if (parsed == NULL) {
+    return -1;
+  }
+
+  long port = -1;
+  char *port_string = NULL;
+  if (curl_url_set(parsed, CURLUPART_URL, url, 0) == CURLUE_OK &&
+      curl_url_get(parsed, CURLUPART_PORT, &port_string,
+                   CURLU_DEFAULT_PORT) == CURLUE_OK) {
+    port = strtol(port_string, NULL, 10);
+  }
+  curl_free(port_string);
+  curl_url_cleanup(parsed);
+  return port;
+}
+
+static CURLcode on_ssl_ctx(CURL *handle, void *ssl_ctx, void *user_data) {
+  SSL_CTX *ctx = ssl_ctx;
+  ngx_curl_shm_cache_t *cache = user_data;
+
+  if (ssl_ctx_data_index == -1) {
+    ssl_ctx_data_index =
+        SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, &free_ssl_ctx_data);
+    if (ssl_ctx_data_index == -1) {
+      return CURLE_OK; // carry on without the cache
+    }
+  }
+
+  const long port = handle_port(handle);
+  if (port < 0) {
+    return CURLE_OK;
+  }
+
+  ngx_curl_ssl_ctx_data_t *data =
+      SSL_CTX_get_ex_data(ctx, ssl_ctx_data_index);
+  if (data == NULL) {
+    data = OPENSSL_zalloc(sizeof *data);
+    if (data == NULL) {
+      return CURLE_OK;
+    }
+    if (!SSL_CTX_set_ex_data(ctx, ssl_ctx_data_index, data)) {
+      OPENSSL_free(data);
+      return CURLE_OK;
+    }
+    data->libcurl_new_session_callback = SSL_CTX_sess_get_new_cb(ctx);
+  }
+  data->cache = cache;
+  data->port = port;
+  data->trust_digested = false;
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, &on_new_ssl_session);
+  SSL_CTX_set_info_callback(ctx, &on_ssl_info);
+  return CURLE_OK;
+}
+
+#endif
+
+ngx_curl_t *ngx_create_curl(void) {
+  const ngx_curl_options_t default_options = {
+      // `ngx_create_curl_with_options` will choose defaults for
+      // any options that are NULL.
+      .allocator = NULL};
+  return ngx_create_curl_with_options(&default_options);
+}
+
+ngx_curl_t *ngx_create_curl_with_options(const ngx_curl_options_t *options) {
+  const ngx_curl_allocator_t *allocator = options->allocator;
+  if (allocator == NULL) {
+    allocator = &malloc_allocator;
+  }
+
+  CURLcode rc = curl_global_init_mem(
+      CURL_GLOBAL_DEFAULT, allocator->allocate, allocator->free,
+      allocator->reallocate, allocator->duplicate, allocator->callocate);
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to perform global initialization of libcurl: %s",
+                  curl_easy_strerror(rc));
+    return NULL;
+  }
+
+  ngx_curl_t *curl = allocator->callocate(1, sizeof(ngx_curl_t));
+  if (curl == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate ngx_curl_t");
+    curl_global_cleanup();
+    return NULL;
+  }
+  curl->allocator = allocator;
+
+  if (options->edge_triggered) {
+    // Registering a connection for both directions at once requires
+    // `add_conn`, which only the edge-triggered event modules (e.g. epoll)
+    // provide.
+    curl->edge_triggered =
+        (ngx_event_flags & NGX_USE_CLEAR_EVENT) && ngx_add_conn != NULL;
+    if (!curl->edge_triggered) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "ngx_curl: the event module does not support "
+                    "edge-triggered connections; using level-triggered "
+                    "events instead");
+    }
+  }
+
+  curl->bucket_count = NGX_CURL_INITIAL_BUCKET_COUNT;
+  curl->contexts = allocator->callocate(curl->bucket_count,
+                                        sizeof(ngx_curl_handle_context_t *));
+  if (curl->contexts == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate handle context table");
+    curl_global_cleanup();
+    allocator->free(curl);
+    return NULL;
+  }
+
+  // Initialize the dummy connection.  In debug mode, nginx assumes that the
+  // `void *ngx_event_t::data` member of the argument to `ngx_add_timer` points
+  // to an `ngx_connection_t`. This is understandable, because nginx uses timer
+  // events for I/O timeouts associated with connections.  The debug form of
+  // `ngx_add_timer` logs the file descriptor (`fd`) associated with the
+  // connection associated with the timer event.  However, we use timers that
+  // aren't associated with a connection, and we need the event's data pointer
+  // to refer to our context, the `ngx_curl_t`. Crash!
+  //
+  // To work around this, we have our timer event's data pointer point to a
+  // dummy `ngx_connection_t`. We then populate the connection's `fd` with a
+  // clearly-not-real value (`-1`), and we could have the connection's data
+  // pointer refer to `ngx_curl_t`. However, because the dummy connection is a
+  // member of `ngx_curl_t`, we instead ignore the connection's data pointer
+  // and use `offsetof` to get a pointer to the enclosing `ngx_curl_t`.
+  curl->dummy_connection.fd = -1;
+  curl->timeout.data = &curl->dummy_connection;
+  curl->kick.data = &curl->dummy_connection;
+
+  curl->multi = curl_multi_init();
+  if (curl->multi == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to initialize libcurl multi-handle");
+    curl_global_cleanup();
+    allocator->free(curl->contexts);
+    allocator->free(curl);
+    return NULL;
+  }
+
+  curl->handle_pool_size = options->handle_pool_size;
+  if (curl->handle_pool_size == 0) {
+    curl->handle_pool_size = NGX_CURL_DEFAULT_HANDLE_POOL_SIZE;
+  }
+  curl->idle_handles =
+      allocator->callocate(curl->handle_pool_size, sizeof(CURL *));
+  if (curl->idle_handles == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate pool of CURL handles");
+    curl_multi_cleanup(curl->multi);
+    curl_global_cleanup();
+    allocator->free(curl->contexts);
+    allocator->free(curl);
+    return NULL;
+  }
+
+  if (options->ssl_session_cache) {
+#if (NGX_OPENSSL)
+    curl->ssl_session_cache = options->ssl_session_cache->data;
+#else
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "ngx_curl: the shared SSL session cache requires nginx "
+                  "to be built with OpenSSL; ignoring it");
+#endif
+  }
+
+  if (options->response_cache) {
+    curl->response_cache = options->response_cache->data;
+  }
+
+  if (options->metrics_zone) {
+    const ngx_curl_metrics_zone_t *metrics_zone = options->metrics_zone->data;
+    curl->metrics = metrics_zone->metrics;
+  }
+
+  ngx_rbtree_init(&curl->flights, &curl->flights_sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&curl->all_flights);
+  ngx_rbtree_init(&curl->origins, &curl->origins_sentinel,
+                  ngx_str_rbtree_insert_value);
+  ngx_queue_init(&curl->all_origins);
+#if (NGX_THREADS)
+  ngx_queue_init(&curl->paused_uploads);
+#endif
+
+  curl->hedge_budget.percent = options->hedge_budget_percent;
+  if (curl->hedge_budget.percent == 0) {
+    curl->hedge_budget.percent = NGX_CURL_DEFAULT_HEDGE_BUDGET_PERCENT;
+  }
+  curl->retry_budget.percent = options->retry_budget_percent;
+  if (curl->retry_budget.percent == 0) {
+    curl->retry_budget.percent = NGX_CURL_DEFAULT_RETRY_BUDGET_PERCENT;
+  }
+
+  if (options->circuit_breaker) {
+    curl->breaker_enabled = true;
+    curl->breaker_error_percent = options->breaker_error_percent
+                                      ? options->breaker_error_percent
+                                      : NGX_CURL_DEFAULT_BREAKER_ERROR_PERCENT;
+    curl->breaker_min_requests = options->breaker_min_requests
+                                     ? options->breaker_min_requests
+                                     : NGX_CURL_DEFAULT_BREAKER_MIN_REQUESTS;
+    curl->breaker_min_requests =
+        ngx_min(curl->breaker_min_requests, (size_t)NGX_CURL_BREAKER_WINDOW);
+    curl->breaker_open_time = options->breaker_open_time
+                                  ? options->breaker_open_time
+                                  : NGX_CURL_DEFAULT_BREAKER_OPEN_TIME;
+  }
+
+  curl->phase_timing = options->phase_timing;
+  curl->slow_transfer_time = options->slow_transfer_time;
+  curl->slow_transfer_log_percent =
+      options->slow_transfer_log_percent
+          ? ngx_min(options->slow_transfer_log_percent, (size_t)100)
+          : 100;
+
+  curl->max_running_handles = options->max_running_handles;
+  curl->connection_headroom = options->connection_headroom;
+  curl->queue_timeout = options->queue_timeout;
+  for (unsigned i = 0; i < NGX_CURL_PRIORITY_CLASSES; ++i) {
+    ngx_queue_init(&curl->queues[i]);
+    const unsigned weight = options->priority_weights[i]
+                                ? options->priority_weights[i]
+                                : default_priority_weights[i];
+    curl->queue_stride[i] = NGX_CURL_STRIDE_SCALE / weight;
+  }
+
+  if (options->resolver) {
+    curl->resolver = options->resolver;
+    curl->resolver_timeout = options->resolver_timeout;
+    if (curl->resolver_timeout == 0) {
+      curl->resolver_timeout = NGX_CURL_DEFAULT_RESOLVER_TIMEOUT;
+    }
+  }
+
+  if (options->share_worker_caches) {
+    // Failure to share is not fatal. Requests will just use this
+    // `ngx_curl_t`'s own caches.
+    curl->share = acquire_worker_share();
+  }
+
+  CURLMcode mrc = curl_multi_setopt(curl->multi, CURLMOPT_SOCKETFUNCTION,
+                                    on_register_event);
+  assert(mrc == CURLM_OK); // that's what the docs say
+  mrc = curl_multi_setopt(curl->multi, CURLMOPT_SOCKETDATA, curl);
+  assert(mrc == CURLM_OK); // that's what the docs say
+
+  mrc = curl_multi_setopt(curl->multi, CURLMOPT_TIMERDATA, curl);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(
+        NGX_LOG_ERR, ngx_cycle->log, 0,
+        "Unable to associate context object with libcurl's timer callback: %s",
+        curl_multi_strerror(mrc));
+    curl_multi_cleanup(curl->multi);
+    if (curl->share) {
+      release_worker_share();
+    }
+    curl_global_cleanup();
+    allocator->free(curl->idle_handles);
+    allocator->free(curl->contexts);
+    allocator->free(curl);
+    return NULL;
+  }
+
+  mrc = curl_multi_setopt(curl->multi, CURLMOPT_TIMERFUNCTION,
+                          &on_register_timer);
+
+  // Connection limits. Zero means "libcurl's default," so leave those alone.
+  // Failures aren't fatal; older versions of libcurl lack some of these.
+  const struct {
+    CURLMoption option;
+    const char *name;
+    long value;
+  } limits[] = {
+      {CURLMOPT_MAX_HOST_CONNECTIONS, "CURLMOPT_MAX_HOST_CONNECTIONS",
+       options->max_host_connections},
+      {CURLMOPT_MAX_TOTAL_CONNECTIONS, "CURLMOPT_MAX_TOTAL_CONNECTIONS",
+       options->max_total_connections},
+      {CURLMOPT_MAXCONNECTS, "CURLMOPT_MAXCONNECTS", options->max_connects},
+      {CURLMOPT_MAX_CONCURRENT_STREAMS, "CURLMOPT_MAX_CONCURRENT_STREAMS",
+       options->max_concurrent_streams}};
+  for (size_t i = 0; i < sizeof limits / sizeof limits[0]; ++i) {
+    if (limits[i].value == 0) {
+      continue;
+    }
+    mrc = curl_multi_setopt(curl->multi, limits[i].option, limits[i].value);
+    if (mrc != CURLM_OK) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "ngx_curl: unable to set %s: %s", limits[i].name,
+                    curl_multi_strerror(mrc));
+    }
+  }
+
+  if (options->multiplex) {
+    mrc = curl_multi_setopt(curl->multi, CURLMOPT_PIPELINING,
+                            CURLPIPE_MULTIPLEX);
+    if (mrc != CURLM_OK) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "ngx_curl: unable to enable multiplexing: %s",
+                    curl_multi_strerror(mrc));
+    } else {
+      curl->multiplex = true;
+    }
+  }
+
+  if (options->accept_submissions && open_submission_channel(curl) != 0) {
+    ngx_destroy_curl(curl);
+    return NULL;
+  }
+
+  return curl;
+}
+
+void ngx_destroy_curl(ngx_curl_t *curl) {
+  // Submitted handles belong to this library until they complete, so they're
+  // removed here, while the multi-handle still exists.
+  close_submission_channel(curl);
+
+  CURLMcode mrc = curl_multi_cleanup(curl->multi);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to clean up libcurl multi-handle: %s",
+                  curl_multi_strerror(mrc));
+  }
+  detach_uploads(curl, NULL);
+
+  if (curl->timeout.timer_set) {
+    ngx_del_timer(&curl->timeout);
+  }
+
+  // The gauges are shared with other workers, which carry on, so take back
+  // what this `ngx_curl_t` contributed to them.
+  add_metric(curl, transfers_running, -(ngx_atomic_int_t)curl->running_count);
+  add_metric(curl, handles_queued, -(ngx_atomic_int_t)curl->queued_count);
+  add_metric(curl, sockets_open, -(ngx_atomic_int_t)curl->stats.sockets_open);
+
+  if (curl->kick.posted) {
+    ngx_delete_posted_event(&curl->kick);
+  }
+
+  // Flights belong to this library rather than to its user, so clean up any
+  // that are still in progress.
+  while (!ngx_queue_empty(&curl->all_flights)) {
+    ngx_queue_t *link = ngx_queue_head(&curl->all_flights);
+    destroy_flight(ngx_queue_data(link, ngx_curl_flight_t, link));
+  }
+
+  while (!ngx_queue_empty(&curl->all_origins)) {
+    ngx_queue_t *link = ngx_queue_head(&curl->all_origins);
+    ngx_queue_remove(link);
+    ngx_curl_origin_t *origin = ngx_queue_data(link, ngx_curl_origin_t, link);
+    curl->allocator->free(origin->phases);
+    curl->allocator->free(origin);
+  }
+
+  while (curl->idle_handle_count) {
+    curl_easy_cleanup(curl->idle_handles[--curl->idle_handle_count]);
+  }
+  curl->allocator->free(curl->idle_handles);
+
+  if (curl->share) {
+    release_worker_share();
+  }
+
+  while (curl->slabs) {
+    ngx_curl_context_slab_t *slab = curl->slabs;
+    curl->slabs = slab->next;
+    curl->allocator->free(slab);
+  }
+  curl->allocator->free(curl->contexts);
+
+  curl->allocator->free(curl);
+  curl_global_cleanup();
+}
+
+static int add_handle(ngx_curl_t *curl, CURL *handle,
+                      const ngx_curl_callbacks_t *callbacks) {
+  assert(curl);
+  assert(handle);
+  assert(callbacks);
+  assert(callbacks->on_complete ||
+         (callbacks->on_error && callbacks->on_done));
+  assert(curl->multi);
+  assert(curl->allocator);
+
+  if (curl->share) {
+    CURLcode rc = curl_easy_setopt(handle, CURLOPT_SHARE, curl->share);
+    if (rc != CURLE_OK) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to attach share handle to CURL handle: %s",
+                    curl_easy_strerror(rc));
+      return -3;
+    }
+  }
+
+  if (curl->multiplex) {
+    // Without this, concurrent requests to an origin that has no connection
+    // yet would each open their own, rather than wait to share the first.
+    CURLcode rc = curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+    if (rc != CURLE_OK) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to set CURLOPT_PIPEWAIT on CURL handle: %s",
+                    curl_easy_strerror(rc));
+      return -3;
+    }
+  }
+
+#if (NGX_OPENSSL)
+  if (curl->ssl_session_cache) {
+    // This fails if libcurl's TLS backend doesn't expose an OpenSSL
+    // `SSL_CTX`, in which case libcurl's own session cache still applies.
+    if (curl_easy_setopt(handle, CURLOPT_SSL_CTX_FUNCTION, &on_ssl_ctx) !=
+            CURLE_OK ||
+        curl_easy_setopt(handle, CURLOPT_SSL_CTX_DATA,
+                         curl->ssl_session_cache) != CURLE_OK) {
+      ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                    "ngx_curl: libcurl does not support the shared SSL "
+                    "session cache; disabling it");
+      curl->ssl_session_cache = NULL;
+    }
+  }
+#endif
+
+  ngx_curl_handle_context_t *context = acquire_context(curl);
+  if (context == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate context for CURL handle");
+    return -1;
+  }
+  context->curl = curl;
+  context->handle = handle;
+  context->callbacks = *callbacks;
+  context->state = NGX_CURL_HANDLE_RUNNING;
+
+  if (curl->resolver) {
+    if (curl_easy_setopt(handle, CURLOPT_RESOLVER_START_FUNCTION,
+                         &on_resolver_start) != CURLE_OK ||
+        curl_easy_setopt(handle, CURLOPT_RESOLVER_START_DATA, context) !=
+            CURLE_OK) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to install resolver callback on CURL handle");
+      clean_up_context(curl, context);
+      release_context(curl, context);
+      return -4;
+    }
+  }
+
+  const int rc = admit_or_enqueue(curl, context);
+  if (rc != 0) {
+    clean_up_context(curl, context);
+    release_context(curl, context);
+    return rc;
+  }
+
+  insert_context(curl, context);
+
+  return 0;
+}
+
+static int remove_handle(ngx_curl_t *curl, CURL *handle) {
+  assert(curl);
+  assert(handle);
+  assert(curl->multi);
+  assert(curl->allocator);
+
+  ngx_curl_handle_context_t *context = remove_context(curl, handle);
+  if (context == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to remove CURL handle that is not registered with "
+                  "ngx_curl");
+    return -1;
+  }
+  const bool in_multi = context->state == NGX_CURL_HANDLE_RUNNING;
+  clean_up_context(curl, context);
+  release_context(curl, context);
+
+  if (!in_multi) {
+    return 0;
+  }
+
+  CURLMcode mrc = curl_multi_remove_handle(curl->multi, handle);
+  detach_uploads(curl, handle);
+  if (mrc != CURLM_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to remove CURL handle from libcurl multi-handle: %s",
+                  curl_multi_strerror(mrc));
+    return -2;
+  }
+
+  return 0;
+}
+
+int ngx_curl_add_handle(ngx_curl_t *curl, CURL *handle,
+                        void (*on_error)(CURL *, CURLcode),
+                        void (*on_done)(CURL *)) {
+  const ngx_curl_callbacks_t callbacks = {.on_error = on_error,
+                                          .on_done = on_done};
+  const int rc = add_handle(curl, handle, &callbacks);
+  if (rc != 0) {
+    return rc;
+  }
+
+  // Rather than calling `curl_multi_socket_action` now, defer it to a posted
+  // event, so that any other handles added before control returns to the
+  // event loop are started by the same call.
+  schedule_kick(curl);
+  return 0;
+}
+
+int ngx_curl_add_handle_with_data(ngx_curl_t *curl, CURL *handle,
+                                  void (*on_complete)(CURL *, CURLcode,
+                                                      void *data),
+                                  void *data) {
+  assert(on_complete);
+
+  const ngx_curl_callbacks_t callbacks = {.on_complete = on_complete,
+                                          .data = data};
+  const int rc = add_handle(curl, handle, &callbacks);
+  if (rc != 0) {
+    return rc;
+  }
+
+  schedule_kick(curl);
+  return 0;
+}
+
+static int submit(ngx_curl_t *curl, CURL *handle,
+                  void (*on_complete)(CURL *, CURLcode, void *data),
+                  void *data, ngx_curl_submission_t **submission_out) {
+  assert(curl);
+  assert(handle);
+  assert(on_complete);
+
+  if (curl->submission_connection == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to submit CURL handle: ngx_curl_t was not created "
+                  "with the accept_submissions option");
+    return -2;
+  }
+
+  ngx_curl_submission_t *submission =
+      curl->allocator->callocate(1, sizeof *submission);
+  if (submission == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate submission for CURL handle");
+    return -1;
+  }
+  submission->allocator = curl->allocator;
+  submission->handle = handle;
+  submission->on_complete = on_complete;
+  submission->data = data;
+  *submission_out = submission;
+  return 0;
+}
+
+static void push_submission(ngx_curl_t *curl,
+                            ngx_curl_submission_t *submission) {
+  // Only the event loop pops, and it pops everything at once, so the stack
+  // is immune to ABA: `head` can't be popped and pushed again in between.
+  ngx_atomic_uint_t head;
+  do {
+    head = curl->submissions;
+    submission->next = (ngx_curl_submission_t *)head;
+  } while (!ngx_atomic_cmp_set(&curl->submissions, head,
+                               (ngx_atomic_uint_t)submission));
+
+  // If the stack was nonempty, whoever made it so has already woken the
+  // event loop, which hasn't yet emptied it.
+  if (head == 0) {
+    wake_event_loop(curl);
+  }
+}
+
+int ngx_curl_submit(ngx_curl_t *curl, CURL *handle,
+                    void (*on_complete)(CURL *, CURLcode, void *data),
+                    void *data) {
+  ngx_curl_submission_t *submission;
+  const int rc = submit(curl, handle, on_complete, data, &submission);
+  if (rc != 0) {
+    return rc;
+  }
+
+  push_submission(curl, submission);
+  return 0;
+}
+
+#if (NGX_THREADS)
+int ngx_curl_submit_to_thread_pool(ngx_curl_t *curl, CURL *handle,
+                                   ngx_thread_pool_t *thread_pool,
+                                   void (*on_complete)(CURL *, CURLcode,
+                                                       void *data),
+                                   void *data) {
+  assert(thread_pool);
+
+  ngx_curl_submission_t *submission;
+  const int rc = submit(curl, handle, on_complete, data, &submission);
+  if (rc != 0) {
+    return rc;
+  }
+
+  submission->thread_pool = thread_pool;
+  submission->task.ctx = submission;
+  submission->task.handler = &on_submission_thread_complete;
+  submission->task.event.data = submission;
+  submission->task.event.handler = &on_submission_thread_done;
+  submission->task.event.log = ngx_cycle->log;
+  push_submission(curl, submission);
+  return 0;
+}
+#endif
+
+static int open_submission_channel(ngx_curl_t *curl) {
+  assert(curl);
+
+#if !(NGX_HAVE_ATOMIC_OPS)
+  ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                "ngx_curl: accept_submissions requires atomic operations, "
+                "which this build of nginx lacks");
+  return -1;
+#else
+  ngx_fd_t read_fd;
+#if (NGX_HAVE_SYS_EVENTFD_H)
+  read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (read_fd == -1) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  "ngx_curl: eventfd() failed");
+    return -1;
+  }
+  curl->submission_fd = read_fd;
+#else
+  int fds[2];
+  if (pipe(fds) == -1) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  "ngx_curl: pipe() failed");
+    return -1;
+  }
+  if (ngx_nonblocking(fds[0]) == -1 || ngx_nonblocking(fds[1]) == -1) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                  "ngx_curl: unable to make submission pipe nonblocking");
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  read_fd = fds[0];
+  curl->submission_fd = fds[1];
+#endif
+
+  ngx_connection_t *connection = ngx_get_connection(read_fd, ngx_cycle->log);
+  if (connection == NULL) {
+    if (curl->submission_fd != read_fd) {
+      close(curl->submission_fd);
+    }
+    close(read_fd);
+    return -1;
+  }
+  connection->data = curl;
+  connection->read->handler = &on_submission_event;
+  connection->read->log = ngx_cycle->log;
+
+  const ngx_uint_t flags =
+      (ngx_event_flags & NGX_USE_CLEAR_EVENT) ? NGX_CLEAR_EVENT
+                                               : NGX_LEVEL_EVENT;
+  if (ngx_add_event(connection->read, NGX_READ_EVENT, flags) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "ngx_curl: unable to watch submission channel");
+    if (curl->submission_fd != read_fd) {
+      close(curl->submission_fd);
+    }
+    ngx_close_connection(connection);
+    return -1;
+  }
+  ++curl->stats.event_registrations;
+
+  curl->submission_connection = connection;
+  return 0;
+#endif
+}
+
+// Takes every pending submission off of `curl->submissions`, and returns them
+// in the order they were submitted.
+static ngx_curl_submission_t *take_submissions(ngx_curl_t *curl) {
+  ngx_atomic_uint_t head;
+  do {
+    head = curl->submissions;
+  } while (head != 0 && !ngx_atomic_cmp_set(&curl->submissions, head, 0));
+
+  ngx_curl_submission_t *reversed = NULL;
+  ngx_curl_submission_t *submission = (ngx_curl_submission_t *)head;
+  while (submission) {
+    ngx_curl_submission_t *next = submission->next;
+    submission->next = reversed;
+    reversed = submission;
+    submission = next;
+  }
+  return reversed;
+}
+
+static void close_submission_channel(ngx_curl_t *curl) {
+  assert(curl);
+
+  ngx_connection_t *connection = curl->submission_connection;
+  if (connection == NULL) {
+    return;
+  }
+
+  // Handles submitted too late never started. They're completed here, on
+  // the event loop, since thread pools might already be gone.
+  ngx_curl_submission_t *submission = take_submissions(curl);
+  while (submission) {
+    ngx_curl_submission_t *next = submission->next;
+    submission->on_complete(submission->handle, CURLE_ABORTED_BY_CALLBACK,
+                            submission->data);
+    submission->allocator->free(submission);
+    submission = next;
+  }
+
+  // Handles that were admitted are still registered, and their submitters
+  // can't remove them, so remove them here and complete them the same way.
+  // `on_complete` might remove other handles, so each bucket is searched
+  // again from its start after each one.
+  for (size_t i = 0; i < curl->bucket_count; ++i) {
+    ngx_curl_handle_context_t **link = &curl->contexts[i];
+    while (*link) {
+      ngx_curl_handle_context_t *context = *link;
+      if (context->callbacks.on_complete != &on_submission_complete) {
+        link = &context->next;
+        continue;
+      }
+      submission = context->callbacks.data;
+      (void)remove_handle(curl, context->handle);
+      submission->result = CURLE_ABORTED_BY_CALLBACK;
+      finish_submission(submission);
+      link = &curl->contexts[i];
+    }
+  }
+
+  if (curl->submission_fd != connection->fd) {
+    close(curl->submission_fd);
+  }
+  ngx_close_connection(connection);
+  curl->submission_connection = NULL;
+}
+
+// Called from any thread.
+static void wake_event_loop(ngx_curl_t *curl) {
+#if (NGX_HAVE_SYS_EVENTFD_H)
+  const uint64_t one = 1;
+  const ssize_t written = write(curl->submission_fd, &one, sizeof one);
+#else
+  const u_char one = 1;
+  const ssize_t written = write(curl->submission_fd, &one, sizeof one);
+#endif
+  // A full pipe (or a saturated eventfd) is already readable, so that the
+  // event loop will wake up regardless.
+  if (written == -1 && ngx_errno != NGX_EAGAIN) {
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                  "ngx_curl: unable to wake the event loop for a submission");
+  }
+}
+
+static void on_submission_event(ngx_event_t *event) {
+  ngx_connection_t *connection = event->data;
+  ngx_curl_t *curl = connection->data;
+
+  // Drain the channel before emptying the stack. A submission pushed after
+  // the stack is emptied then wakes the event loop again, rather than being
+  // stranded.
+  u_char buffer[64];
+  while (read(connection->fd, buffer, sizeof buffer) > 0) {
+  }
+
+  ngx_curl_submission_t *submission = take_submissions(curl);
+  if (submission == NULL) {
+    return;
+  }
+  ++curl->stats.submission_batches;
+
+  while (submission) {
+    ngx_curl_submission_t *next = submission->next;
+    ++curl->stats.handles_submitted;
+    const ngx_curl_callbacks_t callbacks = {
+        .on_complete = &on_submission_complete, .data = submission};
+    if (add_handle(curl, submission->handle, &callbacks) != 0) {
+      on_submission_complete(submission->handle, CURLE_FAILED_INIT,
+                             submission);
+    }
+    submission = next;
+  }
+
+  schedule_kick(curl);
+}
+
+static void on_submission_complete(CURL *handle, CURLcode result,
+                                   void *data) {
+  ngx_curl_submission_t *submission = data;
+  submission->result = result;
+
+#if (NGX_THREADS)
+  if (submission->thread_pool) {
+    if (ngx_thread_task_post(submission->thread_pool, &submission->task) ==
+        NGX_OK) {
+      return;
+    }
+    // The thread pool's queue is full. Complete here instead, so that the
+    // caller still hears about the handle.
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "ngx_curl: unable to post completion to thread pool; "
+                  "completing on the event loop");
+  }
+#endif
+
+  finish_submission(submission);
+}
+
+static void finish_submission(ngx_curl_submission_t *submission) {
+  submission->on_complete(submission->handle, submission->result,
+                          submission->data);
+  submission->allocator->free(submission);
+}
+
+#if (NGX_THREADS)
+static void on_submission_thread_complete(void *data, ngx_log_t *log) {
+  ngx_curl_submission_t *submission = data;
+  submission->on_complete(submission->handle, submission->result,
+                          submission->data);
+}
+
+static void on_submission_thread_done(ngx_event_t *event) {
+  ngx_curl_submission_t *submission = event->data;
+  submission->allocator->free(submission);
+}
+#endif
+
+int ngx_curl_add_handle_to_chain(ngx_curl_t *curl, CURL *handle,
+                                 ngx_pool_t *pool, size_t max_size,
+                                 void (*on_error)(CURL *, CURLcode),
+                                 void (*on_done)(CURL *, ngx_chain_t *)) {
+  assert(curl);
+  assert(handle);
+  assert(pool);
+  assert(on_error);
+  assert(on_done);
+
+  ngx_curl_chain_sink_t *sink = ngx_pcalloc(pool, sizeof *sink);
+  if (sink == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate body sink for CURL handle");
+    return -1;
+  }
+  sink->pool = pool;
+  sink->handle = handle;
+  sink->max_size = max_size;
+  sink->last = &sink->chain;
+  sink->on_error = on_error;
+  sink->on_done = on_done;
+
+  const ngx_curl_callbacks_t callbacks = {.on_complete = &on_sink_complete,
+                                          .on_retry = &on_sink_retry,
+                                          .data = sink};
+  const int rc = add_handle(curl, handle, &callbacks);
+  if (rc != 0) {
+    return rc;
+  }
+
+  // The sink is installed only once the handle is added, so that a failure
+  // leaves the handle's write callback as it was. libcurl can't call it until
+  // the event loop runs.
+  if (curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &on_sink_body) !=
+          CURLE_OK ||
+      curl_easy_setopt(handle, CURLOPT_WRITEDATA, sink) != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to install body sink on CURL handle");
+    (void)remove_handle(curl, handle);
+    return -5;
+  }
+
+  schedule_kick(curl);
+  return 0;
+}
+
+int ngx_curl_add_handles(ngx_curl_t *curl, CURL *const *handles, size_t count,
+                         void (*on_error)(CURL *, CURLcode),
+                         void (*on_done)(CURL *)) {
+  assert(curl);
+  assert(handles || count == 0);
+
+  const ngx_curl_callbacks_t callbacks = {.on_error = on_error,
+                                          .on_done = on_done};
+  for (size_t i = 0; i < count; ++i) {
+    const int rc = add_handle(curl, handles[i], &callbacks);
+    if (rc != 0) {
+      // Either all of the handles are added, or none of them are.
+      while (i--) {
+        (void)remove_handle(curl, handles[i]);
+      }
+      return rc;
+    }
+  }
+
+  if (count) {
+    schedule_kick(curl);
+  }
+  return 0;
+}
+
+ngx_curl_group_t *
+ngx_curl_create_group(ngx_curl_t *curl, const ngx_curl_group_options_t *options,
+                      void (*on_group_done)(ngx_curl_group_t *, void *data),
+                      void *data) {
+  assert(curl);
+  assert(on_group_done);
+
+  ngx_curl_group_t *group = curl->allocator->callocate(1, sizeof *group);
+  if (group == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate ngx_curl group");
+    return NULL;
+  }
+  group->curl = curl;
+  group->quorum = options ? options->quorum : 0;
+  group->on_group_done = on_group_done;
+  group->data = data;
+  return group;
+}
+
+int ngx_curl_group_add(ngx_curl_group_t *group, CURL *handle) {
+  assert(group);
+  assert(handle);
+
+  if (group->started) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to add CURL handle to an ngx_curl group that has "
+                  "already started");
+    return -2;
+  }
+
+  if (group->member_count == group->member_capacity) {
+    const size_t capacity =
+        group->member_capacity ? group->member_capacity * 2 : 8;
+    ngx_curl_group_member_t *members = group->curl->allocator->reallocate(
+        group->members, capacity * sizeof *members);
+    if (members == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to allocate ngx_curl group member");
+      return -1;
+    }
+    group->members = members;
+    group->member_capacity = capacity;
+  }
+
+  ngx_curl_group_member_t *member = &group->members[group->member_count++];
+  member->group = group;
+  member->handle = handle;
+  member->result = CURLE_OK;
+  member->finished = false;
+  return 0;
+}
+
+int ngx_curl_group_start(ngx_curl_group_t *group) {
+  assert(group);
+
+  if (group->started) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to start an ngx_curl group twice");
+    return -2;
+  }
+
+  if (group->quorum > group->member_count) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to start an ngx_curl group of %uz handles with a "
+                  "quorum of %uz",
+                  group->member_count, group->quorum);
+    return -4;
+  }
+
+  ngx_curl_t *curl = group->curl;
+  for (size_t i = 0; i < group->member_count; ++i) {
+    ngx_curl_group_member_t *member = &group->members[i];
+    const ngx_curl_callbacks_t callbacks = {
+        .on_complete = &on_group_member_complete, .data = member};
+    const int rc = add_handle(curl, member->handle, &callbacks);
+    if (rc != 0) {
+      // Either all of the handles are added, or none of them are.
+      while (i--) {
+        (void)remove_handle(curl, group->members[i].handle);
+      }
+      return rc;
+    }
+  }
+
+  group->started = true;
+  if (group->member_count == 0) {
+    // There's nothing to wait for, but the caller still expects to be called
+    // back from the event loop rather than from here.
+    group->resolve.data = group;
+    group->resolve.handler = &on_group_resolve;
+    group->resolve.log = ngx_cycle->log;
+    ngx_post_event(&group->resolve, &ngx_posted_events);
+    return 0;
+  }
+
+  // One kick starts every member.
+  schedule_kick(curl);
+  return 0;
+}
+
+void ngx_curl_group_cancel(ngx_curl_group_t *group) {
+  assert(group);
+  assert(!group->resolving);
+
+  if (group->resolve.posted) {
+    ngx_delete_posted_event(&group->resolve);
+  }
+
+  if (group->started) {
+    cancel_group_members(group);
+  }
+  destroy_group(group);
+}
+
+size_t ngx_curl_group_size(const ngx_curl_group_t *group) {
+  assert(group);
+  return group->member_count;
+}
+
+CURL *ngx_curl_group_handle(const ngx_curl_group_t *group, size_t index) {
+  assert(group);
+  assert(index < group->member_count);
+  return group->members[index].handle;
+}
+
+CURLcode ngx_curl_group_result(const ngx_curl_group_t *group, size_t index) {
+  assert(group);
+  assert(index < group->member_count);
+  return group->members[index].result;
+}
+
+size_t ngx_curl_group_successes(const ngx_curl_group_t *group) {
+  assert(group);
+  return group->success_count;
+}
+
+static void on_group_member_complete(CURL *handle, CURLcode result,
+                                     void *data) {
+  ngx_curl_group_member_t *member = data;
+  ngx_curl_group_t *group = member->group;
+  assert(!member->finished);
+  assert(!group->resolving);
+
+  member->finished = true;
+  member->result = result;
+  ++group->finished_count;
+  if (result == CURLE_OK) {
+    ++group->success_count;
+  }
+
+  const size_t failures = group->finished_count - group->success_count;
+  const bool resolved =
+      group->finished_count == group->member_count ||
+      (group->quorum &&
+       (group->success_count == group->quorum ||
+        failures > group->member_count - group->quorum));
+  if (resolved) {
+    cancel_group_members(group);
+    resolve_group(group);
+  }
+}
+
+// Removes every member that hasn't finished, and marks it
+// `NGX_CURLE_GROUP_CANCELLED`.
+static void cancel_group_members(ngx_curl_group_t *group) {
+  for (size_t i = 0; i < group->member_count; ++i) {
+    ngx_curl_group_member_t *member = &group->members[i];
+    if (member->finished) {
+      continue;
+    }
+    (void)remove_handle(group->curl, member->handle);
+    member->finished = true;
+    member->result = NGX_CURLE_GROUP_CANCELLED;
+    ++group->curl->stats.group_members_cancelled;
+  }
+}
+
+static void on_group_resolve(ngx_event_t *event) {
+  resolve_group(event->data);
+}
+
+static void resolve_group(ngx_curl_group_t *group) {
+  group->resolving = true;
+  group->on_group_done(group, group->data);
+  destroy_group(group);
+}
+
+static void destroy_group(ngx_curl_group_t *group) {
+  const ngx_curl_allocator_t *allocator = group->curl->allocator;
+  allocator->free(group->members);
+  allocator->free(group);
+}
+
+static bool append_to_buffer(const ngx_curl_allocator_t *allocator,
+                             ngx_curl_buffer_t *buffer, const char *data,
+                             size_t length) {
+  if (buffer->length + length > buffer->capacity) {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+    while (capacity < buffer->length + length) {
+      capacity *= 2;
+    }
+    char *grown = allocator->reallocate(buffer->data, capacity);
+    if (grown == NULL) {
+      return false;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return true;
+}
+
+static size_t collect_header(const ngx_curl_allocator_t *allocator,
+                             ngx_curl_buffer_t *headers, char *data,
+                             size_t count) {
+  // Informational responses (e.g. "100 Continue") and redirects each have
+  // their own header block. Keep only the last one.
+  if (count >= 5 && memcmp(data, "HTTP/", 5) == 0) {
+    headers->length = 0;
+  }
+
+  if (!append_to_buffer(allocator, headers, data, count)) {
+    return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+  }
+  return count;
+}
+
+static size_t on_flight_header(char *data, size_t size, size_t count,
+                               void *user_data) {
+  (void)size; // always 1
+  ngx_curl_flight_t *flight = user_data;
+  return collect_header(flight->curl->allocator, &flight->headers, data,
+                        count);
+}
+
+static size_t on_flight_body(char *data, size_t size, size_t count,
+                             void *user_data) {
+  (void)size; // always 1
+  ngx_curl_flight_t *flight = user_data;
+
+  if (!append_to_buffer(flight->curl->allocator, &flight->body, data,
+                        count)) {
+    return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+  }
+  return count;
+}
+
+static ngx_curl_flight_t *create_flight(ngx_curl_t *curl,
+                                        const ngx_str_t *key) {
+  assert(curl);
+  assert(key);
+
+  // The key is stored after the flight.
+  ngx_curl_flight_t *flight =
+      curl->allocator->callocate(1, sizeof *flight + key->len);
+  if (flight == NULL) {
+    return NULL;
+  }
+
+  flight->curl = curl;
+  flight->key.data = (u_char *)(flight + 1);
+  flight->key.len = key->len;
+  if (key->len) {
+    memcpy(flight->key.data, key->data, key->len); // an empty key has no data
+  }
+  ngx_queue_init(&flight->waiters);
+  flight->deliver.data = &curl->dummy_connection;
+  flight->deliver.handler = &on_flight_deliver;
+  flight->deliver.log = ngx_cycle->log;
+  flight->hedge_timer.data = &curl->dummy_connection;
+  flight->hedge_timer.handler = &on_hedge_timer;
+  flight->hedge_timer.log = ngx_cycle->log;
+  flight->hedge_timer.cancelable = true;
+  ngx_queue_insert_tail(&curl->all_flights, &flight->link);
+  return flight;
+}
+
+static int start_flight(ngx_curl_t *curl, ngx_curl_flight_t *flight,
+                        CURL *handle, const ngx_curl_fetch_options_t *options) {
+  assert(curl);
+  assert(flight);
+  assert(handle);
+  assert(options);
+
+  flight->transfer = curl_easy_duphandle(handle);
+  if (flight->transfer == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to duplicate CURL handle for fetch");
+    return -5;
+  }
+
+  struct curl_slist *headers = options->headers;
+  if (flight->stale && flight->stale_etag.length) {
+    // Add `If-None-Match` to a copy of the caller's headers.
+    static const char prefix[] = "If-None-Match: ";
+    char line[sizeof prefix + NGX_CURL_MAX_ETAG_SIZE];
+    ngx_memcpy(ngx_cpymem(line, prefix, sizeof prefix - 1),
+               flight->stale_etag.data, flight->stale_etag.length);
+    line[sizeof prefix - 1 + flight->stale_etag.length] = '\0';
+
+    bool appended = true;
+    for (const struct curl_slist *header = options->headers;
+         header && appended; header = header->next) {
+      struct curl_slist *list =
+          curl_slist_append(flight->request_headers, header->data);
+      appended = list != NULL;
+      if (appended) {
+        flight->request_headers = list;
+      }
+    }
+    struct curl_slist *list =
+        appended ? curl_slist_append(flight->request_headers, line) : NULL;
+    if (list == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to allocate request headers for revalidation");
+      return -1;
+    }
+    flight->request_headers = headers = list;
+  }
+
+  CURLcode rc = curl_easy_setopt(flight->transfer, CURLOPT_HEADERFUNCTION,
+                                 &on_flight_header);
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(flight->transfer, CURLOPT_HEADERDATA, flight);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(flight->transfer, CURLOPT_WRITEFUNCTION,
+                          &on_flight_body);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(flight->transfer, CURLOPT_WRITEDATA, flight);
+  }
+  if (rc == CURLE_OK && headers) {
+    rc = curl_easy_setopt(flight->transfer, CURLOPT_HTTPHEADER, headers);
+  }
+  if (rc == CURLE_OK && flight->stale && flight->stale_last_modified) {
+    rc = curl_easy_setopt(flight->transfer, CURLOPT_TIMECONDITION,
+                          (long)CURL_TIMECOND_IFMODSINCE);
+    if (rc == CURLE_OK) {
+      rc = curl_easy_setopt(flight->transfer, CURLOPT_TIMEVALUE_LARGE,
+                            (curl_off_t)flight->stale_last_modified);
+    }
+  }
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to configure CURL handle for fetch: %s",
+                  curl_easy_strerror(rc));
+    return -5;
+  }
+
+  const ngx_curl_callbacks_t callbacks = {.on_complete = &on_flight_complete,
+                                          .on_retry = &on_flight_retry,
+                                          .data = flight};
+  const int add_rc = add_handle(curl, flight->transfer, &callbacks);
+  if (add_rc != 0) {
+    return add_rc;
+  }
+  schedule_kick(curl);
+
+  ngx_curl_handle_context_t **link = find_context(curl, flight->transfer);
+  assert(link);
+  if (options->priority < NGX_CURL_PRIORITY_CLASSES) {
+    set_context_priority(curl, *link, options->priority);
+  }
+
+  if (options->retry) {
+    rc = attach_retry_policy(curl, *link, options->retry);
+    if (rc != CURLE_OK) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to set CURLOPT_TIMEOUT_MS for fetch: %s",
+                    curl_easy_strerror(rc));
+      (void)remove_handle(curl, flight->transfer);
+      return -5;
+    }
+  }
+
+  if (flight->key.len) {
+    flight->node.str = flight->key;
+    flight->node.node.key = ngx_crc32_short(flight->key.data, flight->key.len);
+    ngx_rbtree_insert(&curl->flights, &flight->node.node);
+    flight->in_flights = true;
+  }
+
+  arm_hedge(curl, flight, options);
+  return 0;
+}
+
+static void destroy_flight(ngx_curl_flight_t *flight) {
+  assert(flight);
+  ngx_curl_t *curl = flight->curl;
+
+  if (flight->in_flights) {
+    ngx_rbtree_delete(&curl->flights, &flight->node.node);
+  }
+  ngx_queue_remove(&flight->link);
+  if (flight->deliver.posted) {
+    ngx_delete_posted_event(&flight->deliver);
+  }
+  if (flight->hedge_timer.timer_set) {
+    ngx_del_timer(&flight->hedge_timer);
+  }
+
+  if (flight->transfer) {
+    curl_easy_cleanup(flight->transfer);
+  }
+  if (flight->hedge.transfer) {
+    curl_easy_cleanup(flight->hedge.transfer);
+  }
+  curl->allocator->free(flight->hedge.headers.data);
+  curl->allocator->free(flight->hedge.body.data);
+  curl->allocator->free(flight->hedge_url);
+  curl_slist_free_all(flight->request_headers);
+  curl->allocator->free(flight->headers.data);
+  curl->allocator->free(flight->body.data);
+  curl->allocator->free(flight->stale_etag.data);
+  curl->allocator->free(flight->stale_headers.data);
+  curl->allocator->free(flight->stale_body.data);
+  curl->allocator->free(flight);
+}
+
+static void on_flight_complete(CURL *transfer, CURLcode result, void *data) {
+  ngx_curl_flight_t *flight = data;
+  assert(flight);
+  assert(flight->transfer == transfer);
+
+  if (flight->hedge_timer.timer_set) {
+    ngx_del_timer(&flight->hedge_timer);
+  }
+
+  if (flight->hedge.transfer) {
+    if (result != CURLE_OK) {
+      // The hedge might yet succeed. Wait for it.
+      flight->transfer_failed = true;
+      return;
+    }
+    discard_hedge(flight);
+  }
+
+  finish_flight(flight, result);
+}
+
+static void finish_flight(ngx_curl_flight_t *flight, CURLcode result) {
+  assert(flight);
+  CURL *transfer = flight->transfer;
+  ngx_curl_t *curl = flight->curl;
+
+  // From now on, new fetches with this key start a new flight.
+  if (flight->in_flights) {
+    ngx_rbtree_delete(&curl->flights, &flight->node.node);
+    flight->in_flights = false;
+  }
+
+  if (result == CURLE_OK) {
+    (void)curl_easy_getinfo(transfer, CURLINFO_RESPONSE_CODE, &flight->status);
+    long condition_unmet = 0;
+    (void)curl_easy_getinfo(transfer, CURLINFO_CONDITION_UNMET,
+                            &condition_unmet);
+
+    if (flight->stale && (flight->status == 304 || condition_unmet)) {
+      // The stale response is still good. Deliver it instead.
+      ++curl->stats.response_cache_revalidations;
+      refresh_cached_response(curl, flight);
+
+      curl->allocator->free(flight->headers.data);
+      curl->allocator->free(flight->body.data);
+      flight->status = flight->stale_status;
+      flight->headers = flight->stale_headers;
+      flight->body = flight->stale_body;
+      memset(&flight->stale_headers, 0, sizeof flight->stale_headers);
+      memset(&flight->stale_body, 0, sizeof flight->stale_body);
+    } else {
+      store_cached_response(curl, flight);
+    }
+  }
+
+  deliver_flight(flight, result);
+}
+
+static void on_flight_retry(CURL *transfer, void *data) {
+  ngx_curl_flight_t *flight = data;
+  assert(flight);
+  assert(flight->transfer == transfer);
+
+  flight->headers.length = 0;
+  flight->body.length = 0;
+}
+
+static void on_flight_deliver(ngx_event_t *event) {
+  assert(event);
+  ngx_curl_flight_t *flight =
+      (ngx_curl_flight_t *)((char *)event -
+                            offsetof(ngx_curl_flight_t, deliver));
+  deliver_flight(flight, CURLE_OK);
+}
+
+static void deliver_flight(ngx_curl_flight_t *flight, CURLcode result) {
+  assert(flight);
+  ngx_curl_t *curl = flight->curl;
+
+  ngx_curl_response_t response;
+  memset(&response, 0, sizeof response);
+  response.transfer = flight->transfer;
+  if (result == CURLE_OK) {
+    response.status = flight->status;
+    response.headers = flight->headers.data;
+    response.headers_length = flight->headers.length;
+    response.body = flight->body.data;
+    response.body_length = flight->body.length;
+  }
+
+  // Callbacks might remove other waiters, so take one waiter at a time.
+  flight->completing = true;
+  while (!ngx_queue_empty(&flight->waiters)) {
+    ngx_queue_t *head = ngx_queue_head(&flight->waiters);
+    ngx_curl_handle_context_t *context =
+        ngx_queue_data(head, ngx_curl_handle_context_t, queue);
+    ngx_queue_remove(&context->queue);
+
+    CURL *handle = context->handle;
+    const ngx_curl_callbacks_t callbacks = context->callbacks;
+    (void)remove_context(curl, handle);
+    release_context(curl, context);
+
+    if (result == CURLE_OK) {
+      callbacks.on_response(handle, &response);
+    } else {
+      callbacks.on_error(handle, result);
+    }
+  }
+
+  destroy_flight(flight);
+}
+
+// Removes whichever of the flight's transfers are still running.
+static void stop_flight(ngx_curl_flight_t *flight) {
+  assert(flight);
+  ngx_curl_t *curl = flight->curl;
+
+  if (flight->transfer && !flight->transfer_failed) {
+    (void)remove_handle(curl, flight->transfer);
+  }
+  if (flight->hedge.transfer) {
+    (void)remove_handle(curl, flight->hedge.transfer);
+  }
+}
+
+static void arm_hedge(ngx_curl_t *curl, ngx_curl_flight_t *flight,
+                      const ngx_curl_fetch_options_t *options) {
+  assert(curl);
+  assert(flight);
+  assert(options);
+
+  if (options->hedge_delay == 0 && !options->hedge_after_p95) {
+    return;
+  }
+
+  earn_budget(&curl->hedge_budget);
+
+  ngx_msec_t delay = options->hedge_delay;
+  if (options->hedge_after_p95) {
+    curl->hedging_after_p95 = true;
+    const ngx_curl_origin_t *origin =
+        find_origin(curl, flight->transfer, false);
+    if (origin && origin->p95) {
+      delay = origin->p95;
+    }
+  }
+  if (delay == 0) {
+    return;
+  }
+
+  if (options->hedge_url) {
+    flight->hedge_url = curl->allocator->duplicate(options->hedge_url);
+    if (flight->hedge_url == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to allocate hedge URL; not hedging");
+      return;
+    }
+  }
+
+  ngx_add_timer(&flight->hedge_timer, delay);
+}
+
+static void on_hedge_timer(ngx_event_t *event) {
+  assert(event);
+  ngx_curl_flight_t *flight =
+      (ngx_curl_flight_t *)((char *)event -
+                            offsetof(ngx_curl_flight_t, hedge_timer));
+  ngx_curl_t *curl = flight->curl;
+
+  // A transfer still waiting in the queue hasn't been slow; it hasn't
+  // started. Another copy would only make the queue longer.
+  ngx_curl_handle_context_t **link = find_context(curl, flight->transfer);
+  if (link == NULL || (*link)->state == NGX_CURL_HANDLE_QUEUED) {
+    return;
+  }
+
+  if (!can_spend_budget(&curl->hedge_budget)) {
+    ++curl->stats.hedges_denied;
+    return;
+  }
+
+  if (start_hedge(curl, flight) == 0) {
+    spend_budget(&curl->hedge_budget);
+    ++curl->stats.hedges_started;
+  }
+}
+
+static int start_hedge(ngx_curl_t *curl, ngx_curl_flight_t *flight) {
+  assert(curl);
+  assert(flight);
+  assert(flight->hedge.transfer == NULL);
+
+  // The duplicate has the same options as the flight's transfer, including
+  // its request headers and revalidation conditions.
+  CURL *transfer = curl_easy_duphandle(flight->transfer);
+  if (transfer == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to duplicate CURL handle for hedge");
+    return -5;
+  }
+
+  CURLcode rc =
+      curl_easy_setopt(transfer, CURLOPT_HEADERFUNCTION, &on_hedge_header);
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(transfer, CURLOPT_HEADERDATA, flight);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(transfer, CURLOPT_WRITEFUNCTION, &on_hedge_body);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(transfer, CURLOPT_WRITEDATA, flight);
+  }
+  if (rc == CURLE_OK && flight->hedge_url) {
+    rc = curl_easy_setopt(transfer, CURLOPT_URL, flight->hedge_url);
+  }
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to configure CURL handle for hedge: %s",
+                  curl_easy_strerror(rc));
+    curl_easy_cleanup(transfer);
+    return -5;
+  }
+
+  const ngx_curl_callbacks_t callbacks = {.on_complete = &on_hedge_complete,
+                                          .data = flight};
+  const int add_rc = add_handle(curl, transfer, &callbacks);
+  if (add_rc != 0) {
+    curl_easy_cleanup(transfer);
+    return add_rc;
+  }
+
+  flight->hedge.transfer = transfer;
+  schedule_kick(curl);
+  return 0;
+}
+
+static size_t on_hedge_header(char *data, size_t size, size_t count,
+                              void *user_data) {
+  (void)size; // always 1
+  ngx_curl_flight_t *flight = user_data;
+  return collect_header(flight->curl->allocator, &flight->hedge.headers, data,
+                        count);
+}
+
+static size_t on_hedge_body(char *data, size_t size, size_t count,
+                            void *user_data) {
+  (void)size; // always 1
+  ngx_curl_flight_t *flight = user_data;
+
+  if (!append_to_buffer(flight->curl->allocator, &flight->hedge.body, data,
+                        count)) {
+    return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+  }
+  return count;
+}
+
+static void on_hedge_complete(CURL *transfer, CURLcode result, void *data) {
+  ngx_curl_flight_t *flight = data;
+  assert(flight);
+  assert(flight->hedge.transfer == transfer);
+  ngx_curl_t *curl = flight->curl;
+
+  if (!flight->transfer_failed) {
+    if (result != CURLE_OK) {
+      // The original might yet succeed. Wait for it.
+      discard_hedge(flight);
+      return;
+    }
+    // The hedge won.
+    (void)remove_handle(curl, flight->transfer);
+    ++curl->stats.hedges_won;
+  }
+
+  // Deliver the hedge's response (or, if both failed, its error) as the
+  // flight's.
+  curl_easy_cleanup(flight->transfer);
+  curl->allocator->free(flight->headers.data);
+  curl->allocator->free(flight->body.data);
+  flight->transfer = flight->hedge.transfer;
+  flight->headers = flight->hedge.headers;
+  flight->body = flight->hedge.body;
+  memset(&flight->hedge, 0, sizeof flight->hedge);
+  flight->transfer_failed = false;
+
+  finish_flight(flight, result);
+}
+
+// Removes the flight's hedge, if it's still running, and frees it.
+static void discard_hedge(ngx_curl_flight_t *flight) {
+  assert(flight);
+  assert(flight->hedge.transfer);
+  ngx_curl_t *curl = flight->curl;
+
+  if (find_context(curl, flight->hedge.transfer)) {
+    (void)remove_handle(curl, flight->hedge.transfer);
+  }
+  curl_easy_cleanup(flight->hedge.transfer);
+  curl->allocator->free(flight->hedge.headers.data);
+  curl->allocator->free(flight->hedge.body.data);
+  memset(&flight->hedge, 0, sizeof flight->hedge);
+}
+
+// Returns whether anything uses origins: circuit breakers, phase timing,
+// slow transfer logging, or hedging after an origin's p95.
+static bool tracks_origins(const ngx_curl_t *curl) {
+  assert(curl);
+
+  return curl->breaker_enabled || curl->phase_timing ||
+         curl->slow_transfer_time || curl->hedging_after_p95;
+}
+
+// Writes the origin of the URL that `handle` requests (or last requested) to
+// `buffer`, which has room for `NGX_CURL_MAX_ORIGIN_SIZE` bytes, as
+// "scheme://host:port", and returns its length. The scheme and host are
+// lowercased, and a missing port is the scheme's default. Returns zero if
+// the URL has no such origin, or if it doesn't fit.
+static size_t origin_key(CURL *handle, u_char *buffer) {
+  assert(handle);
+  assert(buffer);
+
+  // Before a transfer, this is the URL set by `CURLOPT_URL`.
+  char *url = NULL;
+  if (curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url) != CURLE_OK ||
+      url == NULL) {
+    return 0;
+  }
+
+  const char *scheme = url;
+  const char *p = url;
+  while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+         (*p >= '0' && *p <= '9') || *p == '+' || *p == '-' || *p == '.') {
+    ++p;
+  }
+  if (p == scheme || strncmp(p, "://", 3) != 0) {
+    return 0;
+  }
+  const size_t scheme_len = p - scheme;
+
+  // The authority ends at the path, query, or fragment, and the host
+  // follows any user information.
+  const char *host = p + 3;
+  const char *end = host + strcspn(host, "/?#");
+  for (const char *at = host; at < end; ++at) {
+    if (*at == '@') {
+      host = at + 1;
+    }
+  }
+
+  const char *host_end;
+  if (*host == '[') {
+    host_end = memchr(host, ']', end - host);
+    if (host_end == NULL) {
+      return 0;
+    }
+    ++host_end;
+  } else {
+    host_end = memchr(host, ':', end - host);
+    if (host_end == NULL) {
+      host_end = end;
+    }
+  }
+  if (host_end == host) {
+    return 0;
+  }
+
+  static const struct {
+    ngx_str_t scheme;
+    ngx_str_t port;
+  } default_ports[] = {{ngx_string("http"), ngx_string("80")},
+                       {ngx_string("https"), ngx_string("443")},
+                       {ngx_string("ws"), ngx_string("80")},
+                       {ngx_string("wss"), ngx_string("443")},
+                       {ngx_string("ftp"), ngx_string("21")},
+                       {ngx_string("ftps"), ngx_string("990")}};
+  ngx_str_t port = ngx_null_string;
+  if (host_end + 1 < end && *host_end == ':') {
+    port.data = (u_char *)host_end + 1;
+    port.len = end - (host_end + 1);
+    for (size_t i = 0; i < port.len; ++i) {
+      if (port.data[i] < '0' || port.data[i] > '9') {
+        return 0;
+      }
+    }
+  } else {
+    for (size_t i = 0; i < sizeof default_ports / sizeof default_ports[0];
+         ++i) {
+      if (default_ports[i].scheme.len == scheme_len &&
+          ngx_strncasecmp(default_ports[i].scheme.data, (u_char *)scheme,
+                          scheme_len) == 0) {
+        port = default_ports[i].port;
+        break;
+      }
+    }
+    if (port.len == 0) {
+      return 0;
+    }
+  }
+
+  const size_t host_len = host_end - host;
+  const size_t length = scheme_len + 3 + host_len + 1 + port.len;
+  if (length > NGX_CURL_MAX_ORIGIN_SIZE) {
+    return 0;
+  }
+  u_char *last = buffer;
+  for (size_t i = 0; i < scheme_len; ++i) {
+    *last++ = ngx_tolower(scheme[i]);
+  }
+  last = ngx_cpymem(last, "://", 3);
+  for (size_t i = 0; i < host_len; ++i) {
+    *last++ = ngx_tolower(host[i]);
+  }
+  *last++ = ':';
+  ngx_memcpy(last, port.data, port.len);
+  return length;
+}
+
+// Returns the origin of the URL that `handle` requests (or last requested),
+// or NULL if it isn't tracked. If `create` is true, then an untracked origin
+// is tracked if there's room.
+static ngx_curl_origin_t *find_origin(ngx_curl_t *curl, CURL *handle,
+                                      bool create) {
+  assert(curl);
+  assert(handle);
+
+  u_char key_data[NGX_CURL_MAX_ORIGIN_SIZE];
+  ngx_str_t key;
+  key.data = key_data;
+  key.len = origin_key(handle, key_data);
+  if (key.len == 0) {
+    return NULL;
+  }
+
+  const uint32_t hash = ngx_crc32_short(key.data, key.len);
+  ngx_str_node_t *node = ngx_str_rbtree_lookup(&curl->origins, &key, hash);
+  if (node) {
+    return (ngx_curl_origin_t *)((u_char *)node -
+                                 offsetof(ngx_curl_origin_t, node));
+  }
+
+  if (!create || curl->origin_count == NGX_CURL_MAX_ORIGINS) {
+    return NULL;
+  }
+
+  // The origin is stored after the struct.
+  ngx_curl_origin_t *origin =
+      curl->allocator->callocate(1, sizeof *origin + key.len);
+  if (origin == NULL) {
+    return NULL;
+  }
+  origin->node.str.data = (u_char *)(origin + 1);
+  origin->node.str.len = key.len;
+  memcpy(origin->node.str.data, key.data, key.len);
+  origin->node.node.key = hash;
+  ngx_rbtree_insert(&curl->origins, &origin->node.node);
+  ngx_queue_insert_tail(&curl->all_origins, &origin->link);
+  ++curl->origin_count;
+  return origin;
+}
+
+static int compare_msec(const void *left, const void *right) {
+  const ngx_msec_t a = *(const ngx_msec_t *)left;
+  const ngx_msec_t b = *(const ngx_msec_t *)right;
+  return (a > b) - (a < b);
+}
+
+// Records the result of an attempt to transfer the handle of `context`
+// against its origin, and returns the origin, or NULL if it isn't tracked.
+static ngx_curl_origin_t *record_result(ngx_curl_t *curl,
+                                        ngx_curl_handle_context_t *context,
+                                        CURLcode result) {
+  assert(curl);
+  assert(context);
+
+  ngx_curl_origin_t *origin = context->probe_origin;
+  const bool probe = origin != NULL;
+  context->probe_origin = NULL;
+  if (origin == NULL) {
+    if (!tracks_origins(curl)) {
+      return NULL;
+    }
+    origin = find_origin(curl, context->handle, true);
+    if (origin == NULL) {
+      return NULL;
+    }
+  }
+
+  if (result == CURLE_OK && curl->hedging_after_p95) {
+    record_transfer_time(origin, context->handle);
+  }
+
+  if (!curl->breaker_enabled) {
+    return origin;
+  }
+
+  // Only failures that implicate the origin count against it. An error in
+  // the caller's callbacks, for example, doesn't count at all.
+  bool failed;
+  switch (result) {
+  case CURLE_OK: {
+    long status = 0;
+    (void)curl_easy_getinfo(context->handle, CURLINFO_RESPONSE_CODE, &status);
+    failed = status == 502 || status == 503 || status == 504;
+    break;
+  }
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+    failed = true;
+    break;
+  default:
+    if (probe) {
+      origin->probing = false;
+    }
+    return origin;
+  }
+
+  update_breaker(curl, origin, failed, probe);
+  return origin;
+}
+
+// Records how long the successful transfer of `handle` took, as a sample of
+// its origin's latency.
+static void record_transfer_time(ngx_curl_origin_t *origin, CURL *handle) {
+  assert(origin);
+  assert(handle);
+
+  curl_off_t total_us;
+  if (curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total_us) !=
+      CURLE_OK) {
+    return;
+  }
+
+  origin->samples[origin->sample_count % NGX_CURL_ORIGIN_SAMPLE_COUNT] =
+      (ngx_msec_t)(total_us / 1000);
+  ++origin->sample_count;
+  if (origin->sample_count % NGX_CURL_ORIGIN_MIN_SAMPLES) {
+    return;
+  }
+
+  ngx_msec_t sorted[NGX_CURL_ORIGIN_SAMPLE_COUNT];
+  const size_t count =
+      ngx_min(origin->sample_count, (size_t)NGX_CURL_ORIGIN_SAMPLE_COUNT);
+  memcpy(sorted, origin->samples, count * sizeof sorted[0]);
+  ngx_qsort(sorted, count, sizeof sorted[0], &compare_msec);
+  origin->p95 = sorted[count * 95 / 100];
+  if (origin->p95 == 0) {
+    origin->p95 = 1; // zero means "unknown"
+  }
+}
+
+static curl_off_t elapsed_usec(curl_off_t from, curl_off_t to) {
+  return to > from ? to - from : 0;
+}
+
+// Fills `phases` with how long each phase of the attempt just completed by
+// the handle of `context` took, in microseconds, except for
+// `NGX_CURL_PHASE_CALLBACK`. libcurl reports when each phase ended, relative
+// to the start of the transfer; a phase that didn't happen (e.g. a TLS
+// handshake on a reused connection) ends when the previous one did.
+static bool measure_phases(ngx_curl_handle_context_t *context,
+                           curl_off_t *phases) {
+  assert(context);
+  assert(phases);
+
+  CURL *handle = context->handle;
+  curl_off_t name_lookup = 0, connect = 0, app_connect = 0,
+             start_transfer = 0, total = 0;
+  if (curl_easy_getinfo(handle, CURLINFO_NAMELOOKUP_TIME_T, &name_lookup) !=
+          CURLE_OK ||
+      curl_easy_getinfo(handle, CURLINFO_CONNECT_TIME_T, &connect) !=
+          CURLE_OK ||
+      curl_easy_getinfo(handle, CURLINFO_APPCONNECT_TIME_T, &app_connect) !=
+          CURLE_OK ||
+      curl_easy_getinfo(handle, CURLINFO_STARTTRANSFER_TIME_T,
+                        &start_transfer) != CURLE_OK ||
+      curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &total) != CURLE_OK) {
+    return false;
+  }
+
+  connect = ngx_max(connect, name_lookup);
+  app_connect = ngx_max(app_connect, connect);
+  // A transfer that failed before the response began has no first byte.
+  start_transfer = start_transfer ? ngx_max(start_transfer, app_connect)
+                                  : ngx_max(total, app_connect);
+
+  phases[NGX_CURL_PHASE_QUEUE] = (curl_off_t)context->queue_wait * 1000;
+  phases[NGX_CURL_PHASE_DNS] = name_lookup;
+  phases[NGX_CURL_PHASE_CONNECT] = elapsed_usec(name_lookup, connect);
+  phases[NGX_CURL_PHASE_TLS] = elapsed_usec(connect, app_connect);
+  phases[NGX_CURL_PHASE_FIRST_BYTE] = elapsed_usec(app_connect, start_transfer);
+  phases[NGX_CURL_PHASE_BODY] = elapsed_usec(start_transfer, total);
+  phases[NGX_CURL_PHASE_TOTAL] = total;
+  phases[NGX_CURL_PHASE_CALLBACK] = 0;
+  context->queue_wait = 0;
+  return true;
+}
+
+// Returns the time in microseconds. Unlike `ngx_current_msec`, which is
+// updated once per iteration of the event loop, it's read from the clock.
+static curl_off_t monotonic_usec(void) {
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+  struct timespec now;
+  (void)clock_gettime(CLOCK_MONOTONIC, &now);
+  return (curl_off_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+  struct timeval now;
+  ngx_gettimeofday(&now);
+  return (curl_off_t)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+}
+
+static size_t histogram_bucket(uint64_t value) {
+  if (value < NGX_CURL_HISTOGRAM_SUB_BUCKETS) {
+    return value;
+  }
+
+  unsigned magnitude = 63 - __builtin_clzll(value);
+  if (magnitude >= NGX_CURL_HISTOGRAM_MAX_BITS) {
+    return NGX_CURL_HISTOGRAM_BUCKETS - 1;
+  }
+  const unsigned shift = magnitude - NGX_CURL_HISTOGRAM_SUB_BITS;
+  return (shift + 1) * NGX_CURL_HISTOGRAM_SUB_BUCKETS +
+         (value >> shift) - NGX_CURL_HISTOGRAM_SUB_BUCKETS;
+}
+
+// Returns the largest value counted in the bucket at `index`.
+static uint64_t histogram_bucket_limit(size_t index) {
+  if (index < NGX_CURL_HISTOGRAM_SUB_BUCKETS) {
+    return index;
+  }
+
+  const unsigned shift = index / NGX_CURL_HISTOGRAM_SUB_BUCKETS - 1;
+  const uint64_t base = (uint64_t)(NGX_CURL_HISTOGRAM_SUB_BUCKETS +
+                                   index % NGX_CURL_HISTOGRAM_SUB_BUCKETS)
+                        << shift;
+  return base + ((uint64_t)1 << shift) - 1;
+}
+
+// Returns the `percentile` (from 0 to 100) of the durations in `histogram`,
+// or -1 if it's empty. It's never more than the longest duration.
+static curl_off_t histogram_percentile(const ngx_curl_histogram_t *histogram,
+                                       double percentile) {
+  assert(histogram);
+
+  if (histogram->count == 0) {
+    return -1;
+  }
+
+  uint64_t rank = (uint64_t)(percentile / 100 * histogram->count + 0.5);
+  rank = ngx_max(rank, (uint64_t)1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < NGX_CURL_HISTOGRAM_BUCKETS; ++i) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      return (curl_off_t)ngx_min(histogram_bucket_limit(i), histogram->max);
+    }
+  }
+  return (curl_off_t)histogram->max;
+}
+
+static const char *const phase_names[NGX_CURL_PHASE_COUNT] = {
+    "queue", "dns", "connect", "tls", "first byte", "body", "total",
+    "callback"};
+
+// Records the phases of a completed attempt: in the origin's histograms if
+// it succeeded, and in the log if it was slow.
+static void record_phases(ngx_curl_t *curl, ngx_curl_origin_t *origin,
+                          const curl_off_t *phases, CURLcode result,
+                          long status) {
+  assert(curl);
+  assert(phases);
+
+  if (curl->phase_timing && origin && result == CURLE_OK) {
+    if (origin->phases == NULL) {
+      origin->phases = curl->allocator->callocate(
+          NGX_CURL_PHASE_COUNT, sizeof(ngx_curl_histogram_t));
+    }
+    if (origin->phases) {
+      for (size_t i = 0; i < NGX_CURL_PHASE_COUNT; ++i) {
+        ngx_curl_histogram_t *histogram = &origin->phases[i];
+        const uint64_t value = (uint64_t)phases[i];
+        ++histogram->buckets[histogram_bucket(value)];
+        ++histogram->count;
+        histogram->max = ngx_max(histogram->max, value);
+      }
+    }
+  }
+
+  if (curl->slow_transfer_time == 0) {
+    return;
+  }
+
+  const curl_off_t elapsed = phases[NGX_CURL_PHASE_QUEUE] +
+                             phases[NGX_CURL_PHASE_TOTAL] +
+                             phases[NGX_CURL_PHASE_CALLBACK];
+  if (elapsed < (curl_off_t)curl->slow_transfer_time * 1000 ||
+      (size_t)(ngx_random() % 100) >= curl->slow_transfer_log_percent) {
+    return;
+  }
+
+  static const ngx_str_t unknown_origin = ngx_string("unknown origin");
+  const ngx_str_t *name = origin ? &origin->node.str : &unknown_origin;
+  u_char breakdown[NGX_CURL_PHASE_COUNT * 32];
+  u_char *last = breakdown;
+  for (size_t i = 0; i < NGX_CURL_PHASE_COUNT; ++i) {
+    last = ngx_slprintf(last, breakdown + sizeof breakdown, "%s%s %O.%03O ms",
+                        i ? ", " : "", phase_names[i],
+                        (off_t)(phases[i] / 1000), (off_t)(phases[i] % 1000));
+  }
+  ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                "ngx_curl: slow transfer to %V (%s, status %l): %*s", name,
+                ngx_curl_strerror(result), status, last - breakdown,
+                breakdown);
+}
+
+curl_off_t ngx_curl_phase_percentile(ngx_curl_t *curl, const ngx_str_t *origin,
+                                     ngx_curl_phase_t phase,
+                                     double percentile) {
+  assert(curl);
+  assert(origin);
+  assert(phase < NGX_CURL_PHASE_COUNT);
+
+  ngx_str_t key = *origin;
+  ngx_str_node_t *node = ngx_str_rbtree_lookup(
+      &curl->origins, &key, ngx_crc32_short(key.data, key.len));
+  if (node == NULL) {
+    return -1;
+  }
+
+  const ngx_curl_origin_t *found =
+      (ngx_curl_origin_t *)((u_char *)node - offsetof(ngx_curl_origin_t, node));
+  if (found->phases == NULL) {
+    return -1;
+  }
+  return histogram_percentile(&found->phases[phase], percentile);
+}
+
+void ngx_curl_log_phase_timings(ngx_curl_t *curl, ngx_uint_t level) {
+  assert(curl);
+
+  for (ngx_queue_t *link = ngx_queue_head(&curl->all_origins);
+       link != ngx_queue_sentinel(&curl->all_origins);
+       link = ngx_queue_next(link)) {
+    const ngx_curl_origin_t *origin =
+        ngx_queue_data(link, ngx_curl_origin_t, link);
+    if (origin->phases == NULL) {
+      continue;
+    }
+
+    for (size_t i = 0; i < NGX_CURL_PHASE_COUNT; ++i) {
+      const ngx_curl_histogram_t *histogram = &origin->phases[i];
+      ngx_log_error(level, ngx_cycle->log, 0,
+                    "ngx_curl: %V %s: count %uL, p50 %O us, p90 %O us, "
+                    "p99 %O us, p99.9 %O us, max %uL us",
+                    &origin->node.str, phase_names[i], histogram->count,
+                    (off_t)histogram_percentile(histogram, 50),
+                    (off_t)histogram_percentile(histogram, 90),
+                    (off_t)histogram_percentile(histogram, 99),
+                    (off_t)histogram_percentile(histogram, 99.9),
+                    histogram->max);
+    }
+  }
+}
+
+// Returns whether the handle of `context` may proceed, given its origin's
+// circuit breaker. If the breaker is half open, the handle becomes its probe.
+static bool breaker_admits(ngx_curl_t *curl,
+                           ngx_curl_handle_context_t *context) {
+  assert(curl);
+  assert(context);
+
+  ngx_curl_origin_t *origin = find_origin(curl, context->handle, false);
+  if (origin == NULL || origin->breaker == NGX_CURL_BREAKER_CLOSED) {
+    return true;
+  }
+
+  if (origin->breaker == NGX_CURL_BREAKER_OPEN) {
+    if ((ngx_msec_int_t)(ngx_current_msec - origin->open_until) < 0) {
+      return false;
+    }
+    origin->breaker = NGX_CURL_BREAKER_HALF_OPEN;
+  }
+
+  if (origin->probing) {
+    return false;
+  }
+  origin->probing = true;
+  context->probe_origin = origin;
+  return true;
+}
+
+// The breaker opens when, among the last `NGX_CURL_BREAKER_WINDOW` outcomes
+// (and at least `ngx_curl_t::breaker_min_requests` of them), the proportion
+// of failures reaches `ngx_curl_t::breaker_error_percent`. It stays open for
+// `ngx_curl_t::breaker_open_time`, and then a single probe decides whether
+// it closes, with a clean slate, or opens again.
+static void update_breaker(ngx_curl_t *curl, ngx_curl_origin_t *origin,
+                           bool failed, bool probe) {
+  assert(curl);
+  assert(origin);
+
+  if (probe) {
+    origin->probing = false;
+    if (failed) {
+      open_breaker(curl, origin);
+      return;
+    }
+    origin->breaker = NGX_CURL_BREAKER_CLOSED;
+    origin->outcomes = 0;
+    origin->outcome_count = 0;
+    origin->failure_count = 0;
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "ngx_curl: circuit breaker for %V closed",
+                  &origin->node.str);
+    return;
+  }
+
+  // Outcomes of transfers that started before the breaker opened don't
+  // count; the probe will decide.
+  if (origin->breaker != NGX_CURL_BREAKER_CLOSED) {
+    return;
+  }
+
+  if (origin->outcome_count == NGX_CURL_BREAKER_WINDOW) {
+    origin->failure_count -= origin->outcomes >> (NGX_CURL_BREAKER_WINDOW - 1);
+  } else {
+    ++origin->outcome_count;
+  }
+  origin->outcomes = (origin->outcomes << 1) | failed;
+  origin->failure_count += failed;
+
+  if (origin->outcome_count >= curl->breaker_min_requests &&
+      origin->failure_count * 100 >=
+          curl->breaker_error_percent * origin->outcome_count) {
+    open_breaker(curl, origin);
+  }
+}
+
+static void open_breaker(ngx_curl_t *curl, ngx_curl_origin_t *origin) {
+  assert(curl);
+  assert(origin);
+
+  if (origin->breaker != NGX_CURL_BREAKER_HALF_OPEN) {
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "ngx_curl: circuit breaker for %V opened",
+                  &origin->node.str);
+  }
+  origin->breaker = NGX_CURL_BREAKER_OPEN;
+  origin->open_until = ngx_current_msec + curl->breaker_open_time;
+  ++curl->stats.circuits_opened;
+}
+
+static void on_reject(ngx_event_t *event) {
+  assert(event);
+  ngx_curl_handle_context_t *context =
+      (ngx_curl_handle_context_t *)((char *)event -
+                                    offsetof(ngx_curl_handle_context_t,
+                                             reject));
+  assert(context->state == NGX_CURL_HANDLE_REJECTED);
+  complete_context(context->curl, context, NGX_CURLE_CIRCUIT_OPEN);
+}
+
+static bool is_header(const ngx_str_t *name, const char *expected) {
+  const size_t length = ngx_strlen(expected);
+  return name->len == length &&
+         ngx_strncasecmp(name->data, (u_char *)expected, length) == 0;
+}
+
+static ngx_str_t trim(u_char *begin, u_char *end) {
+  while (begin < end && (*begin == ' ' || *begin == '\t')) {
+    ++begin;
+  }
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+    --end;
+  }
+
+  ngx_str_t result;
+  result.data = begin;
+  result.len = end - begin;
+  return result;
+}
+
+static void parse_cache_policy(u_char *headers, size_t length, time_t now,
+                               ngx_curl_cache_policy_t *policy) {
+  assert(policy);
+  memset(policy, 0, sizeof *policy);
+
+  bool no_cache = false;
+  time_t max_age = -1;
+  time_t shared_max_age = -1;
+  bool has_expires = false;
+  time_t expires = 0;
+  time_t date = NGX_ERROR;
+  time_t age = 0;
+
+  u_char *const end = headers + length;
+  for (u_char *line = headers; line < end;) {
+    u_char *newline = ngx_strlchr(line, end, '\n');
+    u_char *next = newline ? newline + 1 : end;
+    u_char *colon = ngx_strlchr(line, newline ? newline : end, ':');
+    if (colon == NULL) {
+      line = next; // e.g. the status line
+      continue;
+    }
+
+    // `trim` doesn't remove the '\r' before the '\n'.
+    u_char *value_end = newline ? newline : end;
+    if (value_end > colon && value_end[-1] == '\r') {
+      --value_end;
+    }
+    const ngx_str_t name = trim(line, colon);
+    ngx_str_t value = trim(colon + 1, value_end);
+    line = next;
+
+    if (is_header(&name, "Cache-Control")) {
+      u_char *directive = value.data;
+      u_char *const value_last = value.data + value.len;
+      while (directive < value_last) {
+        u_char *comma = ngx_strlchr(directive, value_last, ',');
+        u_char *directive_end = comma ? comma : value_last;
+        u_char *equals = ngx_strlchr(directive, directive_end, '=');
+        const ngx_str_t key =
+            trim(directive, equals ? equals : directive_end);
+        ngx_str_t argument = equals ? trim(equals + 1, directive_end)
+                                    : trim(directive_end, directive_end);
+        if (argument.len >= 2 && argument.data[0] == '"' &&
+            argument.data[argument.len - 1] == '"') {
+          ++argument.data;
+          argument.len -= 2;
+        }
+
+        if (is_header(&key, "no-store") || is_header(&key, "private")) {
+          // This is a shared cache, so "private" responses can't be stored.
+          policy->no_store = true;
+        } else if (is_header(&key, "no-cache")) {
+          no_cache = true;
+        } else if (is_header(&key, "max-age")) {
+          max_age = ngx_atotm(argument.data, argument.len);
+        } else if (is_header(&key, "s-maxage")) {
+          shared_max_age = ngx_atotm(argument.data, argument.len);
+          policy->shared = true;
+        } else if (is_header(&key, "public") ||
+                   is_header(&key, "must-revalidate")) {
+          policy->shared = true;
+        }
+        directive = comma ? comma + 1 : value_last;
+      }
+    } else if (is_header(&name, "Expires")) {
+      // An invalid date (e.g. "0") means "already expired."
+      has_expires = true;
+      expires = ngx_parse_http_time(value.data, value.len);
+      if (expires == NGX_ERROR) {
+        expires = 0;
+      }
+    } else if (is_header(&name, "Date")) {
+      date = ngx_parse_http_time(value.data, value.len);
+    } else if (is_header(&name, "Age")) {
+      age = ngx_atotm(value.data, value.len);
+      if (age == NGX_ERROR) {
+        age = 0;
+      }
+    } else if (is_header(&name, "ETag")) {
+      policy->etag = value;
+    } else if (is_header(&name, "Last-Modified")) {
+      policy->last_modified = ngx_parse_http_time(value.data, value.len);
+      if (policy->last_modified == NGX_ERROR) {
+        policy->last_modified = 0;
+      }
+    } else if (is_header(&name, "Set-Cookie")) {
+      // The cookie is meant for whoever made the request, not for everyone
+      // else that the response would be served to.
+      policy->no_store = true;
+    } else if (is_header(&name, "Vary")) {
+      // The key is expected to include any varying request headers, but no
+      // key can include "everything."
+      if (value.len == 1 && value.data[0] == '*') {
+        policy->no_store = true;
+      }
+    }
+  }
+
+  time_t lifetime = 0;
+  if (shared_max_age >= 0) {
+    lifetime = shared_max_age;
+  } else if (max_age >= 0) {
+    lifetime = max_age;
+  } else if (has_expires) {
+    lifetime = expires - (date == NGX_ERROR ? now : date);
+  }
+
+  policy->fresh_until = no_cache || lifetime <= age ? 0 : now + lifetime - age;
+  if (policy->etag.len > NGX_CURL_MAX_ETAG_SIZE) {
+    policy->etag.len = 0;
+  }
+}
+
+// The following two functions are called with the zone's mutex held.
+
+static void evict_cached_response(ngx_curl_shm_cache_t *cache,
+                                  ngx_curl_cached_response_t *entry) {
+  ngx_queue_remove(&entry->queue);
+  ngx_rbtree_delete(&cache->shared->rbtree, &entry->node.node);
+  ngx_slab_free_locked(cache->shpool, entry);
+}
+
+static ngx_curl_cached_response_t *
+find_cached_response(ngx_curl_shm_cache_t *cache, ngx_str_t *key) {
+  ngx_str_node_t *node = ngx_str_rbtree_lookup(
+      &cache->shared->rbtree, key, ngx_crc32_short(key->data, key->len));
+  if (node == NULL) {
+    return NULL;
+  }
+
+  return (ngx_curl_cached_response_t *)((u_char *)node -
+                                        offsetof(ngx_curl_cached_response_t,
+                                                 node));
+}
+
+static ngx_curl_cache_lookup_t
+lookup_cached_response(ngx_curl_t *curl, ngx_curl_flight_t *flight) {
+  ngx_curl_shm_cache_t *cache = curl->response_cache;
+  if (cache == NULL || flight->key.len == 0) {
+    return NGX_CURL_CACHE_MISS;
+  }
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  ngx_curl_cached_response_t *entry = find_cached_response(cache, &flight->key);
+  if (entry == NULL) {
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_CURL_CACHE_MISS;
+  }
+
+  const bool fresh = entry->fresh_until > ngx_time();
+  if (!fresh && entry->etag_length == 0 && entry->last_modified == 0) {
+    // Stale, and there's no way to revalidate it.
+    evict_cached_response(cache, entry);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_CURL_CACHE_MISS;
+  }
+
+  // Copy the response out of shared memory, because it might be evicted by
+  // another worker before it's delivered.
+  const char *etag = (char *)entry->data + entry->node.str.len;
+  const char *headers = etag + entry->etag_length;
+  const char *body = headers + entry->headers_length;
+  const ngx_curl_allocator_t *allocator = curl->allocator;
+  bool copied;
+  if (fresh) {
+    flight->status = entry->status;
+    copied = append_to_buffer(allocator, &flight->headers, headers,
+                              entry->headers_length) &&
+             append_to_buffer(allocator, &flight->body, body,
+                              entry->body_length);
+  } else {
+    flight->stale = true;
+    flight->stale_status = entry->status;
+    flight->stale_last_modified = entry->last_modified;
+    copied = append_to_buffer(allocator, &flight->stale_etag, etag,
+                              entry->etag_length) &&
+             append_to_buffer(allocator, &flight->stale_headers, headers,
+                              entry->headers_length) &&
+             append_to_buffer(allocator, &flight->stale_body, body,
+                              entry->body_length);
+  }
+
+  if (copied) {
+    ngx_queue_remove(&entry->queue);
+    ngx_queue_insert_head(&cache->shared->lru, &entry->queue);
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  if (!copied) {
+    flight->stale = false;
+    return NGX_CURL_CACHE_MISS;
+  }
+  return fresh ? NGX_CURL_CACHE_FRESH : NGX_CURL_CACHE_STALE;
+}
+
+static bool is_cacheable_status(long status) {
+  switch (status) {
+  case 200:
+  case 203:
+  case 204:
+  case 300:
+  case 301:
+  case 308:
+  case 404:
+  case 410:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void store_cached_response(ngx_curl_t *curl,
+                                  ngx_curl_flight_t *flight) {
+  ngx_curl_shm_cache_t *cache = curl->response_cache;
+  if (cache == NULL || flight->key.len == 0 ||
+      !is_cacheable_status(flight->status)) {
+    return;
+  }
+
+  const time_t now = ngx_time();
+  ngx_curl_cache_policy_t policy;
+  parse_cache_policy((u_char *)flight->headers.data, flight->headers.length,
+                     now, &policy);
+  // As RFC 9111 section 3.5 requires of a shared cache, a response to a
+  // request with credentials is stored only if it says that's allowed.
+  if (policy.no_store || (flight->authorized && !policy.shared) ||
+      (policy.fresh_until <= now && policy.etag.len == 0 &&
+       policy.last_modified == 0)) {
+    return;
+  }
+
+  const size_t size = offsetof(ngx_curl_cached_response_t, data) +
+                      flight->key.len + policy.etag.len +
+                      flight->headers.length + flight->body.length;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  ngx_curl_cached_response_t *entry = find_cached_response(cache, &flight->key);
+  if (entry) {
+    evict_cached_response(cache, entry);
+  }
+
+  entry = ngx_slab_alloc_locked(cache->shpool, size);
+  if (entry == NULL) {
+    // Make room by evicting the least recently used responses.
+    for (int i = 0; i < 8 && !ngx_queue_empty(&cache->shared->lru); ++i) {
+      ngx_queue_t *last = ngx_queue_last(&cache->shared->lru);
+      evict_cached_response(cache, ngx_queue_data(last,
+                                                  ngx_curl_cached_response_t,
+                                                  queue));
+    }
+    entry = ngx_slab_alloc_locked(cache->shpool, size);
+  }
+
+  if (entry) {
+    entry->node.str.data = entry->data;
+    entry->node.str.len = flight->key.len;
+    entry->node.node.key = ngx_crc32_short(flight->key.data, flight->key.len);
+    entry->fresh_until = policy.fresh_until;
+    entry->last_modified = policy.last_modified;
+    entry->status = flight->status;
+    entry->etag_length = policy.etag.len;
+    entry->headers_length = flight->headers.length;
+    entry->body_length = flight->body.length;
+    u_char *p = ngx_cpymem(entry->data, flight->key.data, flight->key.len);
+    p = ngx_cpymem(p, policy.etag.data, policy.etag.len);
+    p = ngx_cpymem(p, flight->headers.data, flight->headers.length);
+    ngx_memcpy(p, flight->body.data, flight->body.length);
+    ngx_rbtree_insert(&cache->shared->rbtree, &entry->node.node);
+    ngx_queue_insert_head(&cache->shared->lru, &entry->queue);
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static void refresh_cached_response(ngx_curl_t *curl,
+                                    ngx_curl_flight_t *flight) {
+  ngx_curl_shm_cache_t *cache = curl->response_cache;
+  assert(cache);
+
+  // The 304 response's headers may extend the response's freshness.
+  ngx_curl_cache_policy_t policy;
+  parse_cache_policy((u_char *)flight->headers.data, flight->headers.length,
+                     ngx_time(), &policy);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+  ngx_curl_cached_response_t *entry = find_cached_response(cache, &flight->key);
+  if (entry && policy.no_store) {
+    evict_cached_response(cache, entry);
+  } else if (entry) {
+    entry->fresh_until = policy.fresh_until;
+  }
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+static size_t on_sink_body(char *data, size_t size, size_t count,
+                           void *user_data) {
+  (void)size; // always 1
+  ngx_curl_chain_sink_t *sink = user_data;
+  assert(sink);
+
+  if (sink->max_size && count > sink->max_size - sink->size) {
+    return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+  }
+
+  size_t remaining = count;
+  while (remaining) {
+    ngx_buf_t *buffer = sink->buffer;
+    if (buffer == NULL || buffer->last == buffer->end) {
+      size_t capacity = ngx_max(remaining, NGX_CURL_CHAIN_BUFFER_SIZE);
+      if (buffer == NULL) {
+        // This is the first data. If the length of the body is known by now,
+        // then the whole body fits in one buffer, within reason.
+        curl_off_t length = -1;
+        (void)curl_easy_getinfo(sink->handle,
+                                CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        if (sink->max_size && length > (curl_off_t)sink->max_size) {
+          return 0;
+        }
+        if (sink->max_size == 0) {
+          length = ngx_min(length, NGX_CURL_CHAIN_MAX_PREALLOCATION);
+        }
+        if (length >= (curl_off_t)remaining) {
+          capacity = length;
+        }
+      }
+      if (sink->max_size) {
+        capacity = ngx_min(capacity, sink->max_size - sink->size);
+      }
+
+      buffer = ngx_create_temp_buf(sink->pool, capacity);
+      ngx_chain_t *link = ngx_alloc_chain_link(sink->pool);
+      if (buffer == NULL || link == NULL) {
+        return 0;
+      }
+      link->buf = buffer;
+      link->next = NULL;
+      *sink->last = link;
+      sink->last = &link->next;
+      sink->buffer = buffer;
+    }
+
+    const size_t length =
+        ngx_min(remaining, (size_t)(buffer->end - buffer->last));
+    buffer->last = ngx_cpymem(buffer->last, data, length);
+    data += length;
+    remaining -= length;
+  }
+
+  sink->size += count;
+  return count;
+}
+
+static void on_sink_complete(CURL *handle, CURLcode result, void *data) {
+  ngx_curl_chain_sink_t *sink = data;
+  assert(sink);
+
+  if (result == CURLE_OK) {
+    sink->on_done(handle, sink->chain);
+  } else {
+    sink->on_error(handle, result);
+  }
+}
+
+static void on_sink_retry(CURL *handle, void *data) {
+  ngx_curl_chain_sink_t *sink = data;
+  assert(sink);
+
+  // The previous attempt's buffers stay in the pool until it's destroyed.
+  sink->size = 0;
+  sink->chain = NULL;
+  sink->last = &sink->chain;
+  sink->buffer = NULL;
+}
+
+static size_t on_upload_read(char *data, size_t size, size_t count,
+                             void *user_data) {
+  ngx_curl_upload_t *upload = user_data;
+  assert(upload);
+  const size_t capacity = size * count;
+  size_t written = 0;
+
+  if (upload->failed) {
+    return CURL_READFUNC_ABORT;
+  }
+#if (NGX_THREADS)
+  if (upload->reading) {
+    // libcurl asks again before the read completes, or the handle was
+    // removed during the read and has since been added again, e.g. to
+    // retry. Either way, wait for the same read.
+    pause_upload(upload);
+    return CURL_READFUNC_PAUSE;
+  }
+#endif
+
+  while (written < capacity && upload->link) {
+    ngx_buf_t *buffer = upload->link->buf;
+    const off_t remaining = ngx_buf_size(buffer) - upload->offset;
+    if (remaining <= 0) {
+      upload->link = upload->link->next;
+      upload->offset = 0;
+#if (NGX_THREADS)
+      // Anything staged beyond this buffer isn't part of the body.
+      upload->staged_offset = upload->staged_length = 0;
+#endif
+      continue;
+    }
+    const size_t length = (size_t)ngx_min((off_t)(capacity - written),
+                                          remaining);
+
+    if (ngx_buf_in_memory(buffer)) {
+      ngx_memcpy(data + written, buffer->pos + upload->offset, length);
+      upload->offset += length;
+      written += length;
+      continue;
     }
-    connection->write->handler = &on_connection_event;
-    if (!connection->write->active) {
-      if (ngx_add_event(connection->write, NGX_WRITE_EVENT, 0) != NGX_OK) {
-        return -1;
+
+#if (NGX_THREADS)
+    if (upload->thread_pool) {
+      if (upload->staged_offset == upload->staged_length) {
+        if (written) {
+          break; // send what we have, and read more next time
+        }
+        // Read the next part of the file without blocking the event loop.
+        upload->fd = buffer->file->fd;
+        upload->read_position = buffer->file_pos + upload->offset;
+        upload->read_length =
+            (size_t)ngx_min((off_t)upload->staging_size, remaining);
+        upload->staged_offset = upload->staged_length = 0;
+        if (ngx_thread_task_post(upload->thread_pool, &upload->task) !=
+            NGX_OK) {
+          return CURL_READFUNC_ABORT;
+        }
+        upload->reading = true;
+        pause_upload(upload);
+        return CURL_READFUNC_PAUSE;
       }
+
+      const size_t staged = ngx_min(
+          length, upload->staged_length - upload->staged_offset);
+      ngx_memcpy(data + written, upload->staging + upload->staged_offset,
+                 staged);
+      upload->staged_offset += staged;
+      upload->offset += staged;
+      written += staged;
+      continue;
     }
-    break;
-  case CURL_POLL_REMOVE: {
-    // Remove the connection from nginx's event loop.
-    // Pass zero for the flags so that nginx actually removes the socket from
-    // the event loop.
-    if (ngx_del_conn(connection, 0) != NGX_OK) {
-      return -1;
+#endif
+
+    // Read the file directly into libcurl's buffer.
+    const ssize_t n = ngx_read_file(buffer->file, (u_char *)data + written,
+                                    length, buffer->file_pos + upload->offset);
+    if (n <= 0) {
+      return CURL_READFUNC_ABORT;
     }
-    ngx_free_connection(connection);
+    upload->offset += n;
+    written += n;
+  }
 
-    // The user data associated with the socket appears to be cleared by
-    // libcurl anyway, but let's be explicit with cleanup here.
-    (void)curl_multi_assign(curl->multi, s, NULL);
-  } break;
-  default:
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "libcurl requested notification for an unknown event type: %d", what);
-    return -1;
+  return written;
+}
+
+static int on_upload_seek(void *user_data, curl_off_t offset, int origin) {
+  ngx_curl_upload_t *upload = user_data;
+  assert(upload);
+
+  if (origin != SEEK_SET || offset < 0) {
+    return CURL_SEEKFUNC_CANTSEEK;
   }
+#if (NGX_THREADS)
+  if (upload->reading) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+  upload->staged_offset = upload->staged_length = 0;
+#endif
 
-  return 0; // success
+  // libcurl rewinds to resend the body, e.g. after a redirect, so it's
+  // usually to the beginning.
+  for (ngx_chain_t *link = upload->body; link; link = link->next) {
+    const off_t length = ngx_buf_size(link->buf);
+    if (offset <= length) {
+      upload->link = link;
+      upload->offset = offset;
+      return CURL_SEEKFUNC_OK;
+    }
+    offset -= length;
+  }
+
+  return CURL_SEEKFUNC_FAIL;
 }
 
-ngx_curl_t *ngx_create_curl(void) {
-  const ngx_curl_options_t default_options = {
-      // `ngx_create_curl_with_options` will choose defaults for
-      // any options that are NULL.
-      .allocator = NULL};
-  return ngx_create_curl_with_options(&default_options);
+#if (NGX_THREADS)
+
+static void on_upload_thread_read(void *data, ngx_log_t *log) {
+  (void)log;
+  // This runs in a thread pool.
+  ngx_curl_upload_t *upload = data;
+  upload->read_result = pread(upload->fd, upload->staging,
+                              upload->read_length, upload->read_position);
+  upload->read_error = upload->read_result == -1 ? ngx_errno : 0;
 }
 
-ngx_curl_t *ngx_create_curl_with_options(const ngx_curl_options_t *options) {
-  const ngx_curl_allocator_t *allocator = options->allocator;
-  if (allocator == NULL) {
-    allocator = &malloc_allocator;
+static void pause_upload(ngx_curl_upload_t *upload) {
+  if (!upload->paused) {
+    upload->paused = true;
+    ngx_queue_insert_tail(&upload->curl->paused_uploads,
+                          &upload->paused_link);
   }
+}
 
-  CURLcode rc = curl_global_init_mem(
-      CURL_GLOBAL_DEFAULT, allocator->allocate, allocator->free,
-      allocator->reallocate, allocator->duplicate, allocator->callocate);
+static void on_upload_thread_done(ngx_event_t *event) {
+  ngx_curl_upload_t *upload = event->data;
+  upload->reading = false;
+  const bool paused = upload->paused;
+  if (paused) {
+    upload->paused = false;
+    ngx_queue_remove(&upload->paused_link);
+  }
+
+  if (upload->orphaned) {
+    upload->allocator->free(upload->staging);
+    upload->allocator->free(upload);
+    return;
+  }
+
+  if (upload->read_result <= 0) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, upload->read_error,
+                  "Unable to read request body file for CURL handle");
+    upload->failed = true;
+  } else {
+    upload->staged_length = upload->read_result;
+  }
+
+  if (!paused) {
+    // The handle was removed from the multi-handle while the file was read,
+    // and might since have been cleaned up. If it's added again, then
+    // `on_upload_read` picks up what was read.
+    return;
+  }
+
+  // libcurl calls `on_upload_read` again, which either sends the data read
+  // or aborts the transfer.
+  const CURLcode rc = curl_easy_pause(upload->handle, CURLPAUSE_CONT);
   if (rc != CURLE_OK) {
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                  "Unable to perform global initialization of libcurl: %s",
+                  "Unable to resume uploading CURL handle: %s",
                   curl_easy_strerror(rc));
-    return NULL;
   }
+}
+
+#endif
+
+// Forgets the transfers of `handle` (or, if it's NULL, of every handle)
+// that are paused while a thread pool reads their bodies, now that they're
+// no longer in the multi-handle, so that the reads don't resume them.
+static void detach_uploads(ngx_curl_t *curl, CURL *handle) {
+#if (NGX_THREADS)
+  ngx_queue_t *link = ngx_queue_head(&curl->paused_uploads);
+  while (link != ngx_queue_sentinel(&curl->paused_uploads)) {
+    ngx_curl_upload_t *upload =
+        ngx_queue_data(link, ngx_curl_upload_t, paused_link);
+    link = ngx_queue_next(link);
+    if (handle == NULL || upload->handle == handle) {
+      upload->paused = false;
+      ngx_queue_remove(&upload->paused_link);
+    }
+  }
+#endif
+}
 
-  ngx_curl_t *curl = allocator->callocate(1, sizeof(ngx_curl_t));
-  curl->allocator = allocator;
+static void on_upload_cleanup(void *data) {
+  ngx_curl_upload_t *upload = data;
+#if (NGX_THREADS)
+  if (upload->reading) {
+    upload->orphaned = true;
+    return;
+  }
+  upload->allocator->free(upload->staging);
+#endif
+  upload->allocator->free(upload);
+}
 
-  // Initialize the dummy connection.  In debug mode, nginx assumes that the
-  // `void *ngx_event_t::data` member of the argument to `ngx_add_timer` points
-  // to an `ngx_connection_t`. This is understandable, because nginx uses timer
-  // events for I/O timeouts associated with connections.  The debug form of
-  // `ngx_add_timer` logs the file descriptor (`fd`) associated with the
-  // connection associated with the timer event.  However, we use timers that
-  // aren't associated with a connection, and we need the event's data pointer
-  // to refer to our context, the `ngx_curl_t`. Crash!
-  //
-  // To work around this, we have our timer event's data pointer point to a
-  // dummy `ngx_connection_t`. We then populate the connection's `fd` with a
-  // clearly-not-real value (`-1`), and we could have the connection's data
-  // pointer refer to `ngx_curl_t`. However, because the dummy connection is a
-  // member of `ngx_curl_t`, we instead ignore the connection's data pointer
-  // and use `offsetof` to get a pointer to the enclosing `ngx_curl_t`.
-  curl->dummy_connection.fd = -1;
-  curl->timeout.data = &curl->dummy_connection;
+int ngx_curl_remove_handle(ngx_curl_t *curl, CURL *handle) {
+  return remove_handle(curl, handle);
+}
 
-  curl->multi = curl_multi_init();
-  if (curl->multi == NULL) {
+int ngx_curl_fetch(ngx_curl_t *curl, CURL *handle,
+                   const ngx_curl_fetch_options_t *options,
+                   void (*on_error)(CURL *, CURLcode),
+                   void (*on_response)(CURL *, const ngx_curl_response_t *)) {
+  assert(curl);
+  assert(handle);
+  assert(on_error);
+  assert(on_response);
+
+  static const ngx_curl_fetch_options_t default_options;
+  if (options == NULL) {
+    options = &default_options;
+  }
+
+  if (find_context(curl, handle)) {
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                  "Unable to initialize libcurl multi-handle");
-    curl_global_cleanup();
-    allocator->free(curl);
+                  "Unable to fetch using a CURL handle that is already "
+                  "registered with ngx_curl");
+    return -2;
+  }
+
+  ngx_curl_flight_t *flight = NULL;
+  if (options->key.len) {
+    ngx_str_t key = options->key;
+    ngx_str_node_t *node = ngx_str_rbtree_lookup(
+        &curl->flights, &key, ngx_crc32_short(key.data, key.len));
+    if (node) {
+      flight = (ngx_curl_flight_t *)((u_char *)node -
+                                     offsetof(ngx_curl_flight_t, node));
+      ++curl->stats.fetches_coalesced;
+    }
+  }
+
+  const bool new_flight = flight == NULL;
+  if (new_flight) {
+    flight = create_flight(curl, &options->key);
+    if (flight == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to allocate fetch context");
+      return -1;
+    }
+    for (const struct curl_slist *header = options->headers; header;
+         header = header->next) {
+      flight->authorized |=
+          ngx_strncasecmp((u_char *)header->data, (u_char *)"Authorization:",
+                          sizeof("Authorization:") - 1) == 0;
+    }
+
+    int rc = 0;
+    if (lookup_cached_response(curl, flight) == NGX_CURL_CACHE_FRESH) {
+      // Deliver the response from the event loop, as if it had been fetched.
+      ++curl->stats.response_cache_hits;
+      ngx_post_event(&flight->deliver, &ngx_posted_events);
+    } else {
+      rc = start_flight(curl, flight, handle, options);
+    }
+    if (rc != 0) {
+      destroy_flight(flight);
+      return rc;
+    }
+  }
+
+  ngx_curl_handle_context_t *context = acquire_context(curl);
+  if (context == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate context for CURL handle");
+    if (new_flight) {
+      stop_flight(flight);
+      destroy_flight(flight);
+    }
+    return -1;
+  }
+  context->curl = curl;
+  context->handle = handle;
+  context->callbacks.on_error = on_error;
+  context->callbacks.on_response = on_response;
+  context->state = NGX_CURL_HANDLE_WAITING;
+  context->flight = flight;
+  ngx_queue_insert_tail(&flight->waiters, &context->queue);
+  insert_context(curl, context);
+  return 0;
+}
+
+const ngx_curl_allocator_t *ngx_curl_allocator(const ngx_curl_t *curl) {
+  assert(curl);
+  return curl->allocator;
+}
+
+static ngx_shm_zone_t *add_shm_cache(ngx_conf_t *cf, ngx_str_t *name,
+                                     size_t size, void *tag) {
+  ngx_shm_zone_t *zone = ngx_shared_memory_add(cf, name, size, tag);
+  if (zone == NULL) {
     return NULL;
   }
 
-  CURLMcode mrc = curl_multi_setopt(curl->multi, CURLMOPT_SOCKETFUNCTION,
-                                    on_register_event);
-  assert(mrc == CURLM_OK); // that's what the docs say
-  mrc = curl_multi_setopt(curl->multi, CURLMOPT_SOCKETDATA, curl);
-  assert(mrc == CURLM_OK); // that's what the docs say
+  if (zone->data) {
+    // The zone was already added (e.g. by another module using this library
+    // with the same zone name). Share it.
+    return zone;
+  }
 
-  mrc = curl_multi_setopt(curl->multi, CURLMOPT_TIMERDATA, curl);
-  if (mrc != CURLM_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to associate context object with libcurl's timer callback: %s",
-        curl_multi_strerror(mrc));
-    curl_multi_cleanup(curl->multi);
-    curl_global_cleanup();
-    allocator->free(curl);
+  ngx_curl_shm_cache_t *cache =
+      ngx_pcalloc(cf->pool, sizeof(ngx_curl_shm_cache_t));
+  if (cache == NULL) {
     return NULL;
   }
 
-  mrc = curl_multi_setopt(curl->multi, CURLMOPT_TIMERFUNCTION,
-                          &on_register_timer);
+  zone->init = &init_shm_cache;
+  zone->data = cache;
+  return zone;
+}
 
-  return curl;
+static ngx_int_t init_metrics_zone(ngx_shm_zone_t *zone, void *data) {
+  ngx_curl_metrics_zone_t *metrics_zone = zone->data;
+  ngx_curl_metrics_zone_t *old_metrics_zone = data;
+
+  if (old_metrics_zone) {
+    // nginx is reloading. Keep counting from where the previous cycle was.
+    metrics_zone->metrics = old_metrics_zone->metrics;
+    return NGX_OK;
+  }
+
+  ngx_slab_pool_t *shpool = (ngx_slab_pool_t *)zone->shm.addr;
+  if (zone->shm.exists) {
+    metrics_zone->metrics = shpool->data;
+    return NGX_OK;
+  }
+
+  metrics_zone->metrics = ngx_slab_calloc(shpool, sizeof(ngx_curl_metrics_t));
+  if (metrics_zone->metrics == NULL) {
+    return NGX_ERROR;
+  }
+  shpool->data = metrics_zone->metrics;
+  return NGX_OK;
 }
 
-void ngx_destroy_curl(ngx_curl_t *curl) {
-  CURLMcode mrc = curl_multi_cleanup(curl->multi);
-  if (mrc != CURLM_OK) {
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                  "Unable to clean up libcurl multi-handle: %s",
-                  curl_multi_strerror(mrc));
+ngx_shm_zone_t *ngx_curl_add_metrics_zone(ngx_conf_t *cf, ngx_str_t *name) {
+  assert(cf);
+  assert(name);
+
+  // nginx's slab allocator needs at least eight pages.
+  const size_t size =
+      ngx_max(8 * ngx_pagesize,
+              ngx_align(sizeof(ngx_curl_metrics_t), ngx_pagesize) +
+                  4 * ngx_pagesize);
+  ngx_shm_zone_t *zone = ngx_shared_memory_add(
+      cf, name, size, (void *)&ngx_curl_add_metrics_zone);
+  if (zone == NULL) {
+    return NULL;
   }
 
-  if (curl->timeout.timer_set) {
-    ngx_del_timer(&curl->timeout);
+  if (zone->data) {
+    // The zone was already added, e.g. by another module using this library.
+    return zone;
   }
 
-  curl->allocator->free(curl);
-  curl_global_cleanup();
+  ngx_curl_metrics_zone_t *metrics_zone =
+      ngx_pcalloc(cf->pool, sizeof(ngx_curl_metrics_zone_t));
+  if (metrics_zone == NULL) {
+    return NULL;
+  }
+
+  zone->init = &init_metrics_zone;
+  zone->data = metrics_zone;
+  return zone;
 }
 
-int ngx_curl_add_handle(ngx_curl_t *curl, CURL *handle,
-                        void (*on_error)(CURL *, CURLcode),
-                        void (*on_done)(CURL *)) {
+const ngx_curl_metrics_t *ngx_curl_metrics(const ngx_shm_zone_t *zone) {
+  assert(zone);
+  assert(zone->data);
+  const ngx_curl_metrics_zone_t *metrics_zone = zone->data;
+  return metrics_zone->metrics;
+}
+
+ngx_shm_zone_t *ngx_curl_add_ssl_session_cache(ngx_conf_t *cf, ngx_str_t *name,
+                                               size_t size) {
+  assert(cf);
+  assert(name);
+
+#if (NGX_OPENSSL)
+  return add_shm_cache(cf, name, size, (void *)&ngx_curl_add_ssl_session_cache);
+#else
+  ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                "the ngx_curl SSL session cache \"%V\" requires nginx to be "
+                "built with OpenSSL",
+                name);
+  return NULL;
+#endif
+}
+
+int ngx_curl_upload_chain(ngx_curl_t *curl, CURL *handle, ngx_pool_t *pool,
+                          ngx_chain_t *body,
+                          const ngx_curl_upload_options_t *options) {
   assert(curl);
   assert(handle);
-  assert(on_error);
-  assert(on_done);
-  assert(curl->multi);
-  assert(curl->allocator);
+  assert(pool);
 
-  ngx_curl_handle_context_t *context =
-      curl->allocator->callocate(1, sizeof(ngx_curl_handle_context_t));
-  context->on_error = on_error;
-  context->on_done = on_done;
+  static const ngx_curl_upload_options_t default_options;
+  if (options == NULL) {
+    options = &default_options;
+  }
 
-  CURLcode rc =
-      curl_easy_getinfo(handle, CURLINFO_PRIVATE, &context->user_data);
-  if (rc != CURLE_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to retrieve private data pointer from CURL handle: %s",
-        curl_easy_strerror(rc));
-    curl->allocator->free(context);
+  ngx_pool_cleanup_t *cleanup = ngx_pool_cleanup_add(pool, 0);
+  ngx_curl_upload_t *upload =
+      curl->allocator->callocate(1, sizeof(ngx_curl_upload_t));
+  if (cleanup == NULL || upload == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate request body source for CURL handle");
+    curl->allocator->free(upload);
     return -1;
   }
+  upload->allocator = curl->allocator;
+  upload->handle = handle;
+  upload->body = body;
+  upload->link = body;
+  cleanup->handler = &on_upload_cleanup;
+  cleanup->data = upload;
 
-  rc = curl_easy_setopt(handle, CURLOPT_PRIVATE, context);
-  if (rc != CURLE_OK) {
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                  "Unable to set private data pointer on CURL handle: %s",
-                  curl_easy_strerror(rc));
-    curl->allocator->free(context);
-    return -2;
+  curl_off_t length = 0;
+  for (ngx_chain_t *link = body; link; link = link->next) {
+    length += ngx_buf_size(link->buf);
+#if (NGX_THREADS)
+    if (options->thread_pool && !ngx_buf_in_memory(link->buf) &&
+        link->buf->in_file) {
+      upload->thread_pool = options->thread_pool;
+    }
+#endif
   }
 
-  CURLMcode mrc = curl_multi_add_handle(curl->multi, handle);
-  if (mrc != CURLM_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to register CURL handle with libcurl multi-handle: %s",
-        curl_multi_strerror(mrc));
-    (void)curl_easy_setopt(handle, CURLOPT_PRIVATE, context->user_data);
-    curl->allocator->free(context);
-    return -3;
+#if (NGX_THREADS)
+  if (upload->thread_pool) {
+    // Only bodies with file buffers need this.
+    upload->staging_size = options->read_size
+                               ? options->read_size
+                               : NGX_CURL_DEFAULT_UPLOAD_READ_SIZE;
+    upload->staging = curl->allocator->allocate(upload->staging_size);
+    if (upload->staging == NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                    "Unable to allocate request body buffer for CURL handle");
+      return -1;
+    }
+    upload->curl = curl;
+    upload->task.ctx = upload;
+    upload->task.handler = &on_upload_thread_read;
+    upload->task.event.data = upload;
+    upload->task.event.handler = &on_upload_thread_done;
+    upload->task.event.log = ngx_cycle->log;
   }
+#endif
 
-  // From the libcurl docs:
-  //
-  // > When you have added your initial set of handles, you call
-  // > curl_multi_socket_action with CURL_SOCKET_TIMEOUT set in the sockfd
-  // > argument, and you will get callbacks call that sets you up and you then
-  // > continue to call curl_multi_socket_action accordingly when you get
-  // > activity on the sockets you have been asked to wait on, or if the timeout
-  // > timer expires.
-  int num_running_handles;
-  mrc = curl_multi_socket_action(curl->multi, CURL_SOCKET_TIMEOUT, 0,
-                                 &num_running_handles);
-  if (mrc != CURLM_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to notify libcurl of a CURL handle that was added: %s",
-        curl_multi_strerror(mrc));
+  CURLcode rc = curl_easy_setopt(handle, CURLOPT_READFUNCTION, &on_upload_read);
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_READDATA, upload);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_SEEKFUNCTION, &on_upload_seek);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_SEEKDATA, upload);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE_LARGE, length);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_INFILESIZE_LARGE, length);
+  }
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to install request body source on CURL handle: %s",
+                  curl_easy_strerror(rc));
+    return -5;
   }
 
   return 0;
 }
 
-int ngx_curl_remove_handle(ngx_curl_t *curl, CURL *handle) {
-  assert(curl);
-  assert(handle);
-  assert(curl->multi);
-  assert(curl->allocator);
+ngx_shm_zone_t *ngx_curl_add_response_cache(ngx_conf_t *cf, ngx_str_t *name,
+                                            size_t size) {
+  assert(cf);
+  assert(name);
 
-  // Goals:
-  // - Restore the user_data associated with handle.
-  // - Delete the context associated with handle.
-  // - Remove handle from curl->multi.
+  return add_shm_cache(cf, name, size, (void *)&ngx_curl_add_response_cache);
+}
 
-  ngx_curl_handle_context_t *context;
-  CURLcode rc = curl_easy_getinfo(handle, CURLINFO_PRIVATE, &context);
-  if (rc != CURLE_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to retrieve private data pointer from CURL handle: %s",
-        curl_easy_strerror(rc));
-    return -1;
+CURL *ngx_curl_acquire_handle(ngx_curl_t *curl) {
+  assert(curl);
+
+  if (curl->idle_handle_count) {
+    ++curl->stats.handle_pool_hits;
+    return curl->idle_handles[--curl->idle_handle_count];
   }
 
-  rc = curl_easy_setopt(handle, CURLOPT_PRIVATE, context->user_data);
-  curl->allocator->free(context);
-  if (rc != CURLE_OK) {
-    ngx_log_error(
-        NGX_LOG_ERR, ngx_cycle->log, 0,
-        "Unable to restore original private data pointer on CURL handle: %s",
-        curl_easy_strerror(rc));
-    return -2;
+  ++curl->stats.handle_pool_misses;
+  return curl_easy_init();
+}
+
+void ngx_curl_release_handle(ngx_curl_t *curl, CURL *handle) {
+  assert(curl);
+
+  if (handle == NULL) {
+    return;
   }
 
-  CURLMcode mrc = curl_multi_remove_handle(curl->multi, handle);
-  if (mrc != CURLM_OK) {
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
-                  "Unable to remove CURL handle from libcurl multi-handle: %s",
-                  curl_multi_strerror(mrc));
-    return -3;
+  if (curl->idle_handle_count == curl->handle_pool_size) {
+    curl_easy_cleanup(handle);
+    return;
   }
 
-  return 0;
+  // Reset the handle now, rather than when it's next acquired, so that an
+  // idle handle doesn't refer to memory owned by its previous user (e.g. via
+  // `CURLOPT_WRITEDATA`).
+  curl_easy_reset(handle);
+  curl->idle_handles[curl->idle_handle_count++] = handle;
 }
 
-const ngx_curl_allocator_t *ngx_curl_allocator(const ngx_curl_t *curl) {
+void ngx_curl_stats(const ngx_curl_t *curl, ngx_curl_stats_t *stats) {
   assert(curl);
-  return curl->allocator;
+  assert(stats);
+  *stats = curl->stats;
+  stats->transfers_running = curl->running_count;
+  stats->connections_reserved = curl->reserved_connections;
+}
+
+const char *ngx_curl_strerror(CURLcode code) {
+  switch ((int)code) {
+  case NGX_CURLE_QUEUE_TIMEOUT:
+    return "Timed out waiting to be admitted by ngx_curl";
+  case NGX_CURLE_GROUP_CANCELLED:
+    return "Cancelled because its ngx_curl group was resolved";
+  case NGX_CURLE_CIRCUIT_OPEN:
+    return "Not attempted because the origin's circuit breaker is open";
+  default:
+    return curl_easy_strerror(code);
+  }
 }
@@ -10,7 +10,8 @@
 // Then libcurl "easy" handles (`CURL*`) can be added by the function
 // `ngx_curl_add_handle`.  Associated with the request handle is an `on_done`
 // callback and an `on_error` callback. Request context can be associated with
-// the handle via `curl_easy_setopt(...CURLOPT_PRIVATE...)`.
+// the handle via `curl_easy_setopt(...CURLOPT_PRIVATE...)`. This library does
+// not modify a handle's private data pointer.
 //
 // If `ngx_curl_add_handle` returns zero, indicating success, then the request
 // is registered with libcurl to be fulfilled using nginx's event loop.
@@ -22,18 +23,33 @@
 // If `ngx_curl_add_handle` returns a nonzero value, then an error occurred
 // before the request could begin.
 //
+// Requests do not begin immediately. Handles added during one iteration of
+// nginx's event loop are started together by a posted event, after the
+// currently running event handler returns. `ngx_curl_add_handles` adds an
+// array of handles that share the same callbacks. Either all of the handles
+// are added and it returns zero, or none of them are and it returns nonzero.
+//
 // The caller of `ngx_curl_add_handle` is responsible for freeing the `CURL*`
 // handle. It is natural to do this in the `on_done` and `on_error` callbacks.
 //
+// Instead of `curl_easy_init` and `curl_easy_cleanup`, callers may use
+// `ngx_curl_acquire_handle` and `ngx_curl_release_handle`. A released handle
+// is reset with `curl_easy_reset` and kept by the `ngx_curl_t*` for reuse,
+// which preserves libcurl's per-handle buffers and caches between requests.
+// At most `ngx_curl_options_t::handle_pool_size` handles are kept; beyond
+// that, released handles are cleaned up. A handle must not be released while
+// it is added to the `ngx_curl_t*`.
+//
 // A `CURL*` handle is removed from the `ngx_curl_t*` when the request is
 // complete, or when an error occurs. To remove a handle before then, use the
 // `ngx_curl_remove_handle` function.
 //
 // Before calling `ngx_destroy_curl` to free a `ngx_curl_t*`, the caller must
-// ensure that no `CURL*` handles remain registered. Outstanding handles can
-// be removed by the `ngx_curl_remove_handle` function. There is no way to
-// enumerate the outstanding handles, so calling code might need to keep track
-// of the `CURL*` handles added.
+// ensure that no `CURL*` handles remain registered, except those passed to
+// `ngx_curl_submit` (see below). Outstanding handles can be removed by the
+// `ngx_curl_remove_handle` function. There is no way to enumerate the
+// outstanding handles, so calling code might need to keep track of the
+// `CURL*` handles added.
 //
 // `ngx_create_curl_with_options` allows the specification of a memory
 // allocator to be used by this library and by libcurl. The allocator will be
@@ -42,13 +58,300 @@
 // library will use the allocator regardless. The default allocator uses the
 // C standard library functions (e.g. `malloc`).
 //
+// If `ngx_curl_options_t::share_worker_caches` is nonzero, then the
+// `ngx_curl_t*` uses a libcurl share handle (`CURLSH*`) that is common to all
+// such `ngx_curl_t*` in the process (i.e. in the nginx worker). The share
+// covers the DNS cache, the connection cache, the SSL session cache, and the
+// public suffix list, so that separate users of this library in the same
+// worker reuse each other's connections. Handles added by
+// `ngx_curl_add_handle` are attached to the share via `CURLOPT_SHARE`, and
+// remain attached after the request completes (even across
+// `ngx_curl_release_handle`). Such handles must be cleaned up before the last
+// sharing `ngx_curl_t*` is destroyed.
+//
+// TLS sessions can also be shared between nginx workers. During configuration
+// parsing, `ngx_curl_add_ssl_session_cache` adds a shared memory zone of the
+// specified name and size, and returns it. A `ngx_curl_t*` created with that
+// zone as `ngx_curl_options_t::ssl_session_cache` stores the TLS sessions that
+// it negotiates in the zone, and resumes sessions found there, including
+// sessions negotiated by other workers or before a reload. Only sessions
+// with verified peers are shared, and sessions are resumed only by
+// connections that verify their peer. Sessions are keyed by server name,
+// port, and a digest of the connection's TLS settings that bear on trust and
+// identity: the certificates and CRLs it trusts, its client certificate, and
+// its verification settings, protocol versions, options, and ciphers. So a
+// session is resumed only by a connection that would have accepted the same
+// peer and presented the same client certificate. Connections whose trusted
+// certificates aren't loaded up front (e.g. only `CURLOPT_CAPATH`) don't
+// share sessions. libcurl itself checks the host name and any
+// `CURLOPT_PINNEDPUBLICKEY` against the peer's certificate after every
+// handshake, resumed or not. This requires nginx and libcurl to use the same
+// OpenSSL, and it replaces any `CURLOPT_SSL_CTX_FUNCTION` set on handles
+// added to the `ngx_curl_t*`.
+//
+// If `ngx_curl_options_t::resolver` is set, then host names are resolved by
+// that nginx resolver, asynchronously and using its cache, rather than by
+// libcurl's resolver. The first time a transfer needs a host's address, its
+// resolution by libcurl is aborted, the host is resolved by nginx, and the
+// transfer is restarted with the answer installed via `CURLOPT_RESOLVE`. The
+// answer then stays in libcurl's DNS cache for `CURLOPT_DNS_CACHE_TIMEOUT`, so
+// that other transfers to that host proceed directly. This uses
+// `CURLOPT_RESOLVER_START_FUNCTION`, and requires libcurl 7.75.0 or later.
+//
+// `ngx_curl_options_t` also exposes libcurl's connection limits. If
+// `ngx_curl_options_t::multiplex` is nonzero, concurrent requests to the same
+// origin are multiplexed over shared HTTP/2 connections (`CURLPIPE_MULTIPLEX`),
+// and each added handle waits for such a connection rather than opening its
+// own (`CURLOPT_PIPEWAIT`). Combined with `max_host_connections` and
+// `max_concurrent_streams`, this bounds the number of sockets used per origin.
+// The ratio of `ngx_curl_stats_t::transfers_running` to
+// `ngx_curl_stats_t::sockets_open` is the current number of streams per
+// connection.
+//
+// Each transfer needs an nginx connection for its socket, and nginx has a
+// fixed number of them (`worker_connections`). A transfer that can't get one
+// would break every other transfer in the `ngx_curl_t*`, so handles added
+// while nginx has no free connections to spare, or while
+// `ngx_curl_options_t::max_running_handles` transfers are already running,
+// wait in a queue instead. A connection is reserved for each admitted
+// transfer until libcurl registers its socket, and
+// `ngx_curl_options_t::connection_headroom` more are left free. Queued
+// handles start, in the order they were added, as running transfers
+// complete. A handle that waits longer than
+// `ngx_curl_options_t::queue_timeout` fails with `NGX_CURLE_QUEUE_TIMEOUT`.
+//
+// `ngx_curl_add_handle_with_data` is like `ngx_curl_add_handle`, except that
+// a single `on_complete` callback receives the result (`CURLE_OK` on success)
+// along with an arbitrary `data` pointer, leaving `CURLOPT_PRIVATE` free for
+// other uses.
+//
+// `ngx_curl_add_handle_to_chain` is like `ngx_curl_add_handle`, except that
+// the response body is collected into `ngx_buf_t` buffers allocated from the
+// specified `ngx_pool_t`, and handed to `on_done` as an `ngx_chain_t*` (NULL
+// if the body is empty). If the response has a `Content-Length`, then the
+// body is received into a single buffer of that size, or if no maximum size
+// is specified, at most 1 MiB; otherwise, or beyond that, into buffers of
+// 16 KiB or more. No buffer has `last_buf` set. A body larger than the
+// specified maximum size (unless zero) fails with `CURLE_WRITE_ERROR`. This
+// replaces the handle's `CURLOPT_WRITEFUNCTION` and `CURLOPT_WRITEDATA`
+// (unless it fails), and the pool must outlive the transfer.
+//
+// `ngx_curl_upload_chain` makes a handle send a request body taken from an
+// `ngx_chain_t`, e.g. the `bufs` of an nginx request's `request_body`, without
+// first copying it into one contiguous buffer. libcurl's read callback copies
+// in-memory buffers directly, and reads file buffers (e.g. a client body
+// that nginx spilled to a temporary file) directly into libcurl's own upload
+// buffer, a part at a time. If `ngx_curl_upload_options_t::thread_pool` is
+// set, file buffers are instead read by that thread pool, and the transfer
+// pauses (`CURL_READFUNC_PAUSE`) until each read completes. This sets
+// `CURLOPT_READFUNCTION`, `CURLOPT_SEEKFUNCTION` (so that libcurl can resend
+// the body, e.g. after a redirect), and both `CURLOPT_POSTFIELDSIZE_LARGE`
+// and `CURLOPT_INFILESIZE_LARGE`, along with their data. The caller still
+// chooses the method, e.g. `CURLOPT_POST` or `CURLOPT_UPLOAD`. The chain and
+// its files must remain valid until the transfer completes, and the
+// specified pool, which owns the chain, must outlive the transfer. A handle
+// may be removed (or fail) while the thread pool is reading its body; the
+// read then doesn't resume it, and if it's added again, it waits for that
+// read, so the files must remain open until the read completes.
+//
+// An `ngx_curl_group_t*` fans out to several handles and calls back once.
+// `ngx_curl_create_group` creates an empty group, `ngx_curl_group_add` adds
+// handles to it, and `ngx_curl_group_start` adds them all to the
+// `ngx_curl_t*`, to be started together by a single kick. The group then
+// calls `on_group_done` once, when it's resolved: when every member has
+// finished or, if `ngx_curl_group_options_t::quorum` is K, as soon as K
+// members have succeeded (`CURLE_OK`), or as soon as too many have failed
+// for K to succeed. A quorum of one waits for the first success. Members
+// still running when the group is resolved are removed, and their result is
+// `NGX_CURLE_GROUP_CANCELLED`. Within `on_group_done`, `ngx_curl_group_size`,
+// `ngx_curl_group_handle`, `ngx_curl_group_result`, and
+// `ngx_curl_group_successes` describe the members, in the order they were
+// added. The group is freed after `on_group_done` returns, but its handles
+// are not; they remain the caller's, and are no longer registered. To
+// abandon a group before it's resolved (or one that failed to start), call
+// `ngx_curl_group_cancel`, which removes its members and frees it without
+// calling `on_group_done`. Members must not be removed individually.
+//
+// Every other function in this library must be called on the nginx worker's
+// event loop thread, but `ngx_curl_submit` may be called from any thread,
+// e.g. from an `ngx_thread_pool_t` task, if the `ngx_curl_t*` was created with
+// `ngx_curl_options_t::accept_submissions`. The handle is pushed onto a
+// lock-free queue, and the event loop is woken to add every handle queued
+// since it last looked, in the order they were submitted, as if by
+// `ngx_curl_add_handle_with_data`. The wakeup uses an eventfd (or a pipe) of
+// its own rather than `ngx_notify`, which has room for only one handler per
+// worker and is used by nginx's thread pools. `on_complete` is called on the
+// event loop, or, using `ngx_curl_submit_to_thread_pool`, by a task of the
+// specified thread pool. Once submitted, a handle belongs to the
+// `ngx_curl_t*` until `on_complete` is called, and must not be passed to
+// `ngx_curl_remove_handle`. Submitted handles that haven't completed when the
+// `ngx_curl_t*` is destroyed, whether still queued or already running, are
+// removed by `ngx_destroy_curl`, and complete with `CURLE_ABORTED_BY_CALLBACK`
+// on the event loop, before it returns. Every call to `ngx_curl_submit` must
+// have returned before `ngx_destroy_curl` is called, and none may be made
+// after, since the `ngx_curl_t*` is then freed: stop the submitting threads
+// (e.g. wait for the thread pool tasks that submit) first. Submission uses
+// the `ngx_curl_t*`'s allocator from the submitting thread, so the allocator
+// must be thread-safe (the default allocator is).
+//
+// `ngx_curl_fetch` is an alternative to `ngx_curl_add_handle` that buffers
+// the response and delivers it to `on_response` as an `ngx_curl_response_t`.
+// The transfer is performed by a duplicate of the handle
+// (`curl_easy_duphandle`) that belongs to this library, so the handle's own
+// `CURLOPT_WRITEFUNCTION` and `CURLOPT_HEADERFUNCTION` are not called, and
+// `CURLINFO_*` must be read from `ngx_curl_response_t::transfer` rather than
+// from the handle. The response is valid only until `on_response` returns. If
+// `ngx_curl_fetch_options_t::key` is not empty, then the fetch is coalesced
+// with any fetch having the same key that is already in flight: rather than
+// starting another transfer, the handle waits for that one, and every waiter
+// receives the same response. The key must therefore identify everything
+// that affects the response, e.g. the method, the URL, and any request
+// headers that the origin varies on. Only idempotent requests (e.g. `GET`)
+// should have a key. Removing a waiting handle with `ngx_curl_remove_handle`
+// detaches it, and the shared transfer is cancelled when no waiters remain.
+//
+// Fetched responses can also be cached across nginx workers. During
+// configuration parsing, `ngx_curl_add_response_cache` adds a shared memory
+// zone of the specified name and size, and returns it. A `ngx_curl_t*` created
+// with that zone as `ngx_curl_options_t::response_cache` stores cacheable
+// responses to fetches that have a key, as directed by their `Cache-Control`,
+// `Expires`, `ETag`, and `Last-Modified` headers. The cache is shared, so
+// `private` and `no-store` responses are not stored, nor are responses that set
+// a cookie, nor responses to requests whose `headers` (see below) include
+// `Authorization`, unless the response allows it with `public`, `s-maxage`, or
+// `must-revalidate`. A later fetch with the same key is served from the cache
+// while the response is fresh, without touching the network: `on_response` is
+// called from a posted event, with `ngx_curl_response_t::transfer` NULL. Once
+// stale, the response is revalidated with a conditional request
+// (`If-None-Match`, `If-Modified-Since`), and it is delivered again if the
+// origin responds "304 Not Modified". For this, request headers must be
+// specified by `ngx_curl_fetch_options_t::headers` rather than by
+// `CURLOPT_HTTPHEADER`. Least recently used responses are evicted when the zone
+// is full.
+//
+// Fetches can also be hedged, to cut tail latency. If
+// `ngx_curl_fetch_options_t::hedge_delay` is set, and the transfer has not
+// completed that many milliseconds after it started, a second copy of it is
+// started (optionally requesting `hedge_url` instead). With `hedge_after_p95`,
+// the delay is instead the 95th percentile of recent transfer times to the same
+// origin (scheme, host, and port), once enough are known. Transfer times are
+// sampled from the first such fetch on. Whichever copy succeeds first is
+// delivered, and the other is removed; if one fails, the other's result is
+// delivered instead. Either way, waiters are called back once. Hedges are
+// limited to `ngx_curl_options_t::hedge_budget_percent` of the fetches that
+// could hedge, with a small allowance for bursts, and a transfer still waiting
+// in the queue is never hedged. Since the hedge may be sent as well as the
+// original, only idempotent requests should hedge.
+//
+// Failed transfers can be retried. After adding a handle (by any of the
+// functions above, before returning to the event loop), `ngx_curl_retry`
+// attaches an `ngx_curl_retry_policy_t` to it; for `ngx_curl_fetch`, use
+// `ngx_curl_fetch_options_t::retry` instead. When an attempt fails with a
+// retryable `CURLcode`, or completes with a retryable HTTP status, and the
+// policy allows more attempts, the handle is tried again after a randomized,
+// exponentially growing backoff, on an nginx timer. Only the final attempt's
+// result reaches `on_done`, `on_error`, or `on_complete`. Responses collected
+// by `ngx_curl_add_handle_to_chain` or `ngx_curl_fetch` are discarded between
+// attempts; otherwise, the policy's `on_retry` must discard whatever the
+// handle's callbacks received, and rewind its request body (if it has one,
+// e.g. by calling `ngx_curl_upload_chain` again). If the policy has a
+// `deadline`, it bounds all attempts together: each attempt's
+// `CURLOPT_TIMEOUT_MS` is set to the time remaining (or `attempt_timeout`,
+// if less), and no attempt is made that couldn't start before the deadline.
+// Retries are limited to `ngx_curl_options_t::retry_budget_percent` of the
+// handles that could retry, so that retries don't multiply the load on an
+// origin that is failing. While backing off, a handle doesn't count against
+// `ngx_curl_options_t::max_running_handles`. The policy must remain valid
+// while the handle is registered.
+//
+// If `ngx_curl_options_t::circuit_breaker` is nonzero, then each origin
+// (scheme, host, and port) has a circuit breaker. Results that implicate the
+// origin count against it: failures to resolve, connect, or complete a TLS
+// handshake, timeouts, broken connections, and the HTTP statuses 502, 503,
+// and 504. When, among its last 32 such results (and at least
+// `breaker_min_requests` of them), the proportion of failures reaches
+// `breaker_error_percent`, the breaker opens. While it's open, handles for
+// the origin fail promptly with `NGX_CURLE_CIRCUIT_OPEN`, from a posted
+// event and without using a socket. After `breaker_open_time`, the breaker
+// lets one handle through as a probe: if it succeeds, the breaker closes,
+// and if it fails, the breaker opens again.
+//
+// Handles waiting in the queue are admitted by priority class. After adding
+// a handle, `ngx_curl_set_priority` puts it in one of
+// `NGX_CURL_PRIORITY_CLASSES` classes, of which class 0 (the default) is the
+// most urgent; for `ngx_curl_fetch`, use `ngx_curl_fetch_options_t::priority`.
+// Whenever there's room for another transfer, the scheduler admits the
+// oldest handle of some class, choosing classes so that, while several have
+// handles waiting, each is admitted in proportion to its weight in
+// `ngx_curl_options_t::priority_weights`. The default weights (64, 16, 4, and
+// 1) come close to strict priority, but no class starves.
+// `ngx_curl_stats_t::classes` reports each class's queue depth and how long
+// its handles waited.
+//
+// Counters can also be kept for all nginx workers together, cheaply enough
+// to leave on in production. During configuration parsing,
+// `ngx_curl_add_metrics_zone` adds a small shared memory zone of the
+// specified name, and returns it. Every `ngx_curl_t*` created with that zone
+// as `ngx_curl_options_t::metrics_zone` updates the `ngx_curl_metrics_t` in
+// it with atomic additions, and no lock. `ngx_curl_metrics` returns the
+// counters, e.g. for `ngx_curl_metrics_handler` (see `ngx_curl_http.h`) to
+// report. They survive reloads. The gauges (`transfers_running`,
+// `handles_queued`, and `sockets_open`) are decremented by
+// `ngx_destroy_curl`, but not if a worker dies without calling it.
+//
+// To see where the time goes, set `ngx_curl_options_t::phase_timing`. Each
+// completed transfer is then split into the phases of `ngx_curl_phase_t`,
+// using libcurl's `CURLINFO_*_TIME_T` timings and ngx_curl's own clock, and
+// each successful one is recorded in histograms kept per origin (scheme,
+// host, and port) and phase. The histograms are log-linear, like
+// HdrHistogram's: memory is fixed, at about 8 KiB per origin, and percentiles
+// are accurate to within an eighth. `ngx_curl_phase_percentile` queries
+// them, and `ngx_curl_log_phase_timings` logs a summary of all of them.
+// Separately, `ngx_curl_options_t::slow_transfer_time` logs a warning with
+// the full breakdown of each transfer (or a sample of them) that took at
+// least that long, including failures. Each attempt of a retried handle is
+// a transfer of its own. Histograms are per `ngx_curl_t*`, not shared by
+// workers.
+//
+// Error codes passed to `on_error` are either `CURLcode` values or one of the
+// `NGX_CURLE_*` codes defined below. `ngx_curl_strerror` describes both.
+//
 // The function `ngx_curl_allocator` retrieves the allocator associated with a
 // specified `ngx_curl_t*`.
+//
+// Bookkeeping for each added handle is taken from a pool owned by the
+// `ngx_curl_t*`, which grows on demand and is reused as requests complete.
+// The function `ngx_curl_stats` retrieves counters describing how the
+// `ngx_curl_t*` has been used, such as how often that pool had to fall back
+// to the allocator.
+
+// Nginx headers must go first.
+#include <ngx_config.h>
+#include <ngx_core.h>
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 #include <curl/curl.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct ngx_curl_s ngx_curl_t;
 
+typedef struct ngx_curl_group_s ngx_curl_group_t;
+
+// The handle waited longer than `ngx_curl_options_t::queue_timeout` to be
+// admitted.
+#define NGX_CURLE_QUEUE_TIMEOUT ((CURLcode)(CURL_LAST + 1))
+
+// The handle's `ngx_curl_group_t` was resolved before the handle finished.
+#define NGX_CURLE_GROUP_CANCELLED ((CURLcode)(CURL_LAST + 2))
+
+// The circuit breaker of the handle's origin is open.
+#define NGX_CURLE_CIRCUIT_OPEN ((CURLcode)(CURL_LAST + 3))
+
 typedef struct ngx_curl_allocator_s {
   void *(*allocate)(size_t size);                      // e.g. malloc
   void *(*callocate)(size_t count, size_t size_each);  // e.g. calloc
@@ -57,10 +360,291 @@ typedef struct ngx_curl_allocator_s {
   char *(*duplicate)(const char *string);              // e.g. strdup
 } ngx_curl_allocator_t;
 
+// The number of priority classes. See `ngx_curl_set_priority`.
+#define NGX_CURL_PRIORITY_CLASSES 4
+
+typedef struct ngx_curl_class_stats_s {
+  // Number of handles of the class waiting in the queue.
+  size_t queue_depth;
+  // Number of handles of the class admitted from the queue, and the total
+  // and the longest time that they waited there, in milliseconds.
+  size_t admitted_from_queue;
+  ngx_msec_t total_queue_wait;
+  ngx_msec_t max_queue_wait;
+} ngx_curl_class_stats_t;
+
+typedef struct ngx_curl_stats_s {
+  // Number of times a handle context was reused from the pool.
+  size_t context_pool_hits;
+  // Number of times the pool was empty, so that another slab of handle
+  // contexts was obtained from the allocator.
+  size_t context_pool_misses;
+  // Number of times a socket or event was added to or removed from nginx's
+  // event module. With epoll, each is an `epoll_ctl` system call.
+  size_t event_registrations;
+  // Number of times `ngx_curl_acquire_handle` returned an idle handle.
+  size_t handle_pool_hits;
+  // Number of times `ngx_curl_acquire_handle` had to create a new handle.
+  size_t handle_pool_misses;
+  // Number of host names looked up using `ngx_curl_options_t::resolver`.
+  size_t nginx_resolutions;
+  // Number of handles that had to wait in the queue to be admitted.
+  size_t handles_queued;
+  // Number of handles that failed with `NGX_CURLE_QUEUE_TIMEOUT`.
+  size_t queue_timeouts;
+  // Number of sockets that libcurl currently has registered with nginx.
+  size_t sockets_open;
+  // Number of admitted transfers (i.e. not including queued handles).
+  size_t transfers_running;
+  // Number of admitted transfers that haven't registered a socket yet, and so
+  // have an nginx connection reserved for them.
+  size_t connections_reserved;
+  // Number of connections opened by completed transfers.
+  size_t connections_opened;
+  // Number of completed transfers that reused an existing connection.
+  size_t connections_reused;
+  // Number of `ngx_curl_fetch` calls that joined a transfer already in flight
+  // rather than starting their own.
+  size_t fetches_coalesced;
+  // Number of fetches served from `ngx_curl_options_t::response_cache`
+  // without a request.
+  size_t response_cache_hits;
+  // Number of fetches served from `ngx_curl_options_t::response_cache` after
+  // the origin confirmed that a stale response was still valid.
+  size_t response_cache_revalidations;
+  // Number of handles added by `ngx_curl_submit`.
+  size_t handles_submitted;
+  // Number of times the event loop was woken to add submitted handles.
+  size_t submission_batches;
+  // Number of group members removed because their group was resolved.
+  size_t group_members_cancelled;
+  // Number of hedges started by fetches, and how many of them were
+  // delivered instead of the original.
+  size_t hedges_started;
+  size_t hedges_won;
+  // Number of hedges not started for lack of budget.
+  size_t hedges_denied;
+  // Number of attempts retried under a retry policy.
+  size_t retries;
+  // Number of retryable failures not retried for lack of budget.
+  size_t retries_denied;
+  // Number of times an origin's circuit breaker opened.
+  size_t circuits_opened;
+  // Number of handles that failed with `NGX_CURLE_CIRCUIT_OPEN`.
+  size_t circuit_rejections;
+  // Queueing by priority class.
+  ngx_curl_class_stats_t classes[NGX_CURL_PRIORITY_CLASSES];
+} ngx_curl_stats_t;
+
+// The number of results counted by `ngx_curl_metrics_t::results`: every
+// `CURLcode`, followed by the `NGX_CURLE_*` codes.
+#define NGX_CURL_RESULT_COUNT (CURL_LAST + 4)
+
+typedef struct ngx_curl_metrics_s {
+  // Number of handles registered with ngx_curl, including those that waited
+  // for a fetch in flight.
+  ngx_atomic_t handles_added;
+  // Number of handles waiting in the queue to be admitted.
+  ngx_atomic_t handles_queued;
+  // Number of admitted transfers.
+  ngx_atomic_t transfers_running;
+  // Number of sockets that libcurl currently has registered with nginx.
+  ngx_atomic_t sockets_open;
+  // Number of socket events and timeouts passed to libcurl.
+  ngx_atomic_t socket_events;
+  ngx_atomic_t timeouts;
+  // Number of connections opened by completed transfers, and number of
+  // completed transfers that reused an existing connection.
+  ngx_atomic_t connections_opened;
+  ngx_atomic_t connections_reused;
+  // Number of handles completed with each result, indexed by result.
+  ngx_atomic_t results[NGX_CURL_RESULT_COUNT];
+} ngx_curl_metrics_t;
+
+// The phases of a transfer. Their durations are in microseconds.
+typedef enum ngx_curl_phase_e {
+  // Waiting in ngx_curl's queue to be admitted.
+  NGX_CURL_PHASE_QUEUE,
+  // Resolving the host name.
+  NGX_CURL_PHASE_DNS,
+  // Connecting, after the host name was resolved.
+  NGX_CURL_PHASE_CONNECT,
+  // The TLS handshake, if any.
+  NGX_CURL_PHASE_TLS,
+  // Sending the request and waiting for the first byte of the response.
+  NGX_CURL_PHASE_FIRST_BYTE,
+  // Receiving the rest of the response.
+  NGX_CURL_PHASE_BODY,
+  // The whole transfer, as libcurl measures it: from the start of
+  // `NGX_CURL_PHASE_DNS` to the end of `NGX_CURL_PHASE_BODY`, including any
+  // redirects followed.
+  NGX_CURL_PHASE_TOTAL,
+  // Running the `on_done` or `on_error` callback (or whatever completes the
+  // handle, e.g. delivering a fetched response to its waiters).
+  NGX_CURL_PHASE_CALLBACK,
+  NGX_CURL_PHASE_COUNT
+} ngx_curl_phase_t;
+
 typedef struct ngx_curl_options_s {
   const ngx_curl_allocator_t *allocator;
+  // If nonzero, register each libcurl socket with nginx's event loop once, as
+  // an edge-triggered connection, rather than adding and deleting events
+  // whenever libcurl changes the direction it's waiting on. This is ignored
+  // if the event module does not support edge-triggered connections.
+  int edge_triggered;
+  // The maximum number of idle handles kept by `ngx_curl_release_handle`, or
+  // zero for the default.
+  size_t handle_pool_size;
+  // If nonzero, share DNS, connection, and SSL session caches with every
+  // other `ngx_curl_t` in this process that also sets this option.
+  int share_worker_caches;
+  // A zone returned by `ngx_curl_add_ssl_session_cache`, or NULL.
+  ngx_shm_zone_t *ssl_session_cache;
+  // A zone returned by `ngx_curl_add_response_cache`, or NULL.
+  ngx_shm_zone_t *response_cache;
+  // A zone returned by `ngx_curl_add_metrics_zone`, or NULL.
+  ngx_shm_zone_t *metrics_zone;
+  // If not NULL, resolve host names using this resolver, e.g. the `resolver`
+  // of the `ngx_http_core_loc_conf_t` of the module using this library.
+  ngx_resolver_t *resolver;
+  // How long to wait for `resolver`, or zero for the default (30 seconds).
+  ngx_msec_t resolver_timeout;
+  // The maximum number of transfers running at once, or zero for no limit.
+  // Handles beyond that wait in a queue.
+  size_t max_running_handles;
+  // The maximum number of milliseconds that a handle may wait in the queue,
+  // or zero for no limit.
+  ngx_msec_t queue_timeout;
+  // The number of free nginx connections to leave when admitting handles,
+  // besides the one reserved for each admitted transfer that hasn't opened
+  // its socket yet. Some transfers open more than one socket, e.g. to try
+  // both IPv6 and IPv4, or to a proxy.
+  size_t connection_headroom;
+  // The weight of each priority class when admitting queued handles, or zero
+  // for the default.
+  unsigned priority_weights[NGX_CURL_PRIORITY_CLASSES];
+  // If nonzero, multiplex requests over HTTP/2 connections where possible.
+  int multiplex;
+  // The following correspond to `CURLMOPT_MAX_HOST_CONNECTIONS`,
+  // `CURLMOPT_MAX_TOTAL_CONNECTIONS`, `CURLMOPT_MAXCONNECTS`, and
+  // `CURLMOPT_MAX_CONCURRENT_STREAMS`. Zero means libcurl's default.
+  long max_host_connections;
+  long max_total_connections;
+  long max_connects;
+  long max_concurrent_streams;
+  // The maximum number of hedges, as a percentage of fetches that could
+  // hedge, or zero for the default (5).
+  size_t hedge_budget_percent;
+  // The maximum number of retries, as a percentage of handles with a retry
+  // policy, or zero for the default (10).
+  size_t retry_budget_percent;
+  // If nonzero, give each origin a circuit breaker.
+  int circuit_breaker;
+  // The percentage of failures that opens a breaker, or zero for the
+  // default (50).
+  size_t breaker_error_percent;
+  // The number of results needed before a breaker can open, or zero for the
+  // default (10). At most 32.
+  size_t breaker_min_requests;
+  // How long a breaker stays open before probing, in milliseconds, or zero
+  // for the default (5 seconds).
+  ngx_msec_t breaker_open_time;
+  // If nonzero, keep a histogram of each phase of successful transfers for
+  // each origin.
+  int phase_timing;
+  // If nonzero, log transfers that take at least this many milliseconds,
+  // from being admitted (or queued) to their callback returning.
+  ngx_msec_t slow_transfer_time;
+  // The percentage of such transfers logged, or zero for all of them.
+  size_t slow_transfer_log_percent;
+  // If nonzero, allow `ngx_curl_submit` to be called from other threads.
+  // This uses one nginx connection.
+  int accept_submissions;
 } ngx_curl_options_t;
 
+// A response buffered by `ngx_curl_fetch`.
+typedef struct ngx_curl_response_s {
+  // The HTTP status code, e.g. 200.
+  long status;
+  // The response's header block, including the status line, exactly as
+  // received. Only the final header block is included, e.g. not that of a
+  // "100 Continue" or of a followed redirect.
+  const char *headers;
+  size_t headers_length;
+  const char *body;
+  size_t body_length;
+  // The handle that performed the transfer, for use with `curl_easy_getinfo`,
+  // or NULL if the response came from the response cache. It must not be
+  // modified.
+  CURL *transfer;
+} ngx_curl_response_t;
+
+typedef struct ngx_curl_upload_options_s {
+#if (NGX_THREADS)
+  // If not NULL, read file buffers using this thread pool, rather than
+  // blocking the event loop.
+  ngx_thread_pool_t *thread_pool;
+#endif
+  // How much of a file to read at a time using `thread_pool`, or zero for the
+  // default (64 KiB).
+  size_t read_size;
+} ngx_curl_upload_options_t;
+
+typedef struct ngx_curl_retry_policy_s {
+  // The maximum number of attempts, including the first.
+  unsigned max_attempts;
+  // The `CURLcode` values that warrant another attempt, terminated by
+  // `CURLE_OK`, or NULL for the default: `CURLE_COULDNT_CONNECT`,
+  // `CURLE_OPERATION_TIMEDOUT`, `CURLE_GOT_NOTHING`, `CURLE_SEND_ERROR`,
+  // `CURLE_RECV_ERROR`, `CURLE_HTTP2`, and `CURLE_HTTP2_STREAM`.
+  const CURLcode *retryable_codes;
+  // The HTTP status codes that warrant another attempt (e.g. 502, 503, and
+  // 504), terminated by zero, or NULL for none.
+  const long *retryable_statuses;
+  // The limit of the random delay before the first retry, in milliseconds,
+  // or zero for the default (100). The limit doubles for each further retry,
+  // up to `max_backoff`, or zero for the default (10 seconds).
+  ngx_msec_t backoff;
+  ngx_msec_t max_backoff;
+  // If nonzero, the milliseconds allowed for all attempts, counting from
+  // when the policy is attached.
+  ngx_msec_t deadline;
+  // If nonzero, the milliseconds allowed for each attempt.
+  ngx_msec_t attempt_timeout;
+  // If not NULL, called before each retry. It must not remove the handle.
+  void (*on_retry)(CURL *handle);
+} ngx_curl_retry_policy_t;
+
+typedef struct ngx_curl_fetch_options_s {
+  // If not empty, coalesce with in-flight fetches having the same key, and
+  // use the response cache, if any.
+  ngx_str_t key;
+  // If not NULL, the request headers, used instead of the handle's
+  // `CURLOPT_HTTPHEADER`. The list must remain valid until the fetch
+  // completes.
+  struct curl_slist *headers;
+  // If nonzero, start a second copy of the transfer if it hasn't completed
+  // after this many milliseconds.
+  ngx_msec_t hedge_delay;
+  // If nonzero, hedge after the 95th percentile of recent transfer times to
+  // the origin instead, if known (and otherwise after `hedge_delay`, if set).
+  int hedge_after_p95;
+  // If not NULL, the second copy requests this URL, e.g. on another host.
+  const char *hedge_url;
+  // If not NULL, retry the transfer according to this policy, which must
+  // remain valid until the fetch completes.
+  const ngx_curl_retry_policy_t *retry;
+  // The transfer's priority class. A coalesced fetch shares the transfer,
+  // and with it the priority of the fetch that started it.
+  unsigned priority;
+} ngx_curl_fetch_options_t;
+
+typedef struct ngx_curl_group_options_s {
+  // The number of members that must succeed to resolve the group early, or
+  // zero to wait for every member. It may not exceed the number of members.
+  size_t quorum;
+} ngx_curl_group_options_t;
+
 ngx_curl_t *ngx_create_curl(void);
 
 ngx_curl_t *ngx_create_curl_with_options(const ngx_curl_options_t *);
@@ -71,6 +655,104 @@ int ngx_curl_add_handle(ngx_curl_t *curl, CURL *handle,
                         void (*on_error)(CURL *, CURLcode),
                         void (*on_done)(CURL *));
 
+int ngx_curl_add_handle_with_data(ngx_curl_t *curl, CURL *handle,
+                                  void (*on_complete)(CURL *, CURLcode,
+                                                      void *data),
+                                  void *data);
+
+int ngx_curl_add_handle_to_chain(ngx_curl_t *curl, CURL *handle,
+                                 ngx_pool_t *pool, size_t max_size,
+                                 void (*on_error)(CURL *, CURLcode),
+                                 void (*on_done)(CURL *, ngx_chain_t *));
+
+// `options` may be NULL.
+int ngx_curl_upload_chain(ngx_curl_t *curl, CURL *handle, ngx_pool_t *pool,
+                          ngx_chain_t *body,
+                          const ngx_curl_upload_options_t *options);
+
+int ngx_curl_add_handles(ngx_curl_t *curl, CURL *const *handles, size_t count,
+                         void (*on_error)(CURL *, CURLcode),
+                         void (*on_done)(CURL *));
+
 int ngx_curl_remove_handle(ngx_curl_t *curl, CURL *handle);
 
+int ngx_curl_retry(ngx_curl_t *curl, CURL *handle,
+                   const ngx_curl_retry_policy_t *policy);
+
+int ngx_curl_set_priority(ngx_curl_t *curl, CURL *handle, unsigned priority);
+
+// `options` may be NULL.
+ngx_curl_group_t *
+ngx_curl_create_group(ngx_curl_t *curl, const ngx_curl_group_options_t *options,
+                      void (*on_group_done)(ngx_curl_group_t *, void *data),
+                      void *data);
+
+int ngx_curl_group_add(ngx_curl_group_t *group, CURL *handle);
+
+int ngx_curl_group_start(ngx_curl_group_t *group);
+
+void ngx_curl_group_cancel(ngx_curl_group_t *group);
+
+size_t ngx_curl_group_size(const ngx_curl_group_t *group);
+
+CURL *ngx_curl_group_handle(const ngx_curl_group_t *group, size_t index);
+
+CURLcode ngx_curl_group_result(const ngx_curl_group_t *group, size_t index);
+
+size_t ngx_curl_group_successes(const ngx_curl_group_t *group);
+
+// May be called from any thread.
+int ngx_curl_submit(ngx_curl_t *curl, CURL *handle,
+                    void (*on_complete)(CURL *, CURLcode, void *data),
+                    void *data);
+
+#if (NGX_THREADS)
+// May be called from any thread. `on_complete` is called by a task of
+// `thread_pool`.
+int ngx_curl_submit_to_thread_pool(ngx_curl_t *curl, CURL *handle,
+                                   ngx_thread_pool_t *thread_pool,
+                                   void (*on_complete)(CURL *, CURLcode,
+                                                       void *data),
+                                   void *data);
+#endif
+
+// `options` may be NULL.
+int ngx_curl_fetch(ngx_curl_t *curl, CURL *handle,
+                   const ngx_curl_fetch_options_t *options,
+                   void (*on_error)(CURL *, CURLcode),
+                   void (*on_response)(CURL *, const ngx_curl_response_t *));
+
+ngx_shm_zone_t *ngx_curl_add_ssl_session_cache(ngx_conf_t *cf, ngx_str_t *name,
+                                               size_t size);
+
+ngx_shm_zone_t *ngx_curl_add_response_cache(ngx_conf_t *cf, ngx_str_t *name,
+                                            size_t size);
+
+ngx_shm_zone_t *ngx_curl_add_metrics_zone(ngx_conf_t *cf, ngx_str_t *name);
+
+// `zone` must have been returned by `ngx_curl_add_metrics_zone`.
+const ngx_curl_metrics_t *ngx_curl_metrics(const ngx_shm_zone_t *zone);
+
+CURL *ngx_curl_acquire_handle(ngx_curl_t *curl);
+
+void ngx_curl_release_handle(ngx_curl_t *curl, CURL *handle);
+
 const ngx_curl_allocator_t *ngx_curl_allocator(const ngx_curl_t *);
+
+void ngx_curl_stats(const ngx_curl_t *, ngx_curl_stats_t *);
+
+// Returns the `percentile` (from 0 to 100) of the durations of `phase` of
+// successful transfers to `origin` (e.g. "https://example.com:443"), in
+// microseconds, or -1 if there are none.
+curl_off_t ngx_curl_phase_percentile(ngx_curl_t *curl, const ngx_str_t *origin,
+                                     ngx_curl_phase_t phase,
+                                     double percentile);
+
+// Logs the count, several percentiles, and the maximum of each histogram.
+void ngx_curl_log_phase_timings(ngx_curl_t *curl, ngx_uint_t level);
+
+const char *ngx_curl_strerror(CURLcode code);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,450 @@
+#pragma once
+
+// This header adapts `ngx_curl.h` to C++20 coroutines, so that an outbound
+// flow of several steps can be written as one function instead of a chain of
+// callbacks whose state is carried in `CURLOPT_PRIVATE`.
+//
+// `co_await ngx_curl::fetch(curl, handle)` adds `handle` to `curl`, as
+// `ngx_curl_add_handle_with_data` does, and evaluates to the transfer's
+// result (`CURLE_OK` on success) once it's complete. The awaited object
+// lives in the coroutine's frame and is the callback's `data`, so awaiting
+// allocates nothing beyond ngx_curl's own (pooled) bookkeeping for the
+// handle, and `CURLOPT_PRIVATE` is left alone. If the handle can't be added,
+// the result is `CURLE_FAILED_INIT`, without suspending. Note that
+// `ngx_curl::fetch` performs the handle's transfer as configured; it does not
+// coalesce or buffer responses as `ngx_curl_fetch` does.
+//
+// `ngx_curl::when_all(curl, handles...)` adds several handles at once and
+// evaluates to a `std::array` of their results, once every one of them is
+// complete. `ngx_curl::when_any(curl, handles...)` evaluates to the index of
+// the first handle to succeed, removing the others, whose results would be
+// `NGX_CURLE_GROUP_CANCELLED`; or, if every handle fails, to
+// `std::nullopt`. As with `ngx_curl_add_handles`, either all of the handles
+// are added or none of them are. Their state, too, lives in the coroutine's
+// frame. For a number of handles known only at run time, use an
+// `ngx_curl_group_t*`.
+//
+// Coroutines return an `ngx_curl::task<T>`, which is lazy: it starts when
+// it's awaited by another coroutine, or when `start` is called. A task
+// started by `start` remains suspended after it finishes, until the
+// `ngx_curl::task` is destroyed. `ngx_curl::spawn` instead starts a
+// `task<void>` that frees itself when it finishes.
+//
+// A coroutine's frame is allocated using the allocator of the first
+// `ngx_curl_t*` among the coroutine's parameters (see `ngx_curl_allocator`),
+// or else from the first `ngx_pool_t*` among them (e.g. an nginx request's
+// pool), in which case it's freed along with the pool. A coroutine with
+// neither is allocated using `malloc`. Allocation failure doesn't throw:
+// the coroutine returns an empty `ngx_curl::task`, which tests false and
+// must not be started or awaited. Exceptions that escape a coroutine call
+// `std::terminate`.
+//
+// Coroutines resume on nginx's event loop, from within the callback that
+// completed the awaited transfer, so they're subject to the same rules as
+// any other ngx_curl callback; in particular, they may add and remove
+// handles. Destroying a suspended coroutine (e.g. by destroying the
+// `ngx_curl::task` that started it, from a cleanup handler of the request's
+// pool) removes the handles that it's awaiting, without resuming it.
+
+extern "C" {
+// Nginx headers must go first.
+#include <ngx_config.h>
+#include <ngx_core.h>
+}
+
+#include "ngx_curl.h"
+
+#include <array>
+#include <cassert>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+namespace ngx_curl {
+
+template <typename T = void> class task;
+
+namespace detail {
+
+// Precedes each coroutine frame, and says how to free the block that
+// contains it.
+struct frame_header {
+  // NULL if the block belongs to an `ngx_pool_t`.
+  void (*free)(void *block);
+  void *block;
+};
+
+inline constexpr std::size_t frame_alignment =
+    __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+// Room for the header, and for aligning the frame that follows it.
+inline constexpr std::size_t frame_overhead =
+    sizeof(frame_header) + frame_alignment - 1;
+
+inline void *place_frame(void *block, void (*free)(void *)) noexcept {
+  if (block == nullptr) {
+    return nullptr;
+  }
+
+  std::uintptr_t frame =
+      reinterpret_cast<std::uintptr_t>(block) + sizeof(frame_header);
+  frame = (frame + frame_alignment - 1) & ~(frame_alignment - 1);
+  frame_header *header = reinterpret_cast<frame_header *>(frame) - 1;
+  header->free = free;
+  header->block = block;
+  return reinterpret_cast<void *>(frame);
+}
+
+inline void *allocate_frame(std::size_t size) noexcept {
+  return place_frame(std::malloc(frame_overhead + size),
+                     [](void *block) { std::free(block); });
+}
+
+template <typename First, typename... Rest>
+void *allocate_frame(std::size_t size, First &first, Rest &...rest) noexcept {
+  using parameter = std::remove_cv_t<First>;
+  if constexpr (std::is_same_v<parameter, ngx_curl_t *>) {
+    const ngx_curl_allocator_t *allocator = ngx_curl_allocator(first);
+    return place_frame(allocator->allocate(frame_overhead + size),
+                       allocator->free);
+  } else if constexpr (std::is_same_v<parameter, ngx_pool_t *>) {
+    return place_frame(ngx_palloc(first, frame_overhead + size), nullptr);
+  } else {
+    return allocate_frame(size, rest...);
+  }
+}
+
+inline void free_frame(void *frame) noexcept {
+  const frame_header *header = static_cast<frame_header *>(frame) - 1;
+  if (header->free) {
+    header->free(header->block);
+  }
+}
+
+// Resumes whoever awaited a task that's finished, if anyone did.
+struct final_awaiter {
+  bool await_ready() const noexcept { return false; }
+
+  template <typename Promise>
+  std::coroutine_handle<>
+  await_suspend(std::coroutine_handle<Promise> coroutine) const noexcept {
+    Promise &promise = coroutine.promise();
+    if (promise.continuation) {
+      return promise.continuation;
+    }
+    if (promise.detached) {
+      coroutine.destroy();
+    }
+    return std::noop_coroutine();
+  }
+
+  void await_resume() const noexcept {}
+};
+
+class promise_base {
+public:
+  // The coroutine's parameters are passed here too, to choose an allocator.
+  template <typename... Parameters>
+  static void *operator new(std::size_t size,
+                            Parameters &...parameters) noexcept {
+    return allocate_frame(size, parameters...);
+  }
+
+  static void operator delete(void *frame) noexcept { free_frame(frame); }
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+
+  final_awaiter final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() const noexcept { std::terminate(); }
+
+  std::coroutine_handle<> continuation;
+  // The task was passed to `spawn`, and so frees itself when it finishes.
+  bool detached = false;
+};
+
+template <typename T> class promise final : public promise_base {
+public:
+  task<T> get_return_object() noexcept {
+    return task<T>(std::coroutine_handle<promise>::from_promise(*this));
+  }
+
+  static task<T> get_return_object_on_allocation_failure() noexcept {
+    return task<T>();
+  }
+
+  template <typename U> void return_value(U &&value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T result() {
+    assert(value_);
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template <> class promise<void> final : public promise_base {
+public:
+  task<void> get_return_object() noexcept;
+
+  static task<void> get_return_object_on_allocation_failure() noexcept;
+
+  void return_void() const noexcept {}
+
+  void result() const noexcept {}
+};
+
+// Awaits the handles of `when_all` (`any` is false) or `when_any` (`any` is
+// true).
+template <std::size_t count, bool any> class fan_out {
+public:
+  template <typename... Handles>
+  explicit fan_out(ngx_curl_t *curl, Handles... handles) noexcept
+      : curl_(curl), members_{member{nullptr, handles, CURLE_OK, false}...} {}
+
+  fan_out(const fan_out &) = delete;
+  fan_out &operator=(const fan_out &) = delete;
+
+  ~fan_out() { cancel(); }
+
+  bool await_ready() const noexcept { return count == 0; }
+
+  bool await_suspend(std::coroutine_handle<> waiter) noexcept {
+    waiter_ = waiter;
+    for (member &added : members_) {
+      added.owner = this;
+      if (ngx_curl_add_handle_with_data(curl_, added.handle, &on_complete,
+                                        &added) != 0) {
+        // Either all of the handles are added, or none of them are.
+        cancel();
+        for (member &each : members_) {
+          each.result = CURLE_FAILED_INIT;
+        }
+        return false;
+      }
+      added.pending = true;
+      ++pending_;
+    }
+    return true;
+  }
+
+  auto await_resume() const noexcept {
+    if constexpr (any) {
+      for (std::size_t i = 0; i < count; ++i) {
+        if (members_[i].result == CURLE_OK) {
+          return std::optional<std::size_t>(i);
+        }
+      }
+      return std::optional<std::size_t>();
+    } else {
+      std::array<CURLcode, count> results;
+      for (std::size_t i = 0; i < count; ++i) {
+        results[i] = members_[i].result;
+      }
+      return results;
+    }
+  }
+
+private:
+  struct member {
+    fan_out *owner;
+    CURL *handle;
+    CURLcode result;
+    bool pending;
+  };
+
+  static void on_complete(CURL *, CURLcode result, void *data) noexcept {
+    member *finished = static_cast<member *>(data);
+    fan_out *self = finished->owner;
+    assert(finished->pending);
+    finished->pending = false;
+    finished->result = result;
+    --self->pending_;
+    if (self->pending_ != 0 && !(any && result == CURLE_OK)) {
+      return;
+    }
+
+    self->cancel();
+    self->waiter_.resume();
+  }
+
+  // Removes every member that hasn't finished, and marks it
+  // `NGX_CURLE_GROUP_CANCELLED`.
+  void cancel() noexcept {
+    for (member &each : members_) {
+      if (!each.pending) {
+        continue;
+      }
+      (void)ngx_curl_remove_handle(curl_, each.handle);
+      each.pending = false;
+      each.result = NGX_CURLE_GROUP_CANCELLED;
+    }
+    pending_ = 0;
+  }
+
+  ngx_curl_t *curl_;
+  std::array<member, count> members_;
+  std::size_t pending_ = 0;
+  std::coroutine_handle<> waiter_;
+};
+
+} // namespace detail
+
+template <typename T> class [[nodiscard]] task {
+public:
+  using promise_type = detail::promise<T>;
+
+  task() noexcept = default;
+
+  task(task &&other) noexcept
+      : coroutine_(std::exchange(other.coroutine_, nullptr)) {}
+
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (coroutine_) {
+        coroutine_.destroy();
+      }
+      coroutine_ = std::exchange(other.coroutine_, nullptr);
+    }
+    return *this;
+  }
+
+  ~task() {
+    if (coroutine_) {
+      coroutine_.destroy();
+    }
+  }
+
+  // False if the coroutine's frame couldn't be allocated.
+  explicit operator bool() const noexcept { return bool(coroutine_); }
+
+  // Runs the coroutine until it first suspends.
+  void start() noexcept {
+    assert(coroutine_);
+    coroutine_.resume();
+  }
+
+  bool done() const noexcept {
+    assert(coroutine_);
+    return coroutine_.done();
+  }
+
+  auto operator co_await() const noexcept {
+    struct awaiter {
+      bool await_ready() const noexcept { return coroutine.done(); }
+
+      // Starts the task, which resumes `waiter` when it finishes.
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> waiter) const noexcept {
+        coroutine.promise().continuation = waiter;
+        return coroutine;
+      }
+
+      T await_resume() const { return coroutine.promise().result(); }
+
+      std::coroutine_handle<promise_type> coroutine;
+    };
+    assert(coroutine_);
+    return awaiter{coroutine_};
+  }
+
+private:
+  friend promise_type;
+  friend void spawn(task<void>) noexcept;
+
+  explicit task(std::coroutine_handle<promise_type> coroutine) noexcept
+      : coroutine_(coroutine) {}
+
+  std::coroutine_handle<promise_type> coroutine_;
+};
+
+inline task<void> detail::promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<promise>::from_promise(*this));
+}
+
+inline task<void>
+detail::promise<void>::get_return_object_on_allocation_failure() noexcept {
+  return task<void>();
+}
+
+// Starts `task`, which frees itself when it finishes.
+inline void spawn(task<void> task) noexcept {
+  assert(task);
+  const std::coroutine_handle<detail::promise<void>> coroutine =
+      std::exchange(task.coroutine_, nullptr);
+  coroutine.promise().detached = true;
+  coroutine.resume();
+}
+
+class [[nodiscard]] fetch_awaiter {
+public:
+  fetch_awaiter(ngx_curl_t *curl, CURL *handle) noexcept
+      : curl_(curl), handle_(handle) {}
+
+  fetch_awaiter(const fetch_awaiter &) = delete;
+  fetch_awaiter &operator=(const fetch_awaiter &) = delete;
+
+  ~fetch_awaiter() {
+    if (pending_) {
+      (void)ngx_curl_remove_handle(curl_, handle_);
+    }
+  }
+
+  bool await_ready() const noexcept { return false; }
+
+  // `on_complete` is never called from within
+  // `ngx_curl_add_handle_with_data`, so the coroutine is suspended by then.
+  bool await_suspend(std::coroutine_handle<> waiter) noexcept {
+    waiter_ = waiter;
+    if (ngx_curl_add_handle_with_data(curl_, handle_, &on_complete, this) !=
+        0) {
+      result_ = CURLE_FAILED_INIT;
+      return false;
+    }
+    pending_ = true;
+    return true;
+  }
+
+  CURLcode await_resume() const noexcept { return result_; }
+
+private:
+  static void on_complete(CURL *, CURLcode result, void *data) noexcept {
+    fetch_awaiter *self = static_cast<fetch_awaiter *>(data);
+    self->pending_ = false;
+    self->result_ = result;
+    self->waiter_.resume();
+  }
+
+  ngx_curl_t *curl_;
+  CURL *handle_;
+  CURLcode result_ = CURLE_OK;
+  bool pending_ = false;
+  std::coroutine_handle<> waiter_;
+};
+
+inline fetch_awaiter fetch(ngx_curl_t *curl, CURL *handle) noexcept {
+  return fetch_awaiter(curl, handle);
+}
+
+template <std::same_as<CURL *>... Handles>
+detail::fan_out<sizeof...(Handles), false>
+when_all(ngx_curl_t *curl, Handles... handles) noexcept {
+  return detail::fan_out<sizeof...(Handles), false>(curl, handles...);
+}
+
+template <std::same_as<CURL *>... Handles>
+detail::fan_out<sizeof...(Handles), true>
+when_any(ngx_curl_t *curl, Handles... handles) noexcept {
+  return detail::fan_out<sizeof...(Handles), true>(curl, handles...);
+}
+
+} // namespace ngx_curl
@@ -0,0 +1,656 @@
+// Nginx headers must go first.  It has something to do with competing
+// preprocessor macros.
+#include <nginx.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_curl_http.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+// An `ngx_curl_proxy_t` relays the response of a transfer to an HTTP request.
+// It's allocated from the request's pool, as the data of a cleanup handler,
+// so that it can be found from the request and so that the transfer is
+// removed if the request goes away first.
+typedef struct ngx_curl_proxy_s {
+  ngx_curl_t *curl;
+  CURL *handle;
+  ngx_http_request_t *request;
+  void (*on_error)(CURL *, CURLcode);
+  void (*on_done)(CURL *);
+  // The status of the response, or zero until a status line is received.
+  ngx_uint_t status;
+  // Buffers passed to the output filter but not yet written are in `busy`.
+  // Buffers that can be reused are in `free`. `allocated` counts both, and
+  // is normally at most `max_buffers`.
+  ngx_chain_t *free;
+  ngx_chain_t *busy;
+  size_t allocated;
+  size_t max_buffers;
+  // `active` is true while the handle is added to `curl`.
+  bool active;
+  bool header_sent;
+  // `discard_body` is true if the response has no body to send, e.g. because
+  // the request's method is `HEAD`.
+  bool discard_body;
+  // `paused` is true if the write callback returned `CURL_WRITEFUNC_PAUSE`.
+  bool paused;
+  // `client_failed` is true if the write callback failed the transfer
+  // because the client connection failed, in which case libcurl reports
+  // `CURLE_WRITE_ERROR`, but `CURLE_SEND_ERROR` is passed to `on_error`.
+  bool client_failed;
+} ngx_curl_proxy_t;
+
+// A counter or gauge of `ngx_curl_metrics_t`, as reported by
+// `ngx_curl_metrics_handler`. Prometheus names are prefixed with "ngx_curl_",
+// and counters are suffixed with "_total".
+typedef struct ngx_curl_metric_s {
+  const char *name;
+  const char *help;
+  size_t offset;
+  bool gauge;
+} ngx_curl_metric_t;
+
+static const ngx_curl_metric_t metrics[] = {
+    {"handles_added", "Handles registered with ngx_curl.",
+     offsetof(ngx_curl_metrics_t, handles_added), false},
+    {"handles_queued", "Handles waiting to be admitted.",
+     offsetof(ngx_curl_metrics_t, handles_queued), true},
+    {"transfers_running", "Admitted transfers.",
+     offsetof(ngx_curl_metrics_t, transfers_running), true},
+    {"sockets_open", "Sockets registered with nginx by libcurl.",
+     offsetof(ngx_curl_metrics_t, sockets_open), true},
+    {"socket_events", "Socket events passed to libcurl.",
+     offsetof(ngx_curl_metrics_t, socket_events), false},
+    {"timeouts", "Timeouts passed to libcurl.",
+     offsetof(ngx_curl_metrics_t, timeouts), false},
+    {"connections_opened", "Connections opened by completed transfers.",
+     offsetof(ngx_curl_metrics_t, connections_opened), false},
+    {"connections_reused", "Completed transfers that reused a connection.",
+     offsetof(ngx_curl_metrics_t, connections_reused), false}};
+
+// Response bodies are copied into buffers of this size, which is libcurl's
+// `CURL_MAX_WRITE_SIZE`.
+#define NGX_CURL_PROXY_BUFFER_SIZE 16384
+
+#define NGX_CURL_DEFAULT_PROXY_BUFFER_SIZE (64 * 1024)
+
+// The tag of buffers allocated by a proxy.
+#define NGX_CURL_PROXY_TAG ((ngx_buf_tag_t)&ngx_curl_proxy)
+
+static size_t on_proxy_header(char *data, size_t size, size_t count,
+                              void *user_data);
+static size_t on_proxy_body(char *data, size_t size, size_t count,
+                            void *user_data);
+static void on_proxy_complete(CURL *handle, CURLcode result, void *data);
+static void on_proxy_cleanup(void *data);
+static void on_client_writable(ngx_http_request_t *request);
+static ngx_curl_proxy_t *find_proxy(ngx_http_request_t *request);
+static void abort_proxy(ngx_curl_proxy_t *proxy, CURLcode result);
+static ngx_int_t send_proxy_header(ngx_curl_proxy_t *proxy);
+static ngx_int_t watch_client(ngx_curl_proxy_t *proxy);
+static void resume_proxy(ngx_curl_proxy_t *proxy);
+static ngx_int_t reset_response_headers(ngx_http_request_t *request);
+static ngx_int_t add_response_header(ngx_http_request_t *request,
+                                     const ngx_str_t *name,
+                                     const ngx_str_t *value);
+static ngx_atomic_uint_t read_metric(const ngx_curl_metrics_t *counters,
+                                     const ngx_curl_metric_t *metric);
+static size_t measure_metrics(void);
+static u_char *write_prometheus_metrics(u_char *p,
+                                        const ngx_curl_metrics_t *counters);
+static u_char *write_json_metrics(u_char *p,
+                                  const ngx_curl_metrics_t *counters);
+
+static bool header_name_is(const ngx_str_t *name, const char *expected) {
+  const size_t length = ngx_strlen(expected);
+  return name->len == length &&
+         ngx_strncasecmp(name->data, (u_char *)expected, length) == 0;
+}
+
+static ngx_str_t trim(u_char *begin, u_char *end) {
+  while (begin < end && (*begin == ' ' || *begin == '\t')) {
+    ++begin;
+  }
+  while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+    --end;
+  }
+
+  ngx_str_t result;
+  result.data = begin;
+  result.len = end - begin;
+  return result;
+}
+
+// Headers that describe the connection to the origin, rather than the
+// response, aren't relayed.
+static bool is_hop_by_hop(const ngx_str_t *name) {
+  static const char *const names[] = {
+      "Connection",         "Keep-Alive", "Proxy-Connection",
+      "Proxy-Authenticate", "TE",         "Trailer",
+      "Transfer-Encoding",  "Upgrade"};
+  for (size_t i = 0; i < sizeof names / sizeof names[0]; ++i) {
+    if (header_name_is(name, names[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static ngx_int_t reset_response_headers(ngx_http_request_t *request) {
+  ngx_http_headers_out_t *headers = &request->headers_out;
+  headers->content_type.len = 0;
+  headers->content_type.data = NULL;
+  headers->content_type_len = 0;
+  headers->content_length_n = -1;
+  headers->server = NULL;
+  headers->date = NULL;
+  return ngx_list_init(&headers->headers, request->pool, 20,
+                       sizeof(ngx_table_elt_t));
+}
+
+static ngx_int_t add_response_header(ngx_http_request_t *request,
+                                     const ngx_str_t *name,
+                                     const ngx_str_t *value) {
+  ngx_http_headers_out_t *headers = &request->headers_out;
+
+  if (header_name_is(name, "Content-Length")) {
+    headers->content_length_n = ngx_atoof(value->data, value->len);
+    return headers->content_length_n == NGX_ERROR ? NGX_ERROR : NGX_OK;
+  }
+
+  u_char *copy = ngx_pnalloc(request->pool, name->len + value->len);
+  if (copy == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (header_name_is(name, "Content-Type")) {
+    headers->content_type.data = copy;
+    headers->content_type.len = value->len;
+    headers->content_type_len = value->len;
+    ngx_memcpy(copy, value->data, value->len);
+    return NGX_OK;
+  }
+
+  ngx_table_elt_t *header = ngx_list_push(&headers->headers);
+  if (header == NULL) {
+    return NGX_ERROR;
+  }
+  header->hash = 1;
+  header->key.data = copy;
+  header->key.len = name->len;
+  header->value.data = ngx_cpymem(copy, name->data, name->len);
+  header->value.len = value->len;
+  ngx_memcpy(header->value.data, value->data, value->len);
+#if (nginx_version >= 1023000)
+  header->next = NULL;
+#endif
+
+  // Otherwise, nginx would add its own.
+  if (header_name_is(name, "Server")) {
+    headers->server = header;
+  } else if (header_name_is(name, "Date")) {
+    headers->date = header;
+  }
+
+  return NGX_OK;
+}
+
+static size_t on_proxy_header(char *data, size_t size, size_t count,
+                              void *user_data) {
+  (void)size; // always 1
+  ngx_curl_proxy_t *proxy = user_data;
+  assert(proxy);
+
+  if (proxy->header_sent) {
+    return count; // e.g. trailers, which aren't relayed
+  }
+
+  u_char *line = (u_char *)data;
+  u_char *end = line + count;
+  while (end > line && (end[-1] == '\n' || end[-1] == '\r')) {
+    --end;
+  }
+
+  // A status line begins each response, including "100 Continue" and any
+  // redirects that libcurl follows. Only the last response is relayed.
+  if (count >= 5 && ngx_strncmp(line, "HTTP/", 5) == 0) {
+    u_char *space = ngx_strlchr(line, end, ' ');
+    const ngx_int_t status =
+        space && end - space > 3 ? ngx_atoi(space + 1, 3) : NGX_ERROR;
+    if (status == NGX_ERROR ||
+        reset_response_headers(proxy->request) != NGX_OK) {
+      return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+    }
+    proxy->status = status;
+    return count;
+  }
+
+  // The blank line at the end of the headers has no colon.
+  u_char *colon = ngx_strlchr(line, end, ':');
+  if (colon == NULL) {
+    return count;
+  }
+
+  const ngx_str_t name = trim(line, colon);
+  const ngx_str_t value = trim(colon + 1, end);
+  if (name.len == 0 || is_hop_by_hop(&name)) {
+    return count;
+  }
+
+  if (add_response_header(proxy->request, &name, &value) != NGX_OK) {
+    return 0;
+  }
+  return count;
+}
+
+static ngx_int_t send_proxy_header(ngx_curl_proxy_t *proxy) {
+  ngx_http_request_t *request = proxy->request;
+
+  proxy->header_sent = true;
+  request->headers_out.status = proxy->status ? proxy->status : NGX_HTTP_OK;
+
+  const ngx_int_t rc = ngx_http_send_header(request);
+  if (rc == NGX_ERROR || rc > NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if (request->header_only) {
+    proxy->discard_body = true;
+  }
+  return NGX_OK;
+}
+
+static size_t on_proxy_body(char *data, size_t size, size_t count,
+                            void *user_data) {
+  (void)size; // always 1
+  ngx_curl_proxy_t *proxy = user_data;
+  assert(proxy);
+  ngx_http_request_t *request = proxy->request;
+
+  if (!proxy->header_sent && send_proxy_header(proxy) != NGX_OK) {
+    return 0; // libcurl will fail the transfer with CURLE_WRITE_ERROR
+  }
+
+  if (proxy->discard_body || count == 0) {
+    return count;
+  }
+
+  // If the client is behind, wait for it rather than buffer more. When
+  // nothing is waiting to be written, accept the data regardless, so that a
+  // large write can't stall the transfer.
+  size_t available = proxy->allocated < proxy->max_buffers
+                         ? proxy->max_buffers - proxy->allocated
+                         : 0;
+  for (ngx_chain_t *link = proxy->free; link; link = link->next) {
+    ++available;
+  }
+  if (proxy->busy && available * NGX_CURL_PROXY_BUFFER_SIZE < count) {
+    proxy->paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  ngx_chain_t *out = NULL;
+  ngx_chain_t **last = &out;
+  for (size_t offset = 0; offset < count;) {
+    ngx_chain_t *link = proxy->free;
+    if (link) {
+      proxy->free = link->next;
+    } else {
+      link = ngx_alloc_chain_link(request->pool);
+      if (link == NULL) {
+        return 0;
+      }
+      link->buf =
+          ngx_create_temp_buf(request->pool, NGX_CURL_PROXY_BUFFER_SIZE);
+      if (link->buf == NULL) {
+        return 0;
+      }
+      link->buf->tag = NGX_CURL_PROXY_TAG;
+      ++proxy->allocated;
+    }
+
+    ngx_buf_t *buffer = link->buf;
+    const size_t length =
+        ngx_min(count - offset, (size_t)(buffer->end - buffer->last));
+    buffer->last = ngx_cpymem(buffer->last, data + offset, length);
+    buffer->flush = 1;
+    offset += length;
+
+    link->next = NULL;
+    *last = link;
+    last = &link->next;
+  }
+
+  const ngx_int_t rc = ngx_http_output_filter(request, out);
+  ngx_chain_update_chains(request->pool, &proxy->free, &proxy->busy, &out,
+                          NGX_CURL_PROXY_TAG);
+  if (rc == NGX_ERROR || watch_client(proxy) != NGX_OK) {
+    proxy->client_failed = true;
+    return 0;
+  }
+
+  return count;
+}
+
+static ngx_int_t watch_client(ngx_curl_proxy_t *proxy) {
+  ngx_http_request_t *request = proxy->request;
+  ngx_event_t *event = request->connection->write;
+  ngx_http_core_loc_conf_t *clcf =
+      ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+
+  if (proxy->busy == NULL && !request->connection->buffered) {
+    // Everything has been written. Don't time out while waiting for more.
+    if (event->timer_set && !event->delayed) {
+      ngx_del_timer(event);
+    }
+    return NGX_OK;
+  }
+
+  if (!event->delayed) {
+    ngx_add_timer(event, clcf->send_timeout);
+  }
+  return ngx_handle_write_event(event, clcf->send_lowat);
+}
+
+static void resume_proxy(ngx_curl_proxy_t *proxy) {
+  if (!proxy->paused ||
+      (proxy->free == NULL && proxy->allocated >= proxy->max_buffers)) {
+    return;
+  }
+
+  // libcurl might call `on_proxy_body` before this returns.
+  proxy->paused = false;
+  const CURLcode rc = curl_easy_pause(proxy->handle, CURLPAUSE_CONT);
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to resume proxied CURL handle: %s",
+                  curl_easy_strerror(rc));
+    abort_proxy(proxy, rc);
+  }
+}
+
+static void on_client_writable(ngx_http_request_t *request) {
+  ngx_curl_proxy_t *proxy = find_proxy(request);
+  if (proxy == NULL || !proxy->active) {
+    return;
+  }
+
+  ngx_event_t *event = request->connection->write;
+  if (event->timedout) {
+    event->timedout = 0;
+    if (!event->delayed) {
+      // `send_timeout` elapsed.
+      request->connection->timedout = 1;
+      abort_proxy(proxy, CURLE_SEND_ERROR);
+      return;
+    }
+    // A delay imposed by `limit_rate` elapsed.
+    event->delayed = 0;
+  }
+
+  ngx_chain_t *out = NULL;
+  const ngx_int_t rc = ngx_http_output_filter(request, NULL);
+  ngx_chain_update_chains(request->pool, &proxy->free, &proxy->busy, &out,
+                          NGX_CURL_PROXY_TAG);
+  if (rc == NGX_ERROR || watch_client(proxy) != NGX_OK) {
+    abort_proxy(proxy, CURLE_SEND_ERROR);
+    return;
+  }
+
+  resume_proxy(proxy);
+}
+
+static ngx_curl_proxy_t *find_proxy(ngx_http_request_t *request) {
+  for (ngx_pool_cleanup_t *cleanup = request->pool->cleanup; cleanup;
+       cleanup = cleanup->next) {
+    if (cleanup->handler == &on_proxy_cleanup) {
+      ngx_curl_proxy_t *proxy = cleanup->data;
+      if (proxy->request == request) {
+        return proxy;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void abort_proxy(ngx_curl_proxy_t *proxy, CURLcode result) {
+  (void)ngx_curl_remove_handle(proxy->curl, proxy->handle);
+  on_proxy_complete(proxy->handle, result, proxy);
+}
+
+static void on_proxy_complete(CURL *handle, CURLcode result, void *data) {
+  ngx_curl_proxy_t *proxy = data;
+  assert(proxy);
+  assert(proxy->handle == handle);
+  ngx_http_request_t *request = proxy->request;
+
+  proxy->active = false;
+  if (request->write_event_handler == &on_client_writable) {
+    request->write_event_handler = &ngx_http_request_empty_handler;
+  }
+
+  if (result == CURLE_WRITE_ERROR && proxy->client_failed) {
+    result = CURLE_SEND_ERROR;
+  }
+
+  ngx_int_t rc;
+  if (result == CURLE_OK) {
+    rc = proxy->header_sent ? NGX_OK : send_proxy_header(proxy);
+    if (rc == NGX_OK && !request->header_only) {
+      rc = ngx_http_send_special(request, NGX_HTTP_LAST);
+    }
+    proxy->on_done(handle);
+  } else {
+    rc = proxy->header_sent ? NGX_ERROR : NGX_HTTP_BAD_GATEWAY;
+    proxy->on_error(handle, result);
+  }
+
+  ngx_http_finalize_request(request, rc);
+}
+
+static void on_proxy_cleanup(void *data) {
+  ngx_curl_proxy_t *proxy = data;
+  if (!proxy->active) {
+    return;
+  }
+
+  // The request was terminated while the transfer was in progress.
+  proxy->active = false;
+  (void)ngx_curl_remove_handle(proxy->curl, proxy->handle);
+  proxy->on_error(proxy->handle, CURLE_ABORTED_BY_CALLBACK);
+}
+
+int ngx_curl_proxy(ngx_curl_t *curl, CURL *handle, ngx_http_request_t *request,
+                   const ngx_curl_proxy_options_t *options,
+                   void (*on_error)(CURL *, CURLcode),
+                   void (*on_done)(CURL *)) {
+  assert(curl);
+  assert(handle);
+  assert(request);
+  assert(on_error);
+  assert(on_done);
+
+  static const ngx_curl_proxy_options_t default_options;
+  if (options == NULL) {
+    options = &default_options;
+  }
+
+  ngx_pool_cleanup_t *cleanup =
+      ngx_pool_cleanup_add(request->pool, sizeof(ngx_curl_proxy_t));
+  if (cleanup == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to allocate proxy context for CURL handle");
+    return -1;
+  }
+
+  ngx_curl_proxy_t *proxy = cleanup->data;
+  ngx_memzero(proxy, sizeof *proxy);
+  proxy->curl = curl;
+  proxy->handle = handle;
+  proxy->request = request;
+  proxy->on_error = on_error;
+  proxy->on_done = on_done;
+  const size_t buffer_size = options->buffer_size
+                                 ? options->buffer_size
+                                 : NGX_CURL_DEFAULT_PROXY_BUFFER_SIZE;
+  proxy->max_buffers = (buffer_size + NGX_CURL_PROXY_BUFFER_SIZE - 1) /
+                       NGX_CURL_PROXY_BUFFER_SIZE;
+
+  CURLcode rc = curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION,
+                                 &on_proxy_header);
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_HEADERDATA, proxy);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &on_proxy_body);
+  }
+  if (rc == CURLE_OK) {
+    rc = curl_easy_setopt(handle, CURLOPT_WRITEDATA, proxy);
+  }
+  if (rc != CURLE_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                  "Unable to install proxy callbacks on CURL handle: %s",
+                  curl_easy_strerror(rc));
+    return -5;
+  }
+
+  const int add_rc =
+      ngx_curl_add_handle_with_data(curl, handle, &on_proxy_complete, proxy);
+  if (add_rc != 0) {
+    return add_rc;
+  }
+
+  proxy->active = true;
+  cleanup->handler = &on_proxy_cleanup;
+  request->main->count++;
+  request->write_event_handler = &on_client_writable;
+  return 0;
+}
+
+static ngx_atomic_uint_t read_metric(const ngx_curl_metrics_t *counters,
+                                     const ngx_curl_metric_t *metric) {
+  return *(const ngx_atomic_t *)((const u_char *)counters + metric->offset);
+}
+
+// Returns an upper bound on the size of either format's output.
+static size_t measure_metrics(void) {
+  size_t size = sizeof("{\"results\":{}}\n");
+  for (size_t i = 0; i < sizeof metrics / sizeof metrics[0]; ++i) {
+    // "# HELP ngx_curl_..._total ...\n# TYPE ngx_curl_..._total counter\n"
+    // "ngx_curl_..._total 123\n"
+    size += 3 * (sizeof("ngx_curl__total") + ngx_strlen(metrics[i].name)) +
+            ngx_strlen(metrics[i].help) + sizeof("# HELP \n# TYPE counter\n") +
+            NGX_ATOMIC_T_LEN + 2;
+  }
+  size += sizeof("# HELP ngx_curl_results_total Handles completed, by "
+                 "result.\n# TYPE ngx_curl_results_total counter\n");
+  size += NGX_CURL_RESULT_COUNT *
+          (sizeof("ngx_curl_results_total{code=\"\"} \n") + NGX_INT_T_LEN +
+           NGX_ATOMIC_T_LEN);
+  return size;
+}
+
+static u_char *write_prometheus_metrics(u_char *p,
+                                        const ngx_curl_metrics_t *counters) {
+  for (size_t i = 0; i < sizeof metrics / sizeof metrics[0]; ++i) {
+    const ngx_curl_metric_t *metric = &metrics[i];
+    const char *suffix = metric->gauge ? "" : "_total";
+    p = ngx_sprintf(p,
+                    "# HELP ngx_curl_%s%s %s\n"
+                    "# TYPE ngx_curl_%s%s %s\n"
+                    "ngx_curl_%s%s %uA\n",
+                    metric->name, suffix, metric->help, metric->name, suffix,
+                    metric->gauge ? "gauge" : "counter", metric->name, suffix,
+                    read_metric(counters, metric));
+  }
+
+  p = ngx_cpymem(p,
+                 "# HELP ngx_curl_results_total Handles completed, by result.\n"
+                 "# TYPE ngx_curl_results_total counter\n",
+                 sizeof("# HELP ngx_curl_results_total Handles completed, by "
+                        "result.\n# TYPE ngx_curl_results_total counter\n") -
+                     1);
+  // Only results that have happened are listed.
+  for (ngx_uint_t code = 0; code < NGX_CURL_RESULT_COUNT; ++code) {
+    const ngx_atomic_uint_t count = counters->results[code];
+    if (count) {
+      p = ngx_sprintf(p, "ngx_curl_results_total{code=\"%ui\"} %uA\n", code,
+                      count);
+    }
+  }
+  return p;
+}
+
+static u_char *write_json_metrics(u_char *p,
+                                  const ngx_curl_metrics_t *counters) {
+  *p++ = '{';
+  for (size_t i = 0; i < sizeof metrics / sizeof metrics[0]; ++i) {
+    p = ngx_sprintf(p, "\"%s\":%uA,", metrics[i].name,
+                    read_metric(counters, &metrics[i]));
+  }
+
+  p = ngx_cpymem(p, "\"results\":{", sizeof("\"results\":{") - 1);
+  bool first = true;
+  for (ngx_uint_t code = 0; code < NGX_CURL_RESULT_COUNT; ++code) {
+    const ngx_atomic_uint_t count = counters->results[code];
+    if (count) {
+      p = ngx_sprintf(p, "%s\"%ui\":%uA", first ? "" : ",", code, count);
+      first = false;
+    }
+  }
+  return ngx_cpymem(p, "}}\n", sizeof("}}\n") - 1);
+}
+
+ngx_int_t ngx_curl_metrics_handler(ngx_http_request_t *request,
+                                   ngx_shm_zone_t *zone) {
+  assert(request);
+  assert(zone);
+
+  if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  ngx_int_t rc = ngx_http_discard_request_body(request);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  ngx_str_t format;
+  const bool json =
+      ngx_http_arg(request, (u_char *)"format", sizeof("format") - 1,
+                   &format) == NGX_OK &&
+      format.len == sizeof("json") - 1 &&
+      ngx_strncmp(format.data, "json", format.len) == 0;
+
+  ngx_buf_t *buffer = ngx_create_temp_buf(request->pool, measure_metrics());
+  if (buffer == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  const ngx_curl_metrics_t *counters = ngx_curl_metrics(zone);
+  if (json) {
+    buffer->last = write_json_metrics(buffer->last, counters);
+    ngx_str_set(&request->headers_out.content_type, "application/json");
+  } else {
+    buffer->last = write_prometheus_metrics(buffer->last, counters);
+    ngx_str_set(&request->headers_out.content_type,
+                "text/plain; version=0.0.4");
+  }
+  request->headers_out.content_type_len = request->headers_out.content_type.len;
+  request->headers_out.status = NGX_HTTP_OK;
+  request->headers_out.content_length_n = buffer->last - buffer->pos;
+
+  rc = ngx_http_send_header(request);
+  if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+    return rc;
+  }
+
+  buffer->last_buf = request == request->main;
+  buffer->last_in_chain = 1;
+
+  ngx_chain_t out = {buffer, NULL};
+  return ngx_http_output_filter(request, &out);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+// This component extends `ngx_curl.h` with features that involve nginx's HTTP
+// module, such as relaying a libcurl response to an nginx HTTP request. It is
+// optional: copy it along with `ngx_curl.h` and `ngx_curl.c` only if your
+// module is an HTTP module.
+//
+// The function `ngx_curl_proxy` adds a `CURL*` handle to a `ngx_curl_t*`, like
+// `ngx_curl_add_handle`, and streams the response to the client of the
+// specified `ngx_http_request_t*` as it arrives. The response's status and
+// headers (except for hop-by-hop headers such as `Connection` and
+// `Transfer-Encoding`) become the request's response status and headers, and
+// are sent when the first part of the body arrives. Each part of the body is
+// then copied into a buffer and passed to `ngx_http_output_filter`.
+//
+// Memory is bounded by `ngx_curl_proxy_options_t::buffer_size`, regardless of
+// the size of the response: once that many bytes are waiting to be written to
+// the client, the transfer is paused (`CURL_WRITEFUNC_PAUSE`), and it resumes
+// (`curl_easy_pause`) from the client connection's write event handler when
+// some of them have been written. Buffers are reused.
+//
+// `ngx_curl_proxy` increments the request's reference count, and the request
+// is finalized when the transfer completes, after `on_done` or `on_error` is
+// called. If the transfer fails before the response headers are sent, the
+// client receives "502 Bad Gateway"; after, the client connection is closed.
+// If the client connection fails or times out (`send_timeout`), the transfer
+// is removed and fails with `CURLE_SEND_ERROR`. If the request is terminated
+// by nginx, the transfer is removed and fails with
+// `CURLE_ABORTED_BY_CALLBACK`, but the request is then not finalized.
+//
+// `ngx_curl_proxy` replaces the handle's `CURLOPT_HEADERFUNCTION`,
+// `CURLOPT_HEADERDATA`, `CURLOPT_WRITEFUNCTION`, and `CURLOPT_WRITEDATA`. The
+// response body is relayed as received, so the handle must not enable
+// `CURLOPT_ACCEPT_ENCODING`, or else `Content-Length` would not match the
+// decoded body.
+//
+// `ngx_curl_proxy` must be called from an HTTP content handler (or later),
+// which then returns `NGX_DONE`. It returns zero on success or a negative
+// value on failure, in which case the request is left as it was.
+//
+// `ngx_curl_metrics_handler` reports the counters of a zone added by
+// `ngx_curl_add_metrics_zone`, like nginx's `stub_status`. A content handler
+// returns what it returns. The response is in Prometheus's text format, or
+// in JSON if the request has the argument `format=json`. Only results that
+// have occurred are listed, by numeric code (see `ngx_curl_strerror`).
+
+// Nginx headers must go first.
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include "ngx_curl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ngx_curl_proxy_options_s {
+  // The maximum number of response bytes buffered for the client, or zero for
+  // the default (64 KiB). It is rounded up to a multiple of 16 KiB.
+  size_t buffer_size;
+} ngx_curl_proxy_options_t;
+
+// `options` may be NULL.
+int ngx_curl_proxy(ngx_curl_t *curl, CURL *handle, ngx_http_request_t *request,
+                   const ngx_curl_proxy_options_t *options,
+                   void (*on_error)(CURL *, CURLcode),
+                   void (*on_done)(CURL *));
+
+ngx_int_t ngx_curl_metrics_handler(ngx_http_request_t *request,
+                                   ngx_shm_zone_t *zone);
+
+#ifdef __cplusplus
+}
+#endif
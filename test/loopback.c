@@ -0,0 +1,435 @@
+#define _GNU_SOURCE
+
+#include "loopback.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_BUFFER_SIZE 16384
+#define MAX_FAILING_PATHS 64
+
+typedef struct connection_s {
+  int fd;
+  char in[REQUEST_BUFFER_SIZE];
+  size_t in_length;
+  char *out;
+  size_t out_length;
+  size_t out_sent;
+  size_t out_capacity;
+  // Bytes of the current request's body not yet received.
+  size_t body_remaining;
+  // If nonzero, the status of the response to send at `respond_at`.
+  int delayed_status;
+  long long respond_at;
+  bool writing;
+  // Close once the queued output is sent, rather than read more requests.
+  bool closing;
+} connection_t;
+
+// How many requests for a "/fail/" path have been answered.
+typedef struct failing_path_s {
+  char path[256];
+  int requests;
+} failing_path_t;
+
+typedef struct server_s {
+  int epoll_fd;
+  int listen_fd;
+  char *body;
+  size_t body_size;
+  connection_t **connections;
+  size_t connection_limit;
+  // One more than the highest descriptor accepted.
+  size_t fd_end;
+  failing_path_t failing_paths[MAX_FAILING_PATHS];
+  size_t failing_path_count;
+} server_t;
+
+static void serve(server_t *server);
+static void accept_connections(server_t *server);
+static void read_requests(server_t *server, connection_t *c);
+static bool handle_requests(server_t *server, connection_t *c);
+static bool respond(server_t *server, connection_t *c, int status,
+                    size_t body_size);
+static bool respond_with_length(server_t *server, connection_t *c,
+                                int status, size_t content_length,
+                                size_t body_size, const char *headers);
+static bool flush(server_t *server, connection_t *c);
+static int count_request(server_t *server, const char *path);
+static void consume(connection_t *c, size_t length);
+static void close_connection(server_t *server, connection_t *c);
+static long long now_msec(void);
+
+int loopback_start(loopback_server_t *server, size_t body_size) {
+  const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    perror("loopback: socket");
+    return -1;
+  }
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof address;
+  if (bind(fd, (struct sockaddr *)&address, sizeof address) == -1 ||
+      listen(fd, 4096) == -1 ||
+      getsockname(fd, (struct sockaddr *)&address, &length) == -1) {
+    perror("loopback: bind");
+    close(fd);
+    return -1;
+  }
+
+  const pid_t pid = fork();
+  if (pid == -1) {
+    perror("loopback: fork");
+    close(fd);
+    return -1;
+  }
+
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    server_t child = {0};
+    child.listen_fd = fd;
+    child.body_size = body_size;
+    serve(&child);
+    _exit(1);
+  }
+
+  close(fd);
+  server->pid = pid;
+  server->port = ntohs(address.sin_port);
+  return 0;
+}
+
+void loopback_stop(loopback_server_t *server) {
+  if (server->pid > 0) {
+    kill(server->pid, SIGTERM);
+    waitpid(server->pid, NULL, 0);
+    server->pid = 0;
+  }
+}
+
+static void serve(server_t *server) {
+  struct rlimit limit;
+  server->connection_limit =
+      getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+          ? limit.rlim_cur
+          : 65536;
+  server->connections =
+      calloc(server->connection_limit, sizeof(connection_t *));
+  server->body = malloc(server->body_size + 1);
+  server->epoll_fd = epoll_create1(0);
+  if (server->connections == NULL || server->body == NULL ||
+      server->epoll_fd == -1) {
+    perror("loopback: setup");
+    return;
+  }
+  memset(server->body, 'x', server->body_size);
+
+  struct epoll_event ee = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ee) ==
+      -1) {
+    perror("loopback: epoll_ctl");
+    return;
+  }
+
+  for (;;) {
+    // Wait no longer than the earliest delayed response.
+    long long deadline = -1;
+    for (size_t fd = 0; fd < server->fd_end; ++fd) {
+      const connection_t *c = server->connections[fd];
+      if (c && c->delayed_status &&
+          (deadline == -1 || c->respond_at < deadline)) {
+        deadline = c->respond_at;
+      }
+    }
+    const long long now = now_msec();
+    const int timeout =
+        deadline == -1 ? -1 : (deadline > now ? (int)(deadline - now) : 0);
+
+    struct epoll_event events[256];
+    const int count = epoll_wait(server->epoll_fd, events, 256, timeout);
+    if (count == -1 && errno != EINTR) {
+      perror("loopback: epoll_wait");
+      return;
+    }
+
+    for (int i = 0; i < count; ++i) {
+      connection_t *c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_connections(server);
+      } else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        read_requests(server, c);
+      } else if (events[i].events & EPOLLOUT) {
+        if (flush(server, c)) {
+          handle_requests(server, c);
+        }
+      }
+    }
+
+    const long long later = now_msec();
+    for (size_t fd = 0; fd < server->fd_end; ++fd) {
+      connection_t *c = server->connections[fd];
+      if (c && c->delayed_status && c->respond_at <= later) {
+        const int status = c->delayed_status;
+        c->delayed_status = 0;
+        if (respond(server, c, status, status == 200 ? server->body_size : 0)) {
+          handle_requests(server, c);
+        }
+      }
+    }
+  }
+}
+
+static void accept_connections(server_t *server) {
+  for (;;) {
+    const int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+    if (fd == -1) {
+      if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+        perror("loopback: accept4");
+      }
+      return;
+    }
+
+    connection_t *c = calloc(1, sizeof(connection_t));
+    if (c == NULL || (size_t)fd >= server->connection_limit) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    server->connections[fd] = c;
+    if ((size_t)fd >= server->fd_end) {
+      server->fd_end = fd + 1;
+    }
+
+    struct epoll_event ee = {.events = EPOLLIN, .data.ptr = c};
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ee) == -1) {
+      close_connection(server, c);
+    }
+  }
+}
+
+static void read_requests(server_t *server, connection_t *c) {
+  for (;;) {
+    // Leave room for a terminating null, so that headers are strings.
+    if (c->in_length == sizeof c->in - 1) {
+      // The request header doesn't fit.
+      close_connection(server, c);
+      return;
+    }
+
+    const ssize_t n =
+        read(c->fd, c->in + c->in_length, sizeof c->in - 1 - c->in_length);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      return;
+    }
+    if (n <= 0) {
+      close_connection(server, c);
+      return;
+    }
+    c->in_length += n;
+    c->in[c->in_length] = '\0';
+
+    if (!handle_requests(server, c)) {
+      return;
+    }
+  }
+}
+
+// Answers the requests in `c->in`, one at a time. Returns false if `c` was
+// closed.
+static bool handle_requests(server_t *server, connection_t *c) {
+  while (!c->delayed_status && !c->writing && !c->closing) {
+    if (c->body_remaining) {
+      const size_t n =
+          c->body_remaining < c->in_length ? c->body_remaining : c->in_length;
+      consume(c, n);
+      c->body_remaining -= n;
+      if (c->body_remaining) {
+        return true;
+      }
+    }
+
+    const char *end = memmem(c->in, c->in_length, "\r\n\r\n", 4);
+    if (end == NULL) {
+      return true;
+    }
+    const size_t header_length = end + 4 - c->in;
+
+    char path[256] = "";
+    sscanf(c->in, "%*s %255s", path);
+    for (const char *line = strstr(c->in, "\r\n"); line && line < end;
+         line = strstr(line + 2, "\r\n")) {
+      if (strncasecmp(line + 2, "content-length:", 15) == 0) {
+        c->body_remaining = strtoull(line + 17, NULL, 10);
+      }
+    }
+    consume(c, header_length);
+
+    int value;
+    size_t length;
+    char directives[64];
+    if (strcmp(path, "/close") == 0) {
+      close_connection(server, c);
+      return false;
+    } else if (sscanf(path, "/truncated/%zu", &length) == 1) {
+      c->closing = true;
+      if (!respond_with_length(server, c, 200, length, server->body_size,
+                               "")) {
+        return false;
+      }
+    } else if (sscanf(path, "/status/%d", &value) == 1) {
+      if (!respond(server, c, value, 0)) {
+        return false;
+      }
+    } else if (sscanf(path, "/fail/%d/", &value) == 1) {
+      const int status = count_request(server, path) < value ? 503 : 200;
+      if (!respond(server, c, status, server->body_size)) {
+        return false;
+      }
+    } else if (sscanf(path, "/cache/%63[^/]/", directives) == 1 ||
+               sscanf(path, "/cookie/%63[^/]/", directives) == 1) {
+      char headers[128];
+      snprintf(headers, sizeof headers, "Cache-Control: %s\r\n%s",
+               directives,
+               strncmp(path, "/cookie/", 8) == 0 ? "Set-Cookie: id=1\r\n"
+                                                 : "");
+      if (!respond_with_length(server, c, 200, server->body_size,
+                               server->body_size, headers)) {
+        return false;
+      }
+    } else if (sscanf(path, "/delay/%d", &value) == 1) {
+      c->delayed_status = 200;
+      c->respond_at = now_msec() + value;
+    } else if (!respond(server, c, 200, server->body_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Queues a response and sends what it can. Returns false if `c` was closed.
+static bool respond(server_t *server, connection_t *c, int status,
+                    size_t body_size) {
+  return respond_with_length(server, c, status, body_size, body_size, "");
+}
+
+// Like `respond`, but the header claims `content_length` bytes of body, and
+// `headers` (each line ending in "\r\n") follow it.
+static bool respond_with_length(server_t *server, connection_t *c,
+                                int status, size_t content_length,
+                                size_t body_size, const char *headers) {
+  char head[256];
+  const int head_length =
+      snprintf(head, sizeof head,
+               "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n%s\r\n", status,
+               status == 200 ? "OK" : "Status", content_length, headers);
+
+  const size_t needed = c->out_length + head_length + body_size;
+  if (needed > c->out_capacity) {
+    char *out = realloc(c->out, needed);
+    if (out == NULL) {
+      close_connection(server, c);
+      return false;
+    }
+    c->out = out;
+    c->out_capacity = needed;
+  }
+  memcpy(c->out + c->out_length, head, head_length);
+  memcpy(c->out + c->out_length + head_length, server->body, body_size);
+  c->out_length = needed;
+  return flush(server, c);
+}
+
+// Sends queued output, waiting for the socket to be writable if it must.
+// Returns false if `c` was closed.
+static bool flush(server_t *server, connection_t *c) {
+  while (c->out_sent < c->out_length) {
+    const ssize_t n = send(c->fd, c->out + c->out_sent,
+                           c->out_length - c->out_sent, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EAGAIN) {
+      break;
+    }
+    if (n == -1) {
+      close_connection(server, c);
+      return false;
+    }
+    c->out_sent += n;
+  }
+
+  const bool writing = c->out_sent < c->out_length;
+  if (!writing && c->closing) {
+    close_connection(server, c);
+    return false;
+  }
+  if (!writing) {
+    c->out_sent = 0;
+    c->out_length = 0;
+  }
+  if (writing != c->writing) {
+    c->writing = writing;
+    struct epoll_event ee = {.events = writing ? EPOLLOUT : EPOLLIN,
+                             .data.ptr = c};
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, c->fd, &ee);
+  }
+  return true;
+}
+
+// Returns how many earlier requests there were for `path`.
+static int count_request(server_t *server, const char *path) {
+  for (size_t i = 0; i < server->failing_path_count; ++i) {
+    failing_path_t *failing = &server->failing_paths[i];
+    if (strcmp(failing->path, path) == 0) {
+      return failing->requests++;
+    }
+  }
+
+  if (server->failing_path_count < MAX_FAILING_PATHS) {
+    failing_path_t *failing =
+        &server->failing_paths[server->failing_path_count++];
+    snprintf(failing->path, sizeof failing->path, "%s", path);
+    failing->requests = 1;
+  }
+  return 0;
+}
+
+// Discards the first `length` bytes of `c->in`.
+static void consume(connection_t *c, size_t length) {
+  memmove(c->in, c->in + length, c->in_length - length);
+  c->in_length -= length;
+  c->in[c->in_length] = '\0';
+}
+
+static void close_connection(server_t *server, connection_t *c) {
+  server->connections[c->fd] = NULL;
+  close(c->fd);
+  free(c->out);
+  free(c);
+}
+
+static long long now_msec(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
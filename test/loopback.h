@@ -0,0 +1,33 @@
+#pragma once
+
+// A minimal HTTP/1.1 server on 127.0.0.1, run in a child process so that its
+// work isn't counted against the process under test. It supports keep-alive
+// and answers requests by path:
+//
+// - "/status/<code>" responds with that status and an empty body;
+// - "/delay/<milliseconds>" responds after that long;
+// - "/fail/<count>/<tag>" responds "503 Status", with the configured body,
+//   to the first <count> requests for that path, and then like "/";
+// - "/cache/<directives>/<tag>" responds like "/", with a `Cache-Control`
+//   header of those directives, e.g. "public,max-age=60";
+// - "/cookie/<directives>/<tag>" does the same, and sets a cookie;
+// - "/close" closes the connection without responding;
+// - "/truncated/<length>" claims a `Content-Length` of that many bytes, but
+//   sends the configured body and closes the connection;
+// - anything else responds "200 OK" with the configured body.
+//
+// Request bodies are read (by `Content-Length`) and discarded.
+
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct loopback_server_s {
+  pid_t pid;
+  unsigned short port;
+} loopback_server_t;
+
+// Starts a server whose default responses have `body_size` bytes of body.
+// Returns zero on success or a negative value on failure.
+int loopback_start(loopback_server_t *server, size_t body_size);
+
+void loopback_stop(loopback_server_t *server);
@@ -0,0 +1,392 @@
+// Tests of the coroutine layer in `ngx_curl.hpp`, run like
+// `ngx_curl_test.c`: on the shim's event loop, against a loopback server,
+// with level-triggered events and then edge-triggered.
+//
+// Exits with status zero if every check passed.
+
+#include "ngx_curl.hpp"
+
+extern "C" {
+#include <ngx_event.h>
+
+#include "loopback.h"
+#include "ngx_shim.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+namespace {
+
+constexpr size_t body_size = 1000;
+constexpr size_t max_handles = 16;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__,         \
+                   __LINE__, current_test, #condition);                        \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+const char *current_test;
+int failures;
+loopback_server_t server;
+// Nothing listens on this port. See `ngx_curl_test.c`.
+const unsigned short refused_port = 1;
+int edge_triggered;
+ngx_curl_t *curl;
+CURL *handles[max_handles];
+size_t handle_count;
+
+// Counts the calls to `ngx_curl_options_t::allocator`, which libcurl might
+// also be using.
+std::atomic<size_t> allocations;
+std::atomic<size_t> frees;
+
+void *count_allocate(size_t size) {
+  ++allocations;
+  return std::malloc(size);
+}
+
+void *count_callocate(size_t count, size_t size_each) {
+  ++allocations;
+  return std::calloc(count, size_each);
+}
+
+void *count_reallocate(void *pointer, size_t new_size) {
+  if (pointer == nullptr) {
+    ++allocations;
+  }
+  return std::realloc(pointer, new_size);
+}
+
+void count_free(void *pointer) {
+  if (pointer != nullptr) {
+    ++frees;
+  }
+  std::free(pointer);
+}
+
+char *count_duplicate(const char *string) {
+  ++allocations;
+  return strdup(string);
+}
+
+const ngx_curl_allocator_t counting_allocator = {
+    &count_allocate, &count_callocate, &count_reallocate, &count_free,
+    &count_duplicate};
+
+void create_curl() {
+  ngx_curl_options_t options = {};
+  options.edge_triggered = edge_triggered;
+  options.allocator = &counting_allocator;
+  curl = ngx_create_curl_with_options(&options);
+  CHECK(curl != nullptr);
+}
+
+// Also checks that nothing outlives the `ngx_curl_t*`.
+void destroy_curl() {
+  for (size_t i = 0; i < handle_count; ++i) {
+    curl_easy_cleanup(handles[i]);
+  }
+  handle_count = 0;
+  ngx_destroy_curl(curl);
+  curl = nullptr;
+  CHECK(ngx_cycle->free_connection_n == ngx_cycle->connection_n);
+  CHECK(ngx_shim_timer_count() == 0);
+  CHECK(ngx_queue_empty(&ngx_posted_events));
+}
+
+size_t ignore_body(char *, size_t size, size_t count, void *) {
+  return size * count;
+}
+
+CURL *make_handle(const char *path, unsigned short port = server.port) {
+  char url[128];
+  std::snprintf(url, sizeof url, "http://127.0.0.1:%d%s", port, path);
+  CURL *handle = curl_easy_init();
+  curl_easy_setopt(handle, CURLOPT_URL, url);
+  curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &ignore_body);
+  handles[handle_count++] = handle;
+  return handle;
+}
+
+long status_of(CURL *handle) {
+  long status = 0;
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+  return status;
+}
+
+// Runs the event loop until `*finished`, or for five seconds.
+void run_until(const bool *finished) {
+  const ngx_msec_t deadline = ngx_current_msec + 5000;
+  while (!*finished && (ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(100);
+  }
+  CHECK(*finished);
+}
+
+void run_for(ngx_msec_t duration) {
+  const ngx_msec_t deadline = ngx_current_msec + duration;
+  while ((ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(deadline - ngx_current_msec);
+  }
+}
+
+struct flow_t {
+  int steps = 0;
+  long statuses[2] = {};
+  CURLcode results[3] = {};
+  bool finished = false;
+};
+
+ngx_curl::task<long> fetch_status(ngx_curl_t *curl, CURL *handle) {
+  const CURLcode result = co_await ngx_curl::fetch(curl, handle);
+  co_return result == CURLE_OK ? status_of(handle) : -1;
+}
+
+ngx_curl::task<void> fetch_in_sequence(ngx_curl_t *curl, CURL *first,
+                                       CURL *second, CURL *refused,
+                                       flow_t *flow) {
+  flow->statuses[0] = co_await fetch_status(curl, first);
+  ++flow->steps;
+  flow->statuses[1] = co_await fetch_status(curl, second);
+  ++flow->steps;
+  flow->results[0] = co_await ngx_curl::fetch(curl, refused);
+  ++flow->steps;
+  flow->finished = true;
+}
+
+// Each step resumes from the event loop once its transfer is complete, and
+// frames come from the `ngx_curl_t*`'s allocator.
+void test_sequence() {
+  create_curl();
+  CURL *first = make_handle("/");
+  CURL *second = make_handle("/status/404");
+  CURL *refused = make_handle("/", refused_port);
+  flow_t flow;
+
+  const size_t allocations_before = allocations;
+  ngx_curl::task<void> task =
+      fetch_in_sequence(curl, first, second, refused, &flow);
+  CHECK(task);
+  CHECK(allocations == allocations_before + 1);
+
+  task.start();
+  CHECK(flow.steps == 0);
+  CHECK(!task.done());
+  run_until(&flow.finished);
+
+  CHECK(task.done());
+  CHECK(flow.steps == 3);
+  CHECK(flow.statuses[0] == 200);
+  CHECK(flow.statuses[1] == 404);
+  CHECK(flow.results[0] == CURLE_COULDNT_CONNECT);
+
+  const size_t frees_before = frees;
+  task = {};
+  CHECK(frees == frees_before + 1);
+  destroy_curl();
+}
+
+ngx_curl::task<void> fetch_repeatedly(ngx_pool_t *pool, ngx_curl_t *curl,
+                                      CURL *handle, int count, flow_t *flow) {
+  for (int i = 0; i < count; ++i) {
+    if (co_await ngx_curl::fetch(curl, handle) == CURLE_OK) {
+      ++flow->steps;
+    }
+  }
+  flow->finished = true;
+}
+
+// A frame can come from an `ngx_pool_t`, and awaiting a transfer reuses
+// ngx_curl's handle contexts rather than allocating.
+void test_pool() {
+  create_curl();
+  CURL *handle = make_handle("/");
+  ngx_pool_t *pool = ngx_create_pool(4096, ngx_cycle->log);
+  CHECK(pool != nullptr);
+  flow_t flow;
+
+  const size_t allocations_before = allocations;
+  ngx_curl::task<void> task = fetch_repeatedly(pool, curl, handle, 20, &flow);
+  CHECK(task);
+  CHECK(allocations == allocations_before);
+
+  task.start();
+  run_until(&flow.finished);
+  CHECK(flow.steps == 20);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.context_pool_misses <= 1);
+  CHECK(stats.context_pool_hits + stats.context_pool_misses == 20);
+
+  task = {};
+  ngx_destroy_pool(pool);
+  destroy_curl();
+}
+
+ngx_curl::task<void> fetch_all(ngx_curl_t *curl, flow_t *flow) {
+  const std::array<CURLcode, 0> none = co_await ngx_curl::when_all(curl);
+  (void)none;
+  CURL *ok = make_handle("/");
+  CURL *not_found = make_handle("/status/404");
+  CURL *refused = make_handle("/", refused_port);
+  const std::array<CURLcode, 3> results =
+      co_await ngx_curl::when_all(curl, ok, not_found, refused);
+  std::copy(results.begin(), results.end(), flow->results);
+  flow->statuses[0] = status_of(ok);
+  flow->statuses[1] = status_of(not_found);
+  flow->finished = true;
+}
+
+// `when_all` resumes once every transfer is complete.
+void test_when_all() {
+  create_curl();
+  flow_t flow;
+  ngx_curl::task<void> task = fetch_all(curl, &flow);
+  task.start();
+  CHECK(!flow.finished);
+  run_until(&flow.finished);
+
+  CHECK(flow.results[0] == CURLE_OK);
+  CHECK(flow.results[1] == CURLE_OK);
+  CHECK(flow.results[2] == CURLE_COULDNT_CONNECT);
+  CHECK(flow.statuses[0] == 200);
+  CHECK(flow.statuses[1] == 404);
+  task = {};
+  destroy_curl();
+}
+
+ngx_curl::task<void> fetch_any(ngx_curl_t *curl, flow_t *flow) {
+  const std::optional<size_t> winner = co_await ngx_curl::when_any(
+      curl, make_handle("/delay/3000"), make_handle("/"));
+  flow->statuses[0] = winner ? long(*winner) : -1;
+  const std::optional<size_t> none = co_await ngx_curl::when_any(
+      curl, make_handle("/", refused_port), make_handle("/", refused_port));
+  flow->statuses[1] = none ? long(*none) : -1;
+  flow->finished = true;
+}
+
+// `when_any` resumes at the first success, and removes the slower handles.
+void test_when_any() {
+  create_curl();
+  flow_t flow;
+  const ngx_msec_t start = ngx_current_msec;
+  ngx_curl::task<void> task = fetch_any(curl, &flow);
+  task.start();
+  run_until(&flow.finished);
+
+  CHECK(ngx_current_msec - start < 1000);
+  CHECK(flow.statuses[0] == 1);
+  CHECK(flow.statuses[1] == -1);
+  task = {};
+  destroy_curl();
+}
+
+ngx_curl::task<void> wait_forever(ngx_curl_t *curl, bool all, flow_t *flow) {
+  ++flow->steps;
+  if (all) {
+    (void)co_await ngx_curl::when_all(curl, make_handle("/delay/3000"),
+                                      make_handle("/delay/3000"));
+  } else {
+    (void)co_await ngx_curl::fetch(curl, make_handle("/delay/3000"));
+  }
+  flow->finished = true;
+}
+
+// Destroying a suspended coroutine removes the handles that it's awaiting,
+// without resuming it.
+void test_destroy_suspended() {
+  create_curl();
+  for (bool all : {false, true}) {
+    flow_t flow;
+    ngx_curl::task<void> task = wait_forever(curl, all, &flow);
+    task.start();
+    run_for(50);
+    task = {};
+    run_for(20);
+    CHECK(flow.steps == 1);
+    CHECK(!flow.finished);
+  }
+  destroy_curl();
+}
+
+// Records the destruction of the coroutine frame that it's a parameter of.
+struct sentinel_t {
+  explicit sentinel_t(bool *destroyed) : destroyed(destroyed) {}
+
+  sentinel_t(sentinel_t &&other)
+      : destroyed(std::exchange(other.destroyed, nullptr)) {}
+
+  ~sentinel_t() {
+    if (destroyed) {
+      *destroyed = true;
+    }
+  }
+
+  bool *destroyed;
+};
+
+ngx_curl::task<void> fetch_detached(sentinel_t sentinel, flow_t *flow) {
+  (void)sentinel;
+  flow->results[0] = co_await ngx_curl::fetch(curl, make_handle("/"));
+  flow->finished = true;
+}
+
+// A spawned coroutine frees itself when it finishes.
+void test_spawn() {
+  create_curl();
+  flow_t flow;
+  bool destroyed = false;
+  ngx_curl::spawn(fetch_detached(sentinel_t(&destroyed), &flow));
+  CHECK(!destroyed);
+  run_until(&flow.finished);
+
+  CHECK(flow.results[0] == CURLE_OK);
+  CHECK(destroyed);
+  destroy_curl();
+}
+
+} // namespace
+
+int main() {
+  static const struct {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+      {"sequence", &test_sequence},
+      {"pool", &test_pool},
+      {"when_all", &test_when_all},
+      {"when_any", &test_when_any},
+      {"destroy_suspended", &test_destroy_suspended},
+      {"spawn", &test_spawn},
+  };
+
+  if (loopback_start(&server, body_size) != 0 ||
+      ngx_shim_init(1024, NGX_LOG_WARN) != 0) {
+    return 2;
+  }
+
+  for (edge_triggered = 0; edge_triggered <= 1; ++edge_triggered) {
+    for (const auto &test : tests) {
+      current_test = test.name;
+      const int failures_before = failures;
+      test.run();
+      std::printf("%s %s (%s)\n", failures == failures_before ? "ok  " : "FAIL",
+                  current_test,
+                  edge_triggered ? "edge-triggered" : "level-triggered");
+    }
+  }
+
+  ngx_shim_done();
+  loopback_stop(&server);
+  return failures ? 1 : 0;
+}
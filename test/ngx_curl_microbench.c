@@ -0,0 +1,413 @@
+// Measures what each request costs ngx_curl and libcurl: allocations, system
+// calls, and CPU cycles, on the shim's event loop (see `shim/ngx_shim.h`)
+// against a loopback server in another process, whose work isn't counted.
+//
+// It keeps a fixed number of requests in flight (a closed loop), each
+// completion adding its handle again, and measures after a warmup. Options:
+//
+//   -n <count>    requests measured (default 20000)
+//   -w <count>    requests of warmup (default 2000)
+//   -c <count>    requests in flight (default 16)
+//   -b <bytes>    response body size (default 1000)
+//   -e            register sockets edge-triggered
+//   -k            don't reuse connections (CURLOPT_FORBID_REUSE)
+//   -h            print these options
+//
+// Allocations are counted by an `ngx_curl_allocator_t` that ngx_curl and
+// libcurl share (via `curl_global_init_mem`). System calls are counted by
+// interposing on libc (see `syscalls.h`). Cycles and instructions come from
+// `perf_event_open`, if the kernel allows it, and CPU time from `getrusage`.
+// Since it's a plain program, it can be run under `perf record` or
+// `valgrind --tool=callgrind` to see where the time goes.
+
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_curl.h"
+
+#include "loopback.h"
+#include "ngx_shim.h"
+#include "syscalls.h"
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+typedef struct counters_s {
+  size_t allocations;
+  size_t allocated_bytes;
+  size_t frees;
+  size_t syscalls[SYSCALL_COUNT];
+  ngx_shim_stats_t shim;
+  ngx_curl_stats_t curl;
+  struct rusage usage;
+  struct timespec time;
+} counters_t;
+
+static ngx_curl_t *curl;
+static size_t started;
+static size_t completed;
+static size_t target;
+static size_t failures;
+static size_t allocations;
+static size_t allocated_bytes;
+static size_t frees;
+
+static void *count_malloc(size_t size) {
+  ++allocations;
+  allocated_bytes += size;
+  return malloc(size);
+}
+
+static void *count_calloc(size_t count, size_t size) {
+  ++allocations;
+  allocated_bytes += count * size;
+  return calloc(count, size);
+}
+
+static void *count_realloc(void *pointer, size_t size) {
+  ++allocations;
+  allocated_bytes += size;
+  return realloc(pointer, size);
+}
+
+static void count_free(void *pointer) {
+  if (pointer) {
+    ++frees;
+  }
+  free(pointer);
+}
+
+static char *count_strdup(const char *string) {
+  ++allocations;
+  allocated_bytes += strlen(string) + 1;
+  return strdup(string);
+}
+
+static const ngx_curl_allocator_t counting_allocator = {
+    &count_malloc, &count_calloc, &count_realloc, &count_free, &count_strdup};
+
+static size_t discard_body(char *data, size_t size, size_t count,
+                           void *user_data) {
+  (void)data;
+  (void)user_data;
+  return size * count;
+}
+
+static void on_done(CURL *handle);
+
+static void on_error(CURL *handle, CURLcode result) {
+  if (failures++ == 0) {
+    fprintf(stderr, "microbench: %s\n", curl_easy_strerror(result));
+  }
+  on_done(handle);
+}
+
+static void on_done(CURL *handle) {
+  ++completed;
+  if (started < target) {
+    ++started;
+    if (ngx_curl_add_handle(curl, handle, &on_error, &on_done) != 0) {
+      ++failures;
+      ++completed;
+    }
+  }
+}
+
+// Runs `count` requests, with at most `concurrency` in flight.
+static int run(CURL **handles, size_t concurrency, size_t count) {
+  started = 0;
+  completed = 0;
+  target = count;
+  for (size_t i = 0; i < concurrency && started < target; ++i) {
+    ++started;
+    if (ngx_curl_add_handle(curl, handles[i], &on_error, &on_done) != 0) {
+      return -1;
+    }
+  }
+  while (completed < target) {
+    if (ngx_shim_process_events(1000) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void sample(counters_t *counters) {
+  counters->allocations = allocations;
+  counters->allocated_bytes = allocated_bytes;
+  counters->frees = frees;
+  syscall_counts(counters->syscalls);
+  ngx_shim_stats(&counters->shim);
+  ngx_curl_stats(curl, &counters->curl);
+  getrusage(RUSAGE_SELF, &counters->usage);
+  clock_gettime(CLOCK_MONOTONIC, &counters->time);
+}
+
+// Opens a counter of this process's events of `type` and `config`, disabled,
+// or returns -1.
+static int open_perf_counter(uint32_t type, uint64_t config,
+                             bool exclude_kernel) {
+  struct perf_event_attr attr = {0};
+  attr.size = sizeof attr;
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = 1;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_perf_counter(int fd) {
+  long long value;
+  if (fd == -1 || read(fd, &value, sizeof value) != sizeof value) {
+    return -1;
+  }
+  return value;
+}
+
+// Returns the ID of the `raw_syscalls:sys_enter` tracepoint, or -1.
+static long long find_syscall_tracepoint(void) {
+  static const char *const paths[] = {
+      "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+      "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"};
+  for (size_t i = 0; i < sizeof paths / sizeof paths[0]; ++i) {
+    FILE *file = fopen(paths[i], "r");
+    if (file) {
+      long long id = -1;
+      if (fscanf(file, "%lld", &id) != 1) {
+        id = -1;
+      }
+      fclose(file);
+      return id;
+    }
+  }
+  return -1;
+}
+
+static double seconds(const struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void report_perf_counter(const char *name, long long value,
+                                const char *scope, size_t requests) {
+  if (value < 0) {
+    printf("%-22s n/a (perf_event_open unavailable)\n", name);
+  } else {
+    printf("%-22s %.0f /request (%s)\n", name, (double)value / requests,
+           scope);
+  }
+}
+
+static void report(const counters_t *before, const counters_t *after,
+                   size_t requests, long long cycles, long long instructions,
+                   bool user_only, long long syscalls) {
+  const double elapsed =
+      (after->time.tv_sec - before->time.tv_sec) +
+      (after->time.tv_nsec - before->time.tv_nsec) / 1e9;
+  const double user =
+      seconds(&after->usage.ru_utime) - seconds(&before->usage.ru_utime);
+  const double system =
+      seconds(&after->usage.ru_stime) - seconds(&before->usage.ru_stime);
+
+  printf("%-22s %.3f s, %.0f requests/s\n", "wall time", elapsed,
+         requests / elapsed);
+  printf("%-22s %.2f us/request (user %.2f, system %.2f)\n", "cpu time",
+         (user + system) * 1e6 / requests, user * 1e6 / requests,
+         system * 1e6 / requests);
+  const char *scope = user_only ? "user space" : "user and kernel";
+  report_perf_counter("cycles", cycles, scope, requests);
+  report_perf_counter("instructions", instructions, scope, requests);
+  printf("%-22s %.2f /request, %.0f bytes/request, %.2f frees/request\n",
+         "allocations",
+         (double)(after->allocations - before->allocations) / requests,
+         (double)(after->allocated_bytes - before->allocated_bytes) / requests,
+         (double)(after->frees - before->frees) / requests);
+
+  if (syscalls >= 0) {
+    printf("%-22s %.2f /request (raw_syscalls:sys_enter)\n", "syscalls",
+           (double)syscalls / requests);
+  }
+  size_t interposed = 0;
+  for (size_t i = 0; i < SYSCALL_COUNT; ++i) {
+    interposed += after->syscalls[i] - before->syscalls[i];
+  }
+  printf("%-22s %.2f /request (interposed)\n", "libc socket/io calls",
+         (double)interposed / requests);
+  for (size_t i = 0; i < SYSCALL_COUNT; ++i) {
+    const size_t count = after->syscalls[i] - before->syscalls[i];
+    if (count) {
+      printf("  %-20s %.2f /request\n", syscall_names[i],
+             (double)count / requests);
+    }
+  }
+
+  const ngx_shim_stats_t *s0 = &before->shim;
+  const ngx_shim_stats_t *s1 = &after->shim;
+  printf("%-22s %.2f /request (%.2f ready, %.2f posted, %.2f timers)\n",
+         "event handlers",
+         (double)(s1->events_handled + s1->posted_events_handled +
+                  s1->timers_expired - s0->events_handled -
+                  s0->posted_events_handled - s0->timers_expired) /
+             requests,
+         (double)(s1->events_handled - s0->events_handled) / requests,
+         (double)(s1->posted_events_handled - s0->posted_events_handled) /
+             requests,
+         (double)(s1->timers_expired - s0->timers_expired) / requests);
+
+  const ngx_curl_stats_t *c0 = &before->curl;
+  const ngx_curl_stats_t *c1 = &after->curl;
+  printf("%-22s %.2f /request\n", "event registrations",
+         (double)(c1->event_registrations - c0->event_registrations) /
+             requests);
+  printf("%-22s %zu opened, %zu reused\n", "connections",
+         c1->connections_opened - c0->connections_opened,
+         c1->connections_reused - c0->connections_reused);
+}
+
+static void print_usage(FILE *out, const char *program) {
+  fprintf(out,
+          "usage: %s [-n count] [-w count] [-c count] [-b bytes] [-e] [-k] "
+          "[-h]\n"
+          "  -n <count>    requests measured (default 20000)\n"
+          "  -w <count>    requests of warmup (default 2000)\n"
+          "  -c <count>    requests in flight (default 16)\n"
+          "  -b <bytes>    response body size (default 1000)\n"
+          "  -e            register sockets edge-triggered\n"
+          "  -k            don't reuse connections (CURLOPT_FORBID_REUSE)\n"
+          "  -h            print these options\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  size_t requests = 20000;
+  size_t warmup = 2000;
+  size_t concurrency = 16;
+  size_t body_size = 1000;
+  int edge_triggered = 0;
+  int forbid_reuse = 0;
+
+  int option;
+  while ((option = getopt(argc, argv, "hn:w:c:b:ek")) != -1) {
+    switch (option) {
+    case 'h':
+      print_usage(stdout, argv[0]);
+      return 0;
+    case 'n':
+      requests = strtoul(optarg, NULL, 10);
+      break;
+    case 'w':
+      warmup = strtoul(optarg, NULL, 10);
+      break;
+    case 'c':
+      concurrency = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      body_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'e':
+      edge_triggered = 1;
+      break;
+    case 'k':
+      forbid_reuse = 1;
+      break;
+    default:
+      print_usage(stderr, argv[0]);
+      return 2;
+    }
+  }
+  if (requests == 0 || concurrency == 0) {
+    fprintf(stderr, "microbench: -n and -c must be positive\n");
+    return 2;
+  }
+
+  loopback_server_t server;
+  if (loopback_start(&server, body_size) != 0 ||
+      ngx_shim_init(concurrency + 64, NGX_LOG_WARN) != 0) {
+    return 1;
+  }
+
+  ngx_curl_options_t options = {0};
+  options.allocator = &counting_allocator;
+  options.edge_triggered = edge_triggered;
+  curl = ngx_create_curl_with_options(&options);
+  if (curl == NULL) {
+    return 1;
+  }
+
+  char url[64];
+  snprintf(url, sizeof url, "http://127.0.0.1:%d/", server.port);
+  CURL **handles = calloc(concurrency, sizeof(CURL *));
+  for (size_t i = 0; i < concurrency; ++i) {
+    handles[i] = curl_easy_init();
+    curl_easy_setopt(handles[i], CURLOPT_URL, url);
+    curl_easy_setopt(handles[i], CURLOPT_WRITEFUNCTION, &discard_body);
+    curl_easy_setopt(handles[i], CURLOPT_FORBID_REUSE, (long)forbid_reuse);
+  }
+
+  if (warmup && run(handles, concurrency, warmup) != 0) {
+    return 1;
+  }
+
+  // Prefer counting cycles in the kernel too, since that's where system
+  // calls spend theirs, but settle for user space.
+  bool user_only = false;
+  int cycles_fd =
+      open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false);
+  if (cycles_fd == -1) {
+    user_only = true;
+    cycles_fd =
+        open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true);
+  }
+  const int instructions_fd = open_perf_counter(
+      PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, user_only);
+  const long long tracepoint = find_syscall_tracepoint();
+  const int syscalls_fd =
+      tracepoint == -1
+          ? -1
+          : open_perf_counter(PERF_TYPE_TRACEPOINT, tracepoint, false);
+  const int fds[] = {cycles_fd, instructions_fd, syscalls_fd};
+
+  failures = 0;
+  counters_t before;
+  counters_t after;
+  sample(&before);
+  for (size_t i = 0; i < 3; ++i) {
+    if (fds[i] != -1) {
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  const int rc = run(handles, concurrency, requests);
+  for (size_t i = 0; i < 3; ++i) {
+    if (fds[i] != -1) {
+      ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+  sample(&after);
+  if (rc != 0) {
+    return 1;
+  }
+
+  printf("%zu requests, %zu in flight, %zu-byte bodies, %s%s\n", requests,
+         concurrency, body_size,
+         edge_triggered ? "edge-triggered" : "level-triggered",
+         forbid_reuse ? ", no connection reuse" : "");
+  report(&before, &after, requests, read_perf_counter(cycles_fd),
+         read_perf_counter(instructions_fd), user_only,
+         read_perf_counter(syscalls_fd));
+  if (failures) {
+    printf("%-22s %zu\n", "failures", failures);
+  }
+
+  for (size_t i = 0; i < concurrency; ++i) {
+    curl_easy_cleanup(handles[i]);
+  }
+  free(handles);
+  ngx_destroy_curl(curl);
+  ngx_shim_done();
+  loopback_stop(&server);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,1077 @@
+// Tests of the callback contract described in `ngx_curl.h`, run on the
+// shim's event loop (see `shim/ngx_shim.h`) against a loopback server. Every
+// test runs twice: with level-triggered events, then edge-triggered.
+//
+// Exits with status zero if every check passed.
+
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+#include "ngx_curl.h"
+
+#include "loopback.h"
+#include "ngx_shim.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define BODY_SIZE 1000
+#define MAX_TRANSFERS 32
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: %s: CHECK(%s) failed\n", __FILE__, __LINE__,    \
+              current_test, #condition);                                       \
+      ++failures;                                                              \
+    }                                                                          \
+  } while (0)
+
+typedef struct transfer_s {
+  CURL *handle;
+  char url[128];
+  // How many times `on_done`, `on_error`, `on_complete`, or `on_response`
+  // was called, and with what, and when the last call was, counting from 1.
+  int completions;
+  int order;
+  CURLcode result;
+  long status;
+  size_t body_length;
+  void *data;
+  // A callback ran while ngx_curl was still being called.
+  bool reentered;
+  // A callback ran on a thread other than the event loop's.
+  bool off_loop;
+  // How many more times `on_done_again` adds the handle.
+  int again;
+} transfer_t;
+
+static const char *current_test;
+static int failures;
+static loopback_server_t server;
+// Nothing listens on this port. It's outside of the ephemeral range, so a
+// connection to it can't accidentally connect to itself.
+static unsigned short refused_port = 1;
+static int edge_triggered;
+static pthread_t loop_thread;
+static ngx_curl_t *curl;
+static int inside_ngx_curl;
+static transfer_t transfers[MAX_TRANSFERS];
+static int completion_count;
+
+static void create_curl(ngx_curl_options_t *options) {
+  options->edge_triggered = edge_triggered;
+  curl = ngx_create_curl_with_options(options);
+  CHECK(curl != NULL);
+}
+
+// Also checks that nothing outlives the `ngx_curl_t*`.
+static void destroy_curl(void) {
+  for (size_t i = 0; i < MAX_TRANSFERS; ++i) {
+    if (transfers[i].handle) {
+      curl_easy_cleanup(transfers[i].handle);
+      transfers[i].handle = NULL;
+    }
+  }
+  ngx_destroy_curl(curl);
+  curl = NULL;
+  CHECK(ngx_cycle->free_connection_n == ngx_cycle->connection_n);
+  CHECK(ngx_shim_timer_count() == 0);
+  CHECK(ngx_queue_empty(&ngx_posted_events));
+}
+
+static size_t on_body(char *data, size_t size, size_t count, void *user_data) {
+  (void)data;
+  transfer_t *transfer = user_data;
+  transfer->body_length += size * count;
+  return size * count;
+}
+
+static transfer_t *make_transfer(size_t index, const char *path) {
+  transfer_t *transfer = &transfers[index];
+  *transfer = (transfer_t){0};
+  snprintf(transfer->url, sizeof transfer->url, "http://127.0.0.1:%d%s",
+           server.port, path);
+  transfer->handle = curl_easy_init();
+  curl_easy_setopt(transfer->handle, CURLOPT_URL, transfer->url);
+  curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, transfer);
+  curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, &on_body);
+  curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer);
+  return transfer;
+}
+
+static void record(CURL *handle, CURLcode result) {
+  transfer_t *transfer;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  ++transfer->completions;
+  transfer->order = ++completion_count;
+  transfer->result = result;
+  curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &transfer->status);
+  transfer->reentered |= inside_ngx_curl > 0;
+  transfer->off_loop |= !pthread_equal(pthread_self(), loop_thread);
+}
+
+static void on_error(CURL *handle, CURLcode result) { record(handle, result); }
+
+static void on_done(CURL *handle) { record(handle, CURLE_OK); }
+
+static void on_complete(CURL *handle, CURLcode result, void *data) {
+  record(handle, result);
+  transfer_t *transfer;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  transfer->data = data;
+}
+
+static bool complete(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (transfers[i].completions == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Runs the event loop until the first `count` transfers have completed, or
+// for five seconds.
+static void run_until_complete(size_t count) {
+  const ngx_msec_t deadline = ngx_current_msec + 5000;
+  while (!complete(count) &&
+         (ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(100);
+  }
+  CHECK(complete(count));
+}
+
+static void run_for(ngx_msec_t duration) {
+  const ngx_msec_t deadline = ngx_current_msec + duration;
+  while ((ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(deadline - ngx_current_msec);
+  }
+}
+
+static int add_handle(transfer_t *transfer) {
+  ++inside_ngx_curl;
+  const int rc = ngx_curl_add_handle(curl, transfer->handle, &on_error,
+                                     &on_done);
+  --inside_ngx_curl;
+  return rc;
+}
+
+// `on_done` (or `on_error`) is called exactly once, from the event loop
+// rather than from `ngx_curl_add_handle`, and the transfer starts from a
+// posted event.
+static void test_done_once(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *transfer = make_transfer(0, "/");
+
+  CHECK(add_handle(transfer) == 0);
+  CHECK(transfer->completions == 0);
+  CHECK(!ngx_queue_empty(&ngx_posted_events));
+  run_until_complete(1);
+  run_for(20);
+
+  CHECK(transfer->completions == 1);
+  CHECK(transfer->result == CURLE_OK);
+  CHECK(transfer->status == 200);
+  CHECK(transfer->body_length == BODY_SIZE);
+  CHECK(!transfer->reentered);
+  destroy_curl();
+}
+
+// An HTTP error status is still a complete response.
+static void test_status_is_done(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *transfer = make_transfer(0, "/status/503");
+
+  CHECK(add_handle(transfer) == 0);
+  run_until_complete(1);
+
+  CHECK(transfer->completions == 1);
+  CHECK(transfer->result == CURLE_OK);
+  CHECK(transfer->status == 503);
+  destroy_curl();
+}
+
+static void test_errors(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *refused = make_transfer(0, "/");
+  snprintf(refused->url, sizeof refused->url, "http://127.0.0.1:%d/",
+           refused_port);
+  curl_easy_setopt(refused->handle, CURLOPT_URL, refused->url);
+  transfer_t *closed = make_transfer(1, "/close");
+
+  CHECK(add_handle(refused) == 0);
+  CHECK(add_handle(closed) == 0);
+  run_until_complete(2);
+  run_for(20);
+
+  CHECK(refused->completions == 1);
+  CHECK(refused->result == CURLE_COULDNT_CONNECT);
+  CHECK(closed->completions == 1);
+  CHECK(closed->result == CURLE_GOT_NOTHING);
+  CHECK(!refused->reentered && !closed->reentered);
+  destroy_curl();
+}
+
+static void test_add_handles(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  CURL *handles[MAX_TRANSFERS];
+  for (size_t i = 0; i < MAX_TRANSFERS; ++i) {
+    handles[i] = make_transfer(i, "/")->handle;
+  }
+
+  ++inside_ngx_curl;
+  CHECK(ngx_curl_add_handles(curl, handles, MAX_TRANSFERS, &on_error,
+                             &on_done) == 0);
+  --inside_ngx_curl;
+  run_until_complete(MAX_TRANSFERS);
+  run_for(20);
+
+  for (size_t i = 0; i < MAX_TRANSFERS; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_OK);
+    CHECK(transfers[i].body_length == BODY_SIZE);
+    CHECK(!transfers[i].reentered);
+  }
+  destroy_curl();
+}
+
+// A removed handle's callbacks are never called, whether it's removed before
+// its transfer starts or while it's running.
+static void test_remove_handle(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *unstarted = make_transfer(0, "/delay/100");
+  transfer_t *running = make_transfer(1, "/delay/100");
+
+  CHECK(add_handle(unstarted) == 0);
+  CHECK(add_handle(running) == 0);
+  CHECK(ngx_curl_remove_handle(curl, unstarted->handle) == 0);
+  run_for(30);
+  CHECK(ngx_curl_remove_handle(curl, running->handle) == 0);
+  run_for(200);
+
+  CHECK(unstarted->completions == 0);
+  CHECK(running->completions == 0);
+  destroy_curl();
+}
+
+static void on_done_again(CURL *handle) {
+  record(handle, CURLE_OK);
+  transfer_t *transfer;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  if (transfer->again-- > 0) {
+    CHECK(ngx_curl_add_handle(curl, handle, &on_error, &on_done_again) == 0);
+  }
+}
+
+// A callback may add its handle again.
+static void test_add_from_callback(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *transfer = make_transfer(0, "/");
+  transfer->again = 2;
+
+  CHECK(ngx_curl_add_handle(curl, transfer->handle, &on_error,
+                            &on_done_again) == 0);
+  const ngx_msec_t deadline = ngx_current_msec + 5000;
+  while (transfer->completions < 3 &&
+         (ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(100);
+  }
+  run_for(20);
+
+  CHECK(transfer->completions == 3);
+  CHECK(transfer->result == CURLE_OK);
+  CHECK(transfer->body_length == 3 * BODY_SIZE);
+  destroy_curl();
+}
+
+static void test_add_handle_with_data(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  transfer_t *done = make_transfer(0, "/");
+  transfer_t *failed = make_transfer(1, "/close");
+
+  CHECK(ngx_curl_add_handle_with_data(curl, done->handle, &on_complete,
+                                      &server) == 0);
+  CHECK(ngx_curl_add_handle_with_data(curl, failed->handle, &on_complete,
+                                      &refused_port) == 0);
+  run_until_complete(2);
+
+  CHECK(done->completions == 1 && done->result == CURLE_OK);
+  CHECK(done->data == &server);
+  CHECK(failed->completions == 1 && failed->result == CURLE_GOT_NOTHING);
+  CHECK(failed->data == &refused_port);
+  destroy_curl();
+}
+
+static void on_done_within_limit(CURL *handle) {
+  record(handle, CURLE_OK);
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.transfers_running <= 2);
+}
+
+// Handles beyond `max_running_handles` wait in the queue, in order, and a
+// handle that waits too long fails with `NGX_CURLE_QUEUE_TIMEOUT`.
+static void test_queue(void) {
+  ngx_curl_options_t options = {0};
+  options.max_running_handles = 2;
+  create_curl(&options);
+  for (size_t i = 0; i < 8; ++i) {
+    transfer_t *transfer = make_transfer(i, "/delay/10");
+    CHECK(ngx_curl_add_handle(curl, transfer->handle, &on_error,
+                              &on_done_within_limit) == 0);
+  }
+  run_until_complete(8);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.handles_queued == 6);
+  for (size_t i = 0; i < 8; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_OK);
+  }
+  destroy_curl();
+
+  options.max_running_handles = 1;
+  options.queue_timeout = 50;
+  create_curl(&options);
+  transfer_t *slow = make_transfer(0, "/delay/300");
+  transfer_t *queued = make_transfer(1, "/");
+  CHECK(add_handle(slow) == 0);
+  CHECK(add_handle(queued) == 0);
+  run_until_complete(2);
+
+  CHECK(slow->completions == 1 && slow->result == CURLE_OK);
+  CHECK(queued->completions == 1);
+  CHECK(queued->result == NGX_CURLE_QUEUE_TIMEOUT);
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.queue_timeouts == 1);
+  destroy_curl();
+}
+
+// A connection is reserved for each admitted transfer until its socket is
+// registered, so a batch of handles doesn't start against a single free
+// connection.
+static void test_connection_reservations(void) {
+  // Leave four connections free, i.e. room for three reservations besides
+  // the headroom.
+  static ngx_connection_t *taken[1024];
+  size_t taken_count = 0;
+  while (ngx_cycle->free_connection_n > 4) {
+    taken[taken_count++] = ngx_get_connection(-1, ngx_cycle->log);
+  }
+
+  ngx_curl_options_t options = {0};
+  options.connection_headroom = 1;
+  create_curl(&options);
+  for (size_t i = 0; i < 6; ++i) {
+    transfer_t *transfer = make_transfer(i, "/delay/20");
+    CHECK(add_handle(transfer) == 0);
+  }
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.transfers_running == 3);
+  CHECK(stats.connections_reserved == 3);
+  CHECK(stats.handles_queued == 3);
+  run_until_complete(6);
+
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.connections_reserved == 0);
+  for (size_t i = 0; i < 6; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_OK);
+  }
+
+  while (taken_count) {
+    ngx_free_connection(taken[--taken_count]);
+  }
+  destroy_curl();
+}
+
+// With `max_running_handles`, queued handles are admitted by stride
+// scheduling: in proportion to the weights of their classes.
+static void test_priority(void) {
+  ngx_curl_options_t options = {0};
+  options.max_running_handles = 1;
+  options.priority_weights[0] = 3;
+  options.priority_weights[1] = 1;
+  create_curl(&options);
+  transfer_t *blocker = make_transfer(0, "/delay/20");
+  CHECK(add_handle(blocker) == 0);
+  for (size_t i = 1; i <= 16; ++i) {
+    transfer_t *transfer = make_transfer(i, "/");
+    CHECK(add_handle(transfer) == 0);
+    CHECK(ngx_curl_set_priority(curl, transfer->handle, i <= 8 ? 1 : 0) == 0);
+  }
+  run_until_complete(17);
+
+  // Of the first eight admitted from the queue, class 0 had six.
+  size_t urgent = 0;
+  for (size_t i = 1; i <= 16; ++i) {
+    CHECK(transfers[i].result == CURLE_OK);
+    if (transfers[i].order - blocker->order <= 8 && i > 8) {
+      ++urgent;
+    }
+  }
+  CHECK(urgent == 6);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.classes[0].admitted_from_queue == 8);
+  CHECK(stats.classes[1].admitted_from_queue == 8);
+  CHECK(stats.classes[0].queue_depth == 0);
+  destroy_curl();
+}
+
+static void on_response(CURL *handle, const ngx_curl_response_t *response) {
+  record(handle, CURLE_OK);
+  transfer_t *transfer;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  transfer->status = response->status;
+  transfer->body_length = response->body_length;
+}
+
+// Fetches with the same key share one transfer, and each gets the response.
+static void test_fetch(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  ngx_curl_fetch_options_t fetch_options = {0};
+  fetch_options.key = (ngx_str_t)ngx_string("GET /delay/20");
+  for (size_t i = 0; i < 3; ++i) {
+    transfer_t *transfer = make_transfer(i, "/delay/20");
+    CHECK(ngx_curl_fetch(curl, transfer->handle, &fetch_options, &on_error,
+                         &on_response) == 0);
+  }
+  run_until_complete(3);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.fetches_coalesced == 2);
+  for (size_t i = 0; i < 3; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].status == 200);
+    CHECK(transfers[i].body_length == BODY_SIZE);
+  }
+  destroy_curl();
+}
+
+// Fetches `path` twice, one after the other, with the request headers
+// `headers`, and returns how many of the fetches the response cache served.
+static size_t fetch_twice(size_t index, const char *path,
+                          struct curl_slist *headers) {
+  ngx_curl_fetch_options_t fetch_options = {0};
+  fetch_options.key.data = (u_char *)path;
+  fetch_options.key.len = strlen(path);
+  fetch_options.headers = headers;
+  ngx_curl_stats_t before;
+  ngx_curl_stats(curl, &before);
+  for (size_t i = index; i < index + 2; ++i) {
+    transfer_t *transfer = make_transfer(i, path);
+    CHECK(ngx_curl_fetch(curl, transfer->handle, &fetch_options, &on_error,
+                         &on_response) == 0);
+    run_until_complete(i + 1);
+    CHECK(transfer->status == 200);
+    CHECK(transfer->body_length == BODY_SIZE);
+  }
+  ngx_curl_stats_t after;
+  ngx_curl_stats(curl, &after);
+  return after.response_cache_hits - before.response_cache_hits;
+}
+
+// The response cache is shared, so it doesn't store a response that sets a
+// cookie, or one to a request with `Authorization` unless the response
+// allows it.
+static void test_response_cache_sharing(void) {
+  ngx_pool_t *pool = ngx_create_pool(4096, ngx_cycle->log);
+  ngx_conf_t cf = {.pool = pool, .log = ngx_cycle->log};
+  // Zones last as long as the shim, so each run of the test has its own.
+  ngx_str_t name = ngx_string("responses-level");
+  if (edge_triggered) {
+    name = (ngx_str_t)ngx_string("responses-edge");
+  }
+  ngx_curl_options_t options = {0};
+  options.response_cache = ngx_curl_add_response_cache(&cf, &name, 1 << 20);
+  CHECK(options.response_cache != NULL);
+  CHECK(ngx_shim_init_shared_memory() == 0);
+  create_curl(&options);
+  struct curl_slist *authorization =
+      curl_slist_append(NULL, "Authorization: Bearer secret");
+
+  CHECK(fetch_twice(0, "/cache/max-age=60/", NULL) == 1);
+  CHECK(fetch_twice(2, "/cookie/max-age=60/", NULL) == 0);
+  CHECK(fetch_twice(4, "/cache/max-age=60/authorized", authorization) == 0);
+  CHECK(fetch_twice(6, "/cache/public,max-age=60/", authorization) == 1);
+  CHECK(fetch_twice(8, "/cache/s-maxage=60/", authorization) == 1);
+
+  curl_slist_free_all(authorization);
+  destroy_curl();
+  ngx_destroy_pool(pool);
+}
+
+static void on_chain(CURL *handle, ngx_chain_t *chain) {
+  record(handle, CURLE_OK);
+  transfer_t *transfer;
+  curl_easy_getinfo(handle, CURLINFO_PRIVATE, (char **)&transfer);
+  transfer->data = chain;
+  for (ngx_chain_t *link = chain; link; link = link->next) {
+    transfer->body_length += link->buf->last - link->buf->pos;
+  }
+}
+
+// A body with a `Content-Length` is collected into one buffer, but one that
+// claims more than it sends can't make the sink allocate that much.
+static void test_chain(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  ngx_pool_t *pool = ngx_create_pool(4096, ngx_cycle->log);
+  transfer_t *whole = make_transfer(0, "/");
+  transfer_t *truncated = make_transfer(1, "/truncated/1000000000000000");
+  for (size_t i = 0; i < 2; ++i) {
+    CHECK(ngx_curl_add_handle_to_chain(curl, transfers[i].handle, pool, 0,
+                                       &on_error, &on_chain) == 0);
+  }
+  run_until_complete(2);
+
+  CHECK(whole->completions == 1);
+  CHECK(whole->result == CURLE_OK);
+  CHECK(whole->body_length == BODY_SIZE);
+  CHECK(whole->data && ((ngx_chain_t *)whole->data)->next == NULL);
+  CHECK(truncated->completions == 1);
+  CHECK(truncated->result == CURLE_PARTIAL_FILE);
+
+  destroy_curl();
+  ngx_destroy_pool(pool);
+}
+
+// Makes a body of one buffer holding the first `size` bytes of the file `fd`.
+static ngx_chain_t *make_file_body(ngx_pool_t *pool, ngx_fd_t fd,
+                                   size_t size) {
+  ngx_file_t *file = ngx_pcalloc(pool, sizeof(ngx_file_t));
+  ngx_buf_t *buffer = ngx_pcalloc(pool, sizeof(ngx_buf_t));
+  ngx_chain_t *body = ngx_alloc_chain_link(pool);
+  file->fd = fd;
+  file->log = ngx_cycle->log;
+  buffer->file = file;
+  buffer->file_last = size;
+  buffer->in_file = 1;
+  body->buf = buffer;
+  body->next = NULL;
+  return body;
+}
+
+// A handle can be removed while the thread pool reads its body. The read
+// then doesn't resume the handle, which might have been cleaned up by the
+// time it completes, but if the handle is added again (as it is to retry),
+// then it waits for the read and sends what was read.
+static void test_upload_removed_while_reading(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+  char path[] = "/tmp/ngx_curl_test.XXXXXX";
+  const int fd = mkstemp(path);
+  CHECK(fd != -1);
+  unlink(path);
+  static const char contents[BODY_SIZE];
+  CHECK(write(fd, contents, sizeof contents) == sizeof contents);
+  ngx_pool_t *pool = ngx_create_pool(4096, ngx_cycle->log);
+  ngx_curl_upload_options_t upload_options = {0};
+  upload_options.thread_pool = ngx_shim_thread_pool();
+
+  transfer_t *readded = make_transfer(0, "/");
+  transfer_t *removed = make_transfer(1, "/");
+  for (size_t i = 0; i < 2; ++i) {
+    curl_easy_setopt(transfers[i].handle, CURLOPT_POST, 1L);
+    CHECK(ngx_curl_upload_chain(curl, transfers[i].handle, pool,
+                                make_file_body(pool, fd, sizeof contents),
+                                &upload_options) == 0);
+    CHECK(add_handle(&transfers[i]) == 0);
+  }
+  const ngx_msec_t deadline = ngx_current_msec + 5000;
+  while (ngx_shim_thread_task_count() < 2 &&
+         (ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(100);
+  }
+  CHECK(ngx_shim_thread_task_count() == 2);
+  ngx_shim_stats_t before;
+  ngx_shim_stats(&before);
+
+  CHECK(ngx_curl_remove_handle(curl, removed->handle) == 0);
+  curl_easy_cleanup(removed->handle);
+  removed->handle = NULL;
+  CHECK(ngx_curl_remove_handle(curl, readded->handle) == 0);
+  CHECK(add_handle(readded) == 0);
+  run_for(20);
+  CHECK(ngx_shim_thread_task_count() == 2);
+  CHECK(ngx_shim_run_thread_tasks() == 2);
+  run_until_complete(1);
+
+  CHECK(readded->completions == 1);
+  CHECK(readded->result == CURLE_OK);
+  CHECK(readded->status == 200);
+  CHECK(removed->completions == 0);
+  ngx_shim_stats_t after;
+  ngx_shim_stats(&after);
+  CHECK(after.errors_logged == before.errors_logged);
+  destroy_curl();
+  ngx_destroy_pool(pool);
+  close(fd);
+}
+
+// Makes a "/fail/" path that's unique to the current run of a test.
+static transfer_t *make_failing_transfer(size_t index, int failures,
+                                         const char *tag) {
+  char path[64];
+  snprintf(path, sizeof path, "/fail/%d/%s-%d", failures, tag, edge_triggered);
+  return make_transfer(index, path);
+}
+
+static const long retryable_statuses[] = {503, 0};
+
+// A 503 is retried after a backoff, and the response collected by a chain
+// sink or a fetch is that of the last attempt alone.
+static void test_retry(void) {
+  ngx_curl_options_t options = {0};
+  options.retry_budget_percent = 100;
+  create_curl(&options);
+  ngx_pool_t *pool = ngx_create_pool(4096, ngx_cycle->log);
+  ngx_curl_retry_policy_t policy = {0};
+  policy.max_attempts = 3;
+  policy.retryable_statuses = retryable_statuses;
+  policy.backoff = 20;
+
+  transfer_t *chained = make_failing_transfer(0, 1, "chain");
+  CHECK(ngx_curl_add_handle_to_chain(curl, chained->handle, pool, 0,
+                                     &on_error, &on_chain) == 0);
+  CHECK(ngx_curl_retry(curl, chained->handle, &policy) == 0);
+  transfer_t *fetched = make_failing_transfer(1, 1, "fetch");
+  ngx_curl_fetch_options_t fetch_options = {0};
+  fetch_options.retry = &policy;
+  CHECK(ngx_curl_fetch(curl, fetched->handle, &fetch_options, &on_error,
+                       &on_response) == 0);
+  run_until_complete(2);
+
+  CHECK(chained->completions == 1);
+  CHECK(chained->result == CURLE_OK);
+  CHECK(chained->status == 200);
+  CHECK(chained->body_length == BODY_SIZE);
+  CHECK(fetched->completions == 1);
+  CHECK(fetched->status == 200);
+  CHECK(fetched->body_length == BODY_SIZE);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.retries == 2);
+  CHECK(stats.retries_denied == 0);
+  destroy_curl();
+  ngx_destroy_pool(pool);
+}
+
+// A handle backing off doesn't count against `max_running_handles`, so a
+// handle queued behind it starts, and finishes, first.
+static void test_retry_backing_off(void) {
+  ngx_curl_options_t options = {0};
+  options.max_running_handles = 1;
+  options.retry_budget_percent = 100;
+  create_curl(&options);
+  ngx_curl_retry_policy_t policy = {0};
+  policy.max_attempts = 2;
+  policy.retryable_statuses = retryable_statuses;
+  policy.backoff = 100;
+
+  transfer_t *retried = make_failing_transfer(0, 1, "backing-off");
+  CHECK(add_handle(retried) == 0);
+  CHECK(ngx_curl_retry(curl, retried->handle, &policy) == 0);
+  transfer_t *queued = make_transfer(1, "/delay/50");
+  CHECK(add_handle(queued) == 0);
+  run_until_complete(2);
+
+  CHECK(retried->result == CURLE_OK);
+  CHECK(retried->status == 200);
+  CHECK(queued->result == CURLE_OK);
+  CHECK(queued->order < retried->order);
+  destroy_curl();
+}
+
+// A deadline caps each attempt's `CURLOPT_TIMEOUT_MS`, and no attempt starts
+// that couldn't finish before it.
+static void test_retry_deadline(void) {
+  ngx_curl_options_t options = {0};
+  options.retry_budget_percent = 100;
+  create_curl(&options);
+  ngx_curl_retry_policy_t policy = {0};
+  policy.max_attempts = 5;
+  policy.deadline = 200;
+
+  transfer_t *slow = make_transfer(0, "/delay/3000");
+  CHECK(add_handle(slow) == 0);
+  CHECK(ngx_curl_retry(curl, slow->handle, &policy) == 0);
+  const ngx_msec_t start = ngx_current_msec;
+  run_until_complete(1);
+
+  CHECK(slow->result == CURLE_OPERATION_TIMEDOUT);
+  CHECK(ngx_current_msec - start >= 150);
+  CHECK(ngx_current_msec - start < 1000);
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.retries == 0);
+  destroy_curl();
+}
+
+// Retries are limited to `retry_budget_percent` of the handles that could
+// retry, and a handle denied one completes with its last attempt's result.
+static void test_retry_budget(void) {
+  ngx_curl_options_t options = {0};
+  options.retry_budget_percent = 50;
+  create_curl(&options);
+  ngx_curl_retry_policy_t policy = {0};
+  policy.max_attempts = 3;
+  policy.retryable_statuses = retryable_statuses;
+  policy.backoff = 10;
+
+  for (size_t i = 0; i < 4; ++i) {
+    transfer_t *transfer = make_transfer(i, "/status/503");
+    CHECK(add_handle(transfer) == 0);
+    CHECK(ngx_curl_retry(curl, transfer->handle, &policy) == 0);
+  }
+  run_until_complete(4);
+
+  for (size_t i = 0; i < 4; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_OK);
+    CHECK(transfers[i].status == 503);
+  }
+  // Four handles earn two retries. The other two handles are denied one,
+  // and so are the two that retried, after their second attempt.
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.retries == 2);
+  CHECK(stats.retries_denied == 4);
+  destroy_curl();
+}
+
+typedef struct group_outcome_s {
+  int calls;
+  size_t size;
+  size_t successes;
+  CURLcode results[4];
+} group_outcome_t;
+
+static void on_group_done(ngx_curl_group_t *group, void *data) {
+  group_outcome_t *outcome = data;
+  ++outcome->calls;
+  outcome->size = ngx_curl_group_size(group);
+  outcome->successes = ngx_curl_group_successes(group);
+  for (size_t i = 0; i < outcome->size && i < 4; ++i) {
+    outcome->results[i] = ngx_curl_group_result(group, i);
+  }
+}
+
+// A group calls back once, when every member has finished, or as soon as
+// its quorum is met, cancelling the members still running.
+static void test_group(void) {
+  ngx_curl_options_t options = {0};
+  create_curl(&options);
+
+  group_outcome_t all = {0};
+  ngx_curl_group_t *group = ngx_curl_create_group(curl, NULL, &on_group_done,
+                                                  &all);
+  CHECK(group != NULL);
+  make_transfer(0, "/");
+  make_transfer(1, "/");
+  snprintf(transfers[1].url, sizeof transfers[1].url,
+           "http://127.0.0.1:%d/", refused_port);
+  curl_easy_setopt(transfers[1].handle, CURLOPT_URL, transfers[1].url);
+  CHECK(ngx_curl_group_add(group, transfers[0].handle) == 0);
+  CHECK(ngx_curl_group_add(group, transfers[1].handle) == 0);
+  CHECK(ngx_curl_group_start(group) == 0);
+
+  group_outcome_t first = {0};
+  ngx_curl_group_options_t group_options = {0};
+  group_options.quorum = 1;
+  group = ngx_curl_create_group(curl, &group_options, &on_group_done, &first);
+  CHECK(group != NULL);
+  make_transfer(2, "/delay/3000");
+  make_transfer(3, "/");
+  CHECK(ngx_curl_group_add(group, transfers[2].handle) == 0);
+  CHECK(ngx_curl_group_add(group, transfers[3].handle) == 0);
+  CHECK(ngx_curl_group_start(group) == 0);
+
+  const ngx_msec_t deadline = ngx_current_msec + 2000;
+  while ((all.calls == 0 || first.calls == 0) &&
+         (ngx_msec_int_t)(deadline - ngx_current_msec) > 0) {
+    ngx_shim_process_events(100);
+  }
+
+  CHECK(all.calls == 1);
+  CHECK(all.size == 2);
+  CHECK(all.successes == 1);
+  CHECK(all.results[0] == CURLE_OK);
+  CHECK(all.results[1] == CURLE_COULDNT_CONNECT);
+  CHECK(first.calls == 1);
+  CHECK(first.successes == 1);
+  CHECK(first.results[0] == NGX_CURLE_GROUP_CANCELLED);
+  CHECK(first.results[1] == CURLE_OK);
+
+  run_for(20);
+  CHECK(all.calls == 1);
+  CHECK(first.calls == 1);
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.group_members_cancelled == 1);
+  CHECK(stats.transfers_running == 0);
+  destroy_curl();
+}
+
+// A fetch that's slower than its hedge delay starts a second copy, and the
+// first to succeed is delivered, once.
+static void test_hedge(void) {
+  ngx_curl_options_t options = {0};
+  options.hedge_budget_percent = 100;
+  create_curl(&options);
+  char hedge_url[128];
+  snprintf(hedge_url, sizeof hedge_url, "http://127.0.0.1:%d/", server.port);
+  ngx_curl_fetch_options_t fetch_options = {0};
+  fetch_options.hedge_delay = 30;
+  fetch_options.hedge_url = hedge_url;
+
+  transfer_t *slow = make_transfer(0, "/delay/1000");
+  CHECK(ngx_curl_fetch(curl, slow->handle, &fetch_options, &on_error,
+                       &on_response) == 0);
+  const ngx_msec_t start = ngx_current_msec;
+  run_until_complete(1);
+
+  CHECK(ngx_current_msec - start < 500);
+  CHECK(slow->status == 200);
+  CHECK(slow->body_length == BODY_SIZE);
+  run_for(20);
+  CHECK(slow->completions == 1);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.hedges_started == 1);
+  CHECK(stats.hedges_won == 1);
+  CHECK(stats.transfers_running == 0);
+  destroy_curl();
+}
+
+// Enough 503s open an origin's breaker, which then rejects handles until a
+// probe decides: a failed probe opens it again, and a successful one closes
+// it.
+static void test_breaker(void) {
+  ngx_curl_options_t options = {0};
+  options.circuit_breaker = 1;
+  options.breaker_min_requests = 4;
+  options.breaker_error_percent = 50;
+  options.breaker_open_time = 50;
+  create_curl(&options);
+
+  for (size_t i = 0; i < 4; ++i) {
+    CHECK(add_handle(make_transfer(i, "/status/503")) == 0);
+  }
+  run_until_complete(4);
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.circuits_opened == 1);
+
+  // Open: rejected, without a socket.
+  transfer_t *rejected = make_transfer(4, "/");
+  CHECK(add_handle(rejected) == 0);
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.sockets_open == 0);
+  run_until_complete(5);
+  CHECK(rejected->result == NGX_CURLE_CIRCUIT_OPEN);
+
+  // Half open: the first handle probes, and the next is rejected.
+  run_for(60);
+  transfer_t *failed_probe = make_transfer(5, "/status/503");
+  transfer_t *during_probe = make_transfer(6, "/");
+  CHECK(add_handle(failed_probe) == 0);
+  CHECK(add_handle(during_probe) == 0);
+  run_until_complete(7);
+  CHECK(failed_probe->result == CURLE_OK);
+  CHECK(failed_probe->status == 503);
+  CHECK(during_probe->result == NGX_CURLE_CIRCUIT_OPEN);
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.circuits_opened == 2);
+
+  run_for(60);
+  transfer_t *probe = make_transfer(7, "/");
+  CHECK(add_handle(probe) == 0);
+  run_until_complete(8);
+  CHECK(probe->result == CURLE_OK);
+  CHECK(probe->status == 200);
+
+  // Closed.
+  transfer_t *after = make_transfer(8, "/");
+  CHECK(add_handle(after) == 0);
+  run_until_complete(9);
+  CHECK(after->result == CURLE_OK);
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.circuits_opened == 2);
+  CHECK(stats.circuit_rejections == 2);
+  destroy_curl();
+}
+
+// With phase timing, transfers are recorded under their origin, which
+// leaves out the user information, path, and query, and lowercases the
+// scheme and host.
+static void test_phase_timing(void) {
+  ngx_curl_options_t options = {0};
+  options.phase_timing = 1;
+  create_curl(&options);
+  transfer_t *transfer = make_transfer(0, "/?query");
+  snprintf(transfer->url, sizeof transfer->url,
+           "HTTP://user@127.0.0.1:%d/path?query", server.port);
+  curl_easy_setopt(transfer->handle, CURLOPT_URL, transfer->url);
+  CHECK(add_handle(transfer) == 0);
+  run_until_complete(1);
+  CHECK(transfer->status == 200);
+
+  char name[64];
+  ngx_str_t origin;
+  origin.data = (u_char *)name;
+  origin.len = snprintf(name, sizeof name, "http://127.0.0.1:%d", server.port);
+  CHECK(ngx_curl_phase_percentile(curl, &origin, NGX_CURL_PHASE_TOTAL, 50) >=
+        0);
+  origin.len = snprintf(name, sizeof name, "http://127.0.0.1:%d",
+                        refused_port);
+  CHECK(ngx_curl_phase_percentile(curl, &origin, NGX_CURL_PHASE_TOTAL, 50) ==
+        -1);
+  destroy_curl();
+}
+
+static void *submit_transfers(void *arg) {
+  (void)arg;
+  for (size_t i = 0; i < 4; ++i) {
+    CHECK(ngx_curl_submit(curl, transfers[i].handle, &on_complete, NULL) ==
+          0);
+  }
+  return NULL;
+}
+
+// `ngx_curl_submit` from another thread wakes the event loop, and
+// `on_complete` is called on the event loop.
+static void test_submit(void) {
+  ngx_curl_options_t options = {0};
+  options.accept_submissions = 1;
+  create_curl(&options);
+  for (size_t i = 0; i < 4; ++i) {
+    make_transfer(i, "/");
+  }
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, &submit_transfers, NULL) == 0);
+  run_until_complete(4);
+  pthread_join(thread, NULL);
+
+  ngx_curl_stats_t stats;
+  ngx_curl_stats(curl, &stats);
+  CHECK(stats.handles_submitted == 4);
+  for (size_t i = 0; i < 4; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_OK);
+    CHECK(!transfers[i].off_loop);
+  }
+  destroy_curl();
+}
+
+// Submitted handles that are still running when the `ngx_curl_t*` is
+// destroyed are removed, and complete with `CURLE_ABORTED_BY_CALLBACK`.
+static void test_destroy_with_submissions(void) {
+  ngx_curl_options_t options = {0};
+  options.accept_submissions = 1;
+  create_curl(&options);
+  for (size_t i = 0; i < 4; ++i) {
+    make_transfer(i, "/delay/5000");
+  }
+
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, &submit_transfers, NULL) == 0);
+  pthread_join(thread, NULL);
+  ngx_curl_stats_t stats;
+  const ngx_msec_t deadline = ngx_current_msec + 5000;
+  do {
+    ngx_shim_process_events(100);
+    ngx_curl_stats(curl, &stats);
+  } while (stats.handles_submitted < 4 &&
+           (ngx_msec_int_t)(deadline - ngx_current_msec) > 0);
+  CHECK(stats.handles_submitted == 4);
+  CHECK(!complete(4));
+
+  // The handles are the library's until they complete, so destroy it
+  // before cleaning them up.
+  ngx_destroy_curl(curl);
+  curl = NULL;
+  for (size_t i = 0; i < 4; ++i) {
+    CHECK(transfers[i].completions == 1);
+    CHECK(transfers[i].result == CURLE_ABORTED_BY_CALLBACK);
+    CHECK(!transfers[i].off_loop);
+  }
+  CHECK(ngx_cycle->free_connection_n == ngx_cycle->connection_n);
+  CHECK(ngx_shim_timer_count() == 0);
+  for (size_t i = 0; i < 4; ++i) {
+    curl_easy_cleanup(transfers[i].handle);
+    transfers[i].handle = NULL;
+  }
+}
+
+int main(void) {
+  static const struct {
+    const char *name;
+    void (*run)(void);
+  } tests[] = {
+      {"done_once", &test_done_once},
+      {"status_is_done", &test_status_is_done},
+      {"errors", &test_errors},
+      {"add_handles", &test_add_handles},
+      {"remove_handle", &test_remove_handle},
+      {"add_from_callback", &test_add_from_callback},
+      {"add_handle_with_data", &test_add_handle_with_data},
+      {"queue", &test_queue},
+      {"connection_reservations", &test_connection_reservations},
+      {"priority", &test_priority},
+      {"chain", &test_chain},
+      {"upload_removed_while_reading", &test_upload_removed_while_reading},
+      {"fetch", &test_fetch},
+      {"response_cache_sharing", &test_response_cache_sharing},
+      {"retry", &test_retry},
+      {"retry_backing_off", &test_retry_backing_off},
+      {"retry_deadline", &test_retry_deadline},
+      {"retry_budget", &test_retry_budget},
+      {"group", &test_group},
+      {"hedge", &test_hedge},
+      {"breaker", &test_breaker},
+      {"phase_timing", &test_phase_timing},
+      {"submit", &test_submit},
+      {"destroy_with_submissions", &test_destroy_with_submissions},
+  };
+
+  if (loopback_start(&server, BODY_SIZE) != 0 ||
+      ngx_shim_init(1024, NGX_LOG_WARN) != 0) {
+    return 2;
+  }
+  loop_thread = pthread_self();
+
+  for (edge_triggered = 0; edge_triggered <= 1; ++edge_triggered) {
+    for (size_t i = 0; i < sizeof tests / sizeof tests[0]; ++i) {
+      current_test = tests[i].name;
+      const int failures_before = failures;
+      tests[i].run();
+      printf("%s %s (%s)\n", failures == failures_before ? "ok  " : "FAIL",
+             current_test,
+             edge_triggered ? "edge-triggered" : "level-triggered");
+    }
+  }
+
+  ngx_shim_done();
+  loopback_stop(&server);
+  return failures ? 1 : 0;
+}
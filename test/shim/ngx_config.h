@@ -0,0 +1,50 @@
+#pragma once
+
+// The shim's stand-in for nginx's `ngx_config.h`. See `ngx_shim.h`.
+//
+// It describes a Linux build of nginx with epoll, eventfd, atomic
+// operations, and threads (`NGX_THREADS`), though the shim's thread pool
+// has no threads of its own (see `ngx_shim.h`), but without OpenSSL
+// (`NGX_OPENSSL`), so the parts of `ngx_curl.c` that need shared SSL
+// sessions aren't run. `make check` still compiles them, with
+// `NGX_OPENSSL` defined.
+
+// As in nginx's `ngx_linux_config.h`.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define NGX_LINUX 1
+#define NGX_HAVE_EPOLL 1
+#define NGX_HAVE_CLEAR_EVENT 1
+#define NGX_HAVE_EVENTFD 1
+#define NGX_HAVE_SYS_EVENTFD_H 1
+#define NGX_HAVE_ATOMIC_OPS 1
+#define NGX_HAVE_CLOCK_MONOTONIC 1
+#define NGX_THREADS 1
+
+#define ngx_inline inline
+
+typedef intptr_t ngx_int_t;
+typedef uintptr_t ngx_uint_t;
+typedef intptr_t ngx_flag_t;
+
+#define NGX_INT_T_LEN (sizeof("-9223372036854775808") - 1)
+#define NGX_MAX_INT_T_VALUE INTPTR_MAX
+#define NGX_MAX_SIZE_T_VALUE SIZE_MAX
+#define NGX_ATOMIC_T_LEN (sizeof("-9223372036854775808") - 1)
@@ -0,0 +1,406 @@
+#pragma once
+
+// The shim's stand-in for nginx's `ngx_core.h`. See `ngx_shim.h`.
+//
+// Only what `ngx_curl.c` uses is declared. Types whose layout matters to
+// `ngx_curl.c` have the members it uses, under nginx's names; the rest are
+// opaque.
+
+#include <ngx_config.h>
+
+typedef struct ngx_module_s ngx_module_t;
+typedef struct ngx_conf_s ngx_conf_t;
+typedef struct ngx_cycle_s ngx_cycle_t;
+typedef struct ngx_pool_s ngx_pool_t;
+typedef struct ngx_chain_s ngx_chain_t;
+typedef struct ngx_log_s ngx_log_t;
+typedef struct ngx_file_s ngx_file_t;
+typedef struct ngx_event_s ngx_event_t;
+typedef struct ngx_connection_s ngx_connection_t;
+
+typedef void (*ngx_event_handler_pt)(ngx_event_t *event);
+
+#define NGX_OK 0
+#define NGX_ERROR -1
+#define NGX_AGAIN -2
+#define NGX_BUSY -3
+#define NGX_DONE -4
+#define NGX_DECLINED -5
+#define NGX_ABORT -6
+
+typedef int ngx_fd_t;
+typedef int ngx_socket_t;
+typedef int ngx_err_t;
+
+#define ngx_errno errno
+#define NGX_EAGAIN EAGAIN
+#define NGX_EINTR EINTR
+
+int ngx_nonblocking(ngx_socket_t s);
+
+// Atomics
+
+typedef intptr_t ngx_atomic_int_t;
+typedef uintptr_t ngx_atomic_uint_t;
+typedef volatile ngx_atomic_uint_t ngx_atomic_t;
+
+#define ngx_atomic_cmp_set(lock, old, set)                                     \
+  __sync_bool_compare_and_swap(lock, old, set)
+#define ngx_atomic_fetch_add(value, add) __sync_fetch_and_add(value, add)
+#define ngx_memory_barrier() __sync_synchronize()
+
+// Strings
+
+typedef unsigned char u_char;
+
+typedef struct {
+  size_t len;
+  u_char *data;
+} ngx_str_t;
+
+#define ngx_string(str) {sizeof(str) - 1, (u_char *)str}
+#define ngx_null_string {0, NULL}
+
+#define ngx_tolower(c) (u_char)((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+#define ngx_strlen(s) strlen((const char *)s)
+#define ngx_strncmp(s1, s2, n) strncmp((const char *)s1, (const char *)s2, n)
+#define ngx_memcpy(dst, src, n) (void)memcpy(dst, src, n)
+#define ngx_cpymem(dst, src, n) (((u_char *)memcpy(dst, src, n)) + (n))
+#define ngx_memzero(buf, n) (void)memset(buf, 0, n)
+
+#define ngx_min(a, b) ((a) < (b) ? (a) : (b))
+#define ngx_max(a, b) ((a) > (b) ? (a) : (b))
+#define ngx_align(d, a) (((d) + (a - 1)) & ~(a - 1))
+#define ngx_align_ptr(p, a)                                                    \
+  (u_char *)(((uintptr_t)(p) + ((uintptr_t)a - 1)) & ~((uintptr_t)a - 1))
+
+#define ngx_qsort qsort
+#define ngx_random random
+
+static ngx_inline u_char *ngx_strlchr(u_char *p, u_char *last, u_char c) {
+  while (p < last) {
+    if (*p == c) {
+      return p;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n);
+time_t ngx_atotm(u_char *line, size_t n);
+uint32_t ngx_crc32_short(u_char *p, size_t len);
+u_char *ngx_hex_dump(u_char *dst, u_char *src, size_t len);
+time_t ngx_parse_http_time(u_char *value, size_t len);
+
+// `ngx_sprintf` and friends support nginx's conversions, e.g. "%V" for an
+// `ngx_str_t*`, "%*s" for a length and a `u_char*`, "%uz" for a `size_t`, and
+// "%O" for an `off_t`. See `ngx_vslprintf` in `ngx_shim.c`.
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...);
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...);
+u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt,
+                      va_list args);
+
+// Logging
+
+#define NGX_LOG_STDERR 0
+#define NGX_LOG_EMERG 1
+#define NGX_LOG_ALERT 2
+#define NGX_LOG_CRIT 3
+#define NGX_LOG_ERR 4
+#define NGX_LOG_WARN 5
+#define NGX_LOG_NOTICE 6
+#define NGX_LOG_INFO 7
+#define NGX_LOG_DEBUG 8
+
+struct ngx_log_s {
+  ngx_uint_t log_level;
+};
+
+void ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+                   const char *fmt, ...);
+
+// Time
+
+typedef ngx_uint_t ngx_msec_t;
+typedef intptr_t ngx_msec_int_t;
+
+typedef struct {
+  time_t sec;
+  ngx_uint_t msec;
+  ngx_int_t gmtoff;
+} ngx_time_t;
+
+extern volatile ngx_msec_t ngx_current_msec;
+extern volatile ngx_time_t *ngx_cached_time;
+
+#define ngx_time() ngx_cached_time->sec
+#define ngx_gettimeofday(tp) (void)gettimeofday(tp, NULL)
+
+// Queues
+
+typedef struct ngx_queue_s ngx_queue_t;
+
+struct ngx_queue_s {
+  ngx_queue_t *prev;
+  ngx_queue_t *next;
+};
+
+#define ngx_queue_init(q)                                                      \
+  (q)->prev = q;                                                               \
+  (q)->next = q
+#define ngx_queue_empty(h) (h == (h)->prev)
+#define ngx_queue_insert_head(h, x)                                            \
+  (x)->next = (h)->next;                                                       \
+  (x)->next->prev = x;                                                         \
+  (x)->prev = h;                                                               \
+  (h)->next = x
+#define ngx_queue_insert_tail(h, x)                                            \
+  (x)->prev = (h)->prev;                                                       \
+  (x)->prev->next = x;                                                         \
+  (x)->next = h;                                                               \
+  (h)->prev = x
+#define ngx_queue_head(h) (h)->next
+#define ngx_queue_last(h) (h)->prev
+#define ngx_queue_sentinel(h) (h)
+#define ngx_queue_next(q) (q)->next
+#define ngx_queue_prev(q) (q)->prev
+#define ngx_queue_remove(x)                                                    \
+  (x)->next->prev = (x)->prev;                                                 \
+  (x)->prev->next = (x)->next
+#define ngx_queue_data(q, type, link)                                          \
+  (type *)((u_char *)q - offsetof(type, link))
+
+// Red-black trees. The shim's trees aren't balanced, which is fine for the
+// few nodes a test has, but `ngx_rbtree_node_t` keeps nginx's layout.
+
+typedef ngx_uint_t ngx_rbtree_key_t;
+typedef ngx_int_t ngx_rbtree_key_int_t;
+
+typedef struct ngx_rbtree_node_s ngx_rbtree_node_t;
+
+struct ngx_rbtree_node_s {
+  ngx_rbtree_key_t key;
+  ngx_rbtree_node_t *left;
+  ngx_rbtree_node_t *right;
+  ngx_rbtree_node_t *parent;
+  u_char color;
+  u_char data;
+};
+
+typedef void (*ngx_rbtree_insert_pt)(ngx_rbtree_node_t *root,
+                                     ngx_rbtree_node_t *node,
+                                     ngx_rbtree_node_t *sentinel);
+
+typedef struct ngx_rbtree_s {
+  ngx_rbtree_node_t *root;
+  ngx_rbtree_node_t *sentinel;
+  ngx_rbtree_insert_pt insert;
+} ngx_rbtree_t;
+
+#define ngx_rbtree_sentinel_init(node) ((node)->color = 0)
+#define ngx_rbtree_init(tree, s, i)                                            \
+  ngx_rbtree_sentinel_init(s);                                                 \
+  (tree)->root = s;                                                            \
+  (tree)->sentinel = s;                                                        \
+  (tree)->insert = i
+
+void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node);
+
+typedef struct {
+  ngx_rbtree_node_t node;
+  ngx_str_t str;
+} ngx_str_node_t;
+
+void ngx_str_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel);
+ngx_str_node_t *ngx_str_rbtree_lookup(ngx_rbtree_t *rbtree, ngx_str_t *name,
+                                      uint32_t hash);
+
+// Pools and buffers
+
+typedef void (*ngx_pool_cleanup_pt)(void *data);
+
+typedef struct ngx_pool_cleanup_s ngx_pool_cleanup_t;
+
+struct ngx_pool_cleanup_s {
+  ngx_pool_cleanup_pt handler;
+  void *data;
+  ngx_pool_cleanup_t *next;
+};
+
+typedef struct ngx_pool_block_s ngx_pool_block_t;
+
+// A shim pool is a list of separately allocated blocks, freed (after running
+// the cleanups) by `ngx_destroy_pool`.
+struct ngx_pool_s {
+  ngx_pool_block_t *blocks;
+  ngx_pool_cleanup_t *cleanup;
+  ngx_log_t *log;
+};
+
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log);
+void ngx_destroy_pool(ngx_pool_t *pool);
+void *ngx_palloc(ngx_pool_t *pool, size_t size);
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size);
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *pool, size_t size);
+
+struct ngx_file_s {
+  ngx_fd_t fd;
+  ngx_str_t name;
+  ngx_log_t *log;
+};
+
+ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size,
+                      off_t offset);
+
+typedef void *ngx_buf_tag_t;
+
+typedef struct ngx_buf_s ngx_buf_t;
+
+struct ngx_buf_s {
+  u_char *pos;
+  u_char *last;
+  off_t file_pos;
+  off_t file_last;
+  u_char *start;
+  u_char *end;
+  ngx_buf_tag_t tag;
+  ngx_file_t *file;
+  ngx_buf_t *shadow;
+  unsigned temporary : 1;
+  unsigned memory : 1;
+  unsigned mmap : 1;
+  unsigned recycled : 1;
+  unsigned in_file : 1;
+  unsigned flush : 1;
+  unsigned sync : 1;
+  unsigned last_buf : 1;
+  unsigned last_in_chain : 1;
+  unsigned last_shadow : 1;
+  unsigned temp_file : 1;
+};
+
+struct ngx_chain_s {
+  ngx_buf_t *buf;
+  ngx_chain_t *next;
+};
+
+#define ngx_buf_in_memory(b) ((b)->temporary || (b)->memory || (b)->mmap)
+#define ngx_buf_size(b)                                                        \
+  (ngx_buf_in_memory(b) ? (off_t)((b)->last - (b)->pos)                        \
+                        : ((b)->file_last - (b)->file_pos))
+
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size);
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *pool);
+
+// Shared memory, in this process alone. See `ngx_shim_init_shared_memory`.
+
+typedef struct {
+  ngx_atomic_t *lock;
+} ngx_shmtx_t;
+
+void ngx_shmtx_lock(ngx_shmtx_t *mtx);
+void ngx_shmtx_unlock(ngx_shmtx_t *mtx);
+
+typedef struct {
+  ngx_shmtx_t mutex;
+  // The shim's slab allocator takes memory from `last` up to `end`, and
+  // never reuses what's freed.
+  u_char *start;
+  u_char *last;
+  u_char *end;
+  void *data;
+  void *addr;
+} ngx_slab_pool_t;
+
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p);
+
+typedef struct {
+  u_char *addr;
+  size_t size;
+  ngx_str_t name;
+  ngx_log_t *log;
+  ngx_uint_t exists;
+} ngx_shm_t;
+
+typedef struct ngx_shm_zone_s ngx_shm_zone_t;
+
+typedef ngx_int_t (*ngx_shm_zone_init_pt)(ngx_shm_zone_t *zone, void *data);
+
+struct ngx_shm_zone_s {
+  void *data;
+  ngx_shm_t shm;
+  ngx_shm_zone_init_pt init;
+  void *tag;
+};
+
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
+                                      size_t size, void *tag);
+
+// Configuration and the cycle
+
+struct ngx_conf_s {
+  ngx_cycle_t *cycle;
+  ngx_pool_t *pool;
+  ngx_log_t *log;
+};
+
+struct ngx_cycle_s {
+  ngx_pool_t *pool;
+  ngx_log_t *log;
+  ngx_connection_t *free_connections;
+  ngx_uint_t free_connection_n;
+  ngx_uint_t connection_n;
+};
+
+extern volatile ngx_cycle_t *ngx_cycle;
+extern ngx_uint_t ngx_pagesize;
+
+// The resolver. The shim has none: `ngx_resolve_start` always fails, so tests
+// must leave `ngx_curl_options_t::resolver` NULL.
+
+#define NGX_NO_RESOLVER (void *)-1
+
+typedef struct {
+  struct sockaddr *sockaddr;
+  socklen_t socklen;
+  ngx_str_t name;
+  u_short priority;
+  u_short weight;
+} ngx_resolver_addr_t;
+
+typedef struct ngx_resolver_s ngx_resolver_t;
+typedef struct ngx_resolver_ctx_s ngx_resolver_ctx_t;
+
+typedef void (*ngx_resolver_handler_pt)(ngx_resolver_ctx_t *ctx);
+
+struct ngx_resolver_ctx_s {
+  ngx_int_t state;
+  ngx_str_t name;
+  ngx_uint_t naddrs;
+  ngx_resolver_addr_t *addrs;
+  ngx_resolver_handler_pt handler;
+  void *data;
+  ngx_msec_t timeout;
+};
+
+ngx_resolver_ctx_t *ngx_resolve_start(ngx_resolver_t *r,
+                                      ngx_resolver_ctx_t *temp);
+ngx_int_t ngx_resolve_name(ngx_resolver_ctx_t *ctx);
+void ngx_resolve_name_done(ngx_resolver_ctx_t *ctx);
+char *ngx_resolver_strerror(ngx_int_t err);
+
+// Addresses
+
+#define NGX_SOCKADDR_STRLEN 64
+
+in_addr_t ngx_inet_addr(u_char *text, size_t len);
+size_t ngx_sock_ntop(struct sockaddr *sa, socklen_t socklen, u_char *text,
+                     size_t len, ngx_uint_t port);
@@ -0,0 +1,96 @@
+#pragma once
+
+// The shim's stand-in for nginx's `ngx_event.h`. See `ngx_shim.h`.
+//
+// Events, connections, timers, and posted events behave as they do in nginx
+// with its epoll module, including the flags that `ngx_curl.c` inspects
+// (`active`, `ready`, `posted`, and `timer_set`).
+
+#include <ngx_core.h>
+
+struct ngx_event_s {
+  void *data;
+  unsigned write : 1;
+  unsigned instance : 1;
+  unsigned active : 1;
+  unsigned ready : 1;
+  unsigned eof : 1;
+  unsigned error : 1;
+  unsigned timedout : 1;
+  unsigned timer_set : 1;
+  unsigned posted : 1;
+  unsigned closed : 1;
+  unsigned cancelable : 1;
+  int available;
+  ngx_event_handler_pt handler;
+  ngx_log_t *log;
+  ngx_rbtree_node_t timer;
+  ngx_queue_t queue;
+};
+
+struct ngx_connection_s {
+  void *data;
+  ngx_event_t *read;
+  ngx_event_t *write;
+  ngx_socket_t fd;
+  ngx_log_t *log;
+  ngx_pool_t *pool;
+  unsigned error : 1;
+  unsigned destroyed : 1;
+};
+
+ngx_connection_t *ngx_get_connection(ngx_socket_t s, ngx_log_t *log);
+void ngx_free_connection(ngx_connection_t *c);
+void ngx_close_connection(ngx_connection_t *c);
+
+#define ngx_set_connection_log(c, l) (c)->log = (l)
+
+typedef struct {
+  ngx_int_t (*add)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+  ngx_int_t (*del)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+  ngx_int_t (*enable)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+  ngx_int_t (*disable)(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags);
+  ngx_int_t (*add_conn)(ngx_connection_t *c);
+  ngx_int_t (*del_conn)(ngx_connection_t *c, ngx_uint_t flags);
+  ngx_int_t (*notify)(ngx_event_handler_pt handler);
+} ngx_event_actions_t;
+
+extern ngx_event_actions_t ngx_event_actions;
+extern ngx_uint_t ngx_event_flags;
+
+#define NGX_USE_LEVEL_EVENT 0x00000001
+#define NGX_USE_CLEAR_EVENT 0x00000004
+#define NGX_USE_GREEDY_EVENT 0x00000020
+#define NGX_USE_EPOLL_EVENT 0x00000040
+
+#define NGX_READ_EVENT 0x0001
+#define NGX_WRITE_EVENT 0x0004
+#define NGX_LEVEL_EVENT 0
+#define NGX_CLEAR_EVENT 0x80000000
+
+#define NGX_CLOSE_EVENT 1
+#define NGX_DISABLE_EVENT 2
+
+#define ngx_add_event ngx_event_actions.add
+#define ngx_del_event ngx_event_actions.del
+#define ngx_add_conn ngx_event_actions.add_conn
+#define ngx_del_conn ngx_event_actions.del_conn
+#define ngx_notify ngx_event_actions.notify
+
+void ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer);
+void ngx_event_del_timer(ngx_event_t *ev);
+
+#define ngx_add_timer ngx_event_add_timer
+#define ngx_del_timer ngx_event_del_timer
+
+extern ngx_queue_t ngx_posted_events;
+
+#define ngx_post_event(ev, q)                                                  \
+  if (!(ev)->posted) {                                                         \
+    (ev)->posted = 1;                                                          \
+    ngx_queue_insert_tail(q, &(ev)->queue);                                    \
+  }
+
+#define ngx_delete_posted_event(ev)                                            \
+  (ev)->posted = 0;                                                            \
+  ngx_queue_remove(&(ev)->queue)
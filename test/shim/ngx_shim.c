@@ -0,0 +1,1262 @@
+#include "ngx_shim.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#define NGX_SHIM_MAX_EVENTS 512
+#define NGX_SHIM_MAX_ZONES 16
+#define NGX_INT64_LEN (sizeof("-9223372036854775808") - 1)
+
+volatile ngx_cycle_t *ngx_cycle;
+volatile ngx_msec_t ngx_current_msec;
+volatile ngx_time_t *ngx_cached_time;
+ngx_uint_t ngx_pagesize;
+ngx_queue_t ngx_posted_events;
+ngx_uint_t ngx_event_flags;
+
+static ngx_int_t epoll_add_event(ngx_event_t *ev, ngx_int_t event,
+                                 ngx_uint_t flags);
+static ngx_int_t epoll_del_event(ngx_event_t *ev, ngx_int_t event,
+                                 ngx_uint_t flags);
+static ngx_int_t epoll_add_connection(ngx_connection_t *c);
+static ngx_int_t epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags);
+static int control_epoll(int op, ngx_socket_t fd, struct epoll_event *ee);
+static void insert_timer_value(ngx_rbtree_node_t *temp,
+                               ngx_rbtree_node_t *node,
+                               ngx_rbtree_node_t *sentinel);
+static ngx_rbtree_node_t *tree_min(ngx_rbtree_node_t *node,
+                                   ngx_rbtree_node_t *sentinel);
+static void replace_subtree(ngx_rbtree_t *tree, ngx_rbtree_node_t *old,
+                            ngx_rbtree_node_t *new);
+static void expire_timers(void);
+static void process_posted_events(void);
+static u_char *sprintf_num(u_char *buf, u_char *last, uint64_t ui64,
+                           u_char zero, ngx_uint_t hexadecimal,
+                           ngx_uint_t width);
+
+ngx_event_actions_t ngx_event_actions = {
+    &epoll_add_event,      &epoll_del_event, NULL, NULL,
+    &epoll_add_connection, &epoll_del_connection, NULL};
+
+static ngx_cycle_t cycle;
+static ngx_log_t cycle_log;
+static ngx_time_t cached_time;
+static ngx_connection_t *connections;
+static ngx_event_t *read_events;
+static ngx_event_t *write_events;
+static int epoll_fd = -1;
+static ngx_rbtree_t timers;
+static ngx_rbtree_node_t timers_sentinel;
+static size_t timer_count;
+static ngx_shim_stats_t stats;
+static ngx_shm_zone_t zones[NGX_SHIM_MAX_ZONES];
+static size_t zone_count;
+
+// Event loop
+
+int ngx_shim_init(ngx_uint_t connection_count, ngx_uint_t log_level) {
+  assert(connection_count > 0);
+  assert(epoll_fd == -1);
+
+  cycle_log.log_level = log_level;
+  cycle.log = &cycle_log;
+  ngx_cycle = &cycle;
+  ngx_pagesize = getpagesize();
+  ngx_cached_time = &cached_time;
+  ngx_shim_update_time();
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd == -1) {
+    ngx_log_error(NGX_LOG_EMERG, &cycle_log, ngx_errno,
+                  "epoll_create1() failed");
+    return -1;
+  }
+  ngx_event_flags = NGX_USE_CLEAR_EVENT | NGX_USE_GREEDY_EVENT |
+                    NGX_USE_EPOLL_EVENT;
+
+  connections = calloc(connection_count, sizeof(ngx_connection_t));
+  read_events = calloc(connection_count, sizeof(ngx_event_t));
+  write_events = calloc(connection_count, sizeof(ngx_event_t));
+  if (connections == NULL || read_events == NULL || write_events == NULL) {
+    ngx_log_error(NGX_LOG_EMERG, &cycle_log, 0,
+                  "Unable to allocate connections");
+    ngx_shim_done();
+    return -1;
+  }
+
+  // As in `ngx_event_process_init`, the free list is threaded through
+  // `data`, and `instance` starts out set so that `ngx_get_connection`
+  // clears it.
+  ngx_connection_t *next = NULL;
+  for (ngx_uint_t i = connection_count; i-- > 0;) {
+    read_events[i].closed = 1;
+    read_events[i].instance = 1;
+    write_events[i].closed = 1;
+    connections[i].data = next;
+    connections[i].read = &read_events[i];
+    connections[i].write = &write_events[i];
+    connections[i].fd = -1;
+    next = &connections[i];
+  }
+  cycle.free_connections = next;
+  cycle.free_connection_n = connection_count;
+  cycle.connection_n = connection_count;
+
+  ngx_queue_init(&ngx_posted_events);
+  ngx_rbtree_init(&timers, &timers_sentinel, &insert_timer_value);
+  timer_count = 0;
+  return 0;
+}
+
+void ngx_shim_done(void) {
+  if (cycle.free_connection_n != cycle.connection_n) {
+    ngx_log_error(NGX_LOG_ALERT, &cycle_log, 0,
+                  "%ui connections were not freed",
+                  cycle.connection_n - cycle.free_connection_n);
+  }
+
+  free(connections);
+  free(read_events);
+  free(write_events);
+  connections = NULL;
+  read_events = NULL;
+  write_events = NULL;
+  cycle.free_connections = NULL;
+  cycle.free_connection_n = 0;
+  cycle.connection_n = 0;
+
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
+
+  for (size_t i = 0; i < zone_count; ++i) {
+    free(zones[i].shm.name.data);
+    free(zones[i].shm.addr);
+  }
+  zone_count = 0;
+}
+
+int ngx_shim_process_events(ngx_msec_t timeout) {
+  assert(epoll_fd != -1);
+
+  if (!ngx_queue_empty(&ngx_posted_events)) {
+    timeout = 0;
+  } else if (timers.root != &timers_sentinel) {
+    const ngx_rbtree_node_t *node = tree_min(timers.root, &timers_sentinel);
+    const ngx_msec_int_t until =
+        (ngx_msec_int_t)(node->key - ngx_current_msec);
+    timeout = ngx_min(timeout, (ngx_msec_t)ngx_max(until, 0));
+  }
+
+  struct epoll_event events[NGX_SHIM_MAX_EVENTS];
+  ++stats.epoll_waits;
+  const int count = epoll_wait(epoll_fd, events, NGX_SHIM_MAX_EVENTS,
+                               (int)ngx_min(timeout, (ngx_msec_t)INT32_MAX));
+  const ngx_err_t err = (count == -1) ? ngx_errno : 0;
+  ngx_shim_update_time();
+
+  if (err != 0 && err != NGX_EINTR) {
+    ngx_log_error(NGX_LOG_ALERT, &cycle_log, err, "epoll_wait() failed");
+    return -1;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    ngx_connection_t *c = events[i].data.ptr;
+    const ngx_uint_t instance = (uintptr_t)c & 1;
+    c = (ngx_connection_t *)((uintptr_t)c & (uintptr_t)~1);
+
+    // An earlier handler in this batch may have closed the connection, and
+    // perhaps reused it for another socket.
+    ngx_event_t *rev = c->read;
+    if (c->fd == -1 || rev->instance != instance) {
+      continue;
+    }
+
+    uint32_t revents = events[i].events;
+    if (revents & (EPOLLERR | EPOLLHUP)) {
+      revents |= EPOLLIN | EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+      rev->ready = 1;
+      rev->available = -1;
+      ++stats.events_handled;
+      rev->handler(rev);
+    }
+
+    ngx_event_t *wev = c->write;
+    if ((revents & EPOLLOUT) && wev->active) {
+      if (c->fd == -1 || wev->instance != instance) {
+        continue;
+      }
+      wev->ready = 1;
+      ++stats.events_handled;
+      wev->handler(wev);
+    }
+  }
+
+  expire_timers();
+  process_posted_events();
+  return 0;
+}
+
+void ngx_shim_update_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ngx_current_msec = (ngx_msec_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  cached_time.sec = now.tv_sec;
+  cached_time.msec = now.tv_nsec / 1000000;
+}
+
+size_t ngx_shim_timer_count(void) { return timer_count; }
+
+void ngx_shim_stats(ngx_shim_stats_t *out) { *out = stats; }
+
+static void process_posted_events(void) {
+  while (!ngx_queue_empty(&ngx_posted_events)) {
+    ngx_queue_t *q = ngx_queue_head(&ngx_posted_events);
+    ngx_event_t *ev = ngx_queue_data(q, ngx_event_t, queue);
+    ngx_delete_posted_event(ev);
+    ++stats.posted_events_handled;
+    ev->handler(ev);
+  }
+}
+
+// Connections
+
+ngx_connection_t *ngx_get_connection(ngx_socket_t s, ngx_log_t *log) {
+  ngx_connection_t *c = cycle.free_connections;
+  if (c == NULL) {
+    ngx_log_error(NGX_LOG_ALERT, log, 0, "%ui connections are not enough",
+                  cycle.connection_n);
+    return NULL;
+  }
+  cycle.free_connections = c->data;
+  --cycle.free_connection_n;
+
+  ngx_event_t *rev = c->read;
+  ngx_event_t *wev = c->write;
+  ngx_memzero(c, sizeof(ngx_connection_t));
+  c->read = rev;
+  c->write = wev;
+  c->fd = s;
+  c->log = log;
+
+  const unsigned instance = rev->instance;
+  ngx_memzero(rev, sizeof(ngx_event_t));
+  ngx_memzero(wev, sizeof(ngx_event_t));
+  rev->instance = !instance;
+  wev->instance = !instance;
+  rev->data = c;
+  wev->data = c;
+  wev->write = 1;
+  return c;
+}
+
+void ngx_free_connection(ngx_connection_t *c) {
+  c->data = cycle.free_connections;
+  cycle.free_connections = c;
+  ++cycle.free_connection_n;
+}
+
+void ngx_close_connection(ngx_connection_t *c) {
+  if (c->fd == -1) {
+    ngx_log_error(NGX_LOG_ALERT, c->log, 0, "connection already closed");
+    return;
+  }
+
+  if (c->read->timer_set) {
+    ngx_del_timer(c->read);
+  }
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+  ngx_del_conn(c, NGX_CLOSE_EVENT);
+  if (c->read->posted) {
+    ngx_delete_posted_event(c->read);
+  }
+  if (c->write->posted) {
+    ngx_delete_posted_event(c->write);
+  }
+  c->read->closed = 1;
+  c->write->closed = 1;
+
+  ngx_free_connection(c);
+  const ngx_socket_t fd = c->fd;
+  c->fd = -1;
+  if (close(fd) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "close() socket failed");
+  }
+}
+
+int ngx_nonblocking(ngx_socket_t s) {
+  const int flags = fcntl(s, F_GETFL);
+  if (flags == -1) {
+    return -1;
+  }
+  return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+}
+
+// The epoll "module", after nginx's `ngx_epoll_module.c`. `NGX_READ_EVENT`,
+// `NGX_WRITE_EVENT`, and `NGX_CLEAR_EVENT` are `EPOLLIN`, `EPOLLOUT`, and
+// `EPOLLET`.
+
+static ngx_int_t epoll_add_event(ngx_event_t *ev, ngx_int_t event,
+                                 ngx_uint_t flags) {
+  ngx_connection_t *c = ev->data;
+  const ngx_event_t *other = (event == NGX_READ_EVENT) ? c->write : c->read;
+  const uint32_t other_events = (event == NGX_READ_EVENT) ? EPOLLOUT : EPOLLIN;
+
+  struct epoll_event ee;
+  ee.events = (uint32_t)event | (uint32_t)flags;
+  if (other->active) {
+    ee.events |= other_events;
+  }
+  ee.data.ptr = (void *)((uintptr_t)c | ev->instance);
+  if (control_epoll(other->active ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd,
+                    &ee) != 0) {
+    return NGX_ERROR;
+  }
+
+  ev->active = 1;
+  return NGX_OK;
+}
+
+static ngx_int_t epoll_del_event(ngx_event_t *ev, ngx_int_t event,
+                                 ngx_uint_t flags) {
+  // The socket is about to be closed, which removes it from epoll.
+  if (flags & NGX_CLOSE_EVENT) {
+    ev->active = 0;
+    return NGX_OK;
+  }
+
+  ngx_connection_t *c = ev->data;
+  const ngx_event_t *other = (event == NGX_READ_EVENT) ? c->write : c->read;
+  const uint32_t other_events = (event == NGX_READ_EVENT) ? EPOLLOUT : EPOLLIN;
+
+  struct epoll_event ee;
+  if (other->active) {
+    ee.events = other_events | (uint32_t)flags;
+    ee.data.ptr = (void *)((uintptr_t)c | ev->instance);
+  } else {
+    ee.events = 0;
+    ee.data.ptr = NULL;
+  }
+  if (control_epoll(other->active ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, c->fd,
+                    &ee) != 0) {
+    return NGX_ERROR;
+  }
+
+  ev->active = 0;
+  return NGX_OK;
+}
+
+static ngx_int_t epoll_add_connection(ngx_connection_t *c) {
+  struct epoll_event ee;
+  ee.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+  ee.data.ptr = (void *)((uintptr_t)c | c->read->instance);
+  if (control_epoll(EPOLL_CTL_ADD, c->fd, &ee) != 0) {
+    return NGX_ERROR;
+  }
+
+  c->read->active = 1;
+  c->write->active = 1;
+  return NGX_OK;
+}
+
+static ngx_int_t epoll_del_connection(ngx_connection_t *c, ngx_uint_t flags) {
+  if (!(flags & NGX_CLOSE_EVENT)) {
+    struct epoll_event ee = {0};
+    if (control_epoll(EPOLL_CTL_DEL, c->fd, &ee) != 0) {
+      return NGX_ERROR;
+    }
+  }
+
+  c->read->active = 0;
+  c->write->active = 0;
+  return NGX_OK;
+}
+
+static int control_epoll(int op, ngx_socket_t fd, struct epoll_event *ee) {
+  ++stats.epoll_ctls;
+  if (epoll_ctl(epoll_fd, op, fd, ee) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, &cycle_log, ngx_errno,
+                  "epoll_ctl(%d, %d) failed", op, fd);
+    return -1;
+  }
+  return 0;
+}
+
+// Timers, keyed by `ngx_current_msec` at expiry, as in nginx.
+
+void ngx_event_add_timer(ngx_event_t *ev, ngx_msec_t timer) {
+  if (ev->timer_set) {
+    ngx_event_del_timer(ev);
+  }
+
+  ev->timer.key = ngx_current_msec + timer;
+  ngx_rbtree_insert(&timers, &ev->timer);
+  ev->timer_set = 1;
+  ++timer_count;
+}
+
+void ngx_event_del_timer(ngx_event_t *ev) {
+  assert(ev->timer_set);
+
+  ngx_rbtree_delete(&timers, &ev->timer);
+  ev->timer_set = 0;
+  --timer_count;
+}
+
+static void insert_timer_value(ngx_rbtree_node_t *temp,
+                               ngx_rbtree_node_t *node,
+                               ngx_rbtree_node_t *sentinel) {
+  ngx_rbtree_node_t **p;
+  for (;;) {
+    p = ((ngx_rbtree_key_int_t)(node->key - temp->key) < 0) ? &temp->left
+                                                            : &temp->right;
+    if (*p == sentinel) {
+      break;
+    }
+    temp = *p;
+  }
+
+  *p = node;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+}
+
+static void expire_timers(void) {
+  while (timers.root != &timers_sentinel) {
+    ngx_rbtree_node_t *node = tree_min(timers.root, &timers_sentinel);
+    if ((ngx_msec_int_t)(node->key - ngx_current_msec) > 0) {
+      return;
+    }
+
+    ngx_event_t *ev =
+        (ngx_event_t *)((u_char *)node - offsetof(ngx_event_t, timer));
+    ngx_event_del_timer(ev);
+    ev->timedout = 1;
+    ++stats.timers_expired;
+    ev->handler(ev);
+  }
+}
+
+// Trees. Nodes are inserted by the tree's `insert` function, as in nginx,
+// but never rebalanced.
+
+void ngx_rbtree_insert(ngx_rbtree_t *tree, ngx_rbtree_node_t *node) {
+  ngx_rbtree_node_t *sentinel = tree->sentinel;
+  if (tree->root == sentinel) {
+    node->parent = NULL;
+    node->left = sentinel;
+    node->right = sentinel;
+    tree->root = node;
+    return;
+  }
+
+  tree->insert(tree->root, node, sentinel);
+}
+
+void ngx_rbtree_delete(ngx_rbtree_t *tree, ngx_rbtree_node_t *node) {
+  ngx_rbtree_node_t *sentinel = tree->sentinel;
+  if (node->left == sentinel) {
+    replace_subtree(tree, node, node->right);
+  } else if (node->right == sentinel) {
+    replace_subtree(tree, node, node->left);
+  } else {
+    ngx_rbtree_node_t *successor = tree_min(node->right, sentinel);
+    if (successor->parent != node) {
+      replace_subtree(tree, successor, successor->right);
+      successor->right = node->right;
+      successor->right->parent = successor;
+    }
+    replace_subtree(tree, node, successor);
+    successor->left = node->left;
+    successor->left->parent = successor;
+  }
+
+  node->left = NULL;
+  node->right = NULL;
+  node->parent = NULL;
+  node->key = 0;
+}
+
+// Puts the subtree rooted at `new` where the one rooted at `old` was.
+static void replace_subtree(ngx_rbtree_t *tree, ngx_rbtree_node_t *old,
+                            ngx_rbtree_node_t *new) {
+  if (old == tree->root) {
+    tree->root = new;
+  } else if (old == old->parent->left) {
+    old->parent->left = new;
+  } else {
+    old->parent->right = new;
+  }
+
+  if (new != tree->sentinel) {
+    new->parent = old->parent;
+  }
+}
+
+static ngx_rbtree_node_t *tree_min(ngx_rbtree_node_t *node,
+                                   ngx_rbtree_node_t *sentinel) {
+  while (node->left != sentinel) {
+    node = node->left;
+  }
+  return node;
+}
+
+void ngx_str_rbtree_insert_value(ngx_rbtree_node_t *temp,
+                                 ngx_rbtree_node_t *node,
+                                 ngx_rbtree_node_t *sentinel) {
+  const ngx_str_node_t *n = (ngx_str_node_t *)node;
+  ngx_rbtree_node_t **p;
+  for (;;) {
+    const ngx_str_node_t *t = (ngx_str_node_t *)temp;
+    if (node->key != temp->key) {
+      p = (node->key < temp->key) ? &temp->left : &temp->right;
+    } else if (n->str.len != t->str.len) {
+      p = (n->str.len < t->str.len) ? &temp->left : &temp->right;
+    } else {
+      p = (memcmp(n->str.data, t->str.data, n->str.len) < 0) ? &temp->left
+                                                             : &temp->right;
+    }
+    if (*p == sentinel) {
+      break;
+    }
+    temp = *p;
+  }
+
+  *p = node;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+}
+
+ngx_str_node_t *ngx_str_rbtree_lookup(ngx_rbtree_t *rbtree, ngx_str_t *name,
+                                      uint32_t hash) {
+  ngx_rbtree_node_t *node = rbtree->root;
+  ngx_rbtree_node_t *sentinel = rbtree->sentinel;
+  while (node != sentinel) {
+    ngx_str_node_t *n = (ngx_str_node_t *)node;
+    if (hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+    if (name->len != n->str.len) {
+      node = (name->len < n->str.len) ? node->left : node->right;
+      continue;
+    }
+    const int rc = memcmp(name->data, n->str.data, name->len);
+    if (rc == 0) {
+      return n;
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+  return NULL;
+}
+
+// Pools
+
+struct ngx_pool_block_s {
+  ngx_pool_block_t *next;
+  max_align_t data[];
+};
+
+ngx_pool_t *ngx_create_pool(size_t size, ngx_log_t *log) {
+  (void)size;
+  ngx_pool_t *pool = calloc(1, sizeof(ngx_pool_t));
+  if (pool != NULL) {
+    pool->log = log;
+  }
+  return pool;
+}
+
+void ngx_destroy_pool(ngx_pool_t *pool) {
+  for (ngx_pool_cleanup_t *c = pool->cleanup; c; c = c->next) {
+    if (c->handler) {
+      c->handler(c->data);
+    }
+  }
+
+  ngx_pool_block_t *block = pool->blocks;
+  while (block) {
+    ngx_pool_block_t *next = block->next;
+    free(block);
+    block = next;
+  }
+  free(pool);
+}
+
+void *ngx_palloc(ngx_pool_t *pool, size_t size) {
+  ngx_pool_block_t *block = malloc(sizeof(ngx_pool_block_t) + size);
+  if (block == NULL) {
+    ngx_log_error(NGX_LOG_EMERG, pool->log, ngx_errno,
+                  "malloc(%uz) failed", size);
+    return NULL;
+  }
+  block->next = pool->blocks;
+  pool->blocks = block;
+  return block->data;
+}
+
+void *ngx_pcalloc(ngx_pool_t *pool, size_t size) {
+  void *p = ngx_palloc(pool, size);
+  if (p) {
+    ngx_memzero(p, size);
+  }
+  return p;
+}
+
+ngx_pool_cleanup_t *ngx_pool_cleanup_add(ngx_pool_t *pool, size_t size) {
+  ngx_pool_cleanup_t *c = ngx_palloc(pool, sizeof(ngx_pool_cleanup_t));
+  if (c == NULL) {
+    return NULL;
+  }
+
+  c->data = NULL;
+  if (size) {
+    c->data = ngx_palloc(pool, size);
+    if (c->data == NULL) {
+      return NULL;
+    }
+  }
+  c->handler = NULL;
+  c->next = pool->cleanup;
+  pool->cleanup = c;
+  return c;
+}
+
+ngx_buf_t *ngx_create_temp_buf(ngx_pool_t *pool, size_t size) {
+  ngx_buf_t *b = ngx_pcalloc(pool, sizeof(ngx_buf_t));
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->start = ngx_palloc(pool, size);
+  if (b->start == NULL) {
+    return NULL;
+  }
+  b->pos = b->start;
+  b->last = b->start;
+  b->end = b->last + size;
+  b->temporary = 1;
+  return b;
+}
+
+ngx_chain_t *ngx_alloc_chain_link(ngx_pool_t *pool) {
+  return ngx_palloc(pool, sizeof(ngx_chain_t));
+}
+
+ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size,
+                      off_t offset) {
+  const ssize_t n = pread(file->fd, buf, size, offset);
+  if (n == -1) {
+    ngx_log_error(NGX_LOG_CRIT, file->log, ngx_errno,
+                  "pread() \"%V\" failed", &file->name);
+    return NGX_ERROR;
+  }
+  return n;
+}
+
+// Thread pools, after nginx's `ngx_thread_pool.c`, but with no threads: see
+// `ngx_shim_run_thread_tasks`.
+
+struct ngx_thread_pool_s {
+  ngx_thread_task_t *first;
+  ngx_thread_task_t **last;
+  size_t count;
+};
+
+static ngx_thread_pool_t thread_pool = {NULL, &thread_pool.first, 0};
+static ngx_uint_t thread_task_id;
+
+ngx_thread_pool_t *ngx_shim_thread_pool(void) { return &thread_pool; }
+
+size_t ngx_shim_thread_task_count(void) { return thread_pool.count; }
+
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp,
+                               ngx_thread_task_t *task) {
+  if (task->event.active) {
+    ngx_log_error(NGX_LOG_ALERT, &cycle_log, 0, "task #%ui already active",
+                  task->id);
+    return NGX_ERROR;
+  }
+  task->event.active = 1;
+  task->id = thread_task_id++;
+  task->next = NULL;
+  *tp->last = task;
+  tp->last = &task->next;
+  ++tp->count;
+  return NGX_OK;
+}
+
+size_t ngx_shim_run_thread_tasks(void) {
+  size_t count = 0;
+  while (thread_pool.first) {
+    ngx_thread_task_t *task = thread_pool.first;
+    thread_pool.first = task->next;
+    if (thread_pool.first == NULL) {
+      thread_pool.last = &thread_pool.first;
+    }
+    --thread_pool.count;
+    task->handler(task->ctx, &cycle_log);
+    task->event.active = 0;
+    ngx_post_event(&task->event, &ngx_posted_events);
+    ++count;
+  }
+  return count;
+}
+
+// Shared memory, allocated by `ngx_shim_init_shared_memory` as nginx does
+// once it has parsed the configuration. There's only one process, so the
+// mutex does nothing.
+
+ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
+                                      size_t size, void *tag) {
+  for (size_t i = 0; i < zone_count; ++i) {
+    ngx_shm_zone_t *zone = &zones[i];
+    if (zone->shm.name.len == name->len &&
+        ngx_strncmp(zone->shm.name.data, name->data, name->len) == 0) {
+      if (zone->tag != tag) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "the shared memory zone \"%V\" is already declared "
+                      "for a different use",
+                      name);
+        return NULL;
+      }
+      return zone;
+    }
+  }
+
+  if (zone_count == NGX_SHIM_MAX_ZONES ||
+      size < 2 * sizeof(ngx_slab_pool_t)) {
+    ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                  "shared memory zone \"%V\" is not supported by the shim",
+                  name);
+    return NULL;
+  }
+  u_char *copy = malloc(name->len);
+  if (copy == NULL) {
+    return NULL;
+  }
+  ngx_shm_zone_t *zone = &zones[zone_count++];
+  *zone = (ngx_shm_zone_t){0};
+  ngx_memcpy(copy, name->data, name->len);
+  zone->shm.name.data = copy;
+  zone->shm.name.len = name->len;
+  zone->shm.size = size;
+  zone->shm.log = cf->log;
+  zone->tag = tag;
+  return zone;
+}
+
+int ngx_shim_init_shared_memory(void) {
+  for (size_t i = 0; i < zone_count; ++i) {
+    ngx_shm_zone_t *zone = &zones[i];
+    if (zone->shm.addr) {
+      continue;
+    }
+    zone->shm.addr = calloc(1, zone->shm.size);
+    if (zone->shm.addr == NULL) {
+      ngx_log_error(NGX_LOG_EMERG, &cycle_log, 0,
+                    "Unable to allocate shared memory zone \"%V\"",
+                    &zone->shm.name);
+      return -1;
+    }
+    ngx_slab_pool_t *pool = (ngx_slab_pool_t *)zone->shm.addr;
+    pool->start = pool->last = zone->shm.addr + sizeof(ngx_slab_pool_t);
+    pool->end = zone->shm.addr + zone->shm.size;
+    pool->addr = zone->shm.addr;
+    if (zone->init && zone->init(zone, NULL) != NGX_OK) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void ngx_shmtx_lock(ngx_shmtx_t *mtx) { (void)mtx; }
+
+void ngx_shmtx_unlock(ngx_shmtx_t *mtx) { (void)mtx; }
+
+void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size) {
+  return ngx_slab_alloc_locked(pool, size);
+}
+
+void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size) {
+  u_char *p = ngx_align_ptr(pool->last, sizeof(void *) * 2);
+  if (p > pool->end || size > (size_t)(pool->end - p)) {
+    return NULL;
+  }
+  pool->last = p + size;
+  return p;
+}
+
+void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size) {
+  void *p = ngx_slab_alloc(pool, size);
+  if (p) {
+    ngx_memzero(p, size);
+  }
+  return p;
+}
+
+void ngx_slab_free_locked(ngx_slab_pool_t *pool, void *p) {
+  (void)pool;
+  (void)p;
+}
+
+// What the shim doesn't support
+
+ngx_resolver_ctx_t *ngx_resolve_start(ngx_resolver_t *r,
+                                      ngx_resolver_ctx_t *temp) {
+  (void)r;
+  (void)temp;
+  return NULL;
+}
+
+ngx_int_t ngx_resolve_name(ngx_resolver_ctx_t *ctx) {
+  (void)ctx;
+  return NGX_ERROR;
+}
+
+void ngx_resolve_name_done(ngx_resolver_ctx_t *ctx) { (void)ctx; }
+
+char *ngx_resolver_strerror(ngx_int_t err) {
+  (void)err;
+  return "no resolver in the shim";
+}
+
+// Strings and addresses
+
+ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n) {
+  while (n--) {
+    const ngx_uint_t c1 = ngx_tolower(*s1);
+    const ngx_uint_t c2 = ngx_tolower(*s2);
+    if (c1 != c2) {
+      return c1 - c2;
+    }
+    if (c1 == 0) {
+      return 0;
+    }
+    s1++;
+    s2++;
+  }
+  return 0;
+}
+
+time_t ngx_atotm(u_char *line, size_t n) {
+  if (n == 0) {
+    return NGX_ERROR;
+  }
+
+  time_t value = 0;
+  for (; n--; line++) {
+    if (*line < '0' || *line > '9') {
+      return NGX_ERROR;
+    }
+    value = value * 10 + (*line - '0');
+  }
+  return value;
+}
+
+uint32_t ngx_crc32_short(u_char *p, size_t len) {
+  uint32_t crc = 0xffffffff;
+  while (len--) {
+    crc ^= *p++;
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return crc ^ 0xffffffff;
+}
+
+u_char *ngx_hex_dump(u_char *dst, u_char *src, size_t len) {
+  static const u_char hex[] = "0123456789abcdef";
+  while (len--) {
+    *dst++ = hex[*src >> 4];
+    *dst++ = hex[*src++ & 0xf];
+  }
+  return dst;
+}
+
+// Only the preferred format of RFC 9110, e.g.
+// "Sun, 06 Nov 1994 08:49:37 GMT", is accepted.
+time_t ngx_parse_http_time(u_char *value, size_t len) {
+  char text[64];
+  if (len >= sizeof text) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(text, value, len);
+  text[len] = '\0';
+
+  struct tm tm = {0};
+  const char *end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return NGX_ERROR;
+  }
+  return timegm(&tm);
+}
+
+in_addr_t ngx_inet_addr(u_char *text, size_t len) {
+  char address[INET_ADDRSTRLEN];
+  if (len >= sizeof address) {
+    return INADDR_NONE;
+  }
+  ngx_memcpy(address, text, len);
+  address[len] = '\0';
+
+  struct in_addr addr;
+  if (inet_pton(AF_INET, address, &addr) != 1) {
+    return INADDR_NONE;
+  }
+  return addr.s_addr;
+}
+
+size_t ngx_sock_ntop(struct sockaddr *sa, socklen_t socklen, u_char *text,
+                     size_t len, ngx_uint_t port) {
+  (void)socklen;
+  char address[INET6_ADDRSTRLEN];
+  u_char *p = text;
+  switch (sa->sa_family) {
+  case AF_INET: {
+    const struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+    inet_ntop(AF_INET, &sin->sin_addr, address, sizeof address);
+    p = port ? ngx_snprintf(text, len, "%s:%d", address, ntohs(sin->sin_port))
+             : ngx_snprintf(text, len, "%s", address);
+    break;
+  }
+  case AF_INET6: {
+    const struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)sa;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, address, sizeof address);
+    p = port ? ngx_snprintf(text, len, "[%s]:%d", address,
+                            ntohs(sin6->sin6_port))
+             : ngx_snprintf(text, len, "%s", address);
+    break;
+  }
+  }
+  return p - text;
+}
+
+// Formatting, after nginx's `ngx_vslprintf`
+
+u_char *ngx_sprintf(u_char *buf, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  u_char *p = ngx_vslprintf(buf, (void *)-1, fmt, args);
+  va_end(args);
+  return p;
+}
+
+u_char *ngx_snprintf(u_char *buf, size_t max, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  u_char *p = ngx_vslprintf(buf, buf + max, fmt, args);
+  va_end(args);
+  return p;
+}
+
+u_char *ngx_slprintf(u_char *buf, u_char *last, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  u_char *p = ngx_vslprintf(buf, last, fmt, args);
+  va_end(args);
+  return p;
+}
+
+u_char *ngx_vslprintf(u_char *buf, u_char *last, const char *fmt,
+                      va_list args) {
+  while (*fmt && buf < last) {
+    if (*fmt != '%') {
+      *buf++ = *fmt++;
+      continue;
+    }
+
+    int64_t i64 = 0;
+    uint64_t ui64 = 0;
+    const u_char zero = (*++fmt == '0') ? '0' : ' ';
+    ngx_uint_t width = 0;
+    ngx_uint_t frac_width = 0;
+    ngx_uint_t hex = 0;
+    bool sign = true;
+    bool max_width = false;
+    size_t slen = (size_t)-1;
+
+    while (*fmt >= '0' && *fmt <= '9') {
+      width = width * 10 + (*fmt++ - '0');
+    }
+
+    for (bool modifier = true; modifier;) {
+      switch (*fmt) {
+      case 'u':
+        sign = false;
+        fmt++;
+        break;
+      case 'm':
+        max_width = true;
+        fmt++;
+        break;
+      case 'X':
+        hex = 2;
+        sign = false;
+        fmt++;
+        break;
+      case 'x':
+        hex = 1;
+        sign = false;
+        fmt++;
+        break;
+      case '.':
+        fmt++;
+        while (*fmt >= '0' && *fmt <= '9') {
+          frac_width = frac_width * 10 + (*fmt++ - '0');
+        }
+        break;
+      case '*':
+        slen = va_arg(args, size_t);
+        fmt++;
+        break;
+      default:
+        modifier = false;
+      }
+    }
+
+    switch (*fmt) {
+    case 'V': {
+      const ngx_str_t *v = va_arg(args, ngx_str_t *);
+      buf = ngx_cpymem(buf, v->data, ngx_min((size_t)(last - buf), v->len));
+      fmt++;
+      continue;
+    }
+    case 's': {
+      const u_char *p = va_arg(args, u_char *);
+      if (slen == (size_t)-1) {
+        while (*p && buf < last) {
+          *buf++ = *p++;
+        }
+      } else {
+        buf = ngx_cpymem(buf, p, ngx_min((size_t)(last - buf), slen));
+      }
+      fmt++;
+      continue;
+    }
+    case 'O':
+      i64 = (int64_t)va_arg(args, off_t);
+      sign = true;
+      break;
+    case 'P':
+      i64 = (int64_t)va_arg(args, pid_t);
+      sign = true;
+      break;
+    case 'T':
+      i64 = (int64_t)va_arg(args, time_t);
+      sign = true;
+      break;
+    case 'M': {
+      const ngx_msec_t ms = va_arg(args, ngx_msec_t);
+      if ((ngx_msec_int_t)ms == -1) {
+        sign = true;
+        i64 = -1;
+      } else {
+        sign = false;
+        ui64 = (uint64_t)ms;
+      }
+      break;
+    }
+    case 'z':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, ssize_t);
+      } else {
+        ui64 = (uint64_t)va_arg(args, size_t);
+      }
+      break;
+    case 'i':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, ngx_int_t);
+      } else {
+        ui64 = (uint64_t)va_arg(args, ngx_uint_t);
+      }
+      if (max_width) {
+        width = NGX_INT_T_LEN;
+      }
+      break;
+    case 'd':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, int);
+      } else {
+        ui64 = (uint64_t)va_arg(args, unsigned);
+      }
+      break;
+    case 'l':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, long);
+      } else {
+        ui64 = (uint64_t)va_arg(args, unsigned long);
+      }
+      break;
+    case 'D':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, int32_t);
+      } else {
+        ui64 = (uint64_t)va_arg(args, uint32_t);
+      }
+      break;
+    case 'L':
+      if (sign) {
+        i64 = va_arg(args, int64_t);
+      } else {
+        ui64 = va_arg(args, uint64_t);
+      }
+      break;
+    case 'A':
+      if (sign) {
+        i64 = (int64_t)va_arg(args, ngx_atomic_int_t);
+      } else {
+        ui64 = (uint64_t)va_arg(args, ngx_atomic_uint_t);
+      }
+      if (max_width) {
+        width = NGX_ATOMIC_T_LEN;
+      }
+      break;
+    case 'f': {
+      double f = va_arg(args, double);
+      if (f < 0) {
+        *buf++ = '-';
+        f = -f;
+      }
+      ui64 = (uint64_t)f;
+      uint64_t frac = 0;
+      if (frac_width) {
+        uint64_t scale = 1;
+        for (ngx_uint_t n = frac_width; n--;) {
+          scale *= 10;
+        }
+        frac = (uint64_t)((f - (double)ui64) * scale + 0.5);
+        if (frac == scale) {
+          ui64++;
+          frac = 0;
+        }
+      }
+      buf = sprintf_num(buf, last, ui64, zero, 0, width);
+      if (frac_width) {
+        if (buf < last) {
+          *buf++ = '.';
+        }
+        buf = sprintf_num(buf, last, frac, '0', 0, frac_width);
+      }
+      fmt++;
+      continue;
+    }
+    case 'p':
+      ui64 = (uintptr_t)va_arg(args, void *);
+      hex = 2;
+      sign = false;
+      buf = sprintf_num(buf, last, ui64, '0', hex, 2 * sizeof(void *));
+      fmt++;
+      continue;
+    case 'c':
+      *buf++ = (u_char)(va_arg(args, int) & 0xff);
+      fmt++;
+      continue;
+    case 'Z':
+      *buf++ = '\0';
+      fmt++;
+      continue;
+    case 'N':
+      *buf++ = '\n';
+      fmt++;
+      continue;
+    case '%':
+      *buf++ = '%';
+      fmt++;
+      continue;
+    default:
+      *buf++ = *fmt++;
+      continue;
+    }
+
+    if (sign) {
+      if (i64 < 0) {
+        *buf++ = '-';
+        ui64 = (uint64_t)0 - (uint64_t)i64;
+      } else {
+        ui64 = (uint64_t)i64;
+      }
+    }
+    buf = sprintf_num(buf, last, ui64, zero, hex, width);
+    fmt++;
+  }
+
+  return buf;
+}
+
+static u_char *sprintf_num(u_char *buf, u_char *last, uint64_t ui64,
+                           u_char zero, ngx_uint_t hexadecimal,
+                           ngx_uint_t width) {
+  static const u_char hex[] = "0123456789abcdef";
+  static const u_char HEX[] = "0123456789ABCDEF";
+
+  u_char temp[NGX_INT64_LEN + 1];
+  u_char *p = temp + NGX_INT64_LEN;
+  do {
+    switch (hexadecimal) {
+    case 0:
+      *--p = (u_char)(ui64 % 10 + '0');
+      ui64 /= 10;
+      break;
+    case 1:
+      *--p = hex[ui64 & 0xf];
+      ui64 >>= 4;
+      break;
+    default:
+      *--p = HEX[ui64 & 0xf];
+      ui64 >>= 4;
+    }
+  } while (ui64);
+
+  size_t len = (temp + NGX_INT64_LEN) - p;
+  while (len++ < width && buf < last) {
+    *buf++ = zero;
+  }
+
+  len = ngx_min((size_t)((temp + NGX_INT64_LEN) - p), (size_t)(last - buf));
+  return ngx_cpymem(buf, p, len);
+}
+
+// Logging
+
+void ngx_log_error(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+                   const char *fmt, ...) {
+  static const char *const levels[] = {"",     "emerg",  "alert",
+                                       "crit", "error",  "warn",
+                                       "notice", "info", "debug"};
+
+  if (level <= NGX_LOG_ERR) {
+    ++stats.errors_logged;
+  }
+  if (log != NULL && level > log->log_level) {
+    return;
+  }
+
+  u_char line[2048];
+  u_char *const last = line + sizeof line - 1;
+  u_char *p = ngx_slprintf(line, last, "[%s] ",
+                           levels[ngx_min(level, NGX_LOG_DEBUG)]);
+
+  va_list args;
+  va_start(args, fmt);
+  p = ngx_vslprintf(p, last, fmt, args);
+  va_end(args);
+
+  if (err) {
+    p = ngx_slprintf(p, last, " (%d: %s)", err, strerror(err));
+  }
+  *p++ = '\n';
+  fwrite(line, 1, p - line, stderr);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// The shim is just enough of nginx to run `ngx_curl.c` in a plain process:
+// an epoll event loop with nginx's connections, events, timers, and posted
+// events, plus the string, pool, tree, thread pool, and logging functions
+// that `ngx_curl.c` calls. `ngx_config.h`, `ngx_core.h`, `ngx_event.h`, and
+// `ngx_thread_pool.h` in this directory stand in for nginx's headers, so
+// `ngx_curl.c` compiles unmodified against them.
+//
+// The event loop follows nginx's epoll module: `ngx_add_event` and
+// `ngx_del_event` modify one direction of a socket's registration, while
+// `ngx_add_conn` registers both directions, edge-triggered, and
+// `ngx_event_flags` includes `NGX_USE_CLEAR_EVENT`. Each iteration of
+// `ngx_shim_process_events` waits in `epoll_wait` (for at most the given
+// timeout, and no later than the nearest timer), calls the handlers of the
+// events that are ready, then those of expired timers, then posted events,
+// just like `ngx_process_events_and_timers`.
+//
+// What the shim doesn't do, it refuses: there is no resolver, so
+// `ngx_resolve_start` fails, and OpenSSL isn't configured (see
+// `ngx_config.h`). Shared memory zones are only shared within the process,
+// and their slab allocator never reuses what's freed.
+// There is one thread pool, `ngx_shim_thread_pool`, but it has no threads: a
+// task posted to it waits until `ngx_shim_run_thread_tasks` is called, so
+// that a test decides when it runs.
+
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_thread_pool.h>
+
+typedef struct ngx_shim_stats_s {
+  // Number of `epoll_ctl` and `epoll_wait` system calls made.
+  size_t epoll_ctls;
+  size_t epoll_waits;
+  // Number of handlers called for ready events, expired timers, and posted
+  // events.
+  size_t events_handled;
+  size_t timers_expired;
+  size_t posted_events_handled;
+  // Number of messages logged at `NGX_LOG_ERR` or above.
+  size_t errors_logged;
+} ngx_shim_stats_t;
+
+// Sets up `ngx_cycle` with `connection_count` connections, logging messages
+// at or above `log_level` (e.g. `NGX_LOG_WARN`) to standard error. Returns
+// zero on success or a negative value on failure.
+int ngx_shim_init(ngx_uint_t connection_count, ngx_uint_t log_level);
+
+// Releases what `ngx_shim_init` acquired. Every connection must have been
+// freed.
+void ngx_shim_done(void);
+
+// Runs one iteration of the event loop, waiting at most `timeout`
+// milliseconds for an event. Returns zero on success or a negative value if
+// `epoll_wait` failed.
+int ngx_shim_process_events(ngx_msec_t timeout);
+
+// Updates `ngx_current_msec` and `ngx_cached_time`, as nginx does after
+// waiting for events.
+void ngx_shim_update_time(void);
+
+// Returns the number of timers set.
+size_t ngx_shim_timer_count(void);
+
+void ngx_shim_stats(ngx_shim_stats_t *stats);
+
+// Allocates the zones added by `ngx_shared_memory_add` since the last call,
+// and calls their `init`, as nginx does once it has parsed the
+// configuration. Returns zero on success or a negative value on failure.
+int ngx_shim_init_shared_memory(void);
+
+// Returns the thread pool, for `ngx_thread_task_post`.
+ngx_thread_pool_t *ngx_shim_thread_pool(void);
+
+// Returns the number of tasks posted to the thread pool that haven't run.
+size_t ngx_shim_thread_task_count(void);
+
+// Runs the handler of each task posted to the thread pool, in order, on the
+// calling thread, and then posts the task's event, as nginx's thread pool
+// notifies the event loop once a task is done. Returns the number of tasks
+// run.
+size_t ngx_shim_run_thread_tasks(void);
@@ -0,0 +1,21 @@
+#pragma once
+
+// The shim's stand-in for nginx's `ngx_thread_pool.h`. See
+// `ngx_shim_thread_pool` in `ngx_shim.h`.
+
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+typedef struct ngx_thread_task_s ngx_thread_task_t;
+
+struct ngx_thread_task_s {
+  ngx_thread_task_t *next;
+  ngx_uint_t id;
+  void *ctx;
+  void (*handler)(void *data, ngx_log_t *log);
+  ngx_event_t event;
+};
+
+typedef struct ngx_thread_pool_s ngx_thread_pool_t;
+
+ngx_int_t ngx_thread_task_post(ngx_thread_pool_t *tp, ngx_thread_task_t *task);
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+
+#include "syscalls.h"
+
+#include <dlfcn.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const char *const syscall_names[SYSCALL_COUNT] = {
+    "socket",     "connect",    "close",       "read",        "write",
+    "recv",       "send",       "recvfrom",    "sendto",      "recvmsg",
+    "sendmsg",    "poll",       "getsockopt",  "setsockopt",  "getsockname",
+    "getpeername", "epoll_ctl", "epoll_wait"};
+
+static size_t counts[SYSCALL_COUNT];
+
+void syscall_counts(size_t out[SYSCALL_COUNT]) {
+  for (size_t i = 0; i < SYSCALL_COUNT; ++i) {
+    out[i] = __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+  }
+}
+
+// Counts a call to `name`, and sets `real` to libc's `name`.
+#define COUNT(id, name)                                                        \
+  static __typeof__(&name) real;                                               \
+  if (real == NULL) {                                                          \
+    real = (__typeof__(&name))dlsym(RTLD_NEXT, #name);                         \
+  }                                                                            \
+  __atomic_fetch_add(&counts[id], 1, __ATOMIC_RELAXED)
+
+int socket(int domain, int type, int protocol) {
+  COUNT(SYSCALL_SOCKET, socket);
+  return real(domain, type, protocol);
+}
+
+int connect(int fd, const struct sockaddr *address, socklen_t length) {
+  COUNT(SYSCALL_CONNECT, connect);
+  return real(fd, address, length);
+}
+
+int close(int fd) {
+  COUNT(SYSCALL_CLOSE, close);
+  return real(fd);
+}
+
+ssize_t read(int fd, void *buffer, size_t size) {
+  COUNT(SYSCALL_READ, read);
+  return real(fd, buffer, size);
+}
+
+ssize_t write(int fd, const void *buffer, size_t size) {
+  COUNT(SYSCALL_WRITE, write);
+  return real(fd, buffer, size);
+}
+
+ssize_t recv(int fd, void *buffer, size_t size, int flags) {
+  COUNT(SYSCALL_RECV, recv);
+  return real(fd, buffer, size, flags);
+}
+
+ssize_t send(int fd, const void *buffer, size_t size, int flags) {
+  COUNT(SYSCALL_SEND, send);
+  return real(fd, buffer, size, flags);
+}
+
+ssize_t recvfrom(int fd, void *buffer, size_t size, int flags,
+                 struct sockaddr *address, socklen_t *length) {
+  COUNT(SYSCALL_RECVFROM, recvfrom);
+  return real(fd, buffer, size, flags, address, length);
+}
+
+ssize_t sendto(int fd, const void *buffer, size_t size, int flags,
+               const struct sockaddr *address, socklen_t length) {
+  COUNT(SYSCALL_SENDTO, sendto);
+  return real(fd, buffer, size, flags, address, length);
+}
+
+ssize_t recvmsg(int fd, struct msghdr *message, int flags) {
+  COUNT(SYSCALL_RECVMSG, recvmsg);
+  return real(fd, message, flags);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *message, int flags) {
+  COUNT(SYSCALL_SENDMSG, sendmsg);
+  return real(fd, message, flags);
+}
+
+int poll(struct pollfd *fds, nfds_t count, int timeout) {
+  COUNT(SYSCALL_POLL, poll);
+  return real(fds, count, timeout);
+}
+
+int getsockopt(int fd, int level, int name, void *value, socklen_t *length) {
+  COUNT(SYSCALL_GETSOCKOPT, getsockopt);
+  return real(fd, level, name, value, length);
+}
+
+int setsockopt(int fd, int level, int name, const void *value,
+               socklen_t length) {
+  COUNT(SYSCALL_SETSOCKOPT, setsockopt);
+  return real(fd, level, name, value, length);
+}
+
+int getsockname(int fd, struct sockaddr *address, socklen_t *length) {
+  COUNT(SYSCALL_GETSOCKNAME, getsockname);
+  return real(fd, address, length);
+}
+
+int getpeername(int fd, struct sockaddr *address, socklen_t *length) {
+  COUNT(SYSCALL_GETPEERNAME, getpeername);
+  return real(fd, address, length);
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+  COUNT(SYSCALL_EPOLL_CTL, epoll_ctl);
+  return real(epfd, op, fd, event);
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int max, int timeout) {
+  COUNT(SYSCALL_EPOLL_WAIT, epoll_wait);
+  return real(epfd, events, max, timeout);
+}
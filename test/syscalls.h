@@ -0,0 +1,39 @@
+#pragma once
+
+// Counts the system calls that this process makes through libc's socket and
+// I/O functions, by interposing on them. The program's definitions take
+// precedence over libc's for every caller, libcurl included, and each one
+// forwards to libc's after counting.
+//
+// Functions not listed here (e.g. `fcntl`, `ioctl`, and anything libc calls
+// internally) aren't counted. Where the kernel allows, `perf stat -e
+// raw_syscalls:sys_enter` counts everything.
+
+#include <stddef.h>
+
+typedef enum syscall_e {
+  SYSCALL_SOCKET,
+  SYSCALL_CONNECT,
+  SYSCALL_CLOSE,
+  SYSCALL_READ,
+  SYSCALL_WRITE,
+  SYSCALL_RECV,
+  SYSCALL_SEND,
+  SYSCALL_RECVFROM,
+  SYSCALL_SENDTO,
+  SYSCALL_RECVMSG,
+  SYSCALL_SENDMSG,
+  SYSCALL_POLL,
+  SYSCALL_GETSOCKOPT,
+  SYSCALL_SETSOCKOPT,
+  SYSCALL_GETSOCKNAME,
+  SYSCALL_GETPEERNAME,
+  SYSCALL_EPOLL_CTL,
+  SYSCALL_EPOLL_WAIT,
+  SYSCALL_COUNT
+} syscall_t;
+
+extern const char *const syscall_names[SYSCALL_COUNT];
+
+// Copies the counts so far into `counts`.
+void syscall_counts(size_t counts[SYSCALL_COUNT]);